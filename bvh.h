@@ -0,0 +1,355 @@
+#ifndef BVH
+#define BVH
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <iostream>
+#include <algorithm>
+#include <type_traits>
+#include "gmath.h"
+#include "geometry.h"
+#include "bvh_build.h"
+
+namespace rt {
+
+    /// @brief bounding volume hierarchy with Width (2, 4 or 8) children per node.
+    /// A node holds all its children's boxes in float, structure-of-arrays, so one ray is tested against all of them
+    /// together with SSE (AVX for Width 8 when compiled with -mavx). Nodes are 64, 128 and 256 bytes, cache line aligned.
+    /// Children are visited nearest first using an order stored per node for each octant of ray direction.
+    /// It's built as a binary tree (see BVHBuilder), which is then collapsed by repeatedly pulling up the largest child.
+    template <int Width>
+    class WideBVH {
+        static_assert(Width == 2 || Width == 4 || Width == 8, "WideBVH supports 2, 4 or 8 children per node");
+
+        public:
+            // A child entry is either an inner node's index, or a leaf: leaf_flag | (count - 1) << count_shift | first,
+            // covering refs[first] to refs[first + count - 1]
+            static constexpr std::uint32_t leaf_flag = 0x80000000u;
+            static constexpr int count_shift = 27;
+            static constexpr std::uint32_t max_leaf_size = BVHBuilder::max_leaf_size;
+            static constexpr std::uint32_t max_prims = (1u << count_shift) - max_leaf_size;
+            static constexpr std::uint32_t empty_child = 0xffffffffu; // its box is empty, so it's never hit
+
+            using Order = std::conditional_t<Width <= 4, std::uint8_t, std::uint32_t>;
+            static constexpr int order_bits = Width == 2 ? 1 : (Width == 4 ? 2 : 3);
+
+            struct alignas(Width * 32) Node {
+                float bounds[6][Width]; // min x, max x, min y, max y, min z, max z of each child
+                std::uint32_t child[Width];
+                Order order[8]; // indexed by ray octant: child slots nearest first, order_bits each from the lowest bits up
+            };
+
+            std::vector<Node> nodes; // nodes[0] is the root
+            std::vector<PrimRef> refs; // each leaf is a contiguous range of this
+
+            bool empty() const { return nodes.empty(); }
+            void clear() {
+                nodes.clear();
+                refs.clear();
+            }
+            std::size_t memory() const { return nodes.size() * sizeof(Node) + refs.size() * sizeof(PrimRef); }
+            /// @brief box around everything in the tree (slightly padded), empty if the tree is
+            AABB3T<float> bounds() const { return nodes.empty() ? AABB3T<float>() : node_box(nodes[0]); }
+
+            void build(std::vector<BVHPrim> prims, BVHPreset preset = BVHPreset::quality) {
+                clear();
+                if (prims.empty()) { return; }
+                if (prims.size() > max_prims) {
+                    std::cerr << "Error in WideBVH::build(): " << prims.size() << " primitives is more than the " << max_prims << " supported\n";
+                    return;
+                }
+
+                std::vector<BVHBuildNode> tree = BVHBuilder(prims).build(preset);
+                refs.resize(prims.size());
+                for (std::size_t i = 0; i < prims.size(); i++) { refs[i] = prims[i].ref; }
+                nodes.reserve(tree.size() / (Width - 1) + 1);
+                collapse(tree, 0, origin_pad(tree[0].box));
+            }
+
+            /// @brief recomputes every box for primitives that have moved, keeping the tree as it is. Much faster than
+            /// a rebuild, but traversal slows as the primitives drift from where the tree was built for.
+            /// bounds(ref) gives the primitive's new box in float.
+            template <typename F>
+            void refit(F&& bounds) {
+                if (nodes.empty()) { return; }
+                // leaves first, in parallel. Then inner children from their nodes' children: children always come after
+                // their parent, so going backwards sees each node's children updated before the node itself.
+                parallel_for(0, nodes.size(), [&](std::size_t index) {
+                    Node& node = nodes[index];
+                    for (int k = 0; k < Width; k++) {
+                        if (node.child[k] == empty_child || !(node.child[k] & leaf_flag)) { continue; }
+                        std::uint32_t first = node.child[k] & ((1u << count_shift) - 1);
+                        std::uint32_t count = ((node.child[k] & ~leaf_flag) >> count_shift) + 1;
+                        AABB3T<float> box;
+                        for (std::uint32_t i = first; i < first + count; i++) { box.extend(bounds(refs[i])); }
+                        set_child_box(node, k, box);
+                    }
+                }, 256);
+                for (std::size_t index = nodes.size(); index-- > 0;) {
+                    Node& node = nodes[index];
+                    for (int k = 0; k < Width; k++) {
+                        if (node.child[k] == empty_child || (node.child[k] & leaf_flag)) { continue; }
+                        set_child_box(node, k, node_box(nodes[node.child[k]]));
+                    }
+                }
+
+                // the origin padding has to track the scene's extent too
+                AABB3T<float> scene_box = node_box(nodes[0]);
+                float pad = origin_pad(scene_box);
+                parallel_for(0, nodes.size(), [&](std::size_t index) {
+                    Node& node = nodes[index];
+                    for (int k = 0; k < Width; k++) {
+                        if (node.child[k] == empty_child) { continue; }
+                        for (int a = 0; a < 3; a++) {
+                            node.bounds[2 * a][k] -= pad;
+                            node.bounds[2 * a + 1][k] += pad;
+                        }
+                    }
+                }, 256);
+            }
+
+            /// @brief calls visit(ref) for the primitives in every leaf the ray passes through with 0 < t < t_max,
+            /// nearest leaves first. visit may lower t_max (e.g. when it finds a hit), which culls the rest of the walk.
+            template <typename F>
+            void traverse(const Line3& ray, const Real& t_max, F&& visit, std::size_t* n_nodes_visited = nullptr) const {
+                if (nodes.empty()) { return; }
+                const NodeRay node_ray(ray);
+
+                struct Entry {
+                    std::uint32_t child;
+                    float t; // where the ray enters the child's box
+                };
+                Entry stack[stack_size];
+                int top = 0;
+                stack[top++] = Entry{0, 0.0f};
+
+                while (top > 0) {
+                    const Entry entry = stack[--top];
+                    const float t_limit = static_cast<float>(t_max) * t_scale;
+                    if (entry.t > t_limit) { continue; } // something nearer was hit since this was pushed
+
+                    if (entry.child & leaf_flag) {
+                        std::uint32_t first = entry.child & ((1u << count_shift) - 1);
+                        std::uint32_t count = ((entry.child & ~leaf_flag) >> count_shift) + 1;
+                        for (std::uint32_t i = first; i < first + count; i++) { visit(refs[i]); }
+                        continue;
+                    }
+
+                    const Node& node = nodes[entry.child];
+                    if (n_nodes_visited) { ++*n_nodes_visited; }
+                    alignas(32) float t_near[Width];
+                    unsigned mask = intersect_children(node, node_ray, t_limit, t_near);
+
+                    // push farthest first so the nearest child is popped next
+                    Order order = node.order[node_ray.octant];
+                    for (int position = Width - 1; position >= 0; position--) {
+                        unsigned slot = (order >> (position * order_bits)) & (Width - 1);
+                        if (mask & (1u << slot)) { stack[top++] = Entry{node.child[slot], t_near[slot]}; }
+                    }
+                }
+            }
+
+            /// @brief calls hit(ref) for the primitives in leaves the ray passes through with 0 < t < t_max, until one
+            /// returns true. Returns whether any did. For occlusion queries: t_max is fixed and any hit will do, so the
+            /// stack only holds node indices and children are taken in whatever order they're stored.
+            template <typename F>
+            bool traverse_any(const Line3& ray, Real t_max, F&& hit) const {
+                if (nodes.empty()) { return false; }
+                const NodeRay node_ray(ray);
+                const float t_limit = static_cast<float>(t_max) * t_scale;
+
+                std::uint32_t stack[stack_size];
+                int top = 0;
+                stack[top++] = 0;
+
+                while (top > 0) {
+                    const std::uint32_t child = stack[--top];
+                    if (child & leaf_flag) {
+                        std::uint32_t first = child & ((1u << count_shift) - 1);
+                        std::uint32_t count = ((child & ~leaf_flag) >> count_shift) + 1;
+                        for (std::uint32_t i = first; i < first + count; i++) {
+                            if (hit(refs[i])) { return true; }
+                        }
+                        continue;
+                    }
+
+                    const Node& node = nodes[child];
+                    alignas(32) float t_near[Width];
+                    unsigned mask = intersect_children(node, node_ray, t_limit, t_near);
+                    for (int slot = 0; slot < Width; slot++) {
+                        if (mask & (1u << slot)) { stack[top++] = node.child[slot]; }
+                    }
+                }
+                return false;
+            }
+
+        private:
+            static constexpr int stack_size = 96 * (Width - 1) + 1; // BVHBuilder's trees are at most about 91 deep
+            static constexpr float t_scale = 1.0000005f; // covers float rounding in the slab test (Ize, "Robust BVH Ray Traversal", 2013)
+
+            // the ray in float, with the near and far box planes on each axis picked by the sign of its direction
+            struct NodeRay {
+                float origin[3];
+                float inv_dir[3];
+                int near[3]; // row of Node::bounds
+                int far[3];
+                int octant; // bit i set if the direction is negative on axis i
+
+                NodeRay(const Line3& ray) : octant(0) {
+                    for (int a = 0; a < 3; a++) {
+                        origin[a] = static_cast<float>(axis(ray.p, a));
+                        inv_dir[a] = static_cast<float>(1 / axis(ray.d, a));
+                        bool negative = std::signbit(inv_dir[a]);
+                        near[a] = 2 * a + negative;
+                        far[a] = 2 * a + !negative;
+                        octant |= negative << a;
+                    }
+                }
+            };
+
+            // slab test against every child at once. Returns a bit mask of the children hit, with entry distances in t_near.
+            // A NaN slab distance (ray in the plane of a face) leaves that axis unconstrained.
+            static unsigned intersect_children(const Node& node, const NodeRay& ray, float t_limit, float* t_near) {
+#ifdef GMATH_HAS_SSE
+#ifdef __AVX__
+                if constexpr (Width == 8) {
+                    __m256 t_in = _mm256_setzero_ps();
+                    __m256 t_out = _mm256_set1_ps(t_limit);
+                    for (int a = 0; a < 3; a++) {
+                        __m256 origin = _mm256_set1_ps(ray.origin[a]);
+                        __m256 inv_dir = _mm256_set1_ps(ray.inv_dir[a]);
+                        t_in = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.near[a]]), origin), inv_dir), t_in);
+                        t_out = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.far[a]]), origin), inv_dir), t_out);
+                    }
+                    t_out = _mm256_mul_ps(t_out, _mm256_set1_ps(t_scale));
+                    _mm256_store_ps(t_near, t_in);
+                    return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(t_in, t_out, _CMP_LE_OQ)));
+                }
+#endif
+                if constexpr (Width >= 4) {
+                    unsigned mask = 0;
+                    for (int group = 0; group < Width; group += 4) {
+                        __m128 t_in = _mm_setzero_ps();
+                        __m128 t_out = _mm_set1_ps(t_limit);
+                        for (int a = 0; a < 3; a++) {
+                            __m128 origin = _mm_set1_ps(ray.origin[a]);
+                            __m128 inv_dir = _mm_set1_ps(ray.inv_dir[a]);
+                            t_in = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.near[a]] + group), origin), inv_dir), t_in);
+                            t_out = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.far[a]] + group), origin), inv_dir), t_out);
+                        }
+                        t_out = _mm_mul_ps(t_out, _mm_set1_ps(t_scale));
+                        _mm_store_ps(t_near + group, t_in);
+                        mask |= static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(t_in, t_out))) << group;
+                    }
+                    return mask;
+                }
+#endif
+                unsigned mask = 0;
+                for (int k = 0; k < Width; k++) {
+                    float t_in = 0;
+                    float t_out = t_limit;
+                    for (int a = 0; a < 3; a++) {
+                        float t0 = (node.bounds[ray.near[a]][k] - ray.origin[a]) * ray.inv_dir[a];
+                        float t1 = (node.bounds[ray.far[a]][k] - ray.origin[a]) * ray.inv_dir[a];
+                        clip_slab(t0, t1, t_in, t_out);
+                    }
+                    t_near[k] = t_in;
+                    if (t_in <= t_out * t_scale) { mask |= 1u << k; }
+                }
+                return mask;
+            }
+
+            // ray origins are rounded to float for traversal, which can move them by up to half an ulp of the scene's
+            // largest coordinate, so boxes are grown by a couple of those ulps to keep the test conservative
+            static float origin_pad(const AABB3T<float>& scene_box) {
+                float largest = std::max({std::fabs(scene_box.min.x), std::fabs(scene_box.min.y), std::fabs(scene_box.min.z),
+                                          std::fabs(scene_box.max.x), std::fabs(scene_box.max.y), std::fabs(scene_box.max.z)});
+                return largest * std::numeric_limits<float>::epsilon() * 2;
+            }
+
+            static void set_child_box(Node& node, int k, const AABB3T<float>& box) {
+                for (int a = 0; a < 3; a++) {
+                    node.bounds[2 * a][k] = axis(box.min, a);
+                    node.bounds[2 * a + 1][k] = axis(box.max, a);
+                }
+            }
+
+            // union of a node's children's boxes
+            static AABB3T<float> node_box(const Node& node) {
+                AABB3T<float> box;
+                for (int k = 0; k < Width; k++) {
+                    if (node.child[k] == empty_child) { continue; }
+                    box.extend(AABB3T<float>(Vec3T<float>(node.bounds[0][k], node.bounds[2][k], node.bounds[4][k]),
+                                             Vec3T<float>(node.bounds[1][k], node.bounds[3][k], node.bounds[5][k])));
+                }
+                return box;
+            }
+
+            // makes a node from the binary subtree at binary_index, taking its children and opening the largest inner
+            // ones until there are Width of them. Returns the new node's index.
+            std::uint32_t collapse(const std::vector<BVHBuildNode>& tree, std::uint32_t binary_index, float pad) {
+                std::uint32_t slots[Width];
+                int n = 0;
+                const BVHBuildNode& root = tree[binary_index];
+                if (root.count > 0) {
+                    slots[n++] = binary_index; // a lone leaf, at the root of a small tree
+                } else {
+                    slots[n++] = root.left;
+                    slots[n++] = root.right;
+                }
+                while (n < Width) {
+                    int largest = -1;
+                    float largest_area = -1;
+                    for (int k = 0; k < n; k++) {
+                        const BVHBuildNode& child = tree[slots[k]];
+                        if (child.count == 0 && child.box.surface_area() > largest_area) {
+                            largest = k;
+                            largest_area = child.box.surface_area();
+                        }
+                    }
+                    if (largest < 0) { break; }
+                    std::uint32_t opened = slots[largest];
+                    slots[largest] = tree[opened].left;
+                    slots[n++] = tree[opened].right;
+                }
+
+                std::uint32_t index = static_cast<std::uint32_t>(nodes.size());
+                nodes.emplace_back();
+                for (int k = 0; k < Width; k++) {
+                    AABB3T<float> box; // empty for unused slots
+                    std::uint32_t child = empty_child;
+                    if (k < n) {
+                        const BVHBuildNode& binary = tree[slots[k]];
+                        box = AABB3T<float>(binary.box.min - Vec3T<float>(pad, pad, pad), binary.box.max + Vec3T<float>(pad, pad, pad));
+                        child = binary.count > 0 ? leaf_flag | (binary.count - 1) << count_shift | binary.first : collapse(tree, slots[k], pad);
+                    }
+                    Node& node = nodes[index]; // after collapse(), which may have moved the nodes
+                    node.child[k] = child;
+                    set_child_box(node, k, box);
+                }
+
+                // for each octant, sort the children by how far their centres are along a ray direction in it
+                Node& node = nodes[index];
+                for (int octant = 0; octant < 8; octant++) {
+                    Vec3T<float> direction(octant & 1 ? -1.0f : 1.0f, octant & 2 ? -1.0f : 1.0f, octant & 4 ? -1.0f : 1.0f);
+                    float keys[Width];
+                    int sorted[Width];
+                    for (int k = 0; k < Width; k++) {
+                        const BVHBuildNode& binary = tree[slots[std::min(k, n - 1)]];
+                        keys[k] = k < n ? dot(binary.box.centroid(), direction) : std::numeric_limits<float>::infinity();
+                        sorted[k] = k;
+                    }
+                    std::sort(sorted, sorted + Width, [&](int a, int b) { return keys[a] < keys[b]; });
+                    Order order = 0;
+                    for (int position = 0; position < Width; position++) { order |= static_cast<Order>(sorted[position] << (position * order_bits)); }
+                    node.order[octant] = order;
+                }
+                return index;
+            }
+    };
+
+}
+
+#endif // BVH
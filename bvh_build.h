@@ -0,0 +1,384 @@
+#ifndef BVH_BUILD
+#define BVH_BUILD
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "gmath.h"
+#include "geometry.h"
+#include "parallel.h"
+
+namespace rt {
+
+    /// @brief a primitive as the BVH sees it: which of the scene's primitive arrays it's in, and where
+    struct PrimRef {
+        std::uint32_t type;
+        std::uint32_t idx;
+    };
+
+    /// @brief input to a BVH build: a primitive and its bounds
+    struct BVHPrim {
+        AABB3T<float> box;
+        PrimRef ref;
+    };
+
+    // the float nearest x in the direction that only grows the box it bounds
+    template <typename T>
+    float round_down(T x) {
+        float f = static_cast<float>(x);
+        return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+    template <typename T>
+    float round_up(T x) {
+        float f = static_cast<float>(x);
+        return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+
+    /// @brief box converted to float, rounded outwards so it still contains everything the original did
+    template <typename T>
+    AABB3T<float> to_float_bounds(const AABB3T<T>& box) {
+        return AABB3T<float>(Vec3T<float>(round_down(box.min.x), round_down(box.min.y), round_down(box.min.z)),
+                             Vec3T<float>(round_up(box.max.x), round_up(box.max.y), round_up(box.max.z)));
+    }
+
+    enum class BVHPreset {
+        quality, // binned SAH: slower to build, faster to trace
+        fast // linear BVH from Morton codes: builds several times faster, traces somewhat slower
+    };
+
+    struct BVHBuildNode {
+        AABB3T<float> box;
+        std::uint32_t left{0}; // children, if count is 0
+        std::uint32_t right{0};
+        std::uint32_t first{0}; // primitives, if a leaf
+        std::uint32_t count{0};
+    };
+
+    /// @brief builds a binary BVH over prims, reordering them so each leaf is a contiguous range. The root is tree[0].
+    /// The top of the tree is built with each split's passes over the primitives run in parallel, until there are
+    /// enough subtrees to keep every thread busy; the subtrees are then built independently in parallel and stitched
+    /// together. The tree is the same whatever the number of threads.
+    class BVHBuilder {
+        public:
+            static constexpr std::uint32_t max_leaf_size = 16;
+
+            BVHBuilder(std::vector<BVHPrim>& prims) : prims(prims) {}
+
+            std::vector<BVHBuildNode> build(BVHPreset preset) {
+                this->preset = preset;
+                std::vector<BVHBuildNode> tree;
+                if (prims.empty()) { return tree; }
+                const std::uint32_t n = static_cast<std::uint32_t>(prims.size());
+                if (preset == BVHPreset::fast) { sort_by_morton_code(); }
+
+                // top of the tree, down to subtrees of task_size or fewer primitives
+                task_size = std::max<std::uint32_t>(4096, n / 256);
+                std::vector<Task> tasks;
+                Bounds bounds;
+                if (preset == BVHPreset::quality) { bounds = range_bounds(0, n, true); } // the Morton splits don't need them
+                build_node(tree, 0, n, bounds, 0, &tasks);
+                const std::uint32_t top_size = static_cast<std::uint32_t>(tree.size());
+
+                // subtrees, each into its own array
+                std::vector<std::vector<BVHBuildNode>> subtrees(tasks.size());
+                parallel_for(0, tasks.size(), [&](std::size_t t) {
+                    subtrees[t].reserve(2 * tasks[t].count);
+                    build_node(subtrees[t], tasks[t].first, tasks[t].count, tasks[t].bounds, tasks[t].depth, nullptr);
+                });
+
+                // stitch them in: each subtree's root replaces its placeholder, and the rest of it is appended
+                std::vector<std::uint32_t> bases(tasks.size());
+                std::size_t total = top_size;
+                for (std::size_t t = 0; t < tasks.size(); t++) {
+                    bases[t] = static_cast<std::uint32_t>(total);
+                    total += subtrees[t].size() - 1;
+                }
+                tree.resize(total);
+                parallel_for(0, tasks.size(), [&](std::size_t t) {
+                    const std::vector<BVHBuildNode>& subtree = subtrees[t];
+                    auto place = [&](std::uint32_t i) { return i == 0 ? tasks[t].node : bases[t] + i - 1; };
+                    for (std::uint32_t i = 0; i < subtree.size(); i++) {
+                        BVHBuildNode node = subtree[i];
+                        if (node.count == 0) {
+                            node.left = place(node.left);
+                            node.right = place(node.right);
+                        }
+                        tree[place(i)] = node;
+                    }
+                });
+
+                // top nodes were made before their subtrees' boxes were known. Children always come after their parent.
+                for (std::uint32_t i = top_size; i-- > 0;) {
+                    BVHBuildNode& node = tree[i];
+                    if (node.count == 0) {
+                        node.box = tree[node.left].box;
+                        node.box.extend(tree[node.right].box);
+                    }
+                }
+                return tree;
+            }
+
+        private:
+            static constexpr int n_bins = 16;
+            static constexpr float traversal_cost = 1; // relative to one primitive intersection
+            static constexpr int max_sah_depth = 64; // below this, splits are at the median so the tree stays shallow
+            static constexpr std::uint32_t morton_leaf_size = 4;
+            static constexpr std::uint32_t parallel_threshold = 1 << 16; // ranges at least this big are split in parallel
+
+            // bounds of a range of primitives, and of their centroids
+            struct Bounds {
+                AABB3T<float> box;
+                AABB3T<float> centroids;
+
+                void extend(const BVHPrim& prim) {
+                    box.extend(prim.box);
+                    centroids.extend(prim.box.centroid());
+                }
+                void extend(const Bounds& bounds) {
+                    box.extend(bounds.box);
+                    centroids.extend(bounds.centroids);
+                }
+            };
+
+            struct Task {
+                std::uint32_t node; // placeholder in the top tree
+                std::uint32_t first;
+                std::uint32_t count;
+                Bounds bounds;
+                int depth;
+            };
+
+            struct Bins {
+                Bounds bounds[n_bins];
+                std::uint32_t counts[n_bins] = {};
+            };
+
+            std::vector<BVHPrim>& prims;
+            BVHPreset preset{BVHPreset::quality};
+            std::uint32_t task_size{0};
+            std::vector<std::uint64_t> codes; // Morton code of each primitive, sorted, for the fast preset
+            std::vector<BVHPrim> scratch; // for parallel partitions, allocated once since they happen at every top level
+
+            // builds the subtree over prims[first, first + count) into tree and returns its root. If tasks is given,
+            // ranges of task_size or fewer are left as placeholders to be built later, and splits are done in parallel.
+            // bounds is only needed (and only filled in) for the quality preset.
+            std::uint32_t build_node(std::vector<BVHBuildNode>& tree, std::uint32_t first, std::uint32_t count, const Bounds& bounds, int depth, std::vector<Task>* tasks) {
+                std::uint32_t index = static_cast<std::uint32_t>(tree.size());
+                tree.push_back(BVHBuildNode{bounds.box, 0, 0, first, count});
+                if (tasks && count <= task_size) {
+                    tasks->push_back(Task{index, first, count, bounds, depth});
+                    return index;
+                }
+
+                std::uint32_t mid = 0;
+                Bounds left_bounds;
+                Bounds right_bounds;
+                if (preset == BVHPreset::quality) {
+                    if (!split_sah(first, count, bounds, depth, tasks != nullptr, mid, left_bounds, right_bounds)) { return index; }
+                } else if (!split_morton(first, count, mid)) {
+                    for (std::uint32_t i = first; i < first + count; i++) { tree[index].box.extend(prims[i].box); }
+                    return index;
+                }
+
+                std::uint32_t left = build_node(tree, first, mid - first, left_bounds, depth + 1, tasks);
+                std::uint32_t right = build_node(tree, mid, first + count - mid, right_bounds, depth + 1, tasks);
+                BVHBuildNode& node = tree[index];
+                node.left = left;
+                node.right = right;
+                node.count = 0;
+                node.box = tree[left].box; // empty for placeholders; the top of the tree is redone after the subtrees are built
+                node.box.extend(tree[right].box);
+                return index;
+            }
+
+            // accumulates over prims[first, first + count), in parallel chunks if asked and it's big enough
+            template <typename Result, typename Accumulate, typename Merge>
+            Result reduce(std::uint32_t first, std::uint32_t count, bool parallel, Accumulate accumulate, Merge merge) const {
+                if (!parallel || count < parallel_threshold) {
+                    Result result;
+                    for (std::uint32_t i = first; i < first + count; i++) { accumulate(result, prims[i]); }
+                    return result;
+                }
+                const std::size_t n_chunks = std::min<std::size_t>(n_threads() * 4, count / 4096);
+                std::vector<Result> partial(n_chunks);
+                parallel_for(0, n_chunks, [&](std::size_t chunk) {
+                    for (std::size_t i = first + count * chunk / n_chunks; i < first + count * (chunk + 1) / n_chunks; i++) { accumulate(partial[chunk], prims[i]); }
+                });
+                for (std::size_t chunk = 1; chunk < n_chunks; chunk++) { merge(partial[0], partial[chunk]); }
+                return partial[0];
+            }
+
+            // moves the primitives for which goes_left is true to the front of the range and returns where the rest start.
+            // Stable when run in parallel, so the result doesn't depend on the number of threads.
+            template <typename Predicate>
+            std::uint32_t partition(std::uint32_t first, std::uint32_t count, bool parallel, Predicate goes_left) {
+                if (!parallel || count < parallel_threshold) {
+                    return static_cast<std::uint32_t>(std::partition(prims.begin() + first, prims.begin() + first + count, goes_left) - prims.begin());
+                }
+                const std::size_t n_chunks = std::min<std::size_t>(n_threads() * 4, count / 4096);
+                auto chunk_begin = [&](std::size_t chunk) { return first + count * chunk / n_chunks; };
+                std::vector<std::uint32_t> n_left(n_chunks + 1, 0);
+                parallel_for(0, n_chunks, [&](std::size_t chunk) {
+                    for (std::size_t i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) { n_left[chunk + 1] += goes_left(prims[i]); }
+                });
+                for (std::size_t chunk = 0; chunk < n_chunks; chunk++) { n_left[chunk + 1] += n_left[chunk]; }
+
+                if (scratch.size() < count) { scratch.resize(count); }
+                BVHPrim* sorted = scratch.data();
+                parallel_for(0, n_chunks, [&](std::size_t chunk) {
+                    std::size_t left = n_left[chunk];
+                    std::size_t right = n_left[n_chunks] + (chunk_begin(chunk) - first - n_left[chunk]);
+                    for (std::size_t i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) {
+                        sorted[goes_left(prims[i]) ? left++ : right++] = prims[i];
+                    }
+                });
+                parallel_for(0, count, [&](std::size_t i) { prims[first + i] = sorted[i]; }, 1 << 14);
+                return first + n_left[n_chunks];
+            }
+
+            Bounds range_bounds(std::uint32_t first, std::uint32_t count, bool parallel) const {
+                return reduce<Bounds>(first, count, parallel,
+                    [](Bounds& b, const BVHPrim& prim) { b.extend(prim); },
+                    [](Bounds& a, const Bounds& b) { a.extend(b); });
+            }
+
+            // binned SAH on the longest axis of the centroids. Returns false if a leaf is cheaper, otherwise sets mid
+            // and the bounds of each side (which come from the bins, saving a pass over the primitives per level).
+            bool split_sah(std::uint32_t first, std::uint32_t count, const Bounds& bounds, int depth, bool parallel,
+                           std::uint32_t& mid, Bounds& left_bounds, Bounds& right_bounds) {
+                if (count <= 2) { return false; } // a box test in the parent costs about the same as the intersection it saves
+                const int split_axis = bounds.centroids.longest_axis();
+                const float low = axis(bounds.centroids.min, split_axis);
+                const float extent = axis(bounds.centroids.max, split_axis) - low;
+                const int bins_used = std::min<int>(n_bins, std::max<int>(4, count)); // small ranges don't need so many
+                const float to_bin = bins_used / extent;
+                auto bin_of = [=](const BVHPrim& prim) {
+                    int bin = static_cast<int>((axis(prim.box.centroid(), split_axis) - low) * to_bin);
+                    return std::min(std::max(bin, 0), bins_used - 1);
+                };
+
+                mid = first;
+                if (extent > 0) {
+                    Bins bins = reduce<Bins>(first, count, parallel,
+                        [&](Bins& b, const BVHPrim& prim) {
+                            int bin = bin_of(prim);
+                            b.bounds[bin].extend(prim);
+                            b.counts[bin]++;
+                        },
+                        [=](Bins& a, const Bins& b) {
+                            for (int bin = 0; bin < bins_used; bin++) {
+                                a.bounds[bin].extend(b.bounds[bin]);
+                                a.counts[bin] += b.counts[bin];
+                            }
+                        });
+
+                    // cost of splitting after each bin, from sweeps in from both ends
+                    float right_costs[n_bins];
+                    AABB3T<float> right_box;
+                    std::uint32_t right_count = 0;
+                    for (int bin = bins_used - 1; bin > 0; bin--) {
+                        right_box.extend(bins.bounds[bin].box);
+                        right_count += bins.counts[bin];
+                        right_costs[bin] = right_box.surface_area() * right_count;
+                    }
+                    AABB3T<float> left_box;
+                    std::uint32_t left_count = 0;
+                    float best_cost = std::numeric_limits<float>::infinity();
+                    int best_split = 1; // bins below this go left
+                    for (int split = 1; split < bins_used; split++) {
+                        left_box.extend(bins.bounds[split - 1].box);
+                        left_count += bins.counts[split - 1];
+                        float cost = left_box.surface_area() * left_count + right_costs[split];
+                        if (cost < best_cost) {
+                            best_cost = cost;
+                            best_split = split;
+                        }
+                    }
+
+                    float area = bounds.box.surface_area();
+                    float split_cost = traversal_cost + (area > 0 ? best_cost / area : count);
+                    if (count <= max_leaf_size && count <= split_cost) { return false; }
+                    if (depth < max_sah_depth) {
+                        mid = partition(first, count, parallel, [=](const BVHPrim& prim) { return bin_of(prim) < best_split; });
+                        for (int bin = 0; bin < bins_used; bin++) { (bin < best_split ? left_bounds : right_bounds).extend(bins.bounds[bin]); }
+                    }
+                }
+                if (mid == first || mid == first + count) {
+                    if (count <= max_leaf_size) { return false; } // centroids coincide, so no split would separate them
+                    mid = first + count / 2;
+                    std::nth_element(prims.begin() + first, prims.begin() + mid, prims.begin() + first + count, [&](const BVHPrim& a, const BVHPrim& b) {
+                        return axis(a.box.centroid(), split_axis) < axis(b.box.centroid(), split_axis);
+                    });
+                    left_bounds = range_bounds(first, mid - first, parallel);
+                    right_bounds = range_bounds(mid, first + count - mid, parallel);
+                }
+                return true;
+            }
+
+            // splits where the highest bit that differs across the range's (sorted) Morton codes changes
+            bool split_morton(std::uint32_t first, std::uint32_t count, std::uint32_t& mid) const {
+                if (count <= morton_leaf_size) { return false; }
+                std::uint64_t differing = codes[first] ^ codes[first + count - 1];
+                if (differing == 0) {
+                    if (count <= max_leaf_size) { return false; }
+                    mid = first + count / 2;
+                    return true;
+                }
+                int bit = 63;
+                while (!(differing >> bit)) { bit--; }
+                const std::uint64_t mask = std::uint64_t(1) << bit;
+                mid = static_cast<std::uint32_t>(std::partition_point(codes.begin() + first, codes.begin() + first + count,
+                    [=](std::uint64_t code) { return !(code & mask); }) - codes.begin());
+                return true;
+            }
+
+            // spreads the low 21 bits of x out to every third bit
+            static std::uint64_t spread_bits(std::uint64_t x) {
+                x &= 0x1fffff;
+                x = (x | x << 32) & 0x1f00000000ffff;
+                x = (x | x << 16) & 0x1f0000ff0000ff;
+                x = (x | x << 8) & 0x100f00f00f00f00f;
+                x = (x | x << 4) & 0x10c30c30c30c30c3;
+                x = (x | x << 2) & 0x1249249249249249;
+                return x;
+            }
+
+            // sorts prims along a Z-order curve through their centroids. Up to 2^20 primitives, 30 bit codes (10 bits
+            // per axis) separate them well enough and halve the sort; beyond that, 63 bit codes (21 bits per axis).
+            void sort_by_morton_code() {
+                const std::uint32_t n = static_cast<std::uint32_t>(prims.size());
+                const int bits_per_axis = n <= (1u << 20) ? 10 : 21;
+                AABB3T<float> centroids = reduce<AABB3T<float>>(0, n, true,
+                    [](AABB3T<float>& b, const BVHPrim& prim) { b.extend(prim.box.centroid()); },
+                    [](AABB3T<float>& a, const AABB3T<float>& b) { a.extend(b); });
+                const Vec3T<float> low = centroids.min;
+                const Vec3T<float> extent = centroids.extent();
+                const float cells = static_cast<float>(1 << bits_per_axis);
+                auto scale = [&](float e) { return e > 0 ? cells / e : 0.0f; };
+                const Vec3T<float> to_cells(scale(extent.x), scale(extent.y), scale(extent.z));
+
+                codes.resize(n);
+                std::vector<std::uint32_t> order(n);
+                parallel_for(0, n, [&](std::size_t i) {
+                    Vec3T<float> cell = (prims[i].box.centroid() - low) * to_cells;
+                    std::uint64_t code = 0;
+                    for (int a = 0; a < 3; a++) {
+                        std::uint64_t c = static_cast<std::uint64_t>(std::min(std::max(axis(cell, a), 0.0f), cells - 1));
+                        code |= spread_bits(c) << a;
+                    }
+                    codes[i] = code;
+                    order[i] = static_cast<std::uint32_t>(i);
+                }, 1 << 14);
+                radix_sort(codes, order, 3 * bits_per_axis);
+
+                std::vector<BVHPrim> sorted(n);
+                parallel_for(0, n, [&](std::size_t i) { sorted[i] = prims[order[i]]; }, 1 << 14);
+                prims.swap(sorted);
+            }
+    };
+
+}
+
+#endif // BVH_BUILD
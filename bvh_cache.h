@@ -0,0 +1,105 @@
+#ifndef BVH_CACHE
+#define BVH_CACHE
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <iostream>
+#include <filesystem>
+#include "bvh_build.h"
+#include "bvh.h"
+#include "mapped_file.h"
+
+namespace rt {
+
+    /// @brief 64 bit hash of a block of memory, for keying caches. Not cryptographic.
+    /// Large blocks are hashed in parallel chunks, but the result doesn't depend on the number of threads.
+    std::uint64_t hash_bytes(const void* data, std::size_t size, std::uint64_t seed = 0);
+
+    /// @brief cache key for a BVH over prims: a hash of every primitive's bounds and ref, plus the build settings.
+    /// A tree only depends on these, so primitives that change without changing their bounds keep the same key.
+    std::uint64_t bvh_cache_key(const std::vector<BVHPrim>& prims, BVHPreset preset, int width);
+
+    /// @brief start of a BVH cache file. The node and ref arrays follow as they are in memory, each at a 256 byte
+    /// aligned offset, so a mapped file could be read in place (load_bvh_cache() copies them out).
+    struct BVHCacheHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order; // bvh_cache_byte_order as written by the machine that made the file
+        std::uint64_t key;
+        std::uint32_t width;
+        std::uint32_t node_size;
+        std::uint64_t n_nodes;
+        std::uint64_t nodes_offset;
+        std::uint64_t n_refs;
+        std::uint64_t refs_offset;
+    };
+
+    inline constexpr char bvh_cache_magic[8] = "RTBVHC";
+    inline constexpr std::uint32_t bvh_cache_version = 1; // bump whenever the node layout or the header changes
+    inline constexpr std::uint32_t bvh_cache_byte_order = 0x01020304;
+
+    /// @brief writes header and the arrays it describes to path, via a temporary file so a reader never sees half of one
+    bool write_bvh_cache(const std::string& path, const BVHCacheHeader& header, const void* nodes, const void* refs);
+
+    /// @brief saves bvh to path under key. Returns false (and prints why) if the file can't be written.
+    template <int Width>
+    bool save_bvh_cache(const std::string& path, std::uint64_t key, const WideBVH<Width>& bvh) {
+        using Node = typename WideBVH<Width>::Node;
+        auto align = [](std::uint64_t offset) { return (offset + 255) / 256 * 256; };
+
+        BVHCacheHeader header{};
+        std::memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+        header.version = bvh_cache_version;
+        header.byte_order = bvh_cache_byte_order;
+        header.key = key;
+        header.width = Width;
+        header.node_size = sizeof(Node);
+        header.n_nodes = bvh.nodes.size();
+        header.nodes_offset = align(sizeof(BVHCacheHeader));
+        header.n_refs = bvh.refs.size();
+        header.refs_offset = align(header.nodes_offset + header.n_nodes * sizeof(Node));
+        return write_bvh_cache(path, header, bvh.nodes.data(), bvh.refs.data());
+    }
+
+    /// @brief loads the BVH saved to path under key into bvh. Returns false if there's no such file, or it was saved
+    /// under another key (the scene has changed) or by an incompatible build, leaving bvh as it was.
+    template <int Width>
+    bool load_bvh_cache(const std::string& path, std::uint64_t key, WideBVH<Width>& bvh) {
+        using Node = typename WideBVH<Width>::Node;
+        std::error_code error;
+        if (!std::filesystem::exists(path, error)) { return false; }
+        MappedFile file;
+        if (!file.open(path)) { return false; }
+
+        BVHCacheHeader header;
+        if (file.size < sizeof(header)) {
+            std::cerr << "Error in load_bvh_cache(): " << path << " is too small to be a BVH cache\n";
+            return false;
+        }
+        std::memcpy(&header, file.data, sizeof(header));
+        if (std::memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0) {
+            std::cerr << "Error in load_bvh_cache(): " << path << " is not a BVH cache\n";
+            return false;
+        }
+        if (header.version != bvh_cache_version || header.byte_order != bvh_cache_byte_order || header.width != Width ||
+            header.node_size != sizeof(Node) || header.key != key) {
+            return false;
+        }
+        if (header.nodes_offset + header.n_nodes * sizeof(Node) > file.size || header.refs_offset + header.n_refs * sizeof(PrimRef) > file.size) {
+            std::cerr << "Error in load_bvh_cache(): " << path << " is truncated\n";
+            return false;
+        }
+
+        bvh.nodes.resize(header.n_nodes);
+        bvh.refs.resize(header.n_refs);
+        std::memcpy(bvh.nodes.data(), file.data + header.nodes_offset, header.n_nodes * sizeof(Node));
+        std::memcpy(bvh.refs.data(), file.data + header.refs_offset, header.n_refs * sizeof(PrimRef));
+        return true;
+    }
+
+}
+
+#endif // BVH_CACHE
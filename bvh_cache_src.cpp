@@ -0,0 +1,98 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <filesystem>
+#include "bvh_cache.h"
+#include "parallel.h"
+
+namespace rt {
+
+    namespace {
+
+        constexpr std::uint64_t prime1 = 0x9e3779b185ebca87ull;
+        constexpr std::uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+        constexpr std::size_t chunk_size = 1 << 20;
+
+        std::uint64_t rotl(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+        std::uint64_t avalanche(std::uint64_t h) {
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        // four independent lanes of multiply-rotate, so consecutive words don't wait on each other
+        std::uint64_t hash_chunk(const char* data, std::size_t size, std::uint64_t seed) {
+            std::uint64_t lanes[4] = {seed + prime1 + prime2, seed + prime2, seed, seed - prime1};
+            std::size_t i = 0;
+            for (; i + 32 <= size; i += 32) {
+                for (int lane = 0; lane < 4; lane++) {
+                    std::uint64_t word;
+                    std::memcpy(&word, data + i + 8 * lane, sizeof(word));
+                    lanes[lane] = rotl(lanes[lane] + word * prime2, 31) * prime1;
+                }
+            }
+            std::uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + size;
+            for (; i < size; i++) { h = rotl(h ^ (static_cast<unsigned char>(data[i]) * prime1), 11) * prime2; }
+            return avalanche(h);
+        }
+
+    }
+
+    std::uint64_t hash_bytes(const void* data, std::size_t size, std::uint64_t seed) {
+        const char* bytes = static_cast<const char*>(data);
+        if (size <= chunk_size) { return hash_chunk(bytes, size, seed); }
+
+        std::vector<std::uint64_t> chunk_hashes((size + chunk_size - 1) / chunk_size);
+        parallel_for(0, chunk_hashes.size(), [&](std::size_t chunk) {
+            std::size_t begin = chunk * chunk_size;
+            chunk_hashes[chunk] = hash_chunk(bytes + begin, std::min(chunk_size, size - begin), seed);
+        });
+        return hash_chunk(reinterpret_cast<const char*>(chunk_hashes.data()), chunk_hashes.size() * sizeof(std::uint64_t), seed ^ size);
+    }
+
+    std::uint64_t bvh_cache_key(const std::vector<BVHPrim>& prims, BVHPreset preset, int width) {
+        std::uint64_t settings[3] = {bvh_cache_version, static_cast<std::uint64_t>(preset), static_cast<std::uint64_t>(width)};
+        return hash_bytes(prims.data(), prims.size() * sizeof(BVHPrim), hash_bytes(settings, sizeof(settings)));
+    }
+
+    bool write_bvh_cache(const std::string& path, const BVHCacheHeader& header, const void* nodes, const void* refs) {
+        const std::string temp_path = path + ".tmp";
+        {
+            std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                std::cerr << "Error in write_bvh_cache(): could not open " << temp_path << "\n";
+                return false;
+            }
+            auto pad_to = [&](std::uint64_t offset) {
+                static const char zeros[256] = {};
+                std::uint64_t position = static_cast<std::uint64_t>(file.tellp());
+                file.write(zeros, static_cast<std::streamsize>(offset - position));
+            };
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            pad_to(header.nodes_offset);
+            file.write(static_cast<const char*>(nodes), static_cast<std::streamsize>(header.n_nodes * header.node_size));
+            pad_to(header.refs_offset);
+            file.write(static_cast<const char*>(refs), static_cast<std::streamsize>(header.n_refs * sizeof(PrimRef)));
+            if (!file) {
+                std::cerr << "Error in write_bvh_cache(): could not write " << temp_path << "\n";
+                return false;
+            }
+        }
+
+        std::error_code error;
+        std::filesystem::rename(temp_path, path, error);
+        if (error) {
+            std::cerr << "Error in write_bvh_cache(): could not replace " << path << ": " << error.message() << "\n";
+            std::filesystem::remove(temp_path, error);
+            return false;
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,89 @@
+#ifndef CAMERA
+#define CAMERA
+
+#include <cmath>
+#include "gmath.h"
+#include "geometry.h"
+
+namespace rt {
+
+    template <typename T>
+    class CameraT {
+        // explanation:
+        // the viewport, also the plane of perfect focus, go where the camera is looking
+        // thus lookat is also the viewport centre
+        // focal_length is the distance from the origin to the viewport centre
+        // rays start from the origin
+        // when using defocus blur, rays start randomly from a disc centred on the origin and parallel to the viewport plane
+
+        public:
+            Vec3T<T> up{0,0,1}; // sets the rotation of the field of view box, keeping it viewing "horizontally"
+            Vec3T<T> lookat;
+            Vec3T<T> look_direction;
+            T viewport_height;
+            T aspect_ratio;
+            T fov_deg; // field of view angle
+            T defocus_blur_angle_deg;
+
+            T focal_length;
+            T defocus_blur_radius;
+            T viewport_width;
+            Vec3T<T> origin;
+            // orthogonal unit vectors to traverse viewport
+            Vec3T<T> d_right;
+            Vec3T<T> d_up;
+
+            // default setting
+            CameraT(T aspect_ratio) :
+                lookat(Vec3T<T>(0,0,0)),
+                look_direction(Vec3T<T>(0,1,0)),
+                viewport_height(2.0),
+                aspect_ratio(aspect_ratio),
+                fov_deg(90),
+                defocus_blur_angle_deg(0)
+            { setup(); }
+
+            // any setting
+            CameraT(T aspect_ratio, Vec3T<T> lookat, Vec3T<T> look_direction, T viewport_height, T fov_deg, T defocus_blur_angle_deg) :
+                lookat(lookat),
+                look_direction(look_direction.unit()),
+                viewport_height(viewport_height),
+                aspect_ratio(aspect_ratio),
+                fov_deg(fov_deg),
+                defocus_blur_angle_deg(defocus_blur_angle_deg)
+            { setup(); }
+
+            void setup() {
+                focal_length = viewport_height / (2 * std::tan(fov_deg * pi/180 * 0.5)); // viewport_height / (2 * tan(theta/2))
+                defocus_blur_radius = focal_length * std::tan(defocus_blur_angle_deg * pi/180 * 0.5); // focal_length * tan(theta/2)
+                viewport_width = viewport_height * aspect_ratio;
+                origin = lookat - look_direction * focal_length;
+                d_right = cross(look_direction, up).unit();
+                d_up = -cross(look_direction, d_right).unit();
+            }
+
+            Line3T<T> generate_ray(T x_pos, T y_pos) {
+                Line3T<T> ray;
+
+                // ray origin
+                Vec3T<T> ray_origin = origin;
+                if (defocus_blur_radius > 0) { ray_origin += defocus_blur_radius * std::sqrt(T(random_double())) * (d_up * normal_double() + d_right * normal_double()).unit(); } // defocus blur ray (start the ray from a random point on defocus blur disc)
+
+                // ray point on viewport
+                Vec3T<T> ray_viewport = origin + look_direction * focal_length; // to viewport centre
+                ray_viewport += d_right * viewport_width * x_pos; // add viewport x position
+                ray_viewport += d_up * viewport_height * y_pos; // add viewport y position
+
+                ray.p = ray_origin;
+                ray.d = ray_viewport - ray_origin;
+                ray.d = ray.d.unit();
+
+                return ray;
+            }
+    };
+
+    using Camera = CameraT<Real>;
+
+}
+
+#endif // CAMERA
@@ -0,0 +1,225 @@
+#ifndef CAUSTICS
+#define CAUSTICS
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#include <tuple>
+#include <utility>
+#include "gmath.h"
+#include "geometry.h"
+#include "scene.h"
+#include "materials.h"
+#include "lights.h"
+#include "environment.h"
+#include "parallel.h"
+
+namespace rt {
+
+    /// @brief whether a material bends or mirrors light without spreading it, so light through it forms caustics
+    inline bool is_specular(const MaterialProperties& material) {
+        return material.type == Material::glass || (material.type == Material::metal && material.fuzz == 0);
+    }
+
+    /// @brief a packet of light that reached a matte surface through specular ones only
+    struct Photon {
+        float position[3];
+        float direction[3]; // of travel, unit
+        float power[3]; // flux
+    };
+
+    /// @brief caustics from the sky, found by tracing photons forwards rather than by camera paths, which only find a
+    /// small bright source through glass by chance (Jensen, "Global Illumination using Photon Maps", 1996).
+    /// Photons are aimed at the bounding spheres of the specular primitives, and only ones that bounce off or through
+    /// specular surfaces before landing on a matte one are kept. They're stored in a hashed grid of cells as wide as the
+    /// gather disc, so a lookup reads just the 8 cells around the point.
+    /// A renderer that uses the map must count sky light that reaches a matte surface through specular ones only from
+    /// here where covers() says the photons carry it, and not also from camera paths that escape after a matte bounce
+    /// and specular ones. Elsewhere (specular surfaces that aren't aimed at, like planes and instanced geometry) the
+    /// paths must still count it.
+    class CausticMap {
+        public:
+            Real radius{0.02}; // of the disc photons are gathered from
+            std::vector<Photon> photons;
+
+            bool empty() const { return photons.empty(); }
+
+            /// @brief traces n_emitted photons from the sky in parallel and builds the grid. The sky is environment if it
+            /// isn't null or empty, with directions picked by its own importance sampling; otherwise sky(direction)
+            /// gives the radiance from each direction, which are picked uniformly. Each batch of photons draws from
+            /// its own stream of seed, so the same seed gives the same map on any number of threads. Returns the
+            /// number of photons kept.
+            template <typename Set, typename Sky>
+            std::size_t emit(const Set& scene, const MaterialTable& materials, Sky sky, const EnvironmentMap* environment,
+                             std::size_t n_emitted, int max_bounces = 16, std::uint64_t seed = 0) {
+                photons.clear();
+                targets.clear();
+                add_targets(scene, materials, std::make_index_sequence<std::tuple_size_v<decltype(Set::primitives)>>{});
+                if (targets.empty() || n_emitted == 0) {
+                    build_grid();
+                    return 0;
+                }
+                Real total_area = 0;
+                for (const Target& target : targets) { total_area += target.radius * target.radius; }
+                for (Target& target : targets) { target.probability = target.radius * target.radius / total_area; }
+                AABB3 box = scene.bounds();
+                Vec3 scene_centre = (box.min + box.max) / 2;
+                Real scene_radius = (box.max - box.min).abs() / 2;
+                bool use_environment = environment && !environment->empty();
+
+                // each batch fills its own list, so threads don't share anything but the scene
+                const std::size_t batch_size = 4096;
+                std::vector<std::vector<Photon>> batches((n_emitted + batch_size - 1) / batch_size);
+                parallel_for(0, batches.size(), [&](std::size_t batch) {
+                    seed_random(seed, batch);
+                    std::size_t count = std::min(batch_size, n_emitted - batch * batch_size);
+                    for (std::size_t i = 0; i < count; i++) {
+                        // a direction the light comes from, then a point where it crosses the plane through the chosen target
+                        Vec3 toward_sky;
+                        Real direction_pdf;
+                        Colour radiance;
+                        if (use_environment) {
+                            Real u1 = random_double();
+                            Real u2 = random_double();
+                            if (!environment->sample(u1, u2, toward_sky, direction_pdf)) { continue; }
+                            radiance = environment->radiance(toward_sky);
+                        } else {
+                            Real z = 1 - 2 * random_double();
+                            Real phi = 2 * pi * random_double();
+                            Real r = std::sqrt(std::max(Real(0), 1 - z * z));
+                            toward_sky = Vec3(r * std::cos(phi), r * std::sin(phi), z);
+                            direction_pdf = 1 / (4 * pi);
+                            radiance = sky(toward_sky);
+                        }
+                        Vec3 d = -toward_sky;
+                        Vec3 u, v;
+                        orthonormal_basis(d, u, v);
+                        const Target& target = pick_target(random_double());
+                        Real disc_r = target.radius * std::sqrt(random_double());
+                        Real disc_phi = 2 * pi * random_double();
+                        Vec3 through = target.centre + disc_r * std::cos(disc_phi) * u + disc_r * std::sin(disc_phi) * v;
+
+                        // the targets' discs overlap, so the density of through is summed over every disc it's in
+                        Real area_pdf = 0;
+                        for (const Target& other : targets) {
+                            Vec3 offset = through - other.centre;
+                            if ((offset - dot(offset, d) * d).abs2() <= other.radius * other.radius) {
+                                area_pdf += other.probability / (pi * other.radius * other.radius);
+                            }
+                        }
+                        Colour power = radiance / (direction_pdf * area_pdf * static_cast<Real>(n_emitted));
+                        Line3 ray(through - (scene_radius + (through - scene_centre).abs()) * d, d);
+                        // that's beyond every bounded primitive, but not the unbounded ones, which the sky's light
+                        // can't come through from here
+                        if (scene.closest_hit(Line3(ray.p, toward_sky)).hit()) { continue; }
+                        trace_photon(scene, materials, ray, power, max_bounces, batches[batch]);
+                    }
+                }, 1);
+
+                std::size_t total = 0;
+                for (const std::vector<Photon>& batch : batches) { total += batch.size(); }
+                photons.reserve(total);
+                for (const std::vector<Photon>& batch : batches) { photons.insert(photons.end(), batch.begin(), batch.end()); }
+                build_grid();
+                return photons.size();
+            }
+
+            /// @brief whether photons carry sky light that leaves point in direction toward_sky's opposite: whether the
+            /// line crosses one of the discs they're aimed through. A path that escapes along it from a specular surface
+            /// after a matte one has had its light counted by the map; any other must count it itself.
+            bool covers(const Vec3& point, const Vec3& toward_sky) const {
+                Vec3 d = toward_sky.unit();
+                for (const Target& target : targets) {
+                    Vec3 offset = point - target.centre;
+                    if ((offset - dot(offset, d) * d).abs2() <= target.radius * target.radius) { return true; }
+                }
+                return false;
+            }
+
+            /// @brief caustic light leaving a matte surface at point, as a density estimate over the photons within
+            /// radius that arrived from the side normal_unit faces. A cone filter weights nearer photons more, which
+            /// keeps caustic edges sharper than a flat disc would.
+            Colour radiance(const Vec3& point, const Vec3& normal_unit, const Colour& reflectance) const;
+
+            std::size_t memory() const {
+                return photons.capacity() * sizeof(Photon) + cell_start.capacity() * sizeof(std::uint32_t) + targets.capacity() * sizeof(Target);
+            }
+
+        private:
+            struct Target {
+                Vec3 centre;
+                Real radius;
+                Real probability; // of aiming at it, by its projected area
+            };
+            std::vector<Target> targets;
+            std::vector<std::uint32_t> cell_start; // photons hashed to cell h are photons[cell_start[h], cell_start[h + 1])
+            std::uint64_t hash_mask{0};
+
+            // the bounding spheres of the built-in bounded primitives with specular materials. Instanced geometry and
+            // unbounded primitives aren't aimed at.
+            template <typename Set, std::size_t... I>
+            void add_targets(const Set& scene, const MaterialTable& materials, std::index_sequence<I...>) {
+                auto add_array = [&](const auto& array) {
+                    using P = typename std::decay_t<decltype(array)>::value_type;
+                    if constexpr (is_bounded_v<P> && !is_instance_v<P>) {
+                        for (const P& prim : array) {
+                            if (!is_specular(materials[prim.material_id])) { continue; }
+                            AABB3 box = prim.bounds();
+                            targets.push_back(Target{(box.min + box.max) / 2, (box.max - box.min).abs() / 2, 0});
+                        }
+                    }
+                };
+                (add_array(std::get<I>(scene.primitives)), ...);
+            }
+
+            const Target& pick_target(Real u) const {
+                for (const Target& target : targets) {
+                    if (u < target.probability) { return target; }
+                    u -= target.probability;
+                }
+                return targets.back();
+            }
+
+            template <typename Set>
+            static void trace_photon(const Set& scene, const MaterialTable& materials, Line3 ray, Colour power, int max_bounces,
+                                     std::vector<Photon>& out) {
+                MediumStack media;
+                for (int bounce = 0; bounce <= max_bounces; bounce++) {
+                    Hit hit = scene.closest_hit(ray);
+                    if (!hit.hit()) { return; }
+                    Vec3 point = ray(hit.t);
+                    Vec3 normal_unit;
+                    MaterialId material_id = 0;
+                    scene.visit(hit, [&](const auto& prim) {
+                        normal_unit = prim.normal(point);
+                        material_id = prim.material_id;
+                    });
+                    const MaterialProperties& material = materials[material_id];
+                    if (is_specular(material)) {
+                        ray = scatter(materials, material_id, ray, point, normal_unit, media);
+                        power = power * material.reflectance;
+                        continue;
+                    }
+                    // light straight from the sky isn't a caustic, and other surfaces end the path
+                    if (bounce > 0 && material.type == Material::matte) {
+                        Vec3 d = ray.d.unit();
+                        out.push_back(Photon{{static_cast<float>(point.x), static_cast<float>(point.y), static_cast<float>(point.z)},
+                                             {static_cast<float>(d.x), static_cast<float>(d.y), static_cast<float>(d.z)},
+                                             {static_cast<float>(power.x), static_cast<float>(power.y), static_cast<float>(power.z)}});
+                    }
+                    return;
+                }
+            }
+
+            void build_grid();
+
+            std::uint64_t cell_hash(std::int64_t x, std::int64_t y, std::int64_t z) const {
+                return (static_cast<std::uint64_t>(x) * 73856093u ^ static_cast<std::uint64_t>(y) * 19349663u ^ static_cast<std::uint64_t>(z) * 83492791u) & hash_mask;
+            }
+    };
+
+}
+
+#endif // CAUSTICS
@@ -0,0 +1,61 @@
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "caustics.h"
+#include "parallel.h"
+
+namespace rt {
+
+    void CausticMap::build_grid() {
+        // at least twice as many slots as photons keeps unrelated cells from sharing a slot often
+        int bits = 1;
+        while ((std::size_t(1) << bits) < 2 * photons.size()) { bits++; }
+        hash_mask = (std::uint64_t(1) << bits) - 1;
+        const Real cell = 2 * radius;
+        std::vector<std::uint32_t> keys(photons.size());
+        parallel_for(0, photons.size(), [&](std::size_t i) {
+            const float* p = photons[i].position;
+            keys[i] = static_cast<std::uint32_t>(cell_hash(static_cast<std::int64_t>(std::floor(p[0] / cell)),
+                                                            static_cast<std::int64_t>(std::floor(p[1] / cell)),
+                                                            static_cast<std::int64_t>(std::floor(p[2] / cell))));
+        }, 4096);
+        radix_sort(keys, photons, bits);
+
+        cell_start.assign((std::size_t(1) << bits) + 1, 0);
+        for (std::uint32_t key : keys) { cell_start[key + 1]++; }
+        for (std::size_t h = 1; h < cell_start.size(); h++) { cell_start[h] += cell_start[h - 1]; }
+    }
+
+    Colour CausticMap::radiance(const Vec3& point, const Vec3& normal_unit, const Colour& reflectance) const {
+        if (photons.empty()) { return Colour(0, 0, 0); }
+        const Real cell = 2 * radius;
+        const Real radius2 = radius * radius;
+        // the disc around point overlaps the 2 cells along each axis nearest it
+        const std::int64_t base[3] = {static_cast<std::int64_t>(std::floor((point.x - radius) / cell)),
+                                      static_cast<std::int64_t>(std::floor((point.y - radius) / cell)),
+                                      static_cast<std::int64_t>(std::floor((point.z - radius) / cell))};
+
+        Colour flux(0, 0, 0);
+        std::uint64_t seen[8];
+        int n_seen = 0;
+        for (int corner = 0; corner < 8; corner++) {
+            std::uint64_t h = cell_hash(base[0] + (corner & 1), base[1] + ((corner >> 1) & 1), base[2] + ((corner >> 2) & 1));
+            // two cells can hash to the same slot, which must only be counted once
+            if (std::find(seen, seen + n_seen, h) != seen + n_seen) { continue; }
+            seen[n_seen++] = h;
+            for (std::uint32_t i = cell_start[h]; i < cell_start[h + 1]; i++) {
+                const Photon& photon = photons[i];
+                Vec3 offset(photon.position[0] - point.x, photon.position[1] - point.y, photon.position[2] - point.z);
+                Real distance2 = offset.abs2();
+                if (distance2 >= radius2) { continue; }
+                if (photon.direction[0] * normal_unit.x + photon.direction[1] * normal_unit.y + photon.direction[2] * normal_unit.z >= 0) { continue; }
+                Real weight = 1 - std::sqrt(distance2) / radius;
+                flux += weight * Colour(photon.power[0], photon.power[1], photon.power[2]);
+            }
+        }
+        // a cone filter integrates to a third of the disc's area
+        return (reflectance / pi) * flux / (pi * radius2 / 3);
+    }
+
+}
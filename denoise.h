@@ -0,0 +1,55 @@
+#ifndef DENOISE
+#define DENOISE
+
+#include <vector>
+#include <cstddef>
+#include "gmath.h"
+#include "tonemap.h"
+
+namespace rt {
+
+    /// @brief what each pixel's camera rays hit first, averaged over its samples, for the denoiser to find edges by,
+    /// and how noisy the pixel is. Rows are top to bottom, like Framebuffer.
+    class FeatureBuffers {
+        public:
+            int width;
+            int height;
+            Framebuffer albedo; // reflectance of the surface hit, or 1 where it's a light, glass or the sky
+            Framebuffer normal; // unit normals averaged, so shorter at edges
+            std::vector<float> depth; // distance to the hit, sky_depth where there's none
+            std::vector<float> variance; // of the pixel's luminance, as an estimate of its mean
+
+            static constexpr float sky_depth = 1e30f;
+
+            FeatureBuffers(int width, int height)
+                : width(width), height(height), albedo(width, height), normal(width, height),
+                  depth(static_cast<std::size_t>(width) * height, sky_depth), variance(static_cast<std::size_t>(width) * height, 0.0f) {}
+
+            void set_pixel(int column, int row, const Colour& pixel_albedo, const Vec3& pixel_normal, float pixel_depth, float pixel_variance) {
+                std::size_t i = static_cast<std::size_t>(row) * width + column;
+                albedo.set_pixel(column, row, pixel_albedo);
+                normal.set_pixel(column, row, pixel_normal);
+                depth[i] = pixel_depth;
+                variance[i] = pixel_variance;
+            }
+    };
+
+    struct DenoiseSettings {
+        int iterations{5}; // à-trous passes, each with taps twice as far apart: 5 reach 62 pixels away
+        float sigma_luminance{4}; // luminance differences allowed, in standard deviations of the pixel's noise
+        float sigma_normal{64}; // weight falls as exp(-sigma_normal (n_p . n_p - n_p . n_q)), so the pixel itself always counts fully
+        float sigma_depth{0.05f}; // relative depth change allowed per pixel apart
+    };
+
+    /// @brief an edge-avoiding à-trous wavelet filter (Dammertz et al., "Edge-Avoiding À-Trous Wavelet Transform for
+    /// fast Global Illumination Filtering", 2010), guided by the noise estimate as in SVGF (Schied et al. 2017).
+    /// The colour is divided by the albedo first so texture and material colour aren't blurred, only the light, and
+    /// multiplied back at the end. Each pass is a 5x5 B3-spline with its taps 2^i pixels apart, weighted down across
+    /// luminance differences larger than the noise, across normals that disagree and across depth jumps; the noise
+    /// estimate is filtered along with the colour. Tiles are filtered in parallel, 4 pixels at a time with SSE.
+    /// out may be colour.
+    void denoise(const Framebuffer& colour, const FeatureBuffers& features, Framebuffer& out, const DenoiseSettings& settings = DenoiseSettings());
+
+}
+
+#endif // DENOISE
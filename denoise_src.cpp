@@ -0,0 +1,216 @@
+#include <vector>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <utility>
+#include "denoise.h"
+#include "parallel.h"
+
+namespace rt {
+
+    // one image as a plane per channel, so 4 neighbouring pixels of any channel load together
+    struct DenoisePlanes {
+        std::vector<float> r, g, b, variance;
+
+        explicit DenoisePlanes(std::size_t n) : r(n), g(n), b(n), variance(n) {}
+    };
+
+    struct DenoiseGuides {
+        std::vector<float> nx, ny, nz, depth;
+        std::vector<float> sigma; // luminance difference for a weight of 1/e at each pixel, from its filtered variance
+        std::vector<float> luminance; // of the pass's input
+    };
+
+    // B3-spline
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    static const int tile_size = 64;
+
+    static float luminance(float r, float g, float b) { return 0.2126f * r + 0.7152f * g + 0.0722f * b; }
+
+#ifdef GMATH_HAS_SSE
+    // e^x for x <= 0, to about 2e-4 relative, from 2^(integer part) times a polynomial for 2^(fraction); e^-30 below
+    // -30, which is as good as 0 for a weight, and whose square is still a normal float (denormals are very slow)
+    static inline __m128 exp_negative(__m128 x) {
+        x = _mm_max_ps(x, _mm_set1_ps(-30.0f));
+        __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+        __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+        whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, t), _mm_set1_ps(1.0f))); // truncation rounds up below 0
+        __m128 f = _mm_sub_ps(t, whole);
+        __m128 p = _mm_set1_ps(1.33335581e-3f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.61812911e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.55041087e-2f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.40226507e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.93147181e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+        __m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(whole), _mm_set1_epi32(127)), 23);
+        return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+    }
+
+    static inline __m128 abs_ps(__m128 x) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), x); }
+
+    // pixels i to i + 3 of row y, whose taps are all inside the image horizontally
+    static void filter4(const DenoisePlanes& in, DenoisePlanes& out, const DenoiseGuides& guides, int width, int height, int x, int y,
+                        int step, const DenoiseSettings& settings) {
+        std::size_t p = static_cast<std::size_t>(y) * width + x;
+        __m128 lp = _mm_loadu_ps(&guides.luminance[p]);
+        __m128 inv_sigma = _mm_div_ps(_mm_set1_ps(1.0f), _mm_loadu_ps(&guides.sigma[p]));
+        __m128 nxp = _mm_loadu_ps(&guides.nx[p]), nyp = _mm_loadu_ps(&guides.ny[p]), nzp = _mm_loadu_ps(&guides.nz[p]);
+        __m128 npp = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nxp, nxp), _mm_mul_ps(nyp, nyp)), _mm_mul_ps(nzp, nzp));
+        __m128 zp = _mm_loadu_ps(&guides.depth[p]);
+        __m128 sigma_normal = _mm_set1_ps(settings.sigma_normal);
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 inv_depth = _mm_div_ps(one, _mm_mul_ps(_mm_set1_ps(settings.sigma_depth), zp));
+        const float inv_apart[3] = {1.0f, 1.0f / step, 0.5f / step}; // by how many taps apart, at least 1 pixel
+        __m128 sum_w = _mm_setzero_ps(), sum_r = _mm_setzero_ps(), sum_g = _mm_setzero_ps(), sum_b = _mm_setzero_ps(), sum_v = _mm_setzero_ps();
+        for (int dy = -2; dy <= 2; dy++) {
+            int yq = y + dy * step;
+            if (yq < 0 || yq >= height) { continue; }
+            for (int dx = -2; dx <= 2; dx++) {
+                std::size_t q = static_cast<std::size_t>(yq) * width + x + dx * step;
+                __m128 lq = _mm_loadu_ps(&guides.luminance[q]);
+                __m128 n_dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nxp, _mm_loadu_ps(&guides.nx[q])), _mm_mul_ps(nyp, _mm_loadu_ps(&guides.ny[q]))),
+                                          _mm_mul_ps(nzp, _mm_loadu_ps(&guides.nz[q])));
+                __m128 depth_scale = _mm_mul_ps(inv_depth, _mm_set1_ps(inv_apart[std::max(std::abs(dx), std::abs(dy))]));
+                __m128 exponent = _mm_mul_ps(abs_ps(_mm_sub_ps(lp, lq)), inv_sigma);
+                exponent = _mm_add_ps(exponent, _mm_mul_ps(sigma_normal, _mm_max_ps(_mm_sub_ps(npp, n_dot), _mm_setzero_ps())));
+                exponent = _mm_add_ps(exponent, _mm_mul_ps(abs_ps(_mm_sub_ps(zp, _mm_loadu_ps(&guides.depth[q]))), depth_scale));
+                __m128 w = _mm_mul_ps(_mm_set1_ps(kernel[dx + 2] * kernel[dy + 2]), exp_negative(_mm_sub_ps(_mm_setzero_ps(), exponent)));
+                sum_w = _mm_add_ps(sum_w, w);
+                sum_r = _mm_add_ps(sum_r, _mm_mul_ps(w, _mm_loadu_ps(&in.r[q])));
+                sum_g = _mm_add_ps(sum_g, _mm_mul_ps(w, _mm_loadu_ps(&in.g[q])));
+                sum_b = _mm_add_ps(sum_b, _mm_mul_ps(w, _mm_loadu_ps(&in.b[q])));
+                sum_v = _mm_add_ps(sum_v, _mm_mul_ps(_mm_mul_ps(w, w), _mm_loadu_ps(&in.variance[q])));
+            }
+        }
+        // the centre tap always has weight 9/64, so sum_w is never near 0
+        __m128 inv_w = _mm_div_ps(one, sum_w);
+        _mm_storeu_ps(&out.r[p], _mm_mul_ps(sum_r, inv_w));
+        _mm_storeu_ps(&out.g[p], _mm_mul_ps(sum_g, inv_w));
+        _mm_storeu_ps(&out.b[p], _mm_mul_ps(sum_b, inv_w));
+        _mm_storeu_ps(&out.variance[p], _mm_mul_ps(sum_v, _mm_mul_ps(inv_w, inv_w)));
+    }
+#endif
+
+    static void filter1(const DenoisePlanes& in, DenoisePlanes& out, const DenoiseGuides& guides, int width, int height, int x, int y,
+                        int step, const DenoiseSettings& settings) {
+        std::size_t p = static_cast<std::size_t>(y) * width + x;
+        float lp = guides.luminance[p];
+        float inv_sigma = 1.0f / guides.sigma[p];
+        float npp = guides.nx[p] * guides.nx[p] + guides.ny[p] * guides.ny[p] + guides.nz[p] * guides.nz[p];
+        float zp = guides.depth[p];
+        float sum_w = 0, sum_r = 0, sum_g = 0, sum_b = 0, sum_v = 0;
+        for (int dy = -2; dy <= 2; dy++) {
+            int yq = y + dy * step;
+            if (yq < 0 || yq >= height) { continue; }
+            for (int dx = -2; dx <= 2; dx++) {
+                int xq = x + dx * step;
+                if (xq < 0 || xq >= width) { continue; }
+                std::size_t q = static_cast<std::size_t>(yq) * width + xq;
+                float n_dot = guides.nx[p] * guides.nx[q] + guides.ny[p] * guides.ny[q] + guides.nz[p] * guides.nz[q];
+                int apart = step * std::max(std::abs(dx), std::abs(dy));
+                float exponent = std::fabs(lp - guides.luminance[q]) * inv_sigma +
+                                 settings.sigma_normal * std::max(npp - n_dot, 0.0f) +
+                                 std::fabs(zp - guides.depth[q]) / (settings.sigma_depth * std::max(apart, 1) * zp);
+                float w = kernel[dx + 2] * kernel[dy + 2] * std::exp(-std::min(exponent, 30.0f));
+                sum_w += w;
+                sum_r += w * in.r[q];
+                sum_g += w * in.g[q];
+                sum_b += w * in.b[q];
+                sum_v += w * w * in.variance[q];
+            }
+        }
+        out.r[p] = sum_r / sum_w;
+        out.g[p] = sum_g / sum_w;
+        out.b[p] = sum_b / sum_w;
+        out.variance[p] = sum_v / (sum_w * sum_w);
+    }
+
+    // calls f(x0, x1, y0, y1) for every tile of the image, in parallel
+    template <typename F>
+    static void for_each_tile(int width, int height, F f) {
+        int columns = (width + tile_size - 1) / tile_size;
+        int rows = (height + tile_size - 1) / tile_size;
+        parallel_for(0, static_cast<std::size_t>(columns) * rows, [&](std::size_t tile) {
+            int x0 = static_cast<int>(tile % columns) * tile_size;
+            int y0 = static_cast<int>(tile / columns) * tile_size;
+            f(x0, std::min(x0 + tile_size, width), y0, std::min(y0 + tile_size, height));
+        });
+    }
+
+    static void atrous_pass(const DenoisePlanes& in, DenoisePlanes& out, DenoiseGuides& guides, int width, int height, int step,
+                            const DenoiseSettings& settings) {
+        // a 3x3 blur of the variance steadies the estimate the luminance weights are scaled by
+        for_each_tile(width, height, [&](int x0, int x1, int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    std::size_t p = static_cast<std::size_t>(y) * width + x;
+                    guides.luminance[p] = luminance(in.r[p], in.g[p], in.b[p]);
+                    float sum = 0, sum_w = 0;
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int xq = x + dx, yq = y + dy;
+                            if (xq < 0 || xq >= width || yq < 0 || yq >= height) { continue; }
+                            float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+                            sum += w * in.variance[static_cast<std::size_t>(yq) * width + xq];
+                            sum_w += w;
+                        }
+                    }
+                    guides.sigma[p] = settings.sigma_luminance * std::sqrt(std::max(sum / sum_w, 0.0f)) + 1e-6f;
+                }
+            }
+        });
+
+        for_each_tile(width, height, [&](int x0, int x1, int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                int x = x0;
+#ifdef GMATH_HAS_SSE
+                // 4 at a time between the columns whose taps would leave the image
+                int simd_begin = std::max(x0, 2 * step);
+                int simd_end = std::min(x1, width - 2 * step);
+                for (; x < simd_begin; x++) { filter1(in, out, guides, width, height, x, y, step, settings); }
+                for (; x + 4 <= simd_end; x += 4) { filter4(in, out, guides, width, height, x, y, step, settings); }
+#endif
+                for (; x < x1; x++) { filter1(in, out, guides, width, height, x, y, step, settings); }
+            }
+        });
+    }
+
+    void denoise(const Framebuffer& colour, const FeatureBuffers& features, Framebuffer& out, const DenoiseSettings& settings) {
+        const int width = colour.width;
+        const int height = colour.height;
+        const std::size_t n = static_cast<std::size_t>(width) * height;
+        DenoisePlanes a(n), b(n);
+        DenoiseGuides guides{std::vector<float>(n), std::vector<float>(n), std::vector<float>(n), features.depth, std::vector<float>(n), std::vector<float>(n)};
+
+        // light reaching each pixel's surface, taken apart from the colour of the surface
+        const float min_albedo = 1e-3f;
+        parallel_for(0, n, [&](std::size_t i) {
+            const float* c = &colour.pixels[i * 3];
+            const float* albedo = &features.albedo.pixels[i * 3];
+            const float* normal = &features.normal.pixels[i * 3];
+            a.r[i] = c[0] / std::max(albedo[0], min_albedo);
+            a.g[i] = c[1] / std::max(albedo[1], min_albedo);
+            a.b[i] = c[2] / std::max(albedo[2], min_albedo);
+            float albedo_luminance = std::max(luminance(albedo[0], albedo[1], albedo[2]), min_albedo);
+            a.variance[i] = features.variance[i] / (albedo_luminance * albedo_luminance);
+            guides.nx[i] = normal[0];
+            guides.ny[i] = normal[1];
+            guides.nz[i] = normal[2];
+        }, 4096);
+
+        for (int i = 0; i < settings.iterations; i++) {
+            atrous_pass(a, b, guides, width, height, 1 << i, settings);
+            std::swap(a, b);
+        }
+
+        if (out.width != width || out.height != height) { out = Framebuffer(width, height); }
+        parallel_for(0, n, [&](std::size_t i) {
+            const float* albedo = &features.albedo.pixels[i * 3];
+            out.pixels[i * 3] = a.r[i] * std::max(albedo[0], min_albedo);
+            out.pixels[i * 3 + 1] = a.g[i] * std::max(albedo[1], min_albedo);
+            out.pixels[i * 3 + 2] = a.b[i] * std::max(albedo[2], min_albedo);
+        }, 4096);
+    }
+
+}
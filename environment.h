@@ -0,0 +1,107 @@
+#ifndef ENVIRONMENT
+#define ENVIRONMENT
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "gmath.h"
+#include "geometry.h"
+#include "tonemap.h"
+
+namespace rt {
+
+    /// @brief picks index i with probability pdf[i] in O(1) (Walker's alias method, built in O(n) as in Vose, 1991).
+    /// Each slot holds a threshold and an alias: a uniform number picks a slot, and its fraction picks between the
+    /// slot itself (below the threshold) and its alias.
+    class AliasTable {
+        public:
+            std::vector<float> pdf; // the weights, normalised
+            std::vector<float> threshold;
+            std::vector<std::uint32_t> alias;
+
+            bool empty() const { return pdf.empty(); }
+            std::size_t size() const { return pdf.size(); }
+
+            /// @brief weights must be >= 0 with at least one > 0, or the table is left empty
+            void build(const float* weights, std::size_t n);
+
+            /// @brief u in [0, 1). The part of u not used up in the choice is returned in remainder, uniform in [0, 1) again.
+            std::uint32_t sample(Real u, Real& remainder) const {
+                Real scaled = u * pdf.size();
+                std::uint32_t slot = std::min(static_cast<std::uint32_t>(scaled), static_cast<std::uint32_t>(pdf.size() - 1));
+                Real fraction = scaled - slot;
+                if (fraction < threshold[slot]) {
+                    remainder = fraction / threshold[slot];
+                    return slot;
+                }
+                remainder = (fraction - threshold[slot]) / (1 - threshold[slot]);
+                return alias[slot];
+            }
+    };
+
+    /// @brief light arriving from every direction, from an equirectangular image: row 0 looks straight up (+z) and
+    /// the last row straight down; columns go anticlockwise round z, seen from above, starting at +x.
+    /// Directions are sampled in proportion to the image's luminance times the solid angle its pixels cover, so a
+    /// small bright sun is found directly rather than by chance: a row is picked from a table of their totals, then a
+    /// column from that row's own table, both in O(1).
+    class EnvironmentMap {
+        public:
+            Framebuffer image{0, 0};
+
+            bool empty() const { return rows.empty(); }
+
+            /// @brief takes the image and builds the sampling tables, a row at a time in parallel. An all black image
+            /// leaves the map empty.
+            void build(Framebuffer image);
+
+            Colour radiance(const Vec3& direction) const {
+                int row, column;
+                pixel(direction, row, column);
+                const float* value = image(column, row);
+                return Colour(value[0], value[1], value[2]);
+            }
+
+            /// @brief picks a direction with u1, u2 uniform in [0, 1), giving its density over solid angle
+            bool sample(Real u1, Real u2, Vec3& direction, Real& pdf) const {
+                if (empty()) { return false; }
+                Real v_offset, u_offset;
+                std::uint32_t row = rows.sample(u1, v_offset);
+                std::uint32_t column = columns[row].sample(u2, u_offset);
+                Real theta = pi * (row + v_offset) / image.height;
+                Real phi = 2 * pi * (column + u_offset) / image.width;
+                Real sin_theta = std::sin(theta);
+                if (sin_theta <= 0) { return false; }
+                direction = Vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), std::cos(theta));
+                pdf = rows.pdf[row] * columns[row].pdf[column] * image.width * image.height / (2 * pi * pi * sin_theta);
+                return true;
+            }
+
+            /// @brief density over solid angle with which sample() picks direction
+            Real pdf(const Vec3& direction) const {
+                if (empty()) { return 0; }
+                int row, column;
+                Real sin_theta = pixel(direction, row, column);
+                if (sin_theta <= 0 || columns[row].empty()) { return 0; }
+                return rows.pdf[row] * columns[row].pdf[column] * image.width * image.height / (2 * pi * pi * sin_theta);
+            }
+
+        private:
+            AliasTable rows; // by each row's share of the power
+            std::vector<AliasTable> columns; // within each row
+
+            // the pixel a direction falls in. Returns the sine of its angle from +z.
+            Real pixel(const Vec3& direction, int& row, int& column) const {
+                Vec3 d = direction.unit();
+                Real theta = std::acos(std::clamp(d.z, Real(-1), Real(1)));
+                Real phi = std::atan2(d.y, d.x);
+                if (phi < 0) { phi += 2 * pi; }
+                row = std::min(static_cast<int>(theta / pi * image.height), image.height - 1);
+                column = std::min(static_cast<int>(phi / (2 * pi) * image.width), image.width - 1);
+                return std::sqrt(std::max(Real(0), 1 - d.z * d.z));
+            }
+    };
+
+}
+
+#endif // ENVIRONMENT
@@ -0,0 +1,76 @@
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include "environment.h"
+#include "materials.h"
+#include "parallel.h"
+
+namespace rt {
+
+    void AliasTable::build(const float* weights, std::size_t n) {
+        double total = 0;
+        for (std::size_t i = 0; i < n; i++) { total += weights[i]; }
+        if (!(total > 0)) {
+            pdf.clear();
+            threshold.clear();
+            alias.clear();
+            return;
+        }
+        pdf.resize(n);
+        threshold.resize(n);
+        alias.resize(n);
+
+        // each slot starts with its weight scaled so the average is 1. Slots under 1 are topped up from ones over it,
+        // which then become the aliases.
+        std::vector<double> scaled(n);
+        std::vector<std::uint32_t> small;
+        std::vector<std::uint32_t> large;
+        for (std::size_t i = 0; i < n; i++) {
+            pdf[i] = static_cast<float>(weights[i] / total);
+            scaled[i] = weights[i] / total * n;
+            alias[i] = static_cast<std::uint32_t>(i);
+            (scaled[i] < 1 ? small : large).push_back(static_cast<std::uint32_t>(i));
+        }
+        while (!small.empty() && !large.empty()) {
+            std::uint32_t under = small.back();
+            small.pop_back();
+            std::uint32_t over = large.back();
+            threshold[under] = static_cast<float>(scaled[under]);
+            alias[under] = over;
+            scaled[over] -= 1 - scaled[under];
+            if (scaled[over] < 1) {
+                large.pop_back();
+                small.push_back(over);
+            }
+        }
+        // whatever is left is 1 but for rounding
+        for (std::uint32_t i : small) { threshold[i] = 1; }
+        for (std::uint32_t i : large) { threshold[i] = 1; }
+    }
+
+    void EnvironmentMap::build(Framebuffer image) {
+        this->image = std::move(image);
+        const int width = this->image.width;
+        const int height = this->image.height;
+        columns.assign(height, AliasTable());
+        std::vector<float> row_weights(height, 0.0f);
+
+        // a pixel's share is its luminance times the solid angle it covers, which shrinks with sin(theta) towards the poles
+        parallel_for(0, height, [&](std::size_t row) {
+            std::vector<float> weights(width);
+            const float* pixels = this->image(0, static_cast<int>(row));
+            double sin_theta = std::sin(pi * (row + 0.5) / height);
+            double total = 0;
+            for (int x = 0; x < width; x++) {
+                weights[x] = std::max(0.0f, static_cast<float>(luminance(Colour(pixels[3 * x], pixels[3 * x + 1], pixels[3 * x + 2]))));
+                total += weights[x];
+            }
+            columns[row].build(weights.data(), weights.size());
+            row_weights[row] = static_cast<float>(total * sin_theta);
+        }, 4);
+        rows.build(row_weights.data(), row_weights.size());
+        if (rows.empty()) { columns.clear(); }
+    }
+
+}
@@ -0,0 +1,286 @@
+#ifndef GEOMETRY
+#define GEOMETRY
+
+#include <cmath>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <limits>
+#include "gmath.h"
+
+namespace rt {
+
+    using namespace gmath;
+
+    /// @brief nudges a point on a surface off it along normal, by an amount that scales with the point's magnitude,
+    /// so rays spawned from it can't re-hit the surface they start on due to rounding (in float or double).
+    /// Wächter & Binder, "A Fast and Robust Method for Avoiding Self-Intersection", Ray Tracing Gems (2019), ch. 6.
+    template <typename T>
+    Vec3T<T> offset_ray_origin(const Vec3T<T>& point, const Vec3T<T>& normal) {
+        using Bits = std::conditional_t<sizeof(T) == 4, std::int32_t, std::int64_t>;
+        const T origin = T(1.0 / 32.0); // below this, offset by a fixed amount rather than in ulps
+        const T float_scale = sizeof(T) == 4 ? T(1.0 / 65536.0) : T(1.0 / 1099511627776.0); // 2^-16 for float, 2^-40 for double
+        const T int_scale = 256;
+
+        auto offset = [&](T p, T n) {
+            Bits of_i = static_cast<Bits>(int_scale * n);
+            Bits p_bits;
+            std::memcpy(&p_bits, &p, sizeof(T));
+            p_bits += (p < 0) ? -of_i : of_i;
+            T p_i;
+            std::memcpy(&p_i, &p_bits, sizeof(T));
+            return std::fabs(p) < origin ? p + float_scale * n : p_i;
+        };
+        return Vec3T<T>(offset(point.x, normal.x), offset(point.y, normal.y), offset(point.z, normal.z));
+    }
+
+    template <typename T>
+    class Line3T {
+        public:
+            // line defined by a point it intesects and a direction
+            Vec3T<T> p; // point
+            Vec3T<T> d; // direction
+
+            Line3T() : p(Vec3T<T>(0,0,0)), d(Vec3T<T>(0,0,0)) {}
+            Line3T(Vec3T<T> point, Vec3T<T> direction) : p(point), d(direction) {}
+
+            Vec3T<T> operator()(const T t) const {  // get position vector at a point t along line
+                return p + t*d;
+            }
+    };
+
+    using Line3 = Line3T<Real>;
+
+    // component i (0, 1 or 2 for x, y, z) of v
+    template <typename T>
+    constexpr T axis(const Vec3T<T>& v, int i) { return i == 0 ? v.x : (i == 1 ? v.y : v.z); }
+
+    /// @brief narrows [t_in, t_out] to where a ray is between one axis's pair of planes, which it crosses at t0 and t1
+    /// (t0 the nearer). The comparisons are written so that a NaN from 0 * inf (a ray in the plane of a face) is ignored,
+    /// leaving that axis unconstrained.
+    template <typename T>
+    inline void clip_slab(T t0, T t1, T& t_in, T& t_out) {
+        t_in = t0 > t_in ? t0 : t_in;
+        t_out = t1 < t_out ? t1 : t_out;
+    }
+
+    /// @brief axis-aligned bounding box. A default constructed box is empty (min > max) and grows with extend().
+    template <typename T>
+    class AABB3T {
+        public:
+            Vec3T<T> min;
+            Vec3T<T> max;
+
+            AABB3T() : min(Vec3T<T>(inf(), inf(), inf())), max(Vec3T<T>(-inf(), -inf(), -inf())) {}
+            AABB3T(const Vec3T<T>& min, const Vec3T<T>& max) : min(min), max(max) {}
+
+            void extend(const Vec3T<T>& point) {
+                min = Vec3T<T>(std::min(min.x, point.x), std::min(min.y, point.y), std::min(min.z, point.z));
+                max = Vec3T<T>(std::max(max.x, point.x), std::max(max.y, point.y), std::max(max.z, point.z));
+            }
+            void extend(const AABB3T& box) {
+                min = Vec3T<T>(std::min(min.x, box.min.x), std::min(min.y, box.min.y), std::min(min.z, box.min.z));
+                max = Vec3T<T>(std::max(max.x, box.max.x), std::max(max.y, box.max.y), std::max(max.z, box.max.z));
+            }
+
+            bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+            Vec3T<T> centroid() const { return (min + max) / T(2); }
+            Vec3T<T> extent() const { return max - min; }
+            T surface_area() const {
+                if (empty()) { return 0; }
+                Vec3T<T> e = extent();
+                return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+            }
+            int longest_axis() const {
+                Vec3T<T> e = extent();
+                return e.x >= e.y && e.x >= e.z ? 0 : (e.y >= e.z ? 1 : 2);
+            }
+
+        private:
+            static constexpr T inf() { return std::numeric_limits<T>::infinity(); }
+    };
+
+    using AABB3 = AABB3T<Real>;
+
+    enum class Material {
+        matte,
+        metal,
+        glass,
+        emissive // a light: gives out MaterialProperties::emission and reflects nothing
+    };
+
+    using MaterialId = std::uint16_t; // index into the scene's MaterialTable
+
+    /// @brief escape hatch for user-defined primitives, which are reached through virtual dispatch.
+    /// Built-in primitives (Sphere3, ...) don't derive from this; they live in typed arrays in the scene
+    /// so that their intersection tests can be inlined.
+    class Hittable {
+        public:
+            MaterialId material_id{0};
+
+            Hittable() {}
+            Hittable(MaterialId material_id) : material_id(material_id) {}
+            virtual ~Hittable() {}
+
+            // returns value of t along input ray that causes intersection with the Hittable
+            // (rays start just off the surface they left, so any t > 0 counts)
+            virtual Real intersects(const Line3& ray) const = 0;
+            // returns unit vector normal to the surface at a point on it, pointing out of the surface
+            virtual Vec3 normal(const Vec3& point) const = 0;
+    };
+
+    template <typename T>
+    class Sphere3T {
+        // sphere defined by position of its centre and its radius
+        public:
+            Vec3T<T> p; // centre
+            T r; // radius
+            MaterialId material_id{0};
+            bool is_hollow{false}; // whether the normal should be inverted (i.e. the sphere is a hole in another object)
+
+            Sphere3T() : p(Vec3T<T>(0,0,0)), r(0) {}
+            Sphere3T(Vec3T<T> centre, T radius) : p(Vec3T<T>(centre)), r(radius) {}
+            Sphere3T(Vec3T<T> centre, T radius, MaterialId material_id, bool is_hollow=false) : p(Vec3T<T>(centre)), r(radius), material_id(material_id), is_hollow(is_hollow) {}
+
+            // quadratic equation for intersection has at least one solution (i.e. ray hits sphere) if discriminant >= 0.
+            // The discriminant is found from the ray's closest approach to the centre, and the smaller root from c/q,
+            // which avoids the cancellation the textbook form suffers in float (Ray Tracing Gems, ch. 7).
+            T intersects(const Line3T<T>& ray) const {
+                Vec3T<T> oc = ray.p - p;
+                T a = ray.d.abs2();
+                T half_b = dot(oc, ray.d);
+                T c = oc.abs2() - r*r;
+
+                Vec3T<T> closest = oc - (half_b / a) * ray.d; // from centre to the ray's closest point to it
+                T discriminant = a * (r*r - closest.abs2());
+
+                if (discriminant < 0) {
+                    return -1;
+                } else {
+                    T q = -half_b - std::copysign(std::sqrt(discriminant), half_b);
+                    T t0 = c / q;
+                    T t1 = q / a;
+                    if (t0 > t1) { std::swap(t0, t1); }
+                    return t0 > 0 ? t0 : t1; // return the closest value as long as it is in the +ve direction. otherwise, return further value.
+                }
+            }
+
+            Vec3T<T> normal(const Vec3T<T>& point) const {
+                Vec3T<T> normal_unit = (point - p).unit();
+                return is_hollow ? -normal_unit : normal_unit;
+            }
+
+            AABB3T<T> bounds() const {
+                Vec3T<T> half(r, r, r);
+                return AABB3T<T>(p - half, p + half);
+            }
+    };
+
+    using Sphere3 = Sphere3T<Real>;
+
+    /// @brief infinite plane through p with unit normal n. It has no bounds(), so scenes keep it out of their BVH.
+    template <typename T>
+    class Plane3T {
+        public:
+            Vec3T<T> p; // any point on the plane
+            Vec3T<T> n; // unit normal
+            MaterialId material_id{0};
+
+            Plane3T() : p(Vec3T<T>(0,0,0)), n(Vec3T<T>(0,0,1)) {}
+            Plane3T(Vec3T<T> point, Vec3T<T> normal, MaterialId material_id = 0) : p(point), n(normal.unit()), material_id(material_id) {}
+
+            T intersects(const Line3T<T>& ray) const {
+                T denominator = dot(n, ray.d);
+                if (denominator == 0) { return -1; } // parallel to the plane
+                return dot(p - ray.p, n) / denominator;
+            }
+
+            Vec3T<T> normal(const Vec3T<T>&) const { return n; }
+    };
+
+    using Plane3 = Plane3T<Real>;
+
+    /// @brief flat disk with centre p, unit normal n and radius r
+    template <typename T>
+    class Disk3T {
+        public:
+            Vec3T<T> p; // centre
+            Vec3T<T> n; // unit normal
+            T r; // radius
+            MaterialId material_id{0};
+
+            Disk3T() : p(Vec3T<T>(0,0,0)), n(Vec3T<T>(0,0,1)), r(0) {}
+            Disk3T(Vec3T<T> centre, Vec3T<T> normal, T radius, MaterialId material_id = 0) : p(centre), n(normal.unit()), r(radius), material_id(material_id) {}
+
+            T intersects(const Line3T<T>& ray) const {
+                T denominator = dot(n, ray.d);
+                if (denominator == 0) { return -1; }
+                T t = dot(p - ray.p, n) / denominator;
+                return (ray(t) - p).abs2() <= r*r ? t : -1;
+            }
+
+            Vec3T<T> normal(const Vec3T<T>&) const { return n; }
+
+            AABB3T<T> bounds() const {
+                // along each axis the rim reaches r * sin(angle between the axis and n) from the centre
+                auto reach = [&](T n_axis) { return r * std::sqrt(std::max(T(0), 1 - n_axis*n_axis)); };
+                Vec3T<T> half(reach(n.x), reach(n.y), reach(n.z));
+                return AABB3T<T>(p - half, p + half);
+            }
+    };
+
+    using Disk3 = Disk3T<Real>;
+
+    /// @brief solid axis-aligned box. Rays from inside it hit its far side.
+    template <typename T>
+    class Box3T {
+        public:
+            Vec3T<T> min;
+            Vec3T<T> max;
+            MaterialId material_id{0};
+
+            Box3T() : min(Vec3T<T>(0,0,0)), max(Vec3T<T>(0,0,0)) {}
+            Box3T(Vec3T<T> min, Vec3T<T> max, MaterialId material_id = 0) : min(min), max(max), material_id(material_id) {}
+
+            // slab test
+            T intersects(const Line3T<T>& ray) const {
+                T t_near = -std::numeric_limits<T>::infinity();
+                T t_far = std::numeric_limits<T>::infinity();
+                for (int a = 0; a < 3; a++) {
+                    T inv_d = 1 / axis(ray.d, a);
+                    T t0 = (axis(min, a) - axis(ray.p, a)) * inv_d;
+                    T t1 = (axis(max, a) - axis(ray.p, a)) * inv_d;
+                    if (inv_d < 0) { std::swap(t0, t1); }
+                    clip_slab(t0, t1, t_near, t_far);
+                }
+                if (t_near > t_far) { return -1; }
+                return t_near > 0 ? t_near : t_far;
+            }
+
+            // the face the point is on is the axis along which it's furthest from the centre, relative to the box's size
+            Vec3T<T> normal(const Vec3T<T>& point) const {
+                Vec3T<T> local = point - (min + max) / T(2);
+                Vec3T<T> half = (max - min) / T(2);
+                int face_axis = 0;
+                T furthest = -1;
+                for (int a = 0; a < 3; a++) {
+                    T distance = axis(half, a) > 0 ? std::fabs(axis(local, a)) / axis(half, a) : std::numeric_limits<T>::infinity();
+                    if (distance > furthest) {
+                        furthest = distance;
+                        face_axis = a;
+                    }
+                }
+                T sign = axis(local, face_axis) < 0 ? -1 : 1;
+                return Vec3T<T>(face_axis == 0 ? sign : 0, face_axis == 1 ? sign : 0, face_axis == 2 ? sign : 0);
+            }
+
+            AABB3T<T> bounds() const { return AABB3T<T>(min, max); }
+    };
+
+    using Box3 = Box3T<Real>;
+}
+
+#endif // GEOMETRY
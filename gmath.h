@@ -1,52 +1,313 @@
 #ifndef GMATH
 #define GMATH
 
+#include <cmath>
+#include <cstdint>
+#include <array>
+#include <ostream>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#define GMATH_HAS_SSE
+#endif
+
 namespace gmath {
 
+    // Scalar type used by the renderer. Compile with -DGMATH_USE_FLOAT to trace in single precision.
+#ifdef GMATH_USE_FLOAT
+    using Real = float;
+#else
+    using Real = double;
+#endif
+
     extern const double pi;
 
+    // Random numbers come from a generator per thread. Each thread that hasn't been seeded starts at a sequence of its
+    // own, so parallel loops don't draw the same numbers on every thread.
     double random_double();
     double random_double(double min, double max);
     double normal_double();
 
-    class Vec3 {
+    /// @brief restarts the calling thread's random numbers at the sequence for seed and stream. Parallel loops call it
+    /// at the start of each batch of work with the run's seed and the batch's index, so the numbers each batch draws
+    /// don't depend on which thread runs it and every run with the same seed gives the same result.
+    void seed_random(std::uint64_t seed, std::uint64_t stream);
+
+    /// @brief 1/sqrt(x). In float this is the hardware estimate refined with one Newton step (~23 bits, i.e. about float
+    /// precision), in double it's computed exactly since the estimate would need several steps to reach full precision.
+    inline float rsqrt(float x) {
+#ifdef GMATH_HAS_SSE
+        float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+        return y * (1.5f - 0.5f * x * y * y);
+#else
+        return 1 / std::sqrt(x);
+#endif
+    }
+    inline double rsqrt(double x) { return 1 / std::sqrt(x); }
+
+    /// @brief a function over [0,1] sampled at N + 1 even steps and linearly interpolated between them. The
+    /// constructor is constexpr, so a table of a function usable in constant expressions can be built at compile time.
+    template <int N>
+    class LinearTable {
         public:
-            double x;
-            double y;
-            double z;
+            static constexpr int n_intervals = N;
+            std::array<float, N + 2> table{};
+
+            constexpr LinearTable() = default;
+            template <typename F>
+            constexpr explicit LinearTable(F f) {
+                for (int i = 0; i <= N; i++) { table[i] = static_cast<float>(f(static_cast<double>(i) / N)); }
+                table[N + 1] = table[N]; // lets lookup(1) read one past the end without a branch
+            }
+
+            // x must be in [0,1]
+            template <typename T>
+            constexpr T lookup(T x) const { return lookup(table.data(), x); }
+
+            // for loops that only have the samples, like SIMD ones
+            template <typename T>
+            static constexpr T lookup(const float* table, T x) {
+                T position = x * N;
+                int i = static_cast<int>(position);
+                T frac = position - i;
+                return table[i] + (table[i + 1] - table[i]) * frac;
+            }
+    };
+
+    // Vectors are header-only so that every operation can be inlined into the tracing loops.
+
+    template <typename T>
+    class Vec3T {
+        public:
+            using scalar = T;
+
+            T x;
+            T y;
+            T z;
 
-            Vec3();
-            Vec3(double x, double y, double z);
+            constexpr Vec3T() : x(0), y(0), z(0) {}
+            constexpr Vec3T(T x, T y, T z) : x(x), y(y), z(z) {}
 
-            Vec3 operator-() const;
+            constexpr Vec3T operator-() const { return Vec3T(-x, -y, -z); }
 
-            Vec3& operator+=(const Vec3& v);
-            Vec3& operator-=(const Vec3& v);
-            Vec3& operator*=(const double t);
-            Vec3& operator/=(const double t);
+            constexpr Vec3T& operator+=(const Vec3T& v) {
+                x += v.x;
+                y += v.y;
+                z += v.z;
+                return *this;
+            }
 
-            double abs() const;
-            double abs2() const;
-            Vec3 unit() const;
+            constexpr Vec3T& operator-=(const Vec3T& v) {
+                x -= v.x;
+                y -= v.y;
+                z -= v.z;
+                return *this;
+            }
+
+            constexpr Vec3T& operator*=(const T t) {
+                x *= t;
+                y *= t;
+                z *= t;
+                return *this;
+            }
+
+            constexpr Vec3T& operator/=(const T t) {
+                return *this *= 1/t;
+            }
+
+            T abs() const {
+                return std::sqrt(abs2());
+            }
+
+            constexpr T abs2() const {
+                return x*x + y*y + z*z;
+            }
+
+            Vec3T unit() const {
+                T inv = rsqrt(abs2());
+                return Vec3T(x * inv, y * inv, z * inv);
+            }
     };
 
-    Vec3 operator+(const Vec3& u, const Vec3& v);
-    Vec3 operator-(const Vec3& u, const Vec3& v);
+    // scalar arguments are taken as Vec3T<T>::scalar so that they don't take part in template deduction,
+    // letting e.g. a double literal multiply a float vector
+
+    template <typename T>
+    constexpr Vec3T<T> operator+(const Vec3T<T>& u, const Vec3T<T>& v) {
+        return Vec3T<T>(u.x + v.x, u.y + v.y, u.z + v.z);
+    }
+
+    template <typename T>
+    constexpr Vec3T<T> operator-(const Vec3T<T>& u, const Vec3T<T>& v) {
+        return Vec3T<T>(u.x - v.x, u.y - v.y, u.z - v.z);
+    }
+
+    template <typename T>
+    constexpr T dot(const Vec3T<T>& u, const Vec3T<T>& v) { // dot product
+        return (u.x * v.x + u.y * v.y + u.z * v.z);
+    }
+
+    // removed this because of dodgy precedence rules (^ has lower precedence than addition and multiplication and more).
+    // better just to have an explicit function, which has obvious precedence.
+    // Vec3 operator^(const Vec3& u, const Vec3& v) {
+    //     return Vec3(u.y * v.z - u.z * v.y,
+    //                 u.z * v.x - u.x * v.z,
+    //                 u.x * v.y - u.y * v.x);
+    // }
+
+    template <typename T>
+    constexpr Vec3T<T> cross(const Vec3T<T>& u, const Vec3T<T>& v) {
+        return Vec3T<T>(u.y * v.z - u.z * v.y,
+                        u.z * v.x - u.x * v.z,
+                        u.x * v.y - u.y * v.x);
+    }
+
+    template <typename T>
+    Vec3T<T> pow(const Vec3T<T>& u, const typename Vec3T<T>::scalar t) {
+        return Vec3T<T>(std::pow(u.x, t), std::pow(u.y, t), std::pow(u.z, t));
+    }
+
+    template <typename T>
+    constexpr Vec3T<T> operator*(const Vec3T<T>& v, const typename Vec3T<T>::scalar t) {
+        return Vec3T<T>(t * v.x, t * v.y, t * v.z);
+    }
 
-    double dot(const Vec3& u, const Vec3& v); // dot product
-    // Vec3 operator^(const Vec3& u, const Vec3& v); // cross product
-    Vec3 cross(const Vec3& u, const Vec3& v);
-    Vec3 pow(const Vec3& u, const double t);
+    template <typename T>
+    constexpr Vec3T<T> operator*(const typename Vec3T<T>::scalar t, const Vec3T<T>& v) {
+        return v * t;
+    }
 
-    Vec3 operator*(const Vec3& v, const double t);
-    Vec3 operator*(const double t, const Vec3& v);
-    Vec3 operator*(const Vec3& u, const Vec3& v);
-    Vec3 operator/(const Vec3& v, const double t);
+    template <typename T>
+    constexpr Vec3T<T> operator*(const Vec3T<T>& u, const Vec3T<T>& v) { // item-wise multiplication
+        return Vec3T<T>(u.x * v.x, u.y * v.y, u.z * v.z);
+    }
+
+    template <typename T>
+    constexpr Vec3T<T> operator/(const Vec3T<T>& v, const typename Vec3T<T>::scalar t) {
+        return v * (1/t);
+    }
+
+    template <typename T>
+    std::ostream& operator<<(std::ostream& out, const Vec3T<T>& v) {
+        return out << v.x << " " << v.y << " " << v.z << "\n";
+    }
+
+#ifdef GMATH_USE_SIMD
+    // 4-wide storage for Vec3T<float> (SSE) and, when compiled with AVX2, Vec3T<double>. The 4th lane is padding and is kept
+    // at 0 by every operation. These make each vector 4/3 the size, so they're opt-in: compile with -DGMATH_USE_SIMD.
+    // The overloads below are plain functions, so they're chosen over the generic templates above.
+
+#ifdef GMATH_HAS_SSE
+    template <>
+    class alignas(16) Vec3T<float> {
+        public:
+            using scalar = float;
+
+            union {
+                __m128 v;
+                struct { float x, y, z, w; };
+            };
+
+            Vec3T() : v(_mm_setzero_ps()) {}
+            Vec3T(float x, float y, float z) : v(_mm_set_ps(0, z, y, x)) {}
+            explicit Vec3T(__m128 v) : v(v) {}
+
+            Vec3T operator-() const { return Vec3T(_mm_sub_ps(_mm_setzero_ps(), v)); }
+
+            Vec3T& operator+=(const Vec3T& u) { v = _mm_add_ps(v, u.v); return *this; }
+            Vec3T& operator-=(const Vec3T& u) { v = _mm_sub_ps(v, u.v); return *this; }
+            Vec3T& operator*=(const float t) { v = _mm_mul_ps(v, _mm_set1_ps(t)); return *this; }
+            Vec3T& operator/=(const float t) { return *this *= 1/t; }
+
+            float abs() const { return std::sqrt(abs2()); }
+            float abs2() const { return hsum(_mm_mul_ps(v, v)); }
+
+            Vec3T unit() const {
+                __m128 len2 = _mm_set1_ps(abs2());
+                __m128 inv = _mm_rsqrt_ps(len2);
+                inv = _mm_mul_ps(inv, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), len2), _mm_mul_ps(inv, inv)))); // Newton step
+                return Vec3T(_mm_mul_ps(v, inv));
+            }
+
+            // sum of all 4 lanes
+            static float hsum(__m128 a) {
+                __m128 shuf = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+                __m128 sums = _mm_add_ps(a, shuf);
+                shuf = _mm_movehl_ps(shuf, sums);
+                return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+            }
+    };
+
+    inline Vec3T<float> operator+(const Vec3T<float>& u, const Vec3T<float>& v) { return Vec3T<float>(_mm_add_ps(u.v, v.v)); }
+    inline Vec3T<float> operator-(const Vec3T<float>& u, const Vec3T<float>& v) { return Vec3T<float>(_mm_sub_ps(u.v, v.v)); }
+    inline float dot(const Vec3T<float>& u, const Vec3T<float>& v) { return Vec3T<float>::hsum(_mm_mul_ps(u.v, v.v)); }
+    inline Vec3T<float> cross(const Vec3T<float>& u, const Vec3T<float>& v) {
+        __m128 u_yzx = _mm_shuffle_ps(u.v, u.v, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 v_yzx = _mm_shuffle_ps(v.v, v.v, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 c = _mm_sub_ps(_mm_mul_ps(u.v, v_yzx), _mm_mul_ps(u_yzx, v.v)); // cross product in zxy order
+        return Vec3T<float>(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+    }
+    inline Vec3T<float> operator*(const Vec3T<float>& v, const float t) { return Vec3T<float>(_mm_mul_ps(v.v, _mm_set1_ps(t))); }
+    inline Vec3T<float> operator*(const float t, const Vec3T<float>& v) { return v * t; }
+    inline Vec3T<float> operator*(const Vec3T<float>& u, const Vec3T<float>& v) { return Vec3T<float>(_mm_mul_ps(u.v, v.v)); }
+    inline Vec3T<float> operator/(const Vec3T<float>& v, const float t) { return v * (1/t); }
+#endif // GMATH_HAS_SSE
+
+#ifdef __AVX2__
+    template <>
+    class alignas(32) Vec3T<double> {
+        public:
+            using scalar = double;
+
+            union {
+                __m256d v;
+                struct { double x, y, z, w; };
+            };
+
+            Vec3T() : v(_mm256_setzero_pd()) {}
+            Vec3T(double x, double y, double z) : v(_mm256_set_pd(0, z, y, x)) {}
+            explicit Vec3T(__m256d v) : v(v) {}
+
+            Vec3T operator-() const { return Vec3T(_mm256_sub_pd(_mm256_setzero_pd(), v)); }
+
+            Vec3T& operator+=(const Vec3T& u) { v = _mm256_add_pd(v, u.v); return *this; }
+            Vec3T& operator-=(const Vec3T& u) { v = _mm256_sub_pd(v, u.v); return *this; }
+            Vec3T& operator*=(const double t) { v = _mm256_mul_pd(v, _mm256_set1_pd(t)); return *this; }
+            Vec3T& operator/=(const double t) { return *this *= 1/t; }
+
+            double abs() const { return std::sqrt(abs2()); }
+            double abs2() const { return hsum(_mm256_mul_pd(v, v)); }
+
+            Vec3T unit() const { return Vec3T(_mm256_mul_pd(v, _mm256_set1_pd(rsqrt(abs2())))); }
+
+            // sum of all 4 lanes
+            static double hsum(__m256d a) {
+                __m128d low = _mm256_castpd256_pd128(a);
+                __m128d high = _mm256_extractf128_pd(a, 1);
+                low = _mm_add_pd(low, high);
+                return _mm_cvtsd_f64(_mm_add_sd(low, _mm_unpackhi_pd(low, low)));
+            }
+    };
 
-    std::ostream& operator<<(std::ostream& out, const Vec3& v);
+    inline Vec3T<double> operator+(const Vec3T<double>& u, const Vec3T<double>& v) { return Vec3T<double>(_mm256_add_pd(u.v, v.v)); }
+    inline Vec3T<double> operator-(const Vec3T<double>& u, const Vec3T<double>& v) { return Vec3T<double>(_mm256_sub_pd(u.v, v.v)); }
+    inline double dot(const Vec3T<double>& u, const Vec3T<double>& v) { return Vec3T<double>::hsum(_mm256_mul_pd(u.v, v.v)); }
+    inline Vec3T<double> cross(const Vec3T<double>& u, const Vec3T<double>& v) {
+        __m256d u_yzx = _mm256_permute4x64_pd(u.v, _MM_SHUFFLE(3, 0, 2, 1));
+        __m256d v_yzx = _mm256_permute4x64_pd(v.v, _MM_SHUFFLE(3, 0, 2, 1));
+        __m256d c = _mm256_sub_pd(_mm256_mul_pd(u.v, v_yzx), _mm256_mul_pd(u_yzx, v.v)); // cross product in zxy order
+        return Vec3T<double>(_mm256_permute4x64_pd(c, _MM_SHUFFLE(3, 0, 2, 1)));
+    }
+    inline Vec3T<double> operator*(const Vec3T<double>& v, const double t) { return Vec3T<double>(_mm256_mul_pd(v.v, _mm256_set1_pd(t))); }
+    inline Vec3T<double> operator*(const double t, const Vec3T<double>& v) { return v * t; }
+    inline Vec3T<double> operator*(const Vec3T<double>& u, const Vec3T<double>& v) { return Vec3T<double>(_mm256_mul_pd(u.v, v.v)); }
+    inline Vec3T<double> operator/(const Vec3T<double>& v, const double t) { return v * (1/t); }
+#endif // __AVX2__
+#endif // GMATH_USE_SIMD
 
+    using Vec3 = Vec3T<Real>;
     using Colour = Vec3;
 
 }
 
-#endif // GMATH
\ No newline at end of file
+#endif // GMATH
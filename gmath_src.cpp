@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cstdlib>
 #include <random>
+#include <atomic>
 #include "gmath.h"
 
 namespace gmath {
@@ -10,120 +11,58 @@ namespace gmath {
 
     const double pi = 3.14159265359;
 
-    // Functions
+    // Random numbers
 
-    /// @brief 
-    /// @return random uniform double in range [0,1), i.e. including 0 but not 1
-    double random_double() {
-        return std::rand() / (RAND_MAX + 1.0);
-    }
-
-    /// @brief 
-    /// @return random uniform double in range [min,max), i.e. including min but not max
-    double random_double(double min, double max) {
-        return min + (max-min)*random_double();
-    }
-
-    std::default_random_engine generator;
-    std::normal_distribution<double> distribution(0.0, 1.0);
-
-    double normal_double() {
-        return distribution(generator);
-    }
-
-    // Vec3 Class
-
-    Vec3::Vec3() : x(0), y(0), z(0) {}
-    Vec3::Vec3(double x, double y, double z) : x(x), y(y), z(z) {}
-
-    Vec3 Vec3::operator-() const { return Vec3(-x, -y, -z); }
-
-    Vec3& Vec3::operator+=(const Vec3& v) {
-        x += v.x;
-        y += v.y;
-        z += v.z;
-        return *this;
-    }
-
-    Vec3& Vec3::operator-=(const Vec3& v) {
-        x -= v.x;
-        y -= v.y;
-        z -= v.z;
-        return *this;
-    }
-
-    Vec3& Vec3::operator*=(const double t) {
-        x *= t;
-        y *= t;
-        z *= t;
-        return *this;
-    }
-
-    Vec3& Vec3::operator/=(const double t) {
-        return *this *= 1/t;
-    }
+    // SplitMix64 (Steele et al., "Fast Splittable Pseudorandom Number Generators", 2014): a counter put through a
+    // strong mix, so seeding is just setting the counter and any two seeds start far apart in the sequence. It's a
+    // UniformRandomBitGenerator, for std::normal_distribution.
+    class RandomEngine {
+        public:
+            using result_type = std::uint64_t;
 
-    double Vec3::abs() const {
-        return std::sqrt(abs2());
-    }
-
-    double Vec3::abs2() const {
-        return x*x + y*y + z*z;
-    }
+            explicit RandomEngine(std::uint64_t state) : state(state) {}
 
-    // check performance of this against just using division...
-    Vec3 Vec3::unit() const {
-        return *this / abs();
-    }
-
-    Vec3 operator+(const Vec3& u, const Vec3& v){
-        return Vec3(u.x + v.x, u.y + v.y, u.z + v.z);
-    }
-
-    Vec3 operator-(const Vec3& u, const Vec3& v) {
-        return Vec3(u.x - v.x, u.y - v.y, u.z - v.z);
-    }
+            static constexpr result_type min() { return 0; }
+            static constexpr result_type max() { return ~result_type(0); }
+            result_type operator()() { return mix(state += 0x9e3779b97f4a7c15); }
 
-    double dot(const Vec3& u, const Vec3& v) {
-        return (u.x * v.x + u.y * v.y + u.z * v.z);
-    }
+            static std::uint64_t mix(std::uint64_t z) {
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                return z ^ (z >> 31);
+            }
 
-    // removed this because of dodgy precedence rules (^ has lower precedence than addition and multiplication and more).
-    // better just to have an explicit function, which has obvious precedence.
-    // Vec3 operator^(const Vec3& u, const Vec3& v) {
-    //     return Vec3(u.y * v.z - u.z * v.y,
-    //                 u.z * v.x - u.x * v.z,
-    //                 u.x * v.y - u.y * v.x);
-    // }
-
-    Vec3 cross(const Vec3& u, const Vec3& v) {
-        return Vec3(u.y * v.z - u.z * v.y,
-                    u.z * v.x - u.x * v.z,
-                    u.x * v.y - u.y * v.x);
-    }
+            std::uint64_t state;
+    };
 
-    Vec3 pow(const Vec3& u, const double t) {
-        return Vec3(std::pow(u.x, t), std::pow(u.y, t), std::pow(u.z, t));
+    static std::uint64_t start_state(std::uint64_t seed, std::uint64_t stream) {
+        return RandomEngine::mix(RandomEngine::mix(seed) + stream);
     }
 
-    Vec3 operator*(const Vec3& v, const double t) {
-        return Vec3(t * v.x, t * v.y, t * v.z);
-    }
+    // threads not seeded yet take the next of these streams of seed 0 as they first draw
+    static std::atomic<std::uint64_t> next_thread_stream{0};
+    thread_local RandomEngine engine(start_state(0, next_thread_stream.fetch_add(1)));
+    thread_local std::normal_distribution<double> distribution(0.0, 1.0);
 
-    Vec3 operator*(const double t, const Vec3& v) {
-        return v * t;
+    void seed_random(std::uint64_t seed, std::uint64_t stream) {
+        engine.state = start_state(seed, stream);
+        distribution.reset(); // it holds on to the second of each pair it makes
     }
 
-    Vec3 operator*(const Vec3& u, const Vec3& v) { // item-wise multiplication
-        return Vec3(u.x * v.x, u.y * v.y, u.z * v.z);
+    /// @brief 
+    /// @return random uniform double in range [0,1), i.e. including 0 but not 1
+    double random_double() {
+        return (engine() >> 11) * 0x1.0p-53;
     }
 
-    Vec3 operator/(const Vec3& v, const double t) {
-        return v * (1/t);
+    /// @brief 
+    /// @return random uniform double in range [min,max), i.e. including min but not max
+    double random_double(double min, double max) {
+        return min + (max-min)*random_double();
     }
 
-    std::ostream& operator<<(std::ostream& out, const Vec3& v) {
-        return out << v.x << " " << v.y << " " << v.z << "\n";
+    double normal_double() {
+        return distribution(engine);
     }
 
-}
\ No newline at end of file
+}
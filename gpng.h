@@ -14,11 +14,15 @@ namespace gpng {
 
             int width;
             int height;
+            int bit_depth; // 8 or 16 bits per channel
 
-            Image(int w, int h);
+            Image(int w, int h, int bit_depth = 8);
             ~Image();
 
-            uint8_t& operator()(int column, int row, int colour);
+            int bytes_per_pixel() const { return 3 * bit_depth / 8; }
+
+            uint8_t& operator()(int column, int row, int colour); // byte access, for 8 bit images
+            void set(int column, int row, int colour, uint16_t value); // any bit depth
             void save(std::string filename);
             void deflate_no_compression(std::vector<uint8_t>& buffer);
     };
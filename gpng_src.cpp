@@ -134,10 +134,11 @@ static uint8_t sum_to_31(int number) {
 
 namespace gpng {
 
-    Image::Image(int w, int h) {
-        image = new uint8_t[w * h * 3];
+    Image::Image(int w, int h, int bit_depth) {
+        image = new uint8_t[w * h * 3 * bit_depth / 8];
         width = w;
         height = h;
+        this->bit_depth = bit_depth;
     }
 
     Image::~Image() {
@@ -148,6 +149,16 @@ namespace gpng {
         return image[row * width * 3 + column * 3 + colour];
     }
 
+    void Image::set(int column, int row, int colour, uint16_t value) {
+        if (bit_depth == 16) { // png stores 16 bit samples big-endian
+            uint8_t* sample = &image[(row * width * 3 + column * 3 + colour) * 2];
+            sample[0] = value >> 8;
+            sample[1] = value & 0xff;
+        } else {
+            image[row * width * 3 + column * 3 + colour] = static_cast<uint8_t>(value);
+        }
+    }
+
     void Image::save(std::string filename) {
         std::ofstream image_write;
         image_write.open(filename, std::ios::out | std::ios::binary);
@@ -184,7 +195,7 @@ namespace gpng {
             push_to_buffer(ihdr_dat, &width, sizeof(width));
             push_to_buffer(ihdr_dat, &height, sizeof(height));
 
-            ihdr_dat.insert(ihdr_dat.end(), {0x08, 0x02, 0x00, 0x00, 0x00});
+            ihdr_dat.insert(ihdr_dat.end(), {static_cast<uint8_t>(bit_depth), 0x02, 0x00, 0x00, 0x00}); // bit depth, truecolour, no compression/filter/interlace options
 
             // push IHDR chunk type and chunk data to main buffer
             push_to_buffer(main_buffer, &ihdr_dat[0], ihdr_dat.size(), false);
@@ -237,18 +248,15 @@ namespace gpng {
     void Image::deflate_no_compression(std::vector<uint8_t>& buffer) {
         uint8_t filter_type = 0x00;
         std::vector<uint8_t> uncompressed_buffer; // stores image along with filter types for use in adler32
+        int row_bytes = width * bytes_per_pixel();
         for (int y = 0; y < height; ++y) {
             uncompressed_buffer.push_back(filter_type);
-            for (int x = 0; x < width; ++x) {
-                uncompressed_buffer.push_back( (*this)(x, y, 0) );
-                uncompressed_buffer.push_back( (*this)(x, y, 1) );
-                uncompressed_buffer.push_back( (*this)(x, y, 2) );
-            }
+            uncompressed_buffer.insert(uncompressed_buffer.end(), image + y * row_bytes, image + (y + 1) * row_bytes);
         }
         uint32_t adler = adler32(&uncompressed_buffer[0], uncompressed_buffer.size());
 
         const int block_size_limit = 32768;
-        int raw_length = height * (width * 3 + 1);
+        int raw_length = height * (row_bytes + 1);
         int no_of_blocks = (raw_length + block_size_limit - 5 - 1) / (block_size_limit - 5); // integer division rounding up
         int final_block_raw_length = raw_length % (block_size_limit - 5);
         if (final_block_raw_length == 0) { final_block_raw_length = block_size_limit - 5; }
@@ -272,7 +280,7 @@ namespace gpng {
 
         // pushes final block
         std::cerr << "Starting block " << no_of_blocks - 1 << " (final block)\n";
-        buffer.push_back(0x80);
+        buffer.push_back(0x01); // BFINAL is the lowest bit of the block header
         push_length = final_block_raw_length;
         push_to_buffer(buffer, &push_length, sizeof(push_length), false);
         push_length = ~push_length;
@@ -0,0 +1,168 @@
+#ifndef GRID_ACCEL
+#define GRID_ACCEL
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "gmath.h"
+#include "geometry.h"
+#include "bvh_build.h"
+
+namespace rt {
+
+    /// @brief uniform grid over primitives' boxes: an alternative to WideBVH for many similar-sized primitives spread
+    /// evenly through space (e.g. particles), where it builds in linear time and traces about as fast.
+    /// Cells are stored compressed-row style: cell c holds prims[cell_prims[cell_start[c]] ... cell_prims[cell_start[c + 1] - 1]].
+    /// Rays walk the cells they pass through in order with a 3D-DDA (Amanatides & Woo, "A Fast Voxel Traversal Algorithm
+    /// for Ray Tracing", 1987), stopping once a hit is nearer than the next cell.
+    class GridAccel {
+        public:
+            AABB3T<float> box;
+            int res[3]{0, 0, 0}; // cells along each axis
+            std::vector<PrimRef> prims;
+            std::vector<std::uint32_t> cell_start; // one per cell and one past the end
+            std::vector<std::uint32_t> cell_prims; // indices into prims
+
+            bool empty() const { return prims.empty(); }
+            void clear() {
+                prims.clear();
+                cell_start.clear();
+                cell_prims.clear();
+            }
+            std::size_t memory() const {
+                return prims.size() * sizeof(PrimRef) + (cell_start.size() + cell_prims.size()) * sizeof(std::uint32_t);
+            }
+
+            /// @brief density is the number of cells per primitive. The cells are made as near cubic as the box allows.
+            void build(const std::vector<BVHPrim>& input, float density = 2.0f) {
+                clear();
+                box = AABB3T<float>();
+                for (const BVHPrim& prim : input) { box.extend(prim.box); }
+                if (input.empty()) { return; }
+
+                Vec3T<float> extent = box.extent();
+                float volume = std::max(extent.x, 1e-6f) * std::max(extent.y, 1e-6f) * std::max(extent.z, 1e-6f);
+                float cells_per_length = std::cbrt(density * input.size() / volume);
+                for (int a = 0; a < 3; a++) { res[a] = std::clamp(static_cast<int>(axis(extent, a) * cells_per_length), 1, max_res); }
+                for (int a = 0; a < 3; a++) {
+                    cell_size[a] = axis(extent, a) / res[a];
+                    inv_cell_size[a] = cell_size[a] > 0 ? 1 / cell_size[a] : 0;
+                }
+
+                // count each cell's primitives, turn the counts into start offsets, then fill
+                prims.resize(input.size());
+                cell_start.assign(static_cast<std::size_t>(res[0]) * res[1] * res[2] + 1, 0);
+                for (std::size_t i = 0; i < input.size(); i++) {
+                    prims[i] = input[i].ref;
+                    for_each_cell(input[i].box, [&](std::size_t cell) { cell_start[cell + 1]++; });
+                }
+                for (std::size_t cell = 1; cell < cell_start.size(); cell++) { cell_start[cell] += cell_start[cell - 1]; }
+                cell_prims.resize(cell_start.back());
+                std::vector<std::uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+                for (std::size_t i = 0; i < input.size(); i++) {
+                    for_each_cell(input[i].box, [&](std::size_t cell) { cell_prims[fill[cell]++] = static_cast<std::uint32_t>(i); });
+                }
+            }
+
+            /// @brief calls visit(ref) for the primitives in every cell the ray passes through with 0 < t < t_max, nearest
+            /// cells first. visit may lower t_max (e.g. when it finds a hit), which ends the walk at the cell containing it.
+            /// A primitive spanning several cells is usually only visited once: a small per-ray mailbox remembers the
+            /// primitives tested recently.
+            template <typename F>
+            void traverse(const Line3& ray, const Real& t_max, F&& visit, std::size_t* n_cells_visited = nullptr) const {
+                if (prims.empty()) { return; }
+
+                // clip the ray to the grid
+                Real t_enter = 0;
+                Real t_exit = t_max;
+                for (int a = 0; a < 3; a++) {
+                    Real inv_d = 1 / axis(ray.d, a);
+                    Real t0 = (axis(box.min, a) - axis(ray.p, a)) * inv_d;
+                    Real t1 = (axis(box.max, a) - axis(ray.p, a)) * inv_d;
+                    if (inv_d < 0) { std::swap(t0, t1); }
+                    clip_slab(t0, t1, t_enter, t_exit);
+                }
+                if (t_enter > t_exit) { return; }
+
+                int cell[3];
+                int step[3];
+                int end[3];
+                Real t_next[3]; // where the ray crosses into the next cell along each axis
+                Real t_delta[3]; // distance along the ray between crossings
+                const Vec3 entry = ray(t_enter);
+                for (int a = 0; a < 3; a++) {
+                    Real d = axis(ray.d, a);
+                    cell[a] = std::clamp(static_cast<int>((axis(entry, a) - axis(box.min, a)) * inv_cell_size[a]), 0, res[a] - 1);
+                    if (d > 0) {
+                        step[a] = 1;
+                        end[a] = res[a];
+                        t_next[a] = (axis(box.min, a) + (cell[a] + 1) * Real(cell_size[a]) - axis(ray.p, a)) / d;
+                        t_delta[a] = cell_size[a] / d;
+                    } else if (d < 0) {
+                        step[a] = -1;
+                        end[a] = -1;
+                        t_next[a] = (axis(box.min, a) + cell[a] * Real(cell_size[a]) - axis(ray.p, a)) / d;
+                        t_delta[a] = -cell_size[a] / d;
+                    } else {
+                        step[a] = 0;
+                        end[a] = -1;
+                        t_next[a] = std::numeric_limits<Real>::infinity();
+                        t_delta[a] = 0;
+                    }
+                }
+
+                std::uint32_t mailbox[mailbox_size];
+                std::fill(mailbox, mailbox + mailbox_size, std::numeric_limits<std::uint32_t>::max());
+                while (true) {
+                    if (n_cells_visited) { ++*n_cells_visited; }
+                    std::size_t c = (static_cast<std::size_t>(cell[2]) * res[1] + cell[1]) * res[0] + cell[0];
+                    for (std::uint32_t i = cell_start[c]; i < cell_start[c + 1]; i++) {
+                        std::uint32_t prim = cell_prims[i];
+                        std::uint32_t& slot = mailbox[(prim * 2654435761u) >> (32 - mailbox_bits)];
+                        if (slot == prim) { continue; }
+                        slot = prim;
+                        visit(prims[prim]);
+                    }
+
+                    int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+                    if (t_max <= t_next[a] || t_next[a] > t_exit) { break; } // a hit in this cell, or the ray has left the grid
+                    cell[a] += step[a];
+                    if (cell[a] == end[a]) { break; }
+                    t_next[a] += t_delta[a];
+                }
+            }
+
+        private:
+            static constexpr int max_res = 1024;
+            static constexpr int mailbox_bits = 4;
+            static constexpr int mailbox_size = 1 << mailbox_bits;
+
+            float cell_size[3]{0, 0, 0};
+            float inv_cell_size[3]{0, 0, 0};
+
+            // calls f(cell index) for each cell the box overlaps. Boxes are grown by a sliver of a cell, so a primitive
+            // touching a cell wall is in the cells either side however traversal rounds the crossing.
+            template <typename F>
+            void for_each_cell(const AABB3T<float>& prim_box, F f) const {
+                const float pad = 1e-4f;
+                int low[3];
+                int high[3];
+                for (int a = 0; a < 3; a++) {
+                    float min_cell = (axis(prim_box.min, a) - axis(box.min, a)) * inv_cell_size[a] - pad;
+                    float max_cell = (axis(prim_box.max, a) - axis(box.min, a)) * inv_cell_size[a] + pad;
+                    low[a] = std::clamp(static_cast<int>(std::floor(min_cell)), 0, res[a] - 1);
+                    high[a] = std::clamp(static_cast<int>(std::floor(max_cell)), 0, res[a] - 1);
+                }
+                for (int z = low[2]; z <= high[2]; z++) {
+                    for (int y = low[1]; y <= high[1]; y++) {
+                        for (int x = low[0]; x <= high[0]; x++) { f((static_cast<std::size_t>(z) * res[1] + y) * res[0] + x); }
+                    }
+                }
+            }
+    };
+
+}
+
+#endif // GRID_ACCEL
@@ -0,0 +1,140 @@
+#ifndef GUIDING
+#define GUIDING
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include "gmath.h"
+#include "geometry.h"
+
+namespace rt {
+
+    /// @brief a distribution over directions, as a quadtree over the unit square, which maps to the sphere with equal
+    /// areas (cylindrically: u is (z + 1) / 2, v the angle round z over 2 pi). Each node holds the energy recorded in
+    /// its four quadrants and the subtree, if any, each is split into, so busy directions get finer quadrants.
+    /// Recording is lock-free; anything else must not run at the same time as it.
+    class DTree {
+        public:
+            DTree();
+
+            /// @brief adds value to every quadrant containing (u, v), down to a leaf
+            void record(Real u, Real v, Real value);
+
+            Real total() const;
+
+            /// @brief density over the unit square of sample() picking (u, v)
+            Real pdf(Real u, Real v) const;
+
+            /// @brief picks a point in the unit square in proportion to the recorded energy, from u1, u2 uniform in [0, 1)
+            void sample(Real u1, Real u2, Real& u, Real& v) const;
+
+            /// @brief an empty tree for the next round of recording, whose quadrants are split until each holds no more
+            /// than threshold of this one's energy (assumed spread evenly below its leaves), to at most max_depth levels
+            DTree refined(Real threshold, int max_depth) const;
+
+            std::size_t size() const { return nodes.size(); }
+
+        private:
+            struct Node {
+                std::atomic<float> sum[4] = {};
+                std::uint32_t child[4] = {0, 0, 0, 0}; // 0 where the quadrant is a leaf (the root is never a child)
+
+                Node() = default;
+                Node(const Node& other) { *this = other; }
+                Node& operator=(const Node& other) {
+                    for (int q = 0; q < 4; q++) {
+                        sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                        child[q] = other.child[q];
+                    }
+                    return *this;
+                }
+                Real total() const {
+                    return Real(sum[0].load(std::memory_order_relaxed)) + sum[1].load(std::memory_order_relaxed) +
+                           sum[2].load(std::memory_order_relaxed) + sum[3].load(std::memory_order_relaxed);
+                }
+            };
+            std::vector<Node> nodes;
+
+            std::uint32_t refine_node(DTree& out, int old_node, Real fraction, Real threshold, int depth, int max_depth) const;
+    };
+
+    /// @brief where light arrives from at each point of the scene, learned from the paths rendered so far, for picking
+    /// the directions matte surfaces scatter into (Müller et al., "Practical Path Guiding for Efficient Light-Transport
+    /// Simulation", 2017). Space is split by a binary tree, halving a region along x, y and z in turn once enough
+    /// samples land in it; each region has a DTree of the radiance arriving there for each of 6 bins of the surface
+    /// normal (by its largest component), so the two sides of a wall don't share one, with light from the lit side
+    /// leading the other into the wall.
+    /// Rendering goes in passes. Each records into the regions' building trees while sampling from the trees the pass
+    /// before filled, then refine() splits the busy regions, makes the new trees the ones sampled from, and starts
+    /// fresh ones shaped by them. Scattering picks between cosine weighting and the guide, so it still finds light the
+    /// guide hasn't yet, and gives the pdf of the mixture for weighting against light sampling.
+    class PathGuide {
+        public:
+            Real bsdf_fraction{0.5}; // of scattered rays that ignore the guide
+            std::uint32_t spatial_threshold{4000}; // samples in a region before it's split, times sqrt(2^pass)
+            Real directional_threshold{0.01}; // largest share of a region's energy in one quadrant
+            int max_directional_depth{20};
+            bool recording{true};
+
+            /// @brief forgets everything learned, covering the given bounds (points outside go to the nearest region)
+            void reset(const AABB3& bounds);
+
+            /// @brief whether a pass has finished, so there's something to sample
+            bool ready() const { return passes > 0; }
+            int pass() const { return passes; }
+
+            /// @brief scatters from a matte surface, giving the direction's density over solid angle
+            Vec3 sample_matte(const Vec3& point, const Vec3& normal_unit, Real& pdf) const;
+
+            /// @brief density over solid angle with which sample_matte() picks direction
+            Real pdf_matte(const Vec3& point, const Vec3& normal_unit, const Vec3& direction) const;
+
+            /// @brief records radiance arriving at point, on a surface facing normal_unit, from direction, which was
+            /// sampled with density pdf
+            void record(const Vec3& point, const Vec3& normal_unit, const Vec3& direction, const Colour& radiance, Real pdf);
+
+            /// @brief ends a pass: splits regions, swaps the trees over and starts new ones
+            void refine();
+
+            std::size_t regions() const { return leaves.size(); }
+            std::size_t memory() const;
+
+        private:
+            struct SNode {
+                AABB3 box;
+                std::uint32_t child[2] = {0, 0}; // both 0 for a leaf; otherwise the box is halved along axis
+                int axis{0};
+                std::uint32_t leaf{0};
+            };
+            static constexpr int normal_bins = 6;
+            struct Leaf {
+                DTree sampling[normal_bins];
+                DTree building[normal_bins];
+                std::atomic<std::uint32_t> samples{0}; // over every bin
+
+                Leaf() = default;
+                Leaf(const Leaf& other) { *this = other; }
+                Leaf& operator=(const Leaf& other) {
+                    for (int bin = 0; bin < normal_bins; bin++) {
+                        sampling[bin] = other.sampling[bin];
+                        building[bin] = other.building[bin];
+                    }
+                    samples.store(other.samples.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                    return *this;
+                }
+            };
+            std::vector<SNode> nodes;
+            std::vector<Leaf> leaves;
+            int passes{0};
+
+            std::uint32_t find_leaf(const Vec3& point) const;
+            // the tree sampled from at point, or null where it has nothing to guide by yet
+            const DTree* sampling_tree(const Vec3& point, const Vec3& normal_unit) const;
+            Real mixture_pdf(const DTree* tree, const Vec3& normal_unit, const Vec3& direction) const;
+            void split(std::uint32_t node, int depth, std::uint32_t samples, Real threshold);
+    };
+
+}
+
+#endif // GUIDING
@@ -0,0 +1,265 @@
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "guiding.h"
+#include "materials.h"
+#include "lights.h"
+
+namespace rt {
+
+    static void atomic_add(std::atomic<float>& total, float value) {
+        float old = total.load(std::memory_order_relaxed);
+        while (!total.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+    }
+
+    // which quadrant (u, v) is in: bit 0 for the upper half of u, bit 1 for v. u and v are rescaled to the quadrant.
+    static int quadrant(Real& u, Real& v) {
+        int q = (u >= Real(0.5) ? 1 : 0) | (v >= Real(0.5) ? 2 : 0);
+        u = std::min(2 * u - (q & 1), Real(1) - std::numeric_limits<Real>::epsilon());
+        v = std::min(2 * v - (q >> 1), Real(1) - std::numeric_limits<Real>::epsilon());
+        return q;
+    }
+
+    // DTree
+
+    DTree::DTree() : nodes(1) {}
+
+    void DTree::record(Real u, Real v, Real value) {
+        std::uint32_t node = 0;
+        while (true) {
+            int q = quadrant(u, v);
+            atomic_add(nodes[node].sum[q], static_cast<float>(value));
+            if (nodes[node].child[q] == 0) { return; }
+            node = nodes[node].child[q];
+        }
+    }
+
+    Real DTree::total() const { return nodes[0].total(); }
+
+    Real DTree::pdf(Real u, Real v) const {
+        // every record adds to a quadrant and to the one inside it below, so each node's total is its parent's sum for
+        // it, and the product of 4 * sum / total down the tree comes to 4^depth times the leaf's sum over the root's total
+        Real total = nodes[0].total();
+        if (!(total > 0)) { return 0; }
+        Real scale = 1;
+        std::uint32_t node = 0;
+        while (true) {
+            int q = quadrant(u, v);
+            scale *= 4;
+            if (nodes[node].child[q] == 0) { return scale * nodes[node].sum[q].load(std::memory_order_relaxed) / total; }
+            node = nodes[node].child[q];
+        }
+    }
+
+    void DTree::sample(Real u1, Real u2, Real& u, Real& v) const {
+        // pick quadrants down to a leaf, reusing what's left of u1 at each step, then a point in the leaf from u2 and the rest of u1
+        Real origin_u = 0, origin_v = 0, size = 1;
+        std::uint32_t node = 0;
+        while (true) {
+            Real sums[4];
+            Real total = 0;
+            for (int q = 0; q < 4; q++) {
+                sums[q] = nodes[node].sum[q].load(std::memory_order_relaxed);
+                total += sums[q];
+            }
+            int q = 0;
+            Real target = u1 * total;
+            while (q < 3 && (target >= sums[q] || sums[q] <= 0)) {
+                target -= sums[q];
+                q++;
+            }
+            u1 = sums[q] > 0 ? std::clamp(target / sums[q], Real(0), Real(1) - std::numeric_limits<Real>::epsilon()) : u1;
+            size /= 2;
+            origin_u += (q & 1) * size;
+            origin_v += (q >> 1) * size;
+            if (nodes[node].child[q] == 0) { break; }
+            node = nodes[node].child[q];
+        }
+        u = origin_u + u1 * size;
+        v = origin_v + u2 * size;
+    }
+
+    std::uint32_t DTree::refine_node(DTree& out, int old_node, Real fraction, Real threshold, int depth, int max_depth) const {
+        std::uint32_t index = static_cast<std::uint32_t>(out.nodes.size());
+        out.nodes.emplace_back();
+        Real total = old_node >= 0 ? nodes[old_node].total() : 0;
+        for (int q = 0; q < 4; q++) {
+            Real share = total > 0 ? fraction * nodes[old_node].sum[q].load(std::memory_order_relaxed) / total : fraction / 4;
+            if (share <= threshold || depth + 1 >= max_depth) { continue; }
+            int old_child = old_node >= 0 && nodes[old_node].child[q] != 0 ? static_cast<int>(nodes[old_node].child[q]) : -1;
+            std::uint32_t child = refine_node(out, old_child, share, threshold, depth + 1, max_depth);
+            out.nodes[index].child[q] = child;
+        }
+        return index;
+    }
+
+    DTree DTree::refined(Real threshold, int max_depth) const {
+        DTree out;
+        out.nodes.clear();
+        refine_node(out, total() > 0 ? 0 : -1, 1, threshold, 0, max_depth);
+        return out;
+    }
+
+    // PathGuide
+
+    // the cylindrical map between directions and the unit square, which keeps areas in proportion (4 pi to 1)
+    static void direction_to_square(const Vec3& direction, Real& u, Real& v) {
+        Vec3 d = direction.unit();
+        u = std::clamp((d.z + 1) / 2, Real(0), Real(1) - std::numeric_limits<Real>::epsilon());
+        Real phi = std::atan2(d.y, d.x);
+        if (phi < 0) { phi += 2 * pi; }
+        v = std::clamp(phi / Real(2 * pi), Real(0), Real(1) - std::numeric_limits<Real>::epsilon());
+    }
+
+    static Vec3 square_to_direction(Real u, Real v) {
+        Real z = 2 * u - 1;
+        Real r = std::sqrt(std::max(Real(0), 1 - z * z));
+        Real phi = 2 * pi * v;
+        return Vec3(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    void PathGuide::reset(const AABB3& bounds) {
+        nodes.assign(1, SNode{bounds, {0, 0}, 0, 0});
+        leaves.assign(1, Leaf());
+        passes = 0;
+    }
+
+    std::uint32_t PathGuide::find_leaf(const Vec3& point) const {
+        std::uint32_t node = 0;
+        while (nodes[node].child[0] != 0) {
+            const SNode& n = nodes[node];
+            int axis = n.axis;
+            Real middle = axis == 0 ? (n.box.min.x + n.box.max.x) / 2 : axis == 1 ? (n.box.min.y + n.box.max.y) / 2 : (n.box.min.z + n.box.max.z) / 2;
+            Real coordinate = axis == 0 ? point.x : axis == 1 ? point.y : point.z;
+            node = n.child[coordinate >= middle ? 1 : 0];
+        }
+        return nodes[node].leaf;
+    }
+
+    // 0 to 5 for +x, -x, +y, -y, +z, -z, whichever the normal is nearest
+    static int normal_bin(const Vec3& normal_unit) {
+        Real ax = std::fabs(normal_unit.x), ay = std::fabs(normal_unit.y), az = std::fabs(normal_unit.z);
+        if (ax >= ay && ax >= az) { return normal_unit.x >= 0 ? 0 : 1; }
+        if (ay >= az) { return normal_unit.y >= 0 ? 2 : 3; }
+        return normal_unit.z >= 0 ? 4 : 5;
+    }
+
+    const DTree* PathGuide::sampling_tree(const Vec3& point, const Vec3& normal_unit) const {
+        if (!ready()) { return nullptr; }
+        const DTree& tree = leaves[find_leaf(point)].sampling[normal_bin(normal_unit)];
+        return tree.total() > 0 ? &tree : nullptr;
+    }
+
+    Vec3 PathGuide::sample_matte(const Vec3& point, const Vec3& normal_unit, Real& pdf) const {
+        const DTree* tree = sampling_tree(point, normal_unit);
+        bool guided = tree != nullptr;
+        Vec3 direction;
+        if (!guided || random_double() < bsdf_fraction) {
+            // cosine weighted about the normal
+            Vec3 tangent, bitangent;
+            orthonormal_basis(normal_unit, tangent, bitangent);
+            Real u1 = random_double();
+            Real r = std::sqrt(u1);
+            Real phi = 2 * pi * random_double();
+            direction = r * std::cos(phi) * tangent + r * std::sin(phi) * bitangent + std::sqrt(std::max(Real(0), 1 - u1)) * normal_unit;
+            pdf = mixture_pdf(tree, normal_unit, direction);
+        } else {
+            // the tree's density is looked up where it was sampled, rather than mapping the direction back
+            Real u1 = random_double();
+            Real u2 = random_double();
+            Real u, v;
+            tree->sample(u1, u2, u, v);
+            direction = square_to_direction(u, v);
+            pdf = bsdf_fraction * std::max(dot(direction, normal_unit), Real(0)) / pi + (1 - bsdf_fraction) * tree->pdf(u, v) / (4 * pi);
+        }
+        return direction;
+    }
+
+    Real PathGuide::pdf_matte(const Vec3& point, const Vec3& normal_unit, const Vec3& direction) const {
+        return mixture_pdf(sampling_tree(point, normal_unit), normal_unit, direction);
+    }
+
+    Real PathGuide::mixture_pdf(const DTree* tree, const Vec3& normal_unit, const Vec3& direction) const {
+        Real cosine = std::max(dot(direction.unit(), normal_unit), Real(0)) / pi;
+        if (!tree) { return cosine; }
+        Real u, v;
+        direction_to_square(direction, u, v);
+        return bsdf_fraction * cosine + (1 - bsdf_fraction) * tree->pdf(u, v) / (4 * pi);
+    }
+
+    void PathGuide::record(const Vec3& point, const Vec3& normal_unit, const Vec3& direction, const Colour& radiance, Real pdf) {
+        if (!recording || nodes.empty() || !(pdf > 0)) { return; }
+        // paths that found nothing still count towards splitting the region, as they're where its samples are spent
+        Leaf& region = leaves[find_leaf(point)];
+        region.samples.fetch_add(1, std::memory_order_relaxed);
+        Real value = luminance(radiance) / pdf;
+        if (!(value > 0) || !std::isfinite(value)) { return; }
+        Real u, v;
+        direction_to_square(direction, u, v);
+        region.building[normal_bin(normal_unit)].record(u, v, value);
+    }
+
+    void PathGuide::split(std::uint32_t node, int depth, std::uint32_t samples, Real threshold) {
+        if (samples <= threshold || depth >= 48) { return; }
+        // the region's leaf goes to the lower half and a copy to the upper, both with its trees
+        SNode parent = nodes[node];
+        int axis = depth % 3;
+        AABB3 lower = parent.box;
+        AABB3 upper = parent.box;
+        if (axis == 0) { lower.max.x = upper.min.x = (parent.box.min.x + parent.box.max.x) / 2; }
+        if (axis == 1) { lower.max.y = upper.min.y = (parent.box.min.y + parent.box.max.y) / 2; }
+        if (axis == 2) { lower.max.z = upper.min.z = (parent.box.min.z + parent.box.max.z) / 2; }
+        std::uint32_t upper_leaf = static_cast<std::uint32_t>(leaves.size());
+        leaves.push_back(leaves[parent.leaf]);
+        std::uint32_t first = static_cast<std::uint32_t>(nodes.size());
+        nodes.push_back(SNode{lower, {0, 0}, 0, parent.leaf});
+        nodes.push_back(SNode{upper, {0, 0}, 0, upper_leaf});
+        nodes[node].child[0] = first;
+        nodes[node].child[1] = first + 1;
+        nodes[node].axis = axis;
+        split(first, depth + 1, samples / 2, threshold);
+        split(first + 1, depth + 1, samples / 2, threshold);
+    }
+
+    void PathGuide::refine() {
+        if (nodes.empty()) { return; }
+        Real threshold = spatial_threshold * std::sqrt(std::pow(Real(2), Real(passes)));
+
+        // depth first, keeping each node's depth for its split axis
+        std::vector<std::pair<std::uint32_t, int>> stack{{0, 0}};
+        std::vector<std::pair<std::uint32_t, int>> leaf_nodes;
+        while (!stack.empty()) {
+            auto [node, depth] = stack.back();
+            stack.pop_back();
+            if (nodes[node].child[0] != 0) {
+                stack.push_back({nodes[node].child[0], depth + 1});
+                stack.push_back({nodes[node].child[1], depth + 1});
+            } else {
+                leaf_nodes.push_back({node, depth});
+            }
+        }
+        for (auto [node, depth] : leaf_nodes) { split(node, depth, leaves[nodes[node].leaf].samples.load(), threshold); }
+
+        for (Leaf& region : leaves) {
+            for (int bin = 0; bin < normal_bins; bin++) {
+                region.sampling[bin] = region.building[bin];
+                region.building[bin] = region.sampling[bin].refined(directional_threshold, max_directional_depth);
+            }
+            region.samples.store(0, std::memory_order_relaxed);
+        }
+        passes++;
+    }
+
+    std::size_t PathGuide::memory() const {
+        std::size_t total = nodes.capacity() * sizeof(SNode) + leaves.capacity() * sizeof(Leaf);
+        for (const Leaf& region : leaves) {
+            for (int bin = 0; bin < normal_bins; bin++) {
+                total += (region.sampling[bin].size() + region.building[bin].size()) * 4 * (sizeof(float) + sizeof(std::uint32_t));
+            }
+        }
+        return total;
+    }
+
+}
@@ -0,0 +1,26 @@
+#ifndef IMAGE_IO
+#define IMAGE_IO
+
+#include <string>
+#include "tonemap.h"
+
+namespace rt {
+
+    // High dynamic range image files, to and from a Framebuffer of linear radiance. Loaders memory map the file and
+    // decode rows in parallel. Each returns false (and prints why) if the file can't be read or written.
+
+    /// @brief loads a colour (PF) or greyscale (Pf) Portable Float Map, of either endianness
+    bool load_pfm(const std::string& filename, Framebuffer& image);
+
+    /// @brief loads a Radiance RGBE (.hdr) file, run length encoded or flat, in the usual -Y H +X W orientation
+    bool load_hdr(const std::string& filename, Framebuffer& image);
+
+    /// @brief loads a .pfm or .hdr file, chosen by extension
+    bool load_hdr_image(const std::string& filename, Framebuffer& image);
+
+    bool save_pfm(const std::string& filename, const Framebuffer& image);
+    bool save_hdr(const std::string& filename, const Framebuffer& image); // run length encoded
+
+}
+
+#endif // IMAGE_IO
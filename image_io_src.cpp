@@ -0,0 +1,289 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include "image_io.h"
+#include "mapped_file.h"
+#include "parallel.h"
+
+namespace rt {
+
+    static bool has_extension(const std::string& filename, const char* extension) {
+        std::size_t length = std::strlen(extension);
+        if (filename.size() < length) { return false; }
+        for (std::size_t i = 0; i < length; i++) {
+            if (std::tolower(static_cast<unsigned char>(filename[filename.size() - length + i])) != extension[i]) { return false; }
+        }
+        return true;
+    }
+
+    // reads the next whitespace separated word of a header, leaving p just after the single whitespace character that ends it
+    static std::string header_word(const char*& p, const char* end) {
+        while (p < end && std::isspace(static_cast<unsigned char>(*p))) { p++; }
+        const char* start = p;
+        while (p < end && !std::isspace(static_cast<unsigned char>(*p))) { p++; }
+        std::string word(start, p);
+        if (p < end) { p++; }
+        return word;
+    }
+
+    // PFM
+
+    bool load_pfm(const std::string& filename, Framebuffer& image) {
+        MappedFile file;
+        if (!file.open(filename)) { return false; }
+        const char* p = file.data;
+        const char* end = file.data + file.size;
+
+        std::string magic = header_word(p, end);
+        int width = std::atoi(header_word(p, end).c_str());
+        int height = std::atoi(header_word(p, end).c_str());
+        double scale = std::atof(header_word(p, end).c_str());
+        int channels = magic == "PF" ? 3 : (magic == "Pf" ? 1 : 0);
+        if (channels == 0 || width <= 0 || height <= 0 || scale == 0) {
+            std::cerr << "Error in load_pfm(): " << filename << " isn't a PFM file\n";
+            return false;
+        }
+        std::size_t row_floats = static_cast<std::size_t>(width) * channels;
+        if (static_cast<std::size_t>(end - p) < row_floats * height * sizeof(float)) {
+            std::cerr << "Error in load_pfm(): " << filename << " is truncated\n";
+            return false;
+        }
+
+        // a negative scale means little endian. Rows are stored bottom to top.
+        const std::uint16_t endian_test = 1;
+        bool host_little_endian = *reinterpret_cast<const std::uint8_t*>(&endian_test) == 1;
+        bool swap = (scale < 0) != host_little_endian;
+        image = Framebuffer(width, height);
+        parallel_for(0, height, [&](std::size_t row) {
+            const char* in = p + (height - 1 - row) * row_floats * sizeof(float);
+            float* out = image(0, static_cast<int>(row));
+            for (std::size_t i = 0; i < row_floats; i++) {
+                char bytes[sizeof(float)];
+                std::memcpy(bytes, in + i * sizeof(float), sizeof(float));
+                if (swap) { std::reverse(bytes, bytes + sizeof(float)); }
+                float value;
+                std::memcpy(&value, bytes, sizeof(float));
+                if (channels == 3) {
+                    out[i] = value;
+                } else {
+                    out[3 * i] = out[3 * i + 1] = out[3 * i + 2] = value;
+                }
+            }
+        }, 16);
+        return true;
+    }
+
+    bool save_pfm(const std::string& filename, const Framebuffer& image) {
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Error in save_pfm(): could not open " << filename << "\n";
+            return false;
+        }
+        const std::uint16_t endian_test = 1;
+        bool host_little_endian = *reinterpret_cast<const std::uint8_t*>(&endian_test) == 1;
+        out << "PF\n" << image.width << " " << image.height << "\n" << (host_little_endian ? "-1.0" : "1.0") << "\n";
+        for (int row = image.height - 1; row >= 0; row--) {
+            out.write(reinterpret_cast<const char*>(image(0, row)), static_cast<std::streamsize>(image.width) * 3 * sizeof(float));
+        }
+        if (!out) {
+            std::cerr << "Error in save_pfm(): could not write " << filename << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Radiance HDR. Each pixel is a shared exponent and three 8 bit mantissas. Run length encoded scanlines start
+    // 2, 2, width (16 bits), then hold each of the four channels in turn as runs: a count byte above 128 repeats the
+    // next byte count - 128 times, otherwise count literal bytes follow.
+
+    static bool hdr_rle_scanline(const char* p, const char* end, int width) {
+        return width >= 8 && width < 32768 && end - p >= 4 && p[0] == 2 && p[1] == 2 &&
+               ((static_cast<unsigned char>(p[2]) << 8) | static_cast<unsigned char>(p[3])) == width;
+    }
+
+    // length in bytes of the run length encoded scanline at p, or 0 if it runs off the end or overfills a channel
+    static std::size_t hdr_scanline_size(const char* p, const char* end, int width) {
+        const char* start = p;
+        p += 4;
+        for (int channel = 0; channel < 4; channel++) {
+            for (int x = 0; x < width;) {
+                if (p >= end) { return 0; }
+                int count = static_cast<unsigned char>(*p++);
+                if (count > 128) {
+                    count -= 128;
+                    p++;
+                } else {
+                    p += count;
+                }
+                x += count;
+                if (count == 0 || x > width) { return 0; }
+            }
+        }
+        return p <= end ? static_cast<std::size_t>(p - start) : 0;
+    }
+
+    static void hdr_decode_pixel(const unsigned char* rgbe, float* out) {
+        if (rgbe[3] == 0) {
+            out[0] = out[1] = out[2] = 0;
+            return;
+        }
+        float f = std::ldexp(1.0f, rgbe[3] - (128 + 8));
+        for (int c = 0; c < 3; c++) { out[c] = (rgbe[c] + 0.5f) * f; }
+    }
+
+    bool load_hdr(const std::string& filename, Framebuffer& image) {
+        MappedFile file;
+        if (!file.open(filename)) { return false; }
+        const char* p = file.data;
+        const char* end = file.data + file.size;
+
+        // header lines up to a blank one, then the resolution line
+        std::string line;
+        auto read_line = [&]() {
+            const char* start = p;
+            while (p < end && *p != '\n') { p++; }
+            line.assign(start, p);
+            if (p < end) { p++; }
+        };
+        read_line();
+        if (line.rfind("#?", 0) != 0) {
+            std::cerr << "Error in load_hdr(): " << filename << " isn't a Radiance HDR file\n";
+            return false;
+        }
+        while (p < end) {
+            read_line();
+            if (line.empty()) { break; }
+            if (line.rfind("FORMAT=", 0) == 0 && line != "FORMAT=32-bit_rle_rgbe") {
+                std::cerr << "Error in load_hdr(): " << filename << " has unsupported " << line << "\n";
+                return false;
+            }
+        }
+        read_line();
+        char y_sign = 0, x_sign = 0, y_axis = 0, x_axis = 0;
+        int width = 0, height = 0;
+        if (std::sscanf(line.c_str(), "%c%c %d %c%c %d", &y_sign, &y_axis, &height, &x_sign, &x_axis, &width) != 6 ||
+            y_sign != '-' || y_axis != 'Y' || x_sign != '+' || x_axis != 'X' || width <= 0 || height <= 0) {
+            std::cerr << "Error in load_hdr(): " << filename << " has an unsupported resolution line \"" << line << "\"\n";
+            return false;
+        }
+
+        // find where each scanline starts (serially: their lengths vary), then decode them in parallel
+        std::vector<const char*> scanlines(height);
+        bool rle = hdr_rle_scanline(p, end, width);
+        for (int row = 0; row < height; row++) {
+            std::size_t size = rle ? hdr_scanline_size(p, end, width) : static_cast<std::size_t>(width) * 4;
+            if (size == 0 || (rle && !hdr_rle_scanline(p, end, width)) || static_cast<std::size_t>(end - p) < size) {
+                std::cerr << "Error in load_hdr(): " << filename << " is truncated or corrupt at row " << row << "\n";
+                return false;
+            }
+            scanlines[row] = p;
+            p += size;
+        }
+
+        image = Framebuffer(width, height);
+        parallel_for(0, height, [&](std::size_t row) {
+            const unsigned char* in = reinterpret_cast<const unsigned char*>(scanlines[row]);
+            float* out = image(0, static_cast<int>(row));
+            if (!rle) {
+                for (int x = 0; x < width; x++) { hdr_decode_pixel(in + 4 * x, out + 3 * x); }
+                return;
+            }
+            std::vector<unsigned char> rgbe(static_cast<std::size_t>(width) * 4);
+            in += 4;
+            for (int channel = 0; channel < 4; channel++) {
+                for (int x = 0; x < width;) {
+                    int count = *in++;
+                    if (count > 128) {
+                        count -= 128;
+                        unsigned char value = *in++;
+                        for (int i = 0; i < count; i++) { rgbe[4 * (x + i) + channel] = value; }
+                    } else {
+                        for (int i = 0; i < count; i++) { rgbe[4 * (x + i) + channel] = *in++; }
+                    }
+                    x += count;
+                }
+            }
+            for (int x = 0; x < width; x++) { hdr_decode_pixel(&rgbe[4 * x], out + 3 * x); }
+        }, 8);
+        return true;
+    }
+
+    bool save_hdr(const std::string& filename, const Framebuffer& image) {
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Error in save_hdr(): could not open " << filename << "\n";
+            return false;
+        }
+        out << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " << image.height << " +X " << image.width << "\n";
+
+        const int width = image.width;
+        std::vector<unsigned char> rgbe(static_cast<std::size_t>(width) * 4);
+        std::vector<unsigned char> encoded;
+        for (int row = 0; row < image.height; row++) {
+            const float* in = image(0, row);
+            for (int x = 0; x < width; x++) {
+                float brightest = std::max({in[3 * x], in[3 * x + 1], in[3 * x + 2]});
+                unsigned char* pixel = &rgbe[4 * x];
+                if (brightest < 1e-32f) {
+                    pixel[0] = pixel[1] = pixel[2] = pixel[3] = 0;
+                } else {
+                    int exponent;
+                    float scale = std::frexp(brightest, &exponent) * 256.0f / brightest;
+                    for (int c = 0; c < 3; c++) { pixel[c] = static_cast<unsigned char>(std::max(0.0f, in[3 * x + c]) * scale); }
+                    pixel[3] = static_cast<unsigned char>(exponent + 128);
+                }
+            }
+            if (width < 8 || width >= 32768) { // too narrow or wide to run length encode
+                out.write(reinterpret_cast<const char*>(rgbe.data()), static_cast<std::streamsize>(rgbe.size()));
+                continue;
+            }
+
+            encoded.assign({2, 2, static_cast<unsigned char>(width >> 8), static_cast<unsigned char>(width & 255)});
+            for (int channel = 0; channel < 4; channel++) {
+                auto value = [&](int x) { return rgbe[4 * x + channel]; };
+                for (int x = 0; x < width;) {
+                    // a run of at least 3 equal values is worth encoding; otherwise gather literals up to the next one
+                    int run = 1;
+                    while (x + run < width && run < 127 && value(x + run) == value(x)) { run++; }
+                    if (run >= 3) {
+                        encoded.push_back(static_cast<unsigned char>(128 + run));
+                        encoded.push_back(value(x));
+                        x += run;
+                        continue;
+                    }
+                    int literal = 0;
+                    while (x + literal < width && literal < 128) {
+                        int ahead = x + literal;
+                        if (ahead + 2 < width && value(ahead) == value(ahead + 1) && value(ahead) == value(ahead + 2)) { break; }
+                        literal++;
+                    }
+                    encoded.push_back(static_cast<unsigned char>(literal));
+                    for (int i = 0; i < literal; i++) { encoded.push_back(value(x + i)); }
+                    x += literal;
+                }
+            }
+            out.write(reinterpret_cast<const char*>(encoded.data()), static_cast<std::streamsize>(encoded.size()));
+        }
+        if (!out) {
+            std::cerr << "Error in save_hdr(): could not write " << filename << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool load_hdr_image(const std::string& filename, Framebuffer& image) {
+        if (has_extension(filename, ".pfm")) { return load_pfm(filename, image); }
+        if (has_extension(filename, ".hdr")) { return load_hdr(filename, image); }
+        std::cerr << "Error in load_hdr_image(): unknown file type " << filename << "\n";
+        return false;
+    }
+
+}
@@ -0,0 +1,56 @@
+#ifndef INSTANCE
+#define INSTANCE
+
+#include <type_traits>
+#include "gmath.h"
+#include "geometry.h"
+#include "transform.h"
+
+namespace rt {
+
+    /// @brief a primitive of an instanced object, seen from world space: what PrimitiveSet::visit() passes for a hit
+    /// on an instance. Has the same normal() and material_id as the primitives themselves.
+    template <typename Prim>
+    class Instanced {
+        public:
+            const Prim& prim;
+            const Transform3& to_object;
+            MaterialId material_id;
+
+            Instanced(const Prim& prim, const Transform3& to_object) : prim(prim), to_object(to_object), material_id(prim.material_id) {}
+
+            Vec3 normal(const Vec3& point) const { return to_object.transpose_vector(prim.normal(to_object.point(point))).unit(); }
+    };
+
+    /// @brief a placement of shared geometry in the scene: an object (a PrimitiveSet with its own BVH, which must outlive
+    /// every instance of it) and the transform from its space to the world's, with the inverse cached.
+    /// Rays are taken into object space rather than the geometry into world space, so a thousand instances of an object
+    /// cost a thousand of these and one copy of the object. Instances go into the scene's BVH like any other primitive,
+    /// which makes it the top level of a two-level structure, over the objects' BVHs.
+    template <typename Object>
+    class InstanceT {
+        public:
+            const Object* object;
+            Transform3 to_world;
+            Transform3 to_object;
+
+            InstanceT(const Object& object, const Transform3& to_world) : object(&object), to_world(to_world), to_object(to_world.inverse()) {}
+
+            /// @brief closest hit on the object with 0 < t < t_max along the world space ray, which has the same t in object space
+            auto closest_hit(const Line3& ray, Real t_max) const { return object->closest_hit(to_object(ray), t_max); }
+
+            /// @brief whether anything in the object is hit with 0 < t < t_max
+            bool occluded(const Line3& ray, Real t_max) const { return object->occluded(to_object(ray), t_max); }
+
+            /// @brief calls f with the hit primitive of the object (hit as returned by closest_hit()), wrapped in Instanced
+            template <typename Hit, typename F>
+            decltype(auto) visit(const Hit& hit, F&& f) const {
+                return object->visit(hit, [&](const auto& prim) { return f(Instanced<std::decay_t<decltype(prim)>>(prim, to_object)); });
+            }
+
+            AABB3 bounds() const { return to_world(object->bounds()); }
+    };
+
+}
+
+#endif // INSTANCE
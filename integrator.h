@@ -0,0 +1,84 @@
+#ifndef INTEGRATOR
+#define INTEGRATOR
+
+#include <cstdint>
+#include "gmath.h"
+#include "geometry.h"
+#include "scene.h"
+#include "materials.h"
+#include "lights.h"
+#include "caustics.h"
+#include "radiance_cache.h"
+#include "guiding.h"
+#include "denoise.h"
+
+namespace rt {
+
+    /// @brief what a camera ray hits first, for the denoiser
+    struct FirstHit {
+        Colour albedo{1, 1, 1}; // glass passes on the colour of what's behind it, so only matte and metal have their own
+        Vec3 normal;
+        Real depth{FeatureBuffers::sky_depth};
+    };
+
+    /// @brief a camera ray's hit on geometry the scene doesn't hold, found by another tracer (a StreamedMesh's batch)
+    struct ExternalHit {
+        Real t;
+        Vec3 normal; // unit
+        MaterialId material_id;
+    };
+
+    /// @brief the path tracer: radiance along paths from the camera through a scene, with each of the ways of cutting
+    /// its noise switched on by setting the matching member. main() renders with it, and the benchmarks compare
+    /// renders with and without each, so they measure the same paths main() traces.
+    /// Nothing in it changes while tracing but the cache and the guide, which are lock-free, so any number of threads
+    /// can trace with one at once.
+    class PathTracer {
+        public:
+            const Scene& scene;
+            const MaterialTable& materials;
+            const LightSet& lights; // sampled at matte bounces; lights.environment, if set, is the light from beyond the scene
+            int max_depth{50}; // rays in a path, the last hit's light included but not what it scatters
+            Colour (*sky)(const Vec3& direction){nullptr}; // light from beyond the scene when there's no environment; black if null
+            bool sample_lights{true}; // at matte bounces, weighted against the scattered ray finding them (MIS)
+            bool show_lights{true}; // false leaves lights seen straight from the camera black, leaving just the light they cast
+            bool nested_media{true}; // false refracts at every glass surface as if against air
+            // gathered at matte hits; paths that escape through specular surfaces after a matte one then find
+            // nothing where the map has counted their light (CausticMap::covers), even if it's empty
+            const CausticMap* caustics{nullptr};
+            RadianceCache* cache{nullptr}; // paths past its depth end in it, where it has enough samples, and add to it
+            PathGuide* guide{nullptr}; // matte surfaces scatter by it once it's ready, and record into it while it's recording
+
+            PathTracer(const Scene& scene, const MaterialTable& materials, const LightSet& lights)
+                : scene(scene), materials(materials), lights(lights) {}
+
+            /// @brief radiance arriving along ray, from the camera. The first matte surface the path reaches is
+            /// scattered from split times, averaging them, so the camera ray and any specular bounces before it are
+            /// shared between split paths.
+            /// @param first_hit filled in with what the ray hits, if not null
+            /// @param rays has the rays traced added to it, not counting shadow rays, if not null
+            /// @param do_trace prints each ray, for debugging
+            Colour trace(const Line3& ray, int split = 1, FirstHit* first_hit = nullptr, std::uint64_t* rays = nullptr, bool do_trace = false) const;
+
+            /// @brief like trace(), for a camera ray that also hits external. Whichever of it and the scene is nearer
+            /// is shaded; the rest of the path, its shadow rays included, only sees the scene.
+            Colour trace(const Line3& ray, const ExternalHit& external, int split = 1, FirstHit* first_hit = nullptr,
+                         std::uint64_t* rays = nullptr, bool do_trace = false) const;
+
+        private:
+            /// @brief radiance along a path with n rays left
+            /// @param scatter_pdf density over solid angle with which a matte bounce chose the ray, or 0 if it came from
+            /// the camera or a specular bounce. Lights the ray hits are weighted against light sampling having found them.
+            /// @param scatter_normal normal of the surface the matte bounce was from
+            /// @param caustic_path whether the ray left a matte surface and has only been reflected or refracted by
+            /// specular ones since
+            /// @param media the glass the ray is inside, which sets the refractive index either side of the next glass surface
+            /// @param external a hit outside the scene for the ray, from the camera, or null
+            Colour radiance(int n, const Line3& ray, Real scatter_pdf, const Vec3& scatter_normal, bool caustic_path, int split,
+                            FirstHit* first_hit, MediumStack media, std::uint64_t& rays, bool do_trace,
+                            const ExternalHit* external = nullptr) const;
+    };
+
+}
+
+#endif // INTEGRATOR
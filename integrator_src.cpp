@@ -0,0 +1,116 @@
+#include <iostream>
+#include <cstdint>
+#include <algorithm>
+#include "integrator.h"
+
+namespace rt {
+
+    Colour PathTracer::trace(const Line3& ray, int split, FirstHit* first_hit, std::uint64_t* rays, bool do_trace) const {
+        std::uint64_t traced = 0;
+        Colour colour = radiance(max_depth, ray, 0, Vec3(), false, split, first_hit, MediumStack(), traced, do_trace);
+        if (rays) { *rays += traced; }
+        return colour;
+    }
+
+    Colour PathTracer::trace(const Line3& ray, const ExternalHit& external, int split, FirstHit* first_hit, std::uint64_t* rays,
+                             bool do_trace) const {
+        std::uint64_t traced = 0;
+        Colour colour = radiance(max_depth, ray, 0, Vec3(), false, split, first_hit, MediumStack(), traced, do_trace, &external);
+        if (rays) { *rays += traced; }
+        return colour;
+    }
+
+    Colour PathTracer::radiance(int n, const Line3& ray, Real scatter_pdf, const Vec3& scatter_normal, bool caustic_path, int split,
+                                FirstHit* first_hit, MediumStack media, std::uint64_t& rays, bool do_trace,
+                                const ExternalHit* external) const {
+        if (n == 0) { return Colour(0, 0, 0); }
+        int depth = max_depth - n; // bounces before this ray
+        if (do_trace) { std::cout << "Level: " << n << ", Position: " << ray.p << ", Vector: " << ray.d << "\n"; }
+
+        Hit hit = external ? scene.closest_hit(ray, external->t) : scene.closest_hit(ray);
+        rays++;
+        if (do_trace) { std::cout << "hit type: " << hit.type << ", idx: " << hit.idx << "\n"; }
+
+        if (!hit.hit() && !external) {
+            if (first_hit) { first_hit->normal = -ray.d.unit(); }
+            if (caustics && caustic_path && scatter_pdf == 0 && caustics->covers(ray.p, ray.d)) { return Colour(0, 0, 0); }
+            if (lights.environment) {
+                Real weight = sample_lights && scatter_pdf > 0 ? power_heuristic(scatter_pdf, lights.environment->pdf(ray.d)) : 1;
+                return weight * lights.environment->radiance(ray.d);
+            }
+            return sky ? sky(ray.d) : Colour(0, 0, 0);
+        }
+
+        // an external hit is only ever on a camera ray, so it's never weighted against light sampling, which needs hit
+        Real t = hit.hit() ? hit.t : external->t;
+        Vec3 point = ray(t);
+        Vec3 normal_unit = hit.hit() ? Vec3() : external->normal;
+        MaterialId material_id = hit.hit() ? 0 : external->material_id;
+        if (hit.hit()) {
+            scene.visit(hit, [&](const auto& prim) {
+                normal_unit = prim.normal(point);
+                material_id = prim.material_id;
+            });
+        }
+        const MaterialProperties& material = materials[material_id];
+        if (first_hit) {
+            bool coloured = material.type == Material::matte || material.type == Material::metal;
+            first_hit->albedo = coloured ? material.reflectance : Colour(1, 1, 1);
+            first_hit->normal = normal_unit;
+            first_hit->depth = t * ray.d.abs();
+        }
+        if (material.type == Material::emissive) {
+            if (depth == 0 && !show_lights) { return Colour(0, 0, 0); }
+            Real weight = sample_lights && scatter_pdf > 0 ? power_heuristic(scatter_pdf, lights.pdf(scene, hit, ray.p, scatter_normal, point)) : 1;
+            return weight * material.emission;
+        }
+
+        if (material.type != Material::matte) {
+            Line3 next = nested_media ? scatter(materials, material_id, ray, point, normal_unit, media) : scatter(material, ray, point, normal_unit);
+            bool next_caustic_path = caustic_path && is_specular(material);
+            return material.reflectance * radiance(n - 1, next, 0, normal_unit, next_caustic_path, split, nullptr, media, rays, do_trace);
+        }
+
+        // past the cache's depth, the path ends here if enough paths have been by already
+        Colour incoming;
+        if (cache && depth >= cache->depth && cache->lookup(point, normal_unit, incoming)) { return material.reflectance * incoming; }
+
+        // matte surfaces sample a light directly as well as scattering, and the scattered ray is weighted if it finds
+        // one. Once the guide has learned something, the scatter leans towards where light came from before.
+        auto estimate = [&]() {
+            Colour estimate(0, 0, 0);
+            bool guided = guide && guide->ready();
+            if (sample_lights) {
+                estimate += guided ? direct_matte(scene, lights, point, normal_unit, Colour(1, 1, 1),
+                                                  [&](const Vec3& d) { return guide->pdf_matte(point, normal_unit, d); })
+                                   : direct_matte(scene, lights, point, normal_unit, Colour(1, 1, 1));
+            }
+            if (caustics) { estimate += caustics->radiance(point, normal_unit, Colour(1, 1, 1)); }
+            if (guided) {
+                Real next_pdf;
+                Vec3 direction = guide->sample_matte(point, normal_unit, next_pdf);
+                Real cos_out = dot(direction, normal_unit);
+                if (cos_out > 0 && next_pdf > 0) {
+                    Line3 next(offset_ray_origin(point, normal_unit), direction);
+                    Colour arriving = radiance(n - 1, next, next_pdf, normal_unit, true, 1, nullptr, media, rays, do_trace);
+                    estimate += (cos_out / (pi * next_pdf)) * arriving;
+                    guide->record(point, normal_unit, direction, arriving, next_pdf);
+                }
+            } else {
+                Line3 next = scatter(material, ray, point, normal_unit);
+                Real next_pdf = std::max(dot(next.d, normal_unit), Real(0)) / pi;
+                Colour arriving = radiance(n - 1, next, next_pdf, normal_unit, true, 1, nullptr, media, rays, do_trace);
+                estimate += arriving;
+                if (guide) { guide->record(point, normal_unit, next.d, arriving, next_pdf); }
+            }
+            return estimate;
+        };
+        incoming = estimate();
+        for (int i = 1; i < split; i++) { incoming += estimate(); }
+        incoming /= split;
+        // the path from here had at least half of max_depth left, so what's cut off at the end is negligible
+        if (cache && depth > 0 && n > max_depth / 2) { cache->add(point, normal_unit, incoming); }
+        return material.reflectance * incoming;
+    }
+
+}
@@ -0,0 +1,431 @@
+#ifndef LIGHTS
+#define LIGHTS
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include <type_traits>
+#include <tuple>
+#include <utility>
+#include <limits>
+#include "gmath.h"
+#include "geometry.h"
+#include "mesh.h"
+#include "scene.h"
+#include "bvh_build.h"
+#include "materials.h"
+#include "environment.h"
+
+namespace rt {
+
+    // Sampling points on the shapes that can be lights, as seen from a point being shaded. sample_light_shape() returns
+    // false if it can't sample from there (e.g. from inside a sphere); otherwise the pdf it gives, like light_shape_pdf()'s,
+    // is over solid angle at from. Flat lights shine from both sides.
+
+    /// @brief unit vectors u and v perpendicular to unit n and each other (Duff et al., "Building an Orthonormal Basis, Revisited", 2017)
+    inline void orthonormal_basis(const Vec3& n, Vec3& u, Vec3& v) {
+        Real sign = std::copysign(Real(1), n.z);
+        Real a = -1 / (sign + n.z);
+        Real b = n.x * n.y * a;
+        u = Vec3(1 + sign * n.x * n.x * a, sign * b, -sign * n.x);
+        v = Vec3(b, sign + n.y * n.y * a, -n.y);
+    }
+
+    /// @brief converts a density over area at point, on a surface with the given unit normal, to one over solid angle at from
+    inline Real area_to_solid_angle(Real area_pdf, const Vec3& from, const Vec3& point, const Vec3& normal_unit) {
+        Vec3 to_light = point - from;
+        Real distance2 = to_light.abs2();
+        Real cos_light = std::fabs(dot(normal_unit, to_light)) / std::sqrt(distance2);
+        return cos_light > 0 ? area_pdf * distance2 / cos_light : 0;
+    }
+
+    // spheres: uniformly over the cone of directions the sphere subtends from the shaded point, which (unlike sampling
+    // its surface) wastes no samples on the far side. 1 - cos(cone angle) is found as sin^2 / (1 + cos), which doesn't
+    // cancel to 0 for small or distant spheres.
+
+    inline Real light_shape_area(const Sphere3& sphere) { return 4 * pi * sphere.r * sphere.r; }
+
+    inline Real light_shape_pdf(const Sphere3& sphere, const Vec3& from, const Vec3&) {
+        Real sin2_max = sphere.r * sphere.r / (sphere.p - from).abs2();
+        if (sin2_max >= 1) { return 0; }
+        return 1 / (2 * pi * sin2_max / (1 + std::sqrt(1 - sin2_max)));
+    }
+
+    inline bool sample_light_shape(const Sphere3& sphere, const Vec3& from, Real u1, Real u2, Vec3& point, Real& pdf) {
+        Vec3 to_centre = sphere.p - from;
+        Real distance2 = to_centre.abs2();
+        Real sin2_max = sphere.r * sphere.r / distance2;
+        if (sin2_max >= 1) { return false; }
+        Real one_minus_cos_max = sin2_max / (1 + std::sqrt(1 - sin2_max));
+        Real cos_theta = 1 - u1 * one_minus_cos_max;
+        Real sin_theta = std::sqrt(std::max(Real(0), 1 - cos_theta * cos_theta));
+        Real phi = 2 * pi * u2;
+        Vec3 w = to_centre / std::sqrt(distance2);
+        Vec3 u, v;
+        orthonormal_basis(w, u, v);
+        Vec3 direction = sin_theta * std::cos(phi) * u + sin_theta * std::sin(phi) * v + cos_theta * w;
+        Real t = sphere.intersects(Line3(from, direction));
+        if (t <= 0) { t = std::sqrt(distance2) * cos_theta; } // grazing the rim, where rounding can miss
+        point = from + t * direction;
+        pdf = 1 / (2 * pi * one_minus_cos_max);
+        return true;
+    }
+
+    // triangles and disks: uniformly over their area
+
+    inline Real light_shape_area(const Triangle3& triangle) {
+        return cross(triangle.vertex(1) - triangle.vertex(0), triangle.vertex(2) - triangle.vertex(0)).abs() / 2;
+    }
+
+    inline Real light_shape_pdf(const Triangle3& triangle, const Vec3& from, const Vec3& point) {
+        Vec3 geometric = cross(triangle.vertex(1) - triangle.vertex(0), triangle.vertex(2) - triangle.vertex(0));
+        return area_to_solid_angle(2 / geometric.abs(), from, point, geometric.unit());
+    }
+
+    inline bool sample_light_shape(const Triangle3& triangle, const Vec3& from, Real u1, Real u2, Vec3& point, Real& pdf) {
+        const Vec3& p0 = triangle.vertex(0);
+        Vec3 edge1 = triangle.vertex(1) - p0;
+        Vec3 edge2 = triangle.vertex(2) - p0;
+        Real root = std::sqrt(u1);
+        point = p0 + (1 - u2) * root * edge1 + u2 * root * edge2;
+        Vec3 geometric = cross(edge1, edge2);
+        pdf = area_to_solid_angle(2 / geometric.abs(), from, point, geometric.unit());
+        return pdf > 0;
+    }
+
+    inline Real light_shape_area(const Disk3& disk) { return pi * disk.r * disk.r; }
+
+    inline Real light_shape_pdf(const Disk3& disk, const Vec3& from, const Vec3& point) {
+        return area_to_solid_angle(1 / light_shape_area(disk), from, point, disk.n);
+    }
+
+    inline bool sample_light_shape(const Disk3& disk, const Vec3& from, Real u1, Real u2, Vec3& point, Real& pdf) {
+        Vec3 u, v;
+        orthonormal_basis(disk.n, u, v);
+        Real radius = disk.r * std::sqrt(u1);
+        Real phi = 2 * pi * u2;
+        point = disk.p + radius * std::cos(phi) * u + radius * std::sin(phi) * v;
+        pdf = area_to_solid_angle(1 / light_shape_area(disk), from, point, disk.n);
+        return pdf > 0;
+    }
+
+    /// @brief whether P can be sampled as a light, i.e. has the light_shape_... functions above
+    template <typename P, typename = void>
+    struct is_light_shape : std::false_type {};
+    template <typename P>
+    struct is_light_shape<P, std::void_t<decltype(light_shape_area(std::declval<const P&>()))>> : std::true_type {};
+    template <typename P>
+    inline constexpr bool is_light_shape_v = is_light_shape<P>::value;
+
+    /// @brief a point sampled on a light, towards a point being shaded
+    struct LightSample {
+        Vec3 point;
+        Colour emission;
+        Real pdf{0}; // over solid angle at the shaded point, including the chance of picking this light
+    };
+
+    /// @brief multiple importance sampling weight for a sample taken with density pdf, against one other strategy that
+    /// would have taken it with density other_pdf (Veach's power heuristic, with an exponent of 2)
+    inline Real power_heuristic(Real pdf, Real other_pdf) {
+        Real a = pdf * pdf;
+        Real b = other_pdf * other_pdf;
+        return a + b > 0 ? a / (a + b) : 0;
+    }
+
+    /// @brief how LightSet picks which light to sample
+    enum class LightPicking {
+        uniform, // every light equally likely
+        power, // in proportion to power, wherever the shaded point is
+        tree // by each light's estimated contribution at the shaded point, through a light BVH
+    };
+
+    /// @brief the emissive primitives of a scene, for next-event estimation: picks one and samples a point on it.
+    /// Emissive primitives inside instances, or without sample_light_shape() (planes and boxes), aren't in the set;
+    /// they still light the scene when paths happen to hit them. Refers to primitives by their type and index in the
+    /// scene, so rebuild it after changing the scene's primitives.
+    /// With LightPicking::tree (the default), the lights are leaves of a binary tree whose nodes store their lights'
+    /// bounds and total power. Picking walks down it, choosing each child in proportion to an estimate of how much it
+    /// could light the shaded point: power over squared distance to the node's box, times the most the surface's cosine
+    /// can be over it. That takes O(log N) per sample however many lights there are, and favours the near and
+    /// bright ones (Conty Estevez & Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018).
+    class LightSet {
+        public:
+            struct Light {
+                int type; // as in Hit
+                std::uint32_t idx;
+                Colour emission;
+                Real power;
+            };
+
+            LightPicking picking{LightPicking::tree};
+            std::vector<Light> lights;
+            const EnvironmentMap* environment{nullptr}; // if set, sampled as well as the lights, and must outlive the set
+
+            bool empty() const { return lights.empty(); }
+            std::size_t size() const { return lights.size(); }
+            std::size_t memory() const {
+                return lights.size() * (sizeof(Light) + sizeof(Real) + sizeof(std::uint64_t)) + nodes.size() * sizeof(Node) +
+                       index.size() * (sizeof(std::uint64_t) + sizeof(std::uint32_t));
+            }
+
+            template <typename Set>
+            void build(const Set& scene, const MaterialTable& materials) {
+                lights.clear();
+                cdf.clear();
+                index.clear();
+                nodes.clear();
+                paths.clear();
+                std::vector<AABB3T<float>> boxes;
+                add_types(scene, materials, boxes, std::make_index_sequence<std::tuple_size_v<decltype(Set::primitives)>>{});
+                if (lights.empty()) { return; }
+
+                Real total = 0;
+                for (const Light& light : lights) { total += light.power; }
+                Real running = 0;
+                for (std::size_t i = 0; i < lights.size(); i++) {
+                    running += lights[i].power;
+                    cdf.push_back(running / total);
+                    index[key(lights[i].type, lights[i].idx)] = static_cast<std::uint32_t>(i);
+                }
+
+                std::vector<std::uint32_t> order(lights.size());
+                for (std::uint32_t i = 0; i < order.size(); i++) { order[i] = i; }
+                paths.resize(lights.size());
+                min_distance2 = std::numeric_limits<Real>::infinity();
+                for (const AABB3T<float>& box : boxes) { min_distance2 = std::min(min_distance2, Real(box.extent().abs2() / 4)); }
+                nodes.reserve(2 * lights.size() - 1);
+                build_node(order, 0, order.size(), boxes, 0, 0);
+            }
+
+            /// @brief picks a light and a point on it, as seen from `from` on a surface with the given unit normal (or a
+            /// zero vector if there's no surface). Returns false if there are no lights or the one picked can't be
+            /// sampled from there.
+            template <typename Set>
+            bool sample(const Set& scene, const Vec3& from, const Vec3& normal_unit, LightSample& sample) const {
+                std::uint32_t picked;
+                Real probability;
+                if (!pick(from, normal_unit, picked, probability)) { return false; }
+                const Light& light = lights[picked];
+                Real u1 = random_double();
+                Real u2 = random_double();
+                bool sampled = false;
+                scene.visit(Hit{0, light.type, light.idx}, [&](const auto& prim) {
+                    if constexpr (is_light_shape_v<std::decay_t<decltype(prim)>>) {
+                        sampled = sample_light_shape(prim, from, u1, u2, sample.point, sample.pdf);
+                    }
+                });
+                sample.emission = light.emission;
+                sample.pdf *= probability;
+                return sampled && sample.pdf > 0;
+            }
+
+            /// @brief density over solid angle with which sample() from `from` (on a surface with the given unit normal)
+            /// picks point, on the primitive hit. 0 if that isn't in the set.
+            template <typename Set>
+            Real pdf(const Set& scene, const Hit& hit, const Vec3& from, const Vec3& normal_unit, const Vec3& point) const {
+                if (hit.inner_type != -1) { return 0; }
+                auto found = index.find(key(hit.type, hit.idx));
+                if (found == index.end()) { return 0; }
+                Real shape_pdf = 0;
+                scene.visit(hit, [&](const auto& prim) {
+                    if constexpr (is_light_shape_v<std::decay_t<decltype(prim)>>) { shape_pdf = light_shape_pdf(prim, from, point); }
+                });
+                return probability(found->second, from, normal_unit) * shape_pdf;
+            }
+
+        private:
+            // a node of the light tree. An inner node's first child follows it; second_or_light is the index of its
+            // second, or for a leaf, leaf_flag | the light's index.
+            struct Node {
+                AABB3T<float> box;
+                float power;
+                std::uint32_t second_or_light;
+            };
+            static constexpr std::uint32_t leaf_flag = 0x80000000u;
+
+            std::vector<Real> cdf; // running total of the lights' share of the power, for LightPicking::power
+            std::unordered_map<std::uint64_t, std::uint32_t> index; // light for each key(type, idx)
+            std::vector<Node> nodes;
+            std::vector<std::uint64_t> paths; // for each light, the way down the tree to it: bit d set for the second child at depth d
+            Real min_distance2{0}; // squared radius of the smallest light's bounding sphere
+
+            static std::uint64_t key(int type, std::size_t idx) { return (static_cast<std::uint64_t>(type) << 32) | idx; }
+
+            template <typename Set, std::size_t... I>
+            void add_types(const Set& scene, const MaterialTable& materials, std::vector<AABB3T<float>>& boxes, std::index_sequence<I...>) {
+                auto add_array = [&](const auto& array, int type) {
+                    if constexpr (is_light_shape_v<typename std::decay_t<decltype(array)>::value_type>) {
+                        for (std::size_t i = 0; i < array.size(); i++) {
+                            const MaterialProperties& material = materials[array[i].material_id];
+                            if (material.type != Material::emissive) { continue; }
+                            Real power = luminance(material.emission) * light_shape_area(array[i]);
+                            if (!(power > 0)) { continue; }
+                            lights.push_back(Light{type, static_cast<std::uint32_t>(i), material.emission, power});
+                            boxes.push_back(to_float_bounds(array[i].bounds()));
+                        }
+                    }
+                };
+                (add_array(std::get<I>(scene.primitives), static_cast<int>(I)), ...);
+            }
+
+            // builds the subtree over order[begin, end), splitting at the median of the lights' centres along the axis
+            // they spread furthest, so the tree is balanced. Returns the subtree's root.
+            std::uint32_t build_node(std::vector<std::uint32_t>& order, std::size_t begin, std::size_t end, const std::vector<AABB3T<float>>& boxes,
+                                     std::uint64_t path, int depth) {
+                std::uint32_t node = static_cast<std::uint32_t>(nodes.size());
+                nodes.push_back(Node{AABB3T<float>(), 0, 0});
+                if (end - begin == 1) {
+                    std::uint32_t light = order[begin];
+                    nodes[node] = Node{boxes[light], static_cast<float>(lights[light].power), leaf_flag | light};
+                    paths[light] = path;
+                    return node;
+                }
+
+                AABB3T<float> centres;
+                for (std::size_t i = begin; i < end; i++) { centres.extend(boxes[order[i]].centroid()); }
+                int split_axis = centres.longest_axis();
+                std::size_t middle = begin + (end - begin) / 2;
+                std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](std::uint32_t a, std::uint32_t b) {
+                    return axis(boxes[a].centroid(), split_axis) < axis(boxes[b].centroid(), split_axis);
+                });
+                std::uint32_t first = build_node(order, begin, middle, boxes, path, depth + 1);
+                std::uint32_t second = build_node(order, middle, end, boxes, path | (std::uint64_t(1) << depth), depth + 1);
+                AABB3T<float> box = nodes[first].box;
+                box.extend(nodes[second].box);
+                nodes[node] = Node{box, nodes[first].power + nodes[second].power, second};
+                return node;
+            }
+
+            // estimate of how much the node's lights could light from. The distance is to the nearest point of the node's
+            // box, but no less than the smallest light's radius; the distance to its centre would make a far-reaching
+            // node look dim from a light at its edge, which is then picked too rarely for how bright it is. The cosine
+            // at from is bounded over the node's bounding sphere.
+            Real importance(const Node& node, const Vec3& from, const Vec3& normal_unit) const {
+                Vec3 centre = Vec3(node.box.min.x + node.box.max.x, node.box.min.y + node.box.max.y, node.box.min.z + node.box.max.z) / 2;
+                Vec3 half = Vec3(node.box.max.x - node.box.min.x, node.box.max.y - node.box.min.y, node.box.max.z - node.box.min.z) / 2;
+                Vec3 to_centre = centre - from;
+                Real distance2 = to_centre.abs2();
+                Real radius2 = half.abs2();
+                Real cos_bound = 1;
+                if (distance2 > radius2 && normal_unit.abs2() > 0) {
+                    Real cos_normal = dot(normal_unit, to_centre) / std::sqrt(distance2);
+                    Real sin2_sphere = radius2 / distance2;
+                    Real cos_sphere = std::sqrt(1 - sin2_sphere);
+                    if (cos_normal < cos_sphere) { // the normal isn't within the sphere: the cosine is at most cos(angle to the centre - sphere's angular radius)
+                        Real sin_normal = std::sqrt(std::max(Real(0), 1 - cos_normal * cos_normal));
+                        cos_bound = cos_normal * cos_sphere + sin_normal * std::sqrt(sin2_sphere);
+                        if (cos_bound <= 0) { return 0; }
+                    }
+                }
+                Vec3 nearest(std::clamp(from.x, Real(node.box.min.x), Real(node.box.max.x)), std::clamp(from.y, Real(node.box.min.y), Real(node.box.max.y)),
+                             std::clamp(from.z, Real(node.box.min.z), Real(node.box.max.z)));
+                return node.power * cos_bound / std::max((nearest - from).abs2(), min_distance2);
+            }
+
+            bool pick(const Vec3& from, const Vec3& normal_unit, std::uint32_t& picked, Real& probability) const {
+                if (lights.empty()) { return false; }
+                Real u = random_double();
+                switch (picking) {
+                    case LightPicking::uniform:
+                        picked = std::min(static_cast<std::uint32_t>(u * lights.size()), static_cast<std::uint32_t>(lights.size() - 1));
+                        probability = Real(1) / lights.size();
+                        return true;
+                    case LightPicking::power:
+                        picked = static_cast<std::uint32_t>(std::min<std::size_t>(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), lights.size() - 1));
+                        probability = this->probability(picked, from, normal_unit);
+                        return true;
+                    default:
+                        break;
+                }
+
+                // down the tree, reusing u: once it has chosen a child it is rescaled to be uniform again
+                probability = 1;
+                std::uint32_t node = 0;
+                while (!(nodes[node].second_or_light & leaf_flag)) {
+                    Real first = importance(nodes[node + 1], from, normal_unit);
+                    Real second = importance(nodes[nodes[node].second_or_light], from, normal_unit);
+                    if (!(first + second > 0)) { return false; }
+                    Real p_first = first / (first + second);
+                    if (u < p_first) {
+                        u = std::min(u / p_first, Real(1) - std::numeric_limits<Real>::epsilon());
+                        probability *= p_first;
+                        node = node + 1;
+                    } else {
+                        u = std::min((u - p_first) / (1 - p_first), Real(1) - std::numeric_limits<Real>::epsilon());
+                        probability *= 1 - p_first;
+                        node = nodes[node].second_or_light;
+                    }
+                }
+                picked = nodes[node].second_or_light & ~leaf_flag;
+                return true;
+            }
+
+            // chance of pick() choosing the light, found by retracing its path down the tree
+            Real probability(std::uint32_t light, const Vec3& from, const Vec3& normal_unit) const {
+                switch (picking) {
+                    case LightPicking::uniform: return Real(1) / lights.size();
+                    case LightPicking::power: return cdf[light] - (light > 0 ? cdf[light - 1] : 0);
+                    default: break;
+                }
+                Real probability = 1;
+                std::uint32_t node = 0;
+                for (int depth = 0; !(nodes[node].second_or_light & leaf_flag); depth++) {
+                    Real first = importance(nodes[node + 1], from, normal_unit);
+                    Real second = importance(nodes[nodes[node].second_or_light], from, normal_unit);
+                    if (!(first + second > 0)) { return 0; }
+                    if (paths[light] >> depth & 1) {
+                        probability *= second / (first + second);
+                        node = nodes[node].second_or_light;
+                    } else {
+                        probability *= first / (first + second);
+                        node = node + 1;
+                    }
+                }
+                return probability;
+            }
+    };
+
+    /// @brief next-event estimation at a matte (Lambertian) surface: the light reaching point straight from one sample
+    /// of the lights and one of the environment map (if there is one), times the BRDF. Each is weighted against the
+    /// chance of the surface's own scatter finding the same light: scatter_pdf(direction) gives its density over solid
+    /// angle, which is cosine weighted unless the scatter is guided.
+    /// Samples are taken from where the scattered ray would start, so LightSet::pdf() from that ray matches exactly.
+    template <typename Set, typename ScatterPdf>
+    Colour direct_matte(const Set& scene, const LightSet& lights, const Vec3& point, const Vec3& normal_unit, const Colour& reflectance,
+                        ScatterPdf scatter_pdf) {
+        Colour direct(0, 0, 0);
+        Vec3 origin = offset_ray_origin(point, normal_unit);
+        LightSample sample;
+        if (lights.sample(scene, origin, normal_unit, sample)) {
+            Vec3 to_light = sample.point - origin;
+            Real cos_surface = dot(to_light, normal_unit) / to_light.abs();
+            // the shadow ray's direction isn't normalised, so the light is at t = 1. It stops just short so it can't hit the light itself.
+            if (cos_surface > 0 && !scene.occluded(Line3(origin, to_light), Real(1 - 1e-3))) {
+                direct += (power_heuristic(sample.pdf, scatter_pdf(to_light)) * cos_surface / (pi * sample.pdf)) * (reflectance * sample.emission);
+            }
+        }
+
+        Vec3 direction;
+        Real pdf;
+        Real u1 = lights.environment ? random_double() : 0;
+        Real u2 = lights.environment ? random_double() : 0;
+        if (lights.environment && lights.environment->sample(u1, u2, direction, pdf)) {
+            Real cos_surface = dot(direction, normal_unit);
+            if (cos_surface > 0 && !scene.occluded(Line3(origin, direction))) {
+                direct += (power_heuristic(pdf, scatter_pdf(direction)) * cos_surface / (pi * pdf)) * (reflectance * lights.environment->radiance(direction));
+            }
+        }
+        return direct;
+    }
+
+    template <typename Set>
+    Colour direct_matte(const Set& scene, const LightSet& lights, const Vec3& point, const Vec3& normal_unit, const Colour& reflectance) {
+        return direct_matte(scene, lights, point, normal_unit, reflectance,
+                            [&](const Vec3& direction) { return std::max(dot(direction.unit(), normal_unit), Real(0)) / pi; });
+    }
+
+}
+
+#endif // LIGHTS
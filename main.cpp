@@ -11,304 +11,83 @@
 
 #include <sstream>
 #include <string>
+#include <fstream>
+#include <chrono>
 
 #include "gmath.h"
 #include "gpng.h"
+#include "geometry.h"
+#include "scene.h"
+#include "mesh_io.h"
+#include "materials.h"
+#include "lights.h"
+#include "caustics.h"
+#include "radiance_cache.h"
+#include "guiding.h"
+#include "splitting.h"
+#include "denoise.h"
+#include "environment.h"
+#include "image_io.h"
+#include "camera.h"
+#include "tonemap.h"
+#include "integrator.h"
+#include "streamed_mesh.h"
+#include "parallel.h"
 
 using namespace gmath;
-double min_dist_threshold{0.001}; // minimum distance a point of intersection must be from start of a line to be counted
+using namespace rt;
 int inside_count{0};
 
-class Line3 {
-    public:
-        // line defined by a point it intesects and a direction
-        Vec3 p; // point
-        Vec3 d; // direction
-
-        Line3() : p(Vec3(0,0,0)), d(Vec3(0,0,0)) {}
-        Line3(Vec3 point, Vec3 direction) : p(point), d(direction) {}
-
-        Vec3 operator()(const double t) const {  // get position vector at a point t along line
-            return p + t*d;
-        }
-};
-
-class Camera {
-    // explanation:
-    // the viewport, also the plane of perfect focus, go where the camera is looking
-    // thus lookat is also the viewport centre
-    // focal_length is the distance from the origin to the viewport centre
-    // rays start from the origin
-    // when using defocus blur, rays start randomly from a disc centred on the origin and parallel to the viewport plane
-    
-    public:
-        Vec3 up{0,0,1}; // sets the rotation of the field of view box, keeping it viewing "horizontally"
-        Vec3 lookat;
-        Vec3 look_direction;
-        double viewport_height;
-        double aspect_ratio;
-        double fov_deg; // field of view angle
-        double defocus_blur_angle_deg;
-
-        double focal_length;
-        double defocus_blur_radius;
-        double viewport_width;
-        Vec3 origin;
-        // orthogonal unit vectors to traverse viewport
-        Vec3 d_right;
-        Vec3 d_up;
-
-        // default setting
-        Camera(double aspect_ratio) :
-            lookat(Vec3(0,0,0)),
-            look_direction(Vec3(0,1,0)),
-            viewport_height(2.0),
-            aspect_ratio(aspect_ratio),
-            fov_deg(90),
-            defocus_blur_angle_deg(0)
-        { setup(); }
-
-        // any setting
-        Camera(double aspect_ratio, Vec3 lookat, Vec3 look_direction, double viewport_height, double fov_deg, double defocus_blur_angle_deg) :
-            lookat(lookat),
-            look_direction(look_direction.unit()),
-            viewport_height(viewport_height),
-            aspect_ratio(aspect_ratio),
-            fov_deg(fov_deg),
-            defocus_blur_angle_deg(defocus_blur_angle_deg)
-        { setup(); }
-
-        void setup() {
-            focal_length = viewport_height / (2 * tan(fov_deg * pi/180 * 0.5)); // viewport_height / (2 * tan(theta/2))
-            defocus_blur_radius = focal_length * tan(defocus_blur_angle_deg * pi/180 * 0.5); // focal_length * tan(theta/2)
-            viewport_width = viewport_height * aspect_ratio;
-            origin = lookat - look_direction * focal_length;
-            d_right = cross(look_direction, up).unit();
-            d_up = -cross(look_direction, d_right).unit();
-        }
-
-        Line3 generate_ray(double x_pos, double y_pos) {
-            Line3 ray;
-
-            // ray origin
-            Vec3 ray_origin = origin;
-            if (defocus_blur_radius > 0) { ray_origin += defocus_blur_radius * sqrt(random_double()) * (d_up * normal_double() + d_right * normal_double()).unit(); } // defocus blur ray (start the ray from a random point on defocus blur disc)
-
-            // ray point on viewport
-            Vec3 ray_viewport = origin + look_direction * focal_length; // to viewport centre
-            ray_viewport += d_right * viewport_width * x_pos; // add viewport x position
-            ray_viewport += d_up * viewport_height * y_pos; // add viewport y position
-
-            ray.p = ray_origin;
-            ray.d = ray_viewport - ray_origin;
-            ray.d = ray.d.unit();
-
-            return ray;
-        }
-};
-
-enum class Material {
-    matte,
-    metal,
-    glass
-};
-
-class Hittable {
-    public:
-        Material material{Material::matte};
-        Colour reflectance{0.5, 0.5, 0.5};
-        double fuzz{0}; // for metals, should be between 0 and 1
-        double refractive_index{1.5}; // for glass, should be >= 1 (1 for air, 1.5 for glass)
-
-        Hittable() {}
-        Hittable(Material material) : material(material) { setup(); }
-        Hittable(Material material, Colour reflectance, double fuzz) : material(material), reflectance(reflectance), fuzz(fuzz) { setup(); }
-        
-        void setup() {
-            if (material == Material::glass) { reflectance = Colour(1.0, 1.0, 1.0); }
-        }
-
-        // returns value of t along input ray that causes intersection with the Hittable
-        virtual double intersects(const Line3& ray) const = 0;
-        // returns vector normal to surface at specified point
-        // virtual UnitVec3 get_normal(const Line3& ray, const double t, bool& intersects_outside) const = 0;
-        //
-        virtual Line3 get_next_ray(const Line3& ray, const double t) const = 0;
-};
-
-// Array of all hittable objects
-std::vector<Hittable*> hittables;
-
-class Sphere3 : public Hittable {
-    // sphere defined by position of its centre and its radius
-    public:
-        Vec3 p; // centre
-        double r; // radius
-        bool is_hollow; // whether the norm_vector should be inverted
-
-        Sphere3() : p(Vec3(0,0,0)), r(0) {}
-        Sphere3(Vec3 centre, double radius) : p(Vec3(centre)), r(radius) {}
-
-        // these allow for setting the materials and, if desired, its reflectance
-        Sphere3(Vec3 centre, double radius, Material material) : Hittable(material), p(Vec3(centre)), r(radius) {}
-        Sphere3(Vec3 centre, double radius, Material material, Colour reflectance, double fuzz, bool is_hollow=false) : Hittable(material, reflectance, fuzz), p(Vec3(centre)), r(radius), is_hollow(is_hollow) {}
-
-        // quadratic equation for intersection has at least one solution (i.e. ray hits sphere) if discriminant >= 0
-        double intersects(const Line3& ray) const override {
-            // simplified form of quadratic
-            Vec3 oc = ray.p - p;
-            double a = ray.d.abs2();
-            double half_b = dot(oc, ray.d);
-            double c = oc.abs2() - r*r;
-            
-            double discriminant = half_b * half_b - a*c;
-            
-            if (discriminant < 0) {
-                return -1.0;
-            } else {
-                double smaller = (-half_b - sqrt(discriminant)) / a;
-                if (smaller > min_dist_threshold) { // return the closest value as long as it is in the +ve direction. otherwise, return further value.
-                    return smaller;
-                } else {
-                    return (-half_b + sqrt(discriminant)) / a;
-                }
-            }
-        }
-
-        Line3 get_next_ray(const Line3& ray, const double t) const override {
-            // Find normal unit ray reflection vector
-            Vec3 normal_unit = (ray(t) - p).unit(); // normal unit vector to sphere pointing out of sphere surface
-            Line3 ret_ray;
-
-            switch (material) {
-                case Material::matte: {
-                    // New ray for next iteration, selected randomly from a unit sphere tangential to the intersected surface
-                    // As in https://math.stackexchange.com/questions/87230/picking-random-points-in-the-volume-of-sphere-with-uniform-probability
-                    Vec3 X = Vec3(normal_double(), normal_double(), normal_double()).unit(); // random point on surface of sphere
-                    // Line3 next_ray{ray(t), normal_unit + (X * std::pow(random_double(), 1.0/3.0) / X.abs())}; // random point *in* sphere
-                    ret_ray = Line3(ray(t), (normal_unit + X));
-                    break;
-                }
-                case Material::metal: {
-                    Vec3 X = Vec3(normal_double(), normal_double(), normal_double()).unit();
-                    ret_ray = Line3(ray(t), ray.d - 2*normal_unit*dot(ray.d, normal_unit) + fuzz * X);
-                    break;
-                }
-                case Material::glass: {
-                    // possibilities: 
-                    // entering always -ve to normal
-                    // -> Normal sphere: normal_unit correct; refraction ratio 1/1.5
-                    // -> Hollow section: normal_unit correct; refraction ratio 1.5
-                    // leaving always +ve to normal
-                    // -> Normal sphere: normal_unit inverted; refraction ratio 1.5
-                    // -> Hollow section: normal_unit inverted; refraction ratio 1/1.5
-                    
-                    double refraction_ratio;
-                    if (dot(normal_unit, ray.d) > 0) { // if ray going from inside to outside...
-                        normal_unit = -normal_unit;
-                        refraction_ratio = is_hollow ? 1.0/refractive_index : refractive_index;
-                    } else { // if ray going from outside to inside...
-                        refraction_ratio = is_hollow ? refractive_index : 1.0/refractive_index;
-                    }
-
-                    double cos_theta = -dot(normal_unit, ray.d.unit());
-                    if (cos_theta < 0) {
-                        std::cout << "COS NEGATIVE: " << cos_theta << "\n"; 
-                    }
-
-                    if (refraction_ratio * sqrt(1.0 - cos_theta*cos_theta) > 1.0 || schlick_reflectance(cos_theta, refraction_ratio) > random_double()) { // if total internal reflection or schlick reflection...
-                        ret_ray = Line3(ray(t), ray.d - 2*normal_unit*dot(ray.d, normal_unit)); // reflect
-                    } else {
-                        Vec3 refracted_ray_perpendicular = refraction_ratio * (ray.d.unit() + normal_unit * cos_theta);
-                        Vec3 refracted_ray_parallel = normal_unit * -sqrt(fabs(1.0 - refracted_ray_perpendicular.abs2()));
-                        ret_ray = Line3(ray(t), refracted_ray_perpendicular + refracted_ray_parallel);
-                    }
-                    break;
-                }
-                default:
-                    std::cerr << "Error in Sphere3.get_next_ray(): No material match found";
-                    return Line3(Vec3(0,0,0), Vec3(0,0,0));
-            }
-            ret_ray.d = ret_ray.d.unit();
-            return ret_ray;
-        }
-    
-    private:
-        static double schlick_reflectance(double cos_theta, double reflection_ratio) {
-            double r0 = (1 - reflection_ratio) / (1 + reflection_ratio);
-            r0 = r0*r0;
-            return r0 + (1-r0)*pow((1 - cos_theta), 5);
-        }
-};
-
-/// @brief allows for setting pixel colours using instances of Colour (Vec3) class
-class ImageVec : public gpng::Image {
-    public:
-        ImageVec(double width, double height) : gpng::Image(width, height) {}
-
-        void set_pixel(int column, int row, const Colour& u) {
-            int start_idx = row * width * 3 + column * 3;
-            image[start_idx] = u.x;
-            image[start_idx + 1] = u.y;
-            image[start_idx + 2] = u.z;
-        }
-};
-
-/// @brief 
-/// @param n 
-/// @return number of collisions before hit background (light source)
-Colour ray_recur(int n, Line3& ray, bool do_trace) {
-    if (do_trace) {
-        std::cout << "Level: " << n << ", Position: " << ray.p << ", Vector: " << ray.d << "\n";
-    }
-
-    // Find closest intersection
-    double t {std::numeric_limits<double>::infinity()}; // change this to Tmax if you want 0 < t < Tmax instead of 0 < t < infinity
-    int smallest_idx {-1};
-    for (std::vector<Hittable*>::size_type i = 0; i < hittables.size(); i++) {
-        double intersect_t = hittables[i]->intersects(ray);
-        if (intersect_t < t && intersect_t > min_dist_threshold) {
-            t = intersect_t;
-            smallest_idx = i;
-        }
-    }
-    if (do_trace) { std::cout << "smallest_idx: " << smallest_idx << "\n"; }
-
-    if (smallest_idx != -1) { // if at least one object intersects with the ray...
-        if (n == 1) { return Colour(0,0,0); } // return black if recursion count limit recur_max reached
-        Hittable* closest_item_ptr = hittables[smallest_idx];
-        Line3 next_ray = closest_item_ptr->get_next_ray(ray, t);
-        return closest_item_ptr->reflectance * ray_recur(n-1, next_ray, do_trace);
-
-    } else { // if hit 'sky' (i.e. if nothing else was hit)...
-        // rtow colour scheme
-        double t = 0.5*(ray.d.unit().z + 1.0);
-        Colour faded_blue{0.5, 0.7, 1.0};
-        Colour sky_blue = Colour(25, 114, 255)/255.0;
-        return (1.0-t)*Colour(1.0, 1.0, 1.0) + t*sky_blue;
-
-        // quadrants colour scheme, for debugging
-        // if (ray.d.unit().x >=0) {
-        //     if (ray.d.unit().z >= 0) {
-        //         return Colour(0.0, 0.0, 0.0); // top-right black
-        //     } else {
-        //         return Colour(1.0, 0.0, 0.0); // bottom-right red
-        //     }
-        // } else {
-        //     if (ray.d.unit().z >= 0) {
-        //         return Colour(0.0, 0.0, 1.0); // top-left blue
-        //     } else {
-        //         return Colour(0.0, 1.0, 0.0); // bottom-left green
-        //     }
-        // }
-    }
+// All objects in the scene, stored by primitive type
+Scene scene;
+// Materials referred to by the objects in the scene
+MaterialTable materials;
+// Emissive primitives, sampled directly at each matte bounce
+LightSet lights;
+// Light from an HDR image all around the scene, in place of the sky gradient when one is loaded
+EnvironmentMap environment;
+// Sky light focused onto matte surfaces by the glass and mirrors, gathered at matte hits instead of found by paths
+CausticMap caustics;
+// Light arriving at matte surfaces, averaged as the render goes, which paths end in after a few bounces
+RadianceCache radiance_cache;
+// Where light arrives from across the scene, learned in training passes, for matte surfaces to scatter towards
+PathGuide guide;
+// Longest path, in rays
+const int recur_max = 50;
+// Rays traced by the render, not counting shadow rays
+std::uint64_t rays_traced{0};
+// A mesh too big to load, paged in by clusters as camera rays reach it
+StreamedMesh streamed;
+
+/// @brief light from the sky in direction, when no environment map is loaded
+Colour sky_gradient(const Vec3& direction) {
+    // rtow colour scheme
+    double t = 0.5*(direction.unit().z + 1.0);
+    Colour faded_blue{0.5, 0.7, 1.0};
+    Colour sky_blue = Colour(25, 114, 255)/255.0;
+    return (1.0-t)*Colour(1.0, 1.0, 1.0) + t*sky_blue;
+
+    // quadrants colour scheme, for debugging
+    // if (direction.unit().x >=0) {
+    //     if (direction.unit().z >= 0) {
+    //         return Colour(0.0, 0.0, 0.0); // top-right black
+    //     } else {
+    //         return Colour(1.0, 0.0, 0.0); // bottom-right red
+    //     }
+    // } else {
+    //     if (direction.unit().z >= 0) {
+    //         return Colour(0.0, 0.0, 1.0); // top-left blue
+    //     } else {
+    //         return Colour(0.0, 1.0, 0.0); // bottom-left green
+    //     }
+    // }
 }
 
 int main() {
     int width{1920};
     int height{1080};
 
-    ImageVec img(width, height);
+    Framebuffer img(width, height); // linear colour, tonemapped for output once rendering finishes
     double aspect_ratio = static_cast<double>(width) / static_cast<double>(height);
 
     // default camera
@@ -320,50 +99,193 @@ int main() {
     Camera cam(aspect_ratio, lookat, lookat-lookfrom, 2.5, 40, 0.5);
 
     // 2 spheres scene
-    // Sphere3 sphere1(Vec3(0,3,0), 2, Material::glass, Colour(0.7, 0.3, 0.3), 0);
-    // Sphere3 sphere2(Vec3(0,3,-102), 100, Material::matte, Colour(0.7, 0.3, 0.3), 0);
+    // Sphere3 sphere1(Vec3(0,3,0), 2, materials.add(Material::glass, Colour(0.7, 0.3, 0.3), 0));
+    // Sphere3 sphere2(Vec3(0,3,-102), 100, materials.add(Material::matte, Colour(0.7, 0.3, 0.3), 0));
 
     // 3 spheres scene
-    // Sphere3 sphere1(Vec3(0,0,0), 0.5, Material::matte, Colour(0.7, 0.3, 0.3), 0);
-    // Sphere3 sphere2(Vec3(-1,0,0), 0.5, Material::metal, Colour(0.8, 0.8, 0.8), 0.0);
-    // Sphere3 sphere3(Vec3(1,0,0), 0.5, Material::metal, Colour(0.8, 0.6, 0.2), 0.0);
-    // Sphere3 sphere4(Vec3(0,0,-100.5), 100, Material::matte, Colour(0.8, 0.8, 0.0), 0);
+    // Sphere3 sphere1(Vec3(0,0,0), 0.5, materials.add(Material::matte, Colour(0.7, 0.3, 0.3), 0));
+    // Sphere3 sphere2(Vec3(-1,0,0), 0.5, materials.add(Material::metal, Colour(0.8, 0.8, 0.8), 0.0));
+    // Sphere3 sphere3(Vec3(1,0,0), 0.5, materials.add(Material::metal, Colour(0.8, 0.6, 0.2), 0.0));
+    // Sphere3 sphere4(Vec3(0,0,-100.5), 100, materials.add(Material::matte, Colour(0.8, 0.8, 0.0), 0));
 
     // refraction test scene
-    // Sphere3 sphere1(Vec3(0,0,0), 0.5, Material::glass, Colour(0.8,0.8,0.8), 0);
-    // Sphere3 sphere2(Vec3(0,0,0), 0.4, Material::glass, Colour(0.8,0.8,0.8), 0, true);
+    // Sphere3 sphere1(Vec3(0,0,0), 0.5, materials.add(Material::glass, Colour(0.8,0.8,0.8), 0));
+    // Sphere3 sphere2(Vec3(0,0,0), 0.4, materials.add(Material::glass, Colour(0.8,0.8,0.8), 0), true);
+
+    // glass bowl of water: the water has the higher priority, so it fills the inside of the glass sphere
+    // Sphere3 sphere1(Vec3(0,0,0), 0.5, materials.add(Material::glass, Colour(1,1,1), 0, 1.5, 1));
+    // Sphere3 sphere2(Vec3(0,0,0), 0.4, materials.add(Material::glass, Colour(1,1,1), 0, 1.33, 2));
 
     // Github photo scene
-    // ground and two large spheres
-    Sphere3 sphere1(Vec3(0,0,-100.5), 100, Material::matte, Colour(0.5,0.5,0.5), 0);
-    Sphere3 sphere2(Vec3(0,0,0), 0.5, Material::matte, Colour(0.1,0.2,0.5), 0);
-    Sphere3 sphere3(Vec3(1,0,0), 0.5, Material::metal, Colour(163, 28, 28)/255.0, 0);
+    MaterialId glass = materials.add(Material::glass); // shared by all the glass spheres
+    // ground and two large spheres. The ground used to be Sphere3(Vec3(0,0,-100.5), 100, ...)
+    Plane3 ground(Vec3(0,0,-0.5), Vec3(0,0,1), materials.add(Material::matte, Colour(0.5,0.5,0.5)));
+    Sphere3 sphere2(Vec3(0,0,0), 0.5, materials.add(Material::matte, Colour(0.1,0.2,0.5)));
+    Sphere3 sphere3(Vec3(1,0,0), 0.5, materials.add(Material::metal, Colour(163, 28, 28)/255.0, 0));
     // large hollow glass sphere
-    Sphere3 sphere4(Vec3(-1,0,0), 0.5, Material::glass, Colour(0.8,0.8,0.8), 0);
-    Sphere3 sphere5(Vec3(-1,0,0), 0.4, Material::glass, Colour(0.8,0.8,0.8), 0, true);
+    Sphere3 sphere4(Vec3(-1,0,0), 0.5, glass);
+    Sphere3 sphere5(Vec3(-1,0,0), 0.4, glass, true);
     // smaller foreground spheres
-    Sphere3 sphere6(Vec3(-0.1,-0.8,-0.3), 0.2, Material::glass, Colour(0.8,0.8,0.8), 0);
-    Sphere3 sphere7(Vec3(1.2,-0.85,-0.4), 0.1, Material::metal, Colour(0.8, 0.8, 0.8), 0.0);
-    Sphere3 sphere8(Vec3(0.1,-1.0,-0.38), 0.12, Material::matte, Colour(173, 21, 133)/255.0, 0);
-    Sphere3 sphere9(Vec3(0.6,-0.75,-0.25), 0.25, Material::metal, Colour(19, 173, 119)/255.0, 0);
-
-    hittables.push_back(&sphere1);
-    hittables.push_back(&sphere2);
-    hittables.push_back(&sphere3);
-    hittables.push_back(&sphere4);
-    hittables.push_back(&sphere5);
-    hittables.push_back(&sphere6);
-    hittables.push_back(&sphere7);
-    hittables.push_back(&sphere8);
-    hittables.push_back(&sphere9);
-
-    // render!
+    Sphere3 sphere6(Vec3(-0.1,-0.8,-0.3), 0.2, glass);
+    Sphere3 sphere7(Vec3(1.2,-0.85,-0.4), 0.1, materials.add(Material::metal, Colour(0.8, 0.8, 0.8), 0.0));
+    Sphere3 sphere8(Vec3(0.1,-1.0,-0.38), 0.12, materials.add(Material::matte, Colour(173, 21, 133)/255.0));
+    Sphere3 sphere9(Vec3(0.6,-0.75,-0.25), 0.25, materials.add(Material::metal, Colour(19, 173, 119)/255.0, 0));
+
+    scene.add(ground);
+    scene.add(sphere2);
+    scene.add(sphere3);
+    scene.add(sphere4);
+    scene.add(sphere5);
+    scene.add(sphere6);
+    scene.add(sphere7);
+    scene.add(sphere8);
+    scene.add(sphere9);
+
+    // meshes are loaded from .obj or binary .ply files, and must outlive the scene
+    // TriangleMesh bunny;
+    // if (load_mesh("models/bunny.ply", bunny)) {
+    //     bunny.material_id = materials.add(Material::matte, Colour(0.8, 0.8, 0.8));
+    //     add_mesh(scene, bunny);
+    // }
+
+    // geometry used many times goes in an Object, which is placed by Instances and must also outlive the scene
+    // Object tree;
+    // add_mesh(tree, bunny);
+    // tree.build_bvh();
+    // scene.add(Instance(tree, Transform3::translate(Vec3(2,0,0)) * Transform3::rotate(Vec3(0,0,1), pi/4) * Transform3::scale(0.5)));
+
+    // a path here saves the tree to it, so later runs of an unchanged scene load it instead of building it. Off by
+    // default: the directory has to exist, and checking the file against the scene still bounds every primitive, so
+    // it only pays for scenes with large meshes
+    std::string bvh_cache_path; // e.g. "build/scene.bvhcache"
+    if (bvh_cache_path.empty()) { scene.build_bvh(); } else { scene.build_bvh(bvh_cache_path); }
+    lights.build(scene, materials);
+
+    // paths through the scene, with light sampled at each matte bounce and each of the ways of cutting noise below
+    // switched on as it's set up
+    PathTracer tracer(scene, materials, lights);
+    tracer.max_depth = recur_max;
+    tracer.sky = sky_gradient;
+    tracer.cache = &radiance_cache;
+    tracer.guide = &guide;
+
+    // an equirectangular HDR image (row 0 straight up) in the working directory lights the scene instead of the sky gradient
+    for (const char* filename : {"sky.hdr", "sky.pfm"}) {
+        if (!std::ifstream(filename)) { continue; }
+        auto start = std::chrono::steady_clock::now();
+        Framebuffer sky(0, 0);
+        if (!load_hdr_image(filename, sky)) { break; }
+        auto loaded = std::chrono::steady_clock::now();
+        environment.build(std::move(sky));
+        auto built = std::chrono::steady_clock::now();
+        std::cout << "environment map " << filename << ": " << environment.image.width << "x" << environment.image.height << ", loaded in "
+                  << std::chrono::duration<double, std::milli>(loaded - start).count() << " ms, sampling tables built in "
+                  << std::chrono::duration<double, std::milli>(built - loaded).count() << " ms on " << n_threads() << " threads\n";
+        if (!environment.empty()) { lights.environment = &environment; }
+        break;
+    }
+
+    // a mesh written by write_clustered_mesh() to scene.clusters in the working directory is streamed through a cache
+    // rather than loaded. Each row's camera rays are traced through it in one batch, and where it's nearer than the
+    // scene their paths carry on from it. Only camera rays see it: it casts no shadows and isn't reflected.
+    bool streaming = std::ifstream("scene.clusters") && streamed.open("scene.clusters", 64 << 20);
+    if (streaming) {
+        streamed.material_id = materials.add(Material::matte, Colour(0.8, 0.8, 0.8));
+        std::cout << "streamed mesh scene.clusters: " << streamed.n_clusters() << " clusters\n";
+    }
+
+    // photons from the sky through the glass spheres, for the caustics under them
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::size_t kept = caustics.emit(scene, materials, sky_gradient, &environment, 2000000);
+        if (kept > 0) { tracer.caustics = &caustics; }
+        auto emitted = std::chrono::steady_clock::now();
+        std::cout << "caustic photons: " << kept << " kept, traced in " << std::chrono::duration<double, std::milli>(emitted - start).count()
+                  << " ms on " << n_threads() << " threads\n";
+    }
+
+    // With the denoiser, 32 paths per pixel look about as clean as a few hundred without.
+    int n_antialias = 32;
+    bool denoise_image = true;
+    int split = 1; // paths per camera ray; 0 picks it by a pilot run, below
+
+    // path guiding: passes of 1, 2, 4, ... samples per pixel teach the guide where light arrives from, for as long as
+    // they add up to no more than a quarter of the render's paths per pixel. Rows run in parallel, as the guide
+    // records lock-free. The passes' images are thrown away, and the render proper samples from what the last one learned.
+    {
+        auto start = std::chrono::steady_clock::now();
+        guide.reset(scene.bounds());
+        const int training_budget = n_antialias / 4;
+        int trained_spp = 0;
+        for (int spp = 1; trained_spp + spp <= training_budget; spp *= 2) {
+            parallel_for(0, img.height, [&](std::size_t y_pixel) {
+                seed_random(spp, y_pixel); // each pass's spp is its seed
+                for (int x_pixel = 0; x_pixel < img.width; x_pixel++) {
+                    for (int i = 0; i < spp; i++) {
+                        Line3 ray = cam.generate_ray((x_pixel + random_double())/img.width - 0.5, (y_pixel + random_double())/img.height - 0.5);
+                        tracer.trace(ray);
+                    }
+                }
+            });
+            guide.refine();
+            trained_spp += spp;
+        }
+        guide.recording = false;
+        auto trained = std::chrono::steady_clock::now();
+        std::cout << "path guide: " << guide.regions() << " regions, " << guide.memory() / 1e6 << " MB, trained on " << trained_spp
+                  << " samples per pixel in " << std::chrono::duration<double, std::milli>(trained - start).count() << " ms on "
+                  << n_threads() << " threads\n";
+    }
+
+    // splitting: each camera ray's first matte hit is scattered from split times, so the camera ray, the lens and pixel
+    // position, and any specular bounces before the hit are paid for once per split paths. The paths per pixel stay
+    // n_antialias, shared between n_antialias / split camera rays. 1 traces plain paths. 0 picks split from a pilot
+    // run over a sparse grid of pixels, by what the camera rays and the continuations cost and how much each
+    // contributes to the noise; for the default scene it settles on 1 or 2, so it's left off.
+    if (split == 0) {
+        auto start = std::chrono::steady_clock::now();
+        // about 8000 pixels, enough for the timings to settle
+        const int step = std::max(1, static_cast<int>(std::sqrt(img.width * img.height / 8000.0)));
+        int columns = (img.width + step - 1) / step;
+        int rows = (img.height + step - 1) / step;
+        SplitPilot pilot = pilot_split(static_cast<std::size_t>(columns) * rows, 4, [&](std::size_t pixel, int pilot_split) {
+            int x_pixel = static_cast<int>(pixel % columns) * step;
+            int y_pixel = static_cast<int>(pixel / columns) * step;
+            Line3 ray = cam.generate_ray((x_pixel + random_double())/img.width - 0.5, (y_pixel + random_double())/img.height - 0.5);
+            return tracer.trace(ray, pilot_split);
+        });
+        split = std::min(split_factor(pilot), n_antialias);
+        auto piloted = std::chrono::steady_clock::now();
+        std::cout << "splitting: " << split << " paths per camera ray (pilot: " << 1e6 * pilot.seconds[0] << " us per sample with 1, "
+                  << 1e6 * pilot.seconds[1] << " us with 2; variance " << pilot.variance[0] << " and " << pilot.variance[1] << "), in "
+                  << std::chrono::duration<double, std::milli>(piloted - start).count() << " ms\n";
+    }
+    int n_camera_rays = (n_antialias + split - 1) / split;
+
+    // render! Alongside the colour, what each pixel's camera rays first hit and how noisy it is, for the denoiser
+    FeatureBuffers features(width, height);
+    auto render_start = std::chrono::steady_clock::now();
+    rays_traced = 0;
+    radiance_cache.clear_counts(); // the cells the training and pilot filled are kept, but not their lookups
+    std::vector<Line3> camera_rays(static_cast<std::size_t>(img.width) * n_camera_rays); // a row's, n_camera_rays per pixel
+    std::vector<StreamedHit> streamed_hits;
     for (double y_pixel = 0; y_pixel < img.height; y_pixel++) {
         // progress indicator
         if (abs(fmod(y_pixel, 10)) < 1e-10) {
             std::cout << 100 * y_pixel / height << "%\n";
         }
 
+        // n_camera_rays rays per pixel for antialiasing, made for the whole row first so the streamed mesh gets them
+        // as one batch
+        for (int x_pixel = 0; x_pixel < img.width; x_pixel++) {
+            for (int i = 0; i < n_camera_rays; i++) {
+                double x_pos = (x_pixel + random_double())/img.width - 0.5; // -0.5 to 0.5 position along viewport width
+                double y_pos = (y_pixel + random_double())/img.height - 0.5; // -0.5 to 0.5 position along viewport height
+                camera_rays[static_cast<std::size_t>(x_pixel) * n_camera_rays + i] = cam.generate_ray(x_pos, y_pos);
+            }
+        }
+        if (streaming) { streamed.trace(camera_rays, streamed_hits); }
+
         for (double x_pixel = 0; x_pixel < img.width; x_pixel++) {
             // select a ray and print out its coordinates, for debugging
             double x_trace = -1;
@@ -375,36 +297,71 @@ int main() {
             }
 
             Colour running_colour{0,0,0};
-
-            // n_antialias rays for antialiasing
-            int n_antialias = 200;
-            for (int i = 0; i < n_antialias; i++) {
-                // Make ray
-                double x_pos = (x_pixel + random_double())/img.width - 0.5; // -0.5 to 0.5 position along viewport width
-                double y_pos = (y_pixel + random_double())/img.height - 0.5; // -0.5 to 0.5 position along viewport height
-                Line3 ray = cam.generate_ray(x_pos, y_pos);
-
-                // first argument is maximum recur depth
-                running_colour += ray_recur(50, ray, do_trace); // start with refractive_index=1 (air)
+            Colour albedo_sum{0,0,0};
+            Vec3 normal_sum{0,0,0};
+            Real depth_sum = 0;
+            Real luminance_sum2 = 0;
+
+            for (int i = 0; i < n_camera_rays; i++) {
+                std::size_t r = static_cast<std::size_t>(x_pixel) * n_camera_rays + i;
+                const Line3& ray = camera_rays[r];
+
+                FirstHit first_hit;
+                Colour sample; // start in air
+                if (streaming && streamed_hits[r].hit()) {
+                    ExternalHit external{streamed_hits[r].t, streamed_hits[r].normal, streamed.material_id};
+                    sample = tracer.trace(ray, external, split, &first_hit, &rays_traced, do_trace);
+                } else {
+                    sample = tracer.trace(ray, split, &first_hit, &rays_traced, do_trace);
+                }
+                running_colour += sample;
+                albedo_sum += first_hit.albedo;
+                normal_sum += first_hit.normal;
+                depth_sum += first_hit.depth;
+                luminance_sum2 += luminance(sample) * luminance(sample);
             }
             // average
-            running_colour /= n_antialias + 1;
+            running_colour /= n_camera_rays;
+            Real mean_luminance = luminance(running_colour);
+            Real variance = n_camera_rays > 1 ? (luminance_sum2 / n_camera_rays - mean_luminance * mean_luminance) / (n_camera_rays - 1) : 0;
+            features.set_pixel(x_pixel, img.height - y_pixel - 1, albedo_sum / n_camera_rays, normal_sum / n_camera_rays,
+                               static_cast<float>(depth_sum / n_camera_rays), static_cast<float>(std::max(variance, Real(0))));
 
-            // gamma correction, gamma 2 (colour to the power of 1/2)
-            running_colour = pow(running_colour, 0.5);
             // output colour (if tracing this pixel, give it a colour in the image to verify what we are tracing)
             if (do_trace) {
-                img.set_pixel(x_pixel, img.height - y_pixel - 1, Colour(0,255,0));
+                img.set_pixel(x_pixel, img.height - y_pixel - 1, Colour(0,1,0));
             } else {
-                img.set_pixel(x_pixel, img.height - y_pixel - 1, 255*running_colour);
+                img.set_pixel(x_pixel, img.height - y_pixel - 1, running_colour);
             }
         }
     }
 
+    double render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count();
+    std::cout << "render: " << render_seconds << " s, " << rays_traced / render_seconds / 1e6 << " M rays/s (not counting shadow rays)\n";
+    std::cout << "radiance cache: " << 100 * radiance_cache.hit_rate() << "% of " << radiance_cache.lookups() << " lookups hit, "
+              << radiance_cache.cells_used() << " cells used, " << radiance_cache.memory() / 1e6 << " MB\n";
+    if (streaming) {
+        const StreamStats& stats = streamed.stats;
+        std::cout << "streamed mesh: " << 100 * stats.hit_rate() << "% of " << stats.cluster_visits << " cluster visits hit the cache, "
+                  << stats.page_ins << " page-ins, " << stats.bytes_paged_in / 1e6 << " MB paged in at " << stats.bandwidth() / 1e6
+                  << " MB/s\n";
+    }
+
+    if (denoise_image) {
+        auto start = std::chrono::steady_clock::now();
+        denoise(img, features, img);
+        std::cout << "denoised in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " ms on " << n_threads() << " threads\n";
+    }
+
+    // gamma correction and conversion to 8 bit, as a separate pass over the whole image
+    gpng::Image png(width, height);
+    tonemap(img, png);
+
     std::stringstream string_stream;
     string_stream << "images/" << time(NULL) << ".png";
-    img.save(string_stream.str());
-    // img.save("images/test2.png");
+    png.save(string_stream.str());
+    // png.save("images/test2.png");
 
     std::cout << inside_count << "\n";
 }
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef MAPPED_FILE
+#define MAPPED_FILE
+
+#include <cstddef>
+#include <string>
+
+namespace rt {
+
+    /// @brief read-only memory map of a whole file. The contents are paged in by the OS as they're touched,
+    /// so nothing is copied up front.
+    class MappedFile {
+        public:
+            const char* data{nullptr};
+            std::size_t size{0};
+
+            /// @brief how the file will be read: sequential asks the OS to read ahead the whole file, random only
+            /// pages in what's touched (for files too big to hold, read in pieces)
+            enum class Access { sequential, random };
+
+            MappedFile() {}
+            MappedFile(const std::string& filename, Access access = Access::sequential) { open(filename, access); }
+            ~MappedFile() { close(); }
+
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            bool open(const std::string& filename, Access access = Access::sequential); // returns false (and prints why) if the file can't be mapped
+            void close();
+            // tells the OS a range has been read and its pages can be dropped; touching it again pages it back in
+            void release(std::size_t offset, std::size_t length) const;
+            bool is_open() const { return data != nullptr; }
+
+        private:
+#ifdef _WIN32
+            void* file_handle{nullptr};
+            void* mapping_handle{nullptr};
+#endif
+    };
+
+}
+
+#endif // MAPPED_FILE
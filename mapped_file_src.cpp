@@ -0,0 +1,115 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace rt {
+
+#ifdef _WIN32
+
+    bool MappedFile::open(const std::string& filename, Access access) {
+        close();
+        DWORD flags = access == Access::sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS;
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            std::cerr << "Error in MappedFile::open(): could not open " << filename << "\n";
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size)) {
+            std::cerr << "Error in MappedFile::open(): could not get the size of " << filename << "\n";
+            CloseHandle(file);
+            return false;
+        }
+        if (file_size.QuadPart == 0) { // can't map an empty file, but it's still a valid (empty) file
+            CloseHandle(file);
+            data = "";
+            return true;
+        }
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (view == nullptr) {
+            std::cerr << "Error in MappedFile::open(): could not map " << filename << "\n";
+            if (mapping) { CloseHandle(mapping); }
+            CloseHandle(file);
+            return false;
+        }
+        file_handle = file;
+        mapping_handle = mapping;
+        data = static_cast<const char*>(view);
+        size = static_cast<std::size_t>(file_size.QuadPart);
+        return true;
+    }
+
+    void MappedFile::close() {
+        if (mapping_handle) {
+            UnmapViewOfFile(data);
+            CloseHandle(mapping_handle);
+            CloseHandle(file_handle);
+        }
+        file_handle = nullptr;
+        mapping_handle = nullptr;
+        data = nullptr;
+        size = 0;
+    }
+
+    void MappedFile::release(std::size_t, std::size_t) const {} // clean file pages are trimmed from the working set as needed
+
+#else
+
+    bool MappedFile::open(const std::string& filename, Access access) {
+        close();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error in MappedFile::open(): could not open " << filename << "\n";
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            std::cerr << "Error in MappedFile::open(): could not get the size of " << filename << "\n";
+            ::close(fd);
+            return false;
+        }
+        if (st.st_size == 0) { // can't map an empty file, but it's still a valid (empty) file
+            ::close(fd);
+            data = "";
+            return true;
+        }
+        void* view = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // the mapping keeps the file open
+        if (view == MAP_FAILED) {
+            std::cerr << "Error in MappedFile::open(): could not map " << filename << "\n";
+            return false;
+        }
+        madvise(view, static_cast<std::size_t>(st.st_size), access == Access::sequential ? MADV_WILLNEED : MADV_RANDOM);
+        data = static_cast<const char*>(view);
+        size = static_cast<std::size_t>(st.st_size);
+        return true;
+    }
+
+    void MappedFile::close() {
+        if (data != nullptr && size > 0) { munmap(const_cast<char*>(data), size); }
+        data = nullptr;
+        size = 0;
+    }
+
+    void MappedFile::release(std::size_t offset, std::size_t length) const {
+        if (length == 0 || offset >= size) { return; }
+        const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t begin = offset / page * page;
+        std::size_t end = std::min(offset + length, size);
+        madvise(const_cast<char*>(data) + begin, end - begin, MADV_DONTNEED);
+    }
+
+#endif
+
+}
@@ -0,0 +1,92 @@
+#ifndef MESH
+#define MESH
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include "gmath.h"
+#include "geometry.h"
+
+namespace rt {
+
+    /// @brief indexed triangle mesh. Triangle i uses vertices indices[3i], indices[3i+1], indices[3i+2], wound
+    /// anticlockwise when seen from outside. normals is either empty (flat shading) or holds one normal per vertex.
+    class TriangleMesh {
+        public:
+            std::vector<Vec3> vertices;
+            std::vector<Vec3> normals;
+            std::vector<std::uint32_t> indices;
+            MaterialId material_id{0};
+
+            std::size_t n_triangles() const { return indices.size() / 3; }
+    };
+
+    /// @brief one triangle of a TriangleMesh. The mesh must outlive the scene the triangle is added to.
+    class Triangle3 {
+        public:
+            const TriangleMesh* mesh{nullptr};
+            std::uint32_t index{0}; // triangle number within the mesh
+            MaterialId material_id{0};
+
+            Triangle3() {}
+            Triangle3(const TriangleMesh* mesh, std::uint32_t index) : mesh(mesh), index(index), material_id(mesh->material_id) {}
+
+            const Vec3& vertex(int corner) const { return mesh->vertices[mesh->indices[3 * index + corner]]; }
+
+            // Möller–Trumbore: solves for t and the barycentric coordinates (u, v) of the hit at once
+            Real intersects(const Line3& ray) const {
+                const Vec3& p0 = vertex(0);
+                Vec3 edge1 = vertex(1) - p0;
+                Vec3 edge2 = vertex(2) - p0;
+                Vec3 pvec = cross(ray.d, edge2);
+                Real det = dot(edge1, pvec);
+                if (std::fabs(det) < std::numeric_limits<Real>::min()) { return -1; } // ray parallel to the triangle
+
+                Real inv_det = 1 / det;
+                Vec3 tvec = ray.p - p0;
+                Real u = dot(tvec, pvec) * inv_det;
+                if (u < 0 || u > 1) { return -1; }
+                Vec3 qvec = cross(tvec, edge1);
+                Real v = dot(ray.d, qvec) * inv_det;
+                if (v < 0 || u + v > 1) { return -1; }
+                return dot(edge2, qvec) * inv_det;
+            }
+
+            Vec3 normal(const Vec3& point) const {
+                const Vec3& p0 = vertex(0);
+                Vec3 edge1 = vertex(1) - p0;
+                Vec3 edge2 = vertex(2) - p0;
+                Vec3 geometric = cross(edge1, edge2);
+                if (mesh->normals.empty()) { return geometric.unit(); }
+
+                // interpolate the vertex normals using the barycentric coordinates of point
+                Real area2 = geometric.abs2();
+                Vec3 to_point = point - p0;
+                Real u = dot(cross(to_point, edge2), geometric) / area2;
+                Real v = dot(cross(edge1, to_point), geometric) / area2;
+                const std::uint32_t* corners = &mesh->indices[3 * index];
+                Vec3 shading = (1 - u - v) * mesh->normals[corners[0]] + u * mesh->normals[corners[1]] + v * mesh->normals[corners[2]];
+                return shading.unit();
+            }
+
+            AABB3 bounds() const {
+                AABB3 box;
+                for (int corner = 0; corner < 3; corner++) { box.extend(vertex(corner)); }
+                return box;
+            }
+    };
+
+    /// @brief adds every triangle of mesh to scene (any PrimitiveSet including Triangle3)
+    template <typename Scene>
+    void add_mesh(Scene& scene, const TriangleMesh& mesh) {
+        std::vector<Triangle3>& triangles = scene.template get<Triangle3>();
+        triangles.reserve(triangles.size() + mesh.n_triangles());
+        for (std::size_t i = 0; i < mesh.n_triangles(); i++) {
+            triangles.push_back(Triangle3(&mesh, static_cast<std::uint32_t>(i)));
+        }
+    }
+
+}
+
+#endif // MESH
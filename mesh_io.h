@@ -0,0 +1,26 @@
+#ifndef MESH_IO
+#define MESH_IO
+
+#include <string>
+#include "mesh.h"
+
+namespace rt {
+
+    // Mesh loaders. Files are memory mapped and parsed in parallel chunks straight into the mesh's buffers.
+    // Each returns false (and prints why) if the file can't be read; mesh is then left empty.
+
+    /// @brief loads positions, normals and faces (triangulated as fans) from a Wavefront OBJ file.
+    /// OBJ indexes normals separately from positions; each position takes the normal of the last face corner using it,
+    /// which is exact for smooth meshes but averages away hard edges that share positions.
+    bool load_obj(const std::string& filename, TriangleMesh& mesh);
+
+    /// @brief loads a binary (little or big endian) PLY file's vertex positions, optional vertex normals (nx, ny, nz)
+    /// and faces (triangulated as fans)
+    bool load_ply(const std::string& filename, TriangleMesh& mesh);
+
+    /// @brief loads an .obj or .ply file, chosen by extension
+    bool load_mesh(const std::string& filename, TriangleMesh& mesh);
+
+}
+
+#endif // MESH_IO
@@ -0,0 +1,503 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include "gmath.h"
+#include "mesh.h"
+#include "mesh_io.h"
+#include "mapped_file.h"
+#include "parallel.h"
+
+namespace rt {
+
+    // Shared helpers
+
+    // splits [0, size) into about n_threads() pieces whose boundaries fall just after a newline,
+    // so that every line lies wholly inside one chunk. Returns the n+1 boundaries.
+    static std::vector<std::size_t> line_chunks(const char* data, std::size_t size, std::size_t min_chunk = 1 << 16) {
+        std::size_t n = std::max<std::size_t>(1, std::min<std::size_t>(n_threads() * 4, size / min_chunk));
+        std::vector<std::size_t> bounds{0};
+        for (std::size_t i = 1; i < n; i++) {
+            std::size_t bound = std::max(bounds.back(), size * i / n);
+            const void* newline = bound < size ? std::memchr(data + bound, '\n', size - bound) : nullptr;
+            bound = newline ? static_cast<const char*>(newline) - data + 1 : size;
+            bounds.push_back(bound);
+        }
+        bounds.push_back(size);
+        return bounds;
+    }
+
+    static const char* skip_spaces(const char* p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t')) { p++; }
+        return p;
+    }
+
+    static const char* next_line(const char* p, const char* end) {
+        const void* newline = std::memchr(p, '\n', end - p);
+        return newline ? static_cast<const char*>(newline) + 1 : end;
+    }
+
+    static bool has_extension(const std::string& filename, const char* extension) {
+        std::size_t length = std::strlen(extension);
+        if (filename.size() < length) { return false; }
+        for (std::size_t i = 0; i < length; i++) {
+            if (std::tolower(static_cast<unsigned char>(filename[filename.size() - length + i])) != extension[i]) { return false; }
+        }
+        return true;
+    }
+
+    // OBJ
+
+    // what each chunk of the file contains, found in the first pass
+    struct ObjCounts {
+        std::size_t vertices{0};
+        std::size_t normals{0};
+        std::size_t triangles{0};
+    };
+
+    // counts the corners of the face whose indices start at p
+    static int obj_face_corners(const char* p, const char* end) {
+        int corners = 0;
+        while (true) {
+            p = skip_spaces(p, end);
+            if (p >= end || *p == '\n' || *p == '\r' || *p == '#') { return corners; }
+            corners++;
+            while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') { p++; }
+        }
+    }
+
+    static ObjCounts obj_count(const char* p, const char* end) {
+        ObjCounts counts;
+        for (; p < end; p = next_line(p, end)) {
+            if (p + 1 >= end || p[0] == '#') { continue; }
+            if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+                counts.vertices++;
+            } else if (p[0] == 'v' && p[1] == 'n') {
+                counts.normals++;
+            } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+                int corners = obj_face_corners(p + 2, end);
+                if (corners >= 3) { counts.triangles += corners - 2; }
+            }
+        }
+        return counts;
+    }
+
+    // parses the three numbers of a v or vn line
+    static const char* obj_parse_vec3(const char* p, const char* end, Vec3& v) {
+        Real values[3] = {0, 0, 0};
+        for (int i = 0; i < 3; i++) {
+            p = skip_spaces(p, end);
+            if (p < end && *p == '+') { p++; } // from_chars doesn't accept a leading +
+            std::from_chars_result result = std::from_chars(p, end, values[i]);
+            p = result.ptr;
+        }
+        v = Vec3(values[0], values[1], values[2]);
+        return p;
+    }
+
+    // parses one "v", "v/vt", "v//vn" or "v/vt/vn" face corner. Indices are returned 0-based,
+    // with negative (relative) indices resolved against the number of positions/normals seen so far.
+    static const char* obj_parse_corner(const char* p, const char* end, std::int64_t n_vertices, std::int64_t n_normals, std::int64_t& vertex, std::int64_t& normal) {
+        std::int64_t values[3] = {0, 0, 0};
+        for (int field = 0; field < 3; field++) {
+            if (field > 0) {
+                if (p >= end || *p != '/') { break; }
+                p++;
+            }
+            std::from_chars_result result = std::from_chars(p, end, values[field]);
+            p = result.ptr;
+        }
+        vertex = values[0] < 0 ? n_vertices + values[0] : values[0] - 1;
+        normal = values[2] < 0 ? n_normals + values[2] : values[2] - 1; // -1 if the corner has no normal
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') { p++; }
+        return p;
+    }
+
+    bool load_obj(const std::string& filename, TriangleMesh& mesh) {
+        mesh.vertices.clear();
+        mesh.normals.clear();
+        mesh.indices.clear();
+
+        MappedFile file;
+        if (!file.open(filename)) { return false; }
+        const char* data = file.data;
+
+        // pass 1: count what each chunk holds, so every chunk knows where its output goes
+        std::vector<std::size_t> bounds = line_chunks(data, file.size);
+        std::size_t n_chunks = bounds.size() - 1;
+        std::vector<ObjCounts> counts(n_chunks);
+        parallel_for(0, n_chunks, [&](std::size_t c) { counts[c] = obj_count(data + bounds[c], data + bounds[c + 1]); });
+
+        std::vector<ObjCounts> offsets(n_chunks + 1);
+        for (std::size_t c = 0; c < n_chunks; c++) {
+            offsets[c + 1].vertices = offsets[c].vertices + counts[c].vertices;
+            offsets[c + 1].normals = offsets[c].normals + counts[c].normals;
+            offsets[c + 1].triangles = offsets[c].triangles + counts[c].triangles;
+        }
+        const ObjCounts& total = offsets[n_chunks];
+
+        // pass 2: parse each chunk into its slice of the buffers
+        std::vector<Vec3> file_normals(total.normals);
+        std::vector<std::int32_t> corner_normals(total.normals > 0 ? total.triangles * 3 : 0); // normal index of each triangle corner
+        mesh.vertices.resize(total.vertices);
+        mesh.indices.resize(total.triangles * 3);
+        std::atomic<bool> bad_index{false};
+
+        parallel_for(0, n_chunks, [&](std::size_t c) {
+            std::size_t vertex = offsets[c].vertices;
+            std::size_t normal = offsets[c].normals;
+            std::size_t corner = offsets[c].triangles * 3;
+            const char* end = data + bounds[c + 1];
+            for (const char* p = data + bounds[c]; p < end; p = next_line(p, end)) {
+                if (p + 1 >= end || p[0] == '#') { continue; }
+                if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+                    obj_parse_vec3(p + 2, end, mesh.vertices[vertex++]);
+                } else if (p[0] == 'v' && p[1] == 'n') {
+                    obj_parse_vec3(p + 2, end, file_normals[normal++]);
+                } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+                    // triangulate as a fan around the first corner
+                    std::int64_t first_vertex = 0, first_normal = 0, previous_vertex = 0, previous_normal = 0;
+                    int n_corners = 0;
+                    const char* q = p + 2;
+                    while (true) {
+                        q = skip_spaces(q, end);
+                        if (q >= end || *q == '\n' || *q == '\r' || *q == '#') { break; }
+                        std::int64_t v, vn;
+                        q = obj_parse_corner(q, end, vertex, normal, v, vn);
+                        if (v < 0 || v >= static_cast<std::int64_t>(total.vertices)) { bad_index = true; v = 0; }
+                        if (n_corners == 0) {
+                            first_vertex = v;
+                            first_normal = vn;
+                        } else if (n_corners >= 2) {
+                            std::int64_t triangle_vertices[3] = {first_vertex, previous_vertex, v};
+                            std::int64_t triangle_normals[3] = {first_normal, previous_normal, vn};
+                            for (int k = 0; k < 3; k++) {
+                                if (!corner_normals.empty()) { corner_normals[corner] = static_cast<std::int32_t>(triangle_normals[k]); }
+                                mesh.indices[corner++] = static_cast<std::uint32_t>(triangle_vertices[k]);
+                            }
+                        }
+                        previous_vertex = v;
+                        previous_normal = vn;
+                        n_corners++;
+                    }
+                }
+            }
+        });
+
+        if (bad_index) {
+            std::cerr << "Error in load_obj(): face refers to a vertex that doesn't exist in " << filename << "\n";
+            mesh.vertices.clear();
+            mesh.indices.clear();
+            return false;
+        }
+
+        // give each position the normal of a corner using it. Serial, since corners sharing a position would race.
+        if (!corner_normals.empty()) {
+            mesh.normals.assign(mesh.vertices.size(), Vec3(0, 0, 0));
+            for (std::size_t i = 0; i < mesh.indices.size(); i++) {
+                std::int32_t normal = corner_normals[i];
+                if (normal >= 0 && static_cast<std::size_t>(normal) < file_normals.size()) { mesh.normals[mesh.indices[i]] = file_normals[normal]; }
+            }
+        }
+        return true;
+    }
+
+    // PLY
+
+    enum class PlyType { int8, uint8, int16, uint16, int32, uint32, float32, float64, invalid };
+
+    static PlyType ply_type(const std::string& name) {
+        if (name == "char" || name == "int8") { return PlyType::int8; }
+        if (name == "uchar" || name == "uint8") { return PlyType::uint8; }
+        if (name == "short" || name == "int16") { return PlyType::int16; }
+        if (name == "ushort" || name == "uint16") { return PlyType::uint16; }
+        if (name == "int" || name == "int32") { return PlyType::int32; }
+        if (name == "uint" || name == "uint32") { return PlyType::uint32; }
+        if (name == "float" || name == "float32") { return PlyType::float32; }
+        if (name == "double" || name == "float64") { return PlyType::float64; }
+        return PlyType::invalid;
+    }
+
+    static std::size_t ply_size(PlyType type) {
+        switch (type) {
+            case PlyType::int8: case PlyType::uint8: return 1;
+            case PlyType::int16: case PlyType::uint16: return 2;
+            case PlyType::int32: case PlyType::uint32: case PlyType::float32: return 4;
+            case PlyType::float64: return 8;
+            default: return 0;
+        }
+    }
+
+    // reads a value of type T stored at p, byte swapping if the file's endianness differs from ours
+    template <typename T>
+    static T ply_read_raw(const char* p, bool swap) {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, p, sizeof(T));
+        if (swap) { std::reverse(bytes, bytes + sizeof(T)); }
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+    static double ply_read(const char* p, PlyType type, bool swap) {
+        switch (type) {
+            case PlyType::int8: return ply_read_raw<std::int8_t>(p, swap);
+            case PlyType::uint8: return ply_read_raw<std::uint8_t>(p, swap);
+            case PlyType::int16: return ply_read_raw<std::int16_t>(p, swap);
+            case PlyType::uint16: return ply_read_raw<std::uint16_t>(p, swap);
+            case PlyType::int32: return ply_read_raw<std::int32_t>(p, swap);
+            case PlyType::uint32: return ply_read_raw<std::uint32_t>(p, swap);
+            case PlyType::float32: return ply_read_raw<float>(p, swap);
+            case PlyType::float64: return ply_read_raw<double>(p, swap);
+            default: return 0;
+        }
+    }
+
+    struct PlyProperty {
+        std::string name;
+        PlyType type{PlyType::invalid}; // value type, or item type for lists
+        PlyType count_type{PlyType::invalid}; // invalid unless this is a list
+        std::size_t offset{0}; // byte offset in the record, for properties before the first list
+
+        bool is_list() const { return count_type != PlyType::invalid; }
+    };
+
+    struct PlyElement {
+        std::string name;
+        std::size_t count{0};
+        std::vector<PlyProperty> properties;
+
+        bool has_list() const {
+            for (const PlyProperty& property : properties) { if (property.is_list()) { return true; } }
+            return false;
+        }
+        std::size_t fixed_size() const { // record size if there are no lists
+            std::size_t size = 0;
+            for (const PlyProperty& property : properties) { size += ply_size(property.type); }
+            return size;
+        }
+        const PlyProperty* find(const char* property_name) const {
+            for (const PlyProperty& property : properties) { if (property.name == property_name) { return &property; } }
+            return nullptr;
+        }
+    };
+
+    // size of one record of element starting at p (which may contain lists), or false if it runs past end
+    static bool ply_record_size(const PlyElement& element, const char* p, const char* end, bool swap, std::size_t& size) {
+        size = 0;
+        for (const PlyProperty& property : element.properties) {
+            std::size_t left = static_cast<std::size_t>(end - p) - size;
+            if (property.is_list()) {
+                if (ply_size(property.count_type) > left) { return false; }
+                double count = ply_read(p + size, property.count_type, swap);
+                if (count < 0 || count * ply_size(property.type) > left - ply_size(property.count_type)) { return false; }
+                size += ply_size(property.count_type) + static_cast<std::size_t>(count) * ply_size(property.type);
+            } else {
+                if (ply_size(property.type) > left) { return false; }
+                size += ply_size(property.type);
+            }
+        }
+        return true;
+    }
+
+    static bool ply_error(const std::string& message, const std::string& filename, TriangleMesh& mesh) {
+        std::cerr << "Error in load_ply(): " << message << " in " << filename << "\n";
+        mesh.vertices.clear();
+        mesh.normals.clear();
+        mesh.indices.clear();
+        return false;
+    }
+
+    bool load_ply(const std::string& filename, TriangleMesh& mesh) {
+        mesh.vertices.clear();
+        mesh.normals.clear();
+        mesh.indices.clear();
+
+        MappedFile file;
+        if (!file.open(filename)) { return false; }
+        const char* data = file.data;
+        const char* end = data + file.size;
+
+        // header
+        if (file.size < 4 || std::memcmp(data, "ply", 3) != 0) { return ply_error("not a PLY file", filename, mesh); }
+        std::vector<PlyElement> elements;
+        bool little_endian = true;
+        const char* p = next_line(data, end);
+        while (true) {
+            if (p >= end) { return ply_error("header has no end_header", filename, mesh); }
+            const char* line_end = next_line(p, end);
+            std::string line(p, line_end);
+            while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) { line.pop_back(); }
+            p = line_end;
+
+            std::vector<std::string> words;
+            for (std::size_t start = 0; start < line.size();) {
+                std::size_t stop = line.find(' ', start);
+                if (stop == std::string::npos) { stop = line.size(); }
+                if (stop > start) { words.push_back(line.substr(start, stop - start)); }
+                start = stop + 1;
+            }
+            if (words.empty() || words[0] == "comment" || words[0] == "obj_info") { continue; }
+            if (words[0] == "end_header") { break; }
+            if (words[0] == "format" && words.size() >= 2) {
+                if (words[1] == "binary_little_endian") { little_endian = true; }
+                else if (words[1] == "binary_big_endian") { little_endian = false; }
+                else { return ply_error("only binary PLY is supported, not " + words[1], filename, mesh); }
+            } else if (words[0] == "element" && words.size() >= 3) {
+                PlyElement element;
+                element.name = words[1];
+                const std::string& count = words[2];
+                std::from_chars_result result = std::from_chars(count.data(), count.data() + count.size(), element.count);
+                if (result.ec != std::errc() || result.ptr != count.data() + count.size()) {
+                    return ply_error("bad element count " + count, filename, mesh);
+                }
+                elements.push_back(element);
+            } else if (words[0] == "property" && !elements.empty()) {
+                PlyProperty property;
+                if (words.size() >= 5 && words[1] == "list") {
+                    property.count_type = ply_type(words[2]);
+                    property.type = ply_type(words[3]);
+                    property.name = words[4];
+                    if (property.count_type == PlyType::invalid) { return ply_error("unknown type " + words[2], filename, mesh); }
+                } else if (words.size() >= 3) {
+                    property.type = ply_type(words[1]);
+                    property.name = words[2];
+                }
+                if (property.type == PlyType::invalid) { return ply_error("unknown property type in \"" + line + "\"", filename, mesh); }
+                std::vector<PlyProperty>& properties = elements.back().properties;
+                property.offset = properties.empty() ? 0 : properties.back().offset + ply_size(properties.back().type);
+                properties.push_back(property);
+            }
+        }
+
+        static const std::uint16_t endian_test = 1;
+        bool host_little_endian = *reinterpret_cast<const std::uint8_t*>(&endian_test) == 1;
+        bool swap = little_endian != host_little_endian;
+
+        // locate the vertex and face data, stepping over any other elements
+        const char* vertex_data = nullptr;
+        const char* face_data = nullptr;
+        const PlyElement* vertex_element = nullptr;
+        const PlyElement* face_element = nullptr;
+        for (const PlyElement& element : elements) {
+            if (element.name == "vertex") { vertex_data = p; vertex_element = &element; }
+            if (element.name == "face") { face_data = p; face_element = &element; }
+            if (element.name == "face" || !element.has_list()) {
+                if (element.name == "face") { break; } // faces are walked below, and anything after them isn't needed
+                p += element.count * element.fixed_size();
+            } else {
+                for (std::size_t i = 0; i < element.count; i++) {
+                    std::size_t record_size;
+                    if (!ply_record_size(element, p, end, swap, record_size)) { return ply_error("file is truncated", filename, mesh); }
+                    p += record_size;
+                }
+            }
+            if (p > end) { return ply_error("file is truncated", filename, mesh); }
+        }
+        if (vertex_element == nullptr || vertex_element->has_list()) { return ply_error("no vertex element", filename, mesh); }
+
+        // vertices: fixed size records, decoded in parallel
+        const PlyProperty* xyz[3] = {vertex_element->find("x"), vertex_element->find("y"), vertex_element->find("z")};
+        const PlyProperty* nxyz[3] = {vertex_element->find("nx"), vertex_element->find("ny"), vertex_element->find("nz")};
+        if (!xyz[0] || !xyz[1] || !xyz[2]) { return ply_error("vertices have no x, y, z", filename, mesh); }
+        bool has_normals = nxyz[0] && nxyz[1] && nxyz[2];
+        std::size_t vertex_size = vertex_element->fixed_size();
+        std::size_t n_vertices = vertex_element->count;
+        if (vertex_data + n_vertices * vertex_size > end) { return ply_error("file is truncated", filename, mesh); }
+
+        mesh.vertices.resize(n_vertices);
+        if (has_normals) { mesh.normals.resize(n_vertices); }
+        parallel_for(0, n_vertices, [&](std::size_t i) {
+            const char* record = vertex_data + i * vertex_size;
+            mesh.vertices[i] = Vec3(static_cast<Real>(ply_read(record + xyz[0]->offset, xyz[0]->type, swap)),
+                                    static_cast<Real>(ply_read(record + xyz[1]->offset, xyz[1]->type, swap)),
+                                    static_cast<Real>(ply_read(record + xyz[2]->offset, xyz[2]->type, swap)));
+            if (has_normals) {
+                mesh.normals[i] = Vec3(static_cast<Real>(ply_read(record + nxyz[0]->offset, nxyz[0]->type, swap)),
+                                       static_cast<Real>(ply_read(record + nxyz[1]->offset, nxyz[1]->type, swap)),
+                                       static_cast<Real>(ply_read(record + nxyz[2]->offset, nxyz[2]->type, swap)));
+            }
+        }, 1 << 14);
+
+        if (face_element == nullptr) { return true; } // a point cloud
+        const PlyProperty* index_list = face_element->find("vertex_indices");
+        if (index_list == nullptr) { index_list = face_element->find("vertex_index"); }
+        if (index_list == nullptr || !index_list->is_list()) { return ply_error("faces have no vertex_indices list", filename, mesh); }
+
+        // faces: if every face is a triangle the records are all the same size, so check that in parallel and decode
+        // in parallel. Otherwise walk them one by one, triangulating as fans.
+        std::size_t n_faces = face_element->count;
+        std::size_t count_size = ply_size(index_list->count_type);
+        std::size_t index_size = ply_size(index_list->type);
+        std::size_t before_list = 0; // bytes of scalar properties before the index list
+        std::size_t triangle_size = 0; // record size if the face is a triangle and it has no other lists
+        bool fixed = true;
+        for (const PlyProperty& property : face_element->properties) {
+            if (&property == index_list) {
+                before_list = triangle_size;
+                triangle_size += count_size + 3 * index_size;
+            } else if (property.is_list()) {
+                fixed = false;
+            } else {
+                triangle_size += ply_size(property.type);
+            }
+        }
+        fixed = fixed && face_data + n_faces * triangle_size <= end;
+        if (fixed) {
+            std::atomic<bool> all_triangles{true};
+            parallel_for(0, n_faces, [&](std::size_t i) {
+                if (ply_read(face_data + i * triangle_size + before_list, index_list->count_type, swap) != 3) { all_triangles = false; }
+            }, 1 << 16);
+            fixed = all_triangles;
+        }
+
+        std::atomic<bool> bad_index{false};
+        if (fixed) {
+            mesh.indices.resize(n_faces * 3);
+            parallel_for(0, n_faces, [&](std::size_t i) {
+                const char* indices = face_data + i * triangle_size + before_list + count_size;
+                for (int k = 0; k < 3; k++) {
+                    double index = ply_read(indices + k * index_size, index_list->type, swap);
+                    if (index < 0 || index >= n_vertices) { bad_index = true; index = 0; }
+                    mesh.indices[i * 3 + k] = static_cast<std::uint32_t>(index);
+                }
+            }, 1 << 14);
+        } else {
+            p = face_data;
+            for (std::size_t i = 0; i < n_faces; i++) {
+                std::size_t record_size;
+                if (!ply_record_size(*face_element, p, end, swap, record_size)) { return ply_error("file is truncated", filename, mesh); }
+                std::size_t list_offset = 0;
+                for (const PlyProperty& property : face_element->properties) {
+                    if (&property == index_list) { break; }
+                    list_offset += property.is_list() ? count_size + static_cast<std::size_t>(ply_read(p + list_offset, property.count_type, swap)) * ply_size(property.type) : ply_size(property.type);
+                }
+                std::size_t n_corners = static_cast<std::size_t>(ply_read(p + list_offset, index_list->count_type, swap));
+                const char* indices = p + list_offset + count_size;
+                for (std::size_t k = 2; k < n_corners; k++) {
+                    std::size_t corners[3] = {0, k - 1, k};
+                    for (std::size_t corner : corners) {
+                        double index = ply_read(indices + corner * index_size, index_list->type, swap);
+                        if (index < 0 || index >= n_vertices) { bad_index = true; index = 0; }
+                        mesh.indices.push_back(static_cast<std::uint32_t>(index));
+                    }
+                }
+                p += record_size;
+            }
+        }
+        if (bad_index) { return ply_error("face refers to a vertex that doesn't exist", filename, mesh); }
+        return true;
+    }
+
+    bool load_mesh(const std::string& filename, TriangleMesh& mesh) {
+        if (has_extension(filename, ".obj")) { return load_obj(filename, mesh); }
+        if (has_extension(filename, ".ply")) { return load_ply(filename, mesh); }
+        std::cerr << "Error in load_mesh(): unknown file type " << filename << "\n";
+        return false;
+    }
+
+}
@@ -0,0 +1,1837 @@
+// Benchmarks for the ray tracer's hot paths.
+// Build from the project root with:
+//   g++ -O2 -I. -o bench other/benchmarks.cpp *_src.cpp
+// Run with no arguments for all benchmarks, or name the ones to run, e.g. `./bench intersect`.
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <fstream>
+#include <cstdio>
+#include <thread>
+
+#include "gmath.h"
+#include "geometry.h"
+#include "scene.h"
+#include "camera.h"
+#include "materials.h"
+#include "lights.h"
+#include "caustics.h"
+#include "radiance_cache.h"
+#include "guiding.h"
+#include "splitting.h"
+#include "denoise.h"
+#include "environment.h"
+#include "image_io.h"
+#include "tonemap.h"
+#include "parallel.h"
+#include "bvh.h"
+#include "quantised_bvh.h"
+#include "bvh_cache.h"
+#include "grid_accel.h"
+#include "streamed_mesh.h"
+#include "mesh.h"
+#include "mesh_io.h"
+#include "integrator.h"
+
+using namespace gmath;
+using namespace rt;
+
+// Stopwatch returning seconds since construction
+class Timer {
+    public:
+        std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+
+        double seconds() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+};
+
+// A new seed for each pass over an image. Rows seed the generator with it and their index before drawing, so a pass's
+// noise doesn't depend on which thread runs each row, and no two passes or rows draw the same numbers.
+static std::uint64_t next_pass_seed() {
+    static std::uint64_t pass = 0;
+    return ++pass;
+}
+
+static std::vector<Line3> random_rays(int n) {
+    std::vector<Line3> rays;
+    for (int i = 0; i < n; i++) {
+        Vec3 origin(random_double(-5, 5), random_double(-5, 5), random_double(-5, 5));
+        Vec3 direction = Vec3(normal_double(), normal_double(), normal_double()).unit();
+        rays.push_back(Line3(origin, direction));
+    }
+    return rays;
+}
+
+// Intersections/s of the typed primitive arrays against the same spheres behind virtual Hittable dispatch
+
+// Sphere3 wrapped as a user-defined Hittable, to measure the virtual path
+class VirtualSphere : public Hittable {
+    public:
+        Sphere3 sphere;
+
+        VirtualSphere(const Sphere3& sphere) : Hittable(sphere.material_id), sphere(sphere) {}
+
+        Real intersects(const Line3& ray) const override { return sphere.intersects(ray); }
+        Vec3 normal(const Vec3& point) const override { return sphere.normal(point); }
+};
+
+static void bench_intersect() {
+    const int n_spheres = 1000;
+    const int n_rays = 20000;
+
+    Scene typed;
+    Scene virtual_only;
+    std::vector<VirtualSphere*> owned;
+    for (int i = 0; i < n_spheres; i++) {
+        Sphere3 sphere(Vec3(random_double(-5, 5), random_double(-5, 5), random_double(-5, 5)), random_double(0.05, 0.2));
+        typed.add(sphere);
+        owned.push_back(new VirtualSphere(sphere));
+        virtual_only.add(owned.back());
+    }
+    std::vector<Line3> rays = random_rays(n_rays);
+
+    auto run = [&](const char* name, const Scene& scene) {
+        Timer timer;
+        int hits = 0;
+        for (const Line3& ray : rays) {
+            if (scene.closest_hit(ray).hit()) { hits++; }
+        }
+        double seconds = timer.seconds();
+        std::cout << "  " << name << ": " << static_cast<double>(n_rays) * n_spheres / seconds / 1e6 << " M intersections/s (" << hits << " hits)\n";
+    };
+
+    std::cout << "intersect: " << n_spheres << " spheres, " << n_rays << " rays\n";
+    run("virtual Hittable", virtual_only);
+    run("typed arrays    ", typed);
+
+    for (VirtualSphere* sphere : owned) { delete sphere; }
+}
+
+// Throughput and accuracy of float against double on the GitHub scene, at its normal position and moved far from the origin.
+// Accuracy is the distance of each primary hit from the double precision hit, and the fraction of rays reflected off a hit
+// that hit the same sphere again (self-intersection), both with the ray origin offset and with it left on the surface.
+
+template <typename T>
+struct PrecisionResult {
+    double seconds{0};
+    std::vector<Vec3T<double>> hits; // primary hit points in double, (nan,nan,nan) for a miss
+    int n_hits{0};
+    int self_hits_offset{0};
+    int self_hits_raw{0};
+};
+
+template <typename T>
+static PrecisionResult<T> trace_precision(const std::vector<Sphere3T<double>>& spheres_d, const Vec3T<double>& shift, int width, int height) {
+    auto to_t = [](const Vec3T<double>& v) { return Vec3T<T>(T(v.x), T(v.y), T(v.z)); };
+
+    std::vector<Sphere3T<T>> spheres;
+    for (const Sphere3T<double>& sphere : spheres_d) { spheres.push_back(Sphere3T<T>(to_t(sphere.p + shift), T(sphere.r))); }
+    Vec3T<double> lookfrom(0.3, -1, -0.03);
+    Vec3T<double> lookat(0.12, 0, 0);
+    CameraT<T> cam(T(width) / T(height), to_t(lookat + shift), to_t(lookat - lookfrom), 2.5, 40, 0);
+
+    auto closest = [&](const Line3T<T>& ray, T& t) {
+        int idx = -1;
+        t = std::numeric_limits<T>::infinity();
+        for (std::size_t i = 0; i < spheres.size(); i++) {
+            T intersect_t = spheres[i].intersects(ray);
+            if (intersect_t > 0 && intersect_t < t) { t = intersect_t; idx = static_cast<int>(i); }
+        }
+        return idx;
+    };
+
+    PrecisionResult<T> result;
+    std::vector<Line3T<T>> rays;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            rays.push_back(cam.generate_ray((x + T(0.5)) / width - T(0.5), (y + T(0.5)) / height - T(0.5)));
+        }
+    }
+
+    std::vector<T> ts(rays.size());
+    std::vector<int> idxs(rays.size());
+    Timer timer;
+    for (std::size_t i = 0; i < rays.size(); i++) { idxs[i] = closest(rays[i], ts[i]); }
+    result.seconds = timer.seconds();
+
+    for (std::size_t i = 0; i < rays.size(); i++) {
+        if (idxs[i] == -1) {
+            result.hits.push_back(Vec3T<double>(NAN, NAN, NAN));
+            continue;
+        }
+        Vec3T<T> point = rays[i](ts[i]);
+        result.hits.push_back(Vec3T<double>(point.x, point.y, point.z) - shift);
+        result.n_hits++;
+
+        // camera rays hit the outside of a sphere, so the reflected ray can't legitimately hit it again
+        Vec3T<T> normal_unit = spheres[idxs[i]].normal(point);
+        Vec3T<T> reflected = rays[i].d - 2*normal_unit*dot(rays[i].d, normal_unit);
+        T t;
+        if (closest(Line3T<T>(offset_ray_origin(point, normal_unit), reflected), t) == idxs[i]) { result.self_hits_offset++; }
+        if (closest(Line3T<T>(point, reflected), t) == idxs[i]) { result.self_hits_raw++; }
+    }
+    return result;
+}
+
+static void bench_precision() {
+    const int width = 960;
+    const int height = 540;
+    std::vector<Sphere3T<double>> spheres = {
+        Sphere3T<double>(Vec3T<double>(0,0,-100.5), 100),
+        Sphere3T<double>(Vec3T<double>(0,0,0), 0.5),
+        Sphere3T<double>(Vec3T<double>(1,0,0), 0.5),
+        Sphere3T<double>(Vec3T<double>(-1,0,0), 0.5),
+        Sphere3T<double>(Vec3T<double>(-0.1,-0.8,-0.3), 0.2),
+        Sphere3T<double>(Vec3T<double>(1.2,-0.85,-0.4), 0.1),
+        Sphere3T<double>(Vec3T<double>(0.1,-1.0,-0.38), 0.12),
+        Sphere3T<double>(Vec3T<double>(0.6,-0.75,-0.25), 0.25),
+    };
+
+    std::cout << "precision: GitHub scene, " << width << "x" << height << " primary rays\n";
+    for (double shift : {0.0, 1e3, 1e5}) {
+        Vec3T<double> shift_vec(shift, shift, 0);
+        PrecisionResult<float> f = trace_precision<float>(spheres, shift_vec, width, height);
+        PrecisionResult<double> d = trace_precision<double>(spheres, shift_vec, width, height);
+
+        double error2 = 0;
+        double error_max = 0;
+        int n_compared = 0;
+        int n_mismatched = 0; // hit in one precision and not the other
+        for (std::size_t i = 0; i < d.hits.size(); i++) {
+            bool f_hit = !std::isnan(f.hits[i].x);
+            bool d_hit = !std::isnan(d.hits[i].x);
+            if (f_hit != d_hit) { n_mismatched++; continue; }
+            if (!d_hit) { continue; }
+            double error = (f.hits[i] - d.hits[i]).abs();
+            error2 += error * error;
+            error_max = std::max(error_max, error);
+            n_compared++;
+        }
+
+        std::cout << "  scene moved by (" << shift << ", " << shift << ", 0)\n";
+        std::cout << "    double: " << d.hits.size() / d.seconds / 1e6 << " M rays/s, self-intersections " << d.self_hits_offset << " offset / " << d.self_hits_raw << " raw of " << d.n_hits << "\n";
+        std::cout << "    float:  " << f.hits.size() / f.seconds / 1e6 << " M rays/s, self-intersections " << f.self_hits_offset << " offset / " << f.self_hits_raw << " raw of " << f.n_hits << "\n";
+        std::cout << "    float hit point error: rms " << std::sqrt(error2 / std::max(n_compared, 1)) << ", max " << error_max << ", " << n_mismatched << " rays hit/missed differently\n";
+    }
+}
+
+// The GitHub scene with its ground as a giant sphere against an infinite plane: diffuse paths traced per second, and how big
+// the ground makes the BVH's root box (the plane stays out of the tree)
+
+static void bench_ground() {
+    const int width = 960;
+    const int height = 540;
+    const int max_depth = 4;
+
+    auto github_scene = [](Scene& scene, bool plane_ground) {
+        if (plane_ground) {
+            scene.add(Plane3(Vec3(0,0,-0.5), Vec3(0,0,1)));
+        } else {
+            scene.add(Sphere3(Vec3(0,0,-100.5), 100));
+        }
+        for (const Sphere3& sphere : {Sphere3(Vec3(0,0,0), 0.5), Sphere3(Vec3(1,0,0), 0.5), Sphere3(Vec3(-1,0,0), 0.5), Sphere3(Vec3(-1,0,0), 0.4),
+                                      Sphere3(Vec3(-0.1,-0.8,-0.3), 0.2), Sphere3(Vec3(1.2,-0.85,-0.4), 0.1), Sphere3(Vec3(0.1,-1.0,-0.38), 0.12),
+                                      Sphere3(Vec3(0.6,-0.75,-0.25), 0.25)}) {
+            scene.add(sphere);
+        }
+        scene.build_bvh();
+    };
+
+    Vec3 lookfrom(0.3, -1, -0.03);
+    Vec3 lookat(0.12, 0, 0);
+    Camera cam(Real(width) / Real(height), lookat, lookat - lookfrom, 2.5, 40, 0);
+    std::vector<Line3> primary;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) { primary.push_back(cam.generate_ray((x + 0.5) / width - 0.5, (y + 0.5) / height - 0.5)); }
+    }
+
+    auto run = [&](const char* name, bool plane_ground) {
+        Scene scene;
+        github_scene(scene, plane_ground);
+        AABB3T<float> root;
+        for (const BVHPrim& prim : scene.bvh_prims()) { root.extend(prim.box); }
+
+        std::size_t n_rays = 0;
+        Timer timer;
+        for (Line3 ray : primary) {
+            for (int depth = 0; depth < max_depth; depth++) {
+                Hit hit = scene.closest_hit(ray);
+                n_rays++;
+                if (!hit.hit()) { break; }
+                Vec3 point = ray(hit.t);
+                Vec3 normal_unit;
+                scene.visit(hit, [&](const auto& prim) { normal_unit = prim.normal(point); });
+                ray = scatter_matte(point, normal_unit);
+                ray.p = offset_ray_origin(point, normal_unit);
+            }
+        }
+        double seconds = timer.seconds();
+        std::cout << "  " << name << ": " << n_rays / seconds / 1e6 << " M rays/s, " << static_cast<double>(n_rays) / primary.size()
+                  << " rays/path, BVH root box " << root.extent().x << " x " << root.extent().y << " x " << root.extent().z << "\n";
+    };
+
+    std::cout << "ground: GitHub scene, " << width << "x" << height << " diffuse paths of up to " << max_depth << " rays\n";
+    run("sphere ground", false);
+    run("plane ground ", true);
+}
+
+// Per-operation cost of Vec3, in ns per operation, over arrays too big to stay in registers but small enough for L2
+
+template <typename F>
+static void time_vec_op(const char* name, int n_ops, F op) {
+    Timer timer;
+    Real sink = op();
+    double seconds = timer.seconds();
+    std::cout << "  " << name << ": " << seconds / n_ops * 1e9 << " ns/op (" << sink << ")\n";
+}
+
+static void bench_vecops() {
+    const int n = 4096;
+    const int repeats = 2000;
+    std::vector<Vec3> us;
+    std::vector<Vec3> vs;
+    for (int i = 0; i < n; i++) {
+        us.push_back(Vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)));
+        vs.push_back(Vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)));
+    }
+    std::vector<Vec3> out(n);
+
+    std::cout << "vecops: sizeof(Vec3) = " << sizeof(Vec3) << "\n";
+    // each op writes its result out and reads one component back, so it can't be optimised away
+    time_vec_op("u + v    ", n * repeats, [&]() { Real sum = 0; for (int r = 0; r < repeats; r++) { for (int i = 0; i < n; i++) { out[i] = us[i] + vs[i]; } sum += out[r % n].x; } return sum; });
+    time_vec_op("u * t    ", n * repeats, [&]() { Real sum = 0; for (int r = 0; r < repeats; r++) { for (int i = 0; i < n; i++) { out[i] = us[i] * Real(r); } sum += out[r % n].x; } return sum; });
+    time_vec_op("u * v    ", n * repeats, [&]() { Real sum = 0; for (int r = 0; r < repeats; r++) { for (int i = 0; i < n; i++) { out[i] = us[i] * vs[i]; } sum += out[r % n].x; } return sum; });
+    time_vec_op("dot(u, v)", n * repeats, [&]() { Real sum = 0; for (int r = 0; r < repeats; r++) { for (int i = 0; i < n; i++) { sum += dot(us[i], vs[i]); } } return sum; });
+    time_vec_op("cross    ", n * repeats, [&]() { Real sum = 0; for (int r = 0; r < repeats; r++) { for (int i = 0; i < n; i++) { out[i] = cross(us[i], vs[i]); } sum += out[r % n].x; } return sum; });
+    time_vec_op("u.abs()  ", n * repeats, [&]() { Real sum = 0; for (int r = 0; r < repeats; r++) { for (int i = 0; i < n; i++) { sum += us[i].abs(); } } return sum; });
+    time_vec_op("u.unit() ", n * repeats, [&]() { Real sum = 0; for (int r = 0; r < repeats; r++) { for (int i = 0; i < n; i++) { out[i] = us[i].unit(); } sum += out[r % n].x; } return sum; });
+}
+
+// Framebuffer to 8/16 bit conversion at 8k, against the per-pixel pow() and unclamped cast main() used to do inline
+
+static void bench_tonemap() {
+    const int width = 7680;
+    const int height = 4320;
+    Framebuffer framebuffer(width, height);
+    for (float& value : framebuffer.pixels) { value = static_cast<float>(random_double(0, 1.1)); }
+
+    std::cout << "tonemap: " << width << "x" << height << ", " << n_threads() << " threads\n";
+    auto report = [&](const char* name, double seconds) {
+        std::cout << "  " << name << ": " << seconds * 1e3 << " ms (" << static_cast<double>(width) * height / seconds / 1e6 << " Mpixels/s)\n";
+    };
+
+    {
+        gpng::Image image(width, height);
+        Timer timer;
+        for (int row = 0; row < height; row++) {
+            for (int column = 0; column < width; column++) {
+                const float* in = framebuffer(column, row);
+                Vec3 colour = 255 * pow(Vec3(in[0], in[1], in[2]), 0.5);
+                image(column, row, 0) = static_cast<uint8_t>(static_cast<int>(colour.x)); // wraps above 255, as before
+                image(column, row, 1) = static_cast<uint8_t>(static_cast<int>(colour.y));
+                image(column, row, 2) = static_cast<uint8_t>(static_cast<int>(colour.z));
+            }
+        }
+        report("inline pow, 8 bit       ", timer.seconds());
+    }
+
+    auto run = [&](const char* name, int bit_depth, TonemapSettings settings, unsigned threads) {
+        gpng::Image image(width, height, bit_depth);
+        unsigned saved = thread_count;
+        thread_count = threads;
+        Timer timer;
+        tonemap(framebuffer, image, settings);
+        report(name, timer.seconds());
+        thread_count = saved;
+    };
+    run("LUT sRGB, 8 bit, 1 thread", 8, TonemapSettings{Transfer::srgb, false}, 1);
+    run("LUT sRGB, 8 bit         ", 8, TonemapSettings{Transfer::srgb, false}, 0);
+    run("LUT sRGB, 8 bit, dither ", 8, TonemapSettings{Transfer::srgb, true}, 0);
+    run("LUT gamma 2, 8 bit      ", 8, TonemapSettings{Transfer::gamma2, false}, 0);
+    run("LUT sRGB, 16 bit        ", 16, TonemapSettings{Transfer::srgb, false}, 0);
+
+    // accuracy of the interpolated table against the exact transfer function
+    TransferTable table(Transfer::srgb);
+    double max_error = 0;
+    for (int i = 0; i <= 1000000; i++) {
+        double linear = i / 1e6;
+        max_error = std::max(max_error, std::fabs(table.lookup(static_cast<float>(linear)) - TransferTable::encode(Transfer::srgb, linear)));
+    }
+    std::cout << "  LUT max error: " << max_error * 255 << " 8 bit steps, " << max_error * 65535 << " 16 bit steps\n";
+}
+
+// Mesh loading throughput: a 10M triangle binary PLY and a 1M triangle OBJ, both a flat grid written to /tmp
+
+// writes an n x n grid of quads (2n^2 triangles) as binary little endian PLY, or as OBJ
+static std::string write_grid(int n, bool ply) {
+    std::string filename = ply ? "/tmp/bench_grid.ply" : "/tmp/bench_grid.obj";
+    std::ofstream file(filename, std::ios::binary);
+    std::size_t n_vertices = static_cast<std::size_t>(n + 1) * (n + 1);
+    std::size_t n_faces = static_cast<std::size_t>(n) * n * 2;
+    if (ply) {
+        file << "ply\nformat binary_little_endian 1.0\nelement vertex " << n_vertices << "\nproperty float x\nproperty float y\nproperty float z\n"
+             << "element face " << n_faces << "\nproperty list uchar int vertex_indices\nend_header\n";
+    }
+    std::vector<char> buffer;
+    for (int row = 0; row <= n; row++) {
+        buffer.clear();
+        for (int column = 0; column <= n; column++) {
+            float position[3] = {static_cast<float>(column) / n, 0.0f, static_cast<float>(row) / n};
+            if (ply) {
+                buffer.insert(buffer.end(), reinterpret_cast<char*>(position), reinterpret_cast<char*>(position) + sizeof(position));
+            } else {
+                char line[64];
+                int length = std::snprintf(line, sizeof(line), "v %g %g %g\n", position[0], position[1], position[2]);
+                buffer.insert(buffer.end(), line, line + length);
+            }
+        }
+        file.write(buffer.data(), buffer.size());
+    }
+    for (int row = 0; row < n; row++) {
+        buffer.clear();
+        for (int column = 0; column < n; column++) {
+            std::int32_t corner = row * (n + 1) + column;
+            std::int32_t triangles[2][3] = {{corner, corner + n + 1, corner + 1}, {corner + 1, corner + n + 1, corner + n + 2}};
+            for (const auto& triangle : triangles) {
+                if (ply) {
+                    buffer.push_back(3);
+                    buffer.insert(buffer.end(), reinterpret_cast<const char*>(triangle), reinterpret_cast<const char*>(triangle) + sizeof(triangle));
+                } else {
+                    char line[64];
+                    int length = std::snprintf(line, sizeof(line), "f %d %d %d\n", triangle[0] + 1, triangle[1] + 1, triangle[2] + 1);
+                    buffer.insert(buffer.end(), line, line + length);
+                }
+            }
+        }
+        file.write(buffer.data(), buffer.size());
+    }
+    return filename;
+}
+
+static void bench_mesh() {
+    std::cout << "mesh: " << n_threads() << " threads\n";
+    auto run = [](const char* name, const std::string& filename, unsigned threads) {
+        unsigned saved = thread_count;
+        thread_count = threads;
+        TriangleMesh mesh;
+        Timer timer;
+        bool loaded = load_mesh(filename, mesh);
+        double seconds = timer.seconds();
+        thread_count = saved;
+        if (!loaded) { return; }
+        std::cout << "  " << name << ": " << mesh.n_triangles() << " triangles in " << seconds * 1e3 << " ms ("
+                  << mesh.n_triangles() / seconds / 1e6 << " Mtriangles/s)\n";
+    };
+
+    std::string ply = write_grid(2237, true); // 10.0M triangles
+    run("PLY, 1 thread", ply, 1);
+    run("PLY          ", ply, 0);
+    std::remove(ply.c_str());
+
+    std::string obj = write_grid(708, false); // 1.0M triangles
+    run("OBJ, 1 thread", obj, 1);
+    run("OBJ          ", obj, 0);
+    std::remove(obj.c_str());
+}
+
+// BVH traversal: rays/s and nodes visited per ray for binary, 4 and 8 wide trees over a sphere scene and a triangle mesh
+
+// a unit sphere with bumps on it, as 2 * n_rings * n_segments triangles
+static TriangleMesh bumpy_sphere(int n_rings, int n_segments) {
+    TriangleMesh mesh;
+    for (int ring = 0; ring <= n_rings; ring++) {
+        for (int segment = 0; segment < n_segments; segment++) {
+            Real theta = pi * ring / n_rings;
+            Real phi = 2 * pi * segment / n_segments;
+            Real r = 1 + 0.02 * std::sin(40 * theta) * std::sin(40 * phi);
+            mesh.vertices.push_back(r * Vec3(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta)));
+        }
+    }
+    for (std::uint32_t ring = 0; ring < static_cast<std::uint32_t>(n_rings); ring++) {
+        for (std::uint32_t segment = 0; segment < static_cast<std::uint32_t>(n_segments); segment++) {
+            std::uint32_t a = ring * n_segments + segment;
+            std::uint32_t b = ring * n_segments + (segment + 1) % n_segments;
+            std::uint32_t triangles[6] = {a, a + n_segments, b, b, a + n_segments, b + n_segments};
+            mesh.indices.insert(mesh.indices.end(), triangles, triangles + 6);
+        }
+    }
+    return mesh;
+}
+
+// rays at the middle of bumpy_sphere() from all around it
+static std::vector<Line3> rays_at_sphere(int n) {
+    std::vector<Line3> rays;
+    for (int i = 0; i < n; i++) {
+        Vec3 origin = 3 * Vec3(normal_double(), normal_double(), normal_double()).unit();
+        Vec3 target(random_double(-0.8, 0.8), random_double(-0.8, 0.8), random_double(-0.8, 0.8));
+        rays.push_back(Line3(origin, (target - origin).unit()));
+    }
+    return rays;
+}
+
+template <typename Accel>
+static void time_bvh(const char* name, const Scene& scene, const std::vector<Line3>& rays, const std::vector<Hit>& expected) {
+    Accel bvh;
+    Timer build_timer;
+    bvh.build(scene.bvh_prims());
+    double build_seconds = build_timer.seconds();
+
+    std::size_t n_nodes_visited = 0;
+    std::vector<Hit> hits(rays.size());
+    Timer timer;
+    for (std::size_t i = 0; i < rays.size(); i++) {
+        Hit& hit = hits[i];
+        bvh.traverse(rays[i], hit.t, [&](const PrimRef& ref) { scene.intersect(ref, rays[i], hit); }, &n_nodes_visited);
+    }
+    double seconds = timer.seconds();
+
+    int mismatches = 0;
+    for (std::size_t i = 0; i < expected.size(); i++) {
+        if (hits[i].type != expected[i].type || hits[i].idx != expected[i].idx) { mismatches++; }
+    }
+    std::cout << "  " << name << ": " << rays.size() / seconds / 1e6 << " M rays/s, " << static_cast<double>(n_nodes_visited) / rays.size()
+              << " nodes/ray, " << bvh.nodes.size() << " nodes (" << bvh.memory() / 1e6 << " MB), built in " << build_seconds * 1e3 << " ms, "
+              << mismatches << "/" << expected.size() << " differ from a linear scan\n";
+}
+
+static void bench_bvh_scene(const char* name, const Scene& scene, const std::vector<Line3>& rays) {
+    // the linear scan is too slow to run every ray through, so it only checks the first few
+    std::vector<Hit> expected;
+    for (std::size_t i = 0; i < std::min<std::size_t>(rays.size(), 1000); i++) { expected.push_back(scene.closest_hit(rays[i])); }
+
+    std::cout << "bvh: " << name << ", " << rays.size() << " rays\n";
+    time_bvh<WideBVH<2>>("binary", scene, rays, expected);
+    time_bvh<WideBVH<4>>("BVH4  ", scene, rays, expected);
+    time_bvh<WideBVH<8>>("BVH8  ", scene, rays, expected);
+}
+
+static void bench_bvh() {
+    const int n_rays = 1000000;
+
+    Scene spheres;
+    for (int i = 0; i < 100000; i++) {
+        spheres.add(Sphere3(Vec3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50)), random_double(0.1, 0.5)));
+    }
+    std::vector<Line3> sphere_rays;
+    for (int i = 0; i < n_rays; i++) {
+        Vec3 origin(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50));
+        sphere_rays.push_back(Line3(origin, Vec3(normal_double(), normal_double(), normal_double()).unit()));
+    }
+    bench_bvh_scene("100k random spheres", spheres, sphere_rays);
+
+    TriangleMesh mesh = bumpy_sphere(500, 1000);
+    Scene triangles;
+    add_mesh(triangles, mesh);
+    bench_bvh_scene("1M triangle mesh", triangles, rays_at_sphere(n_rays));
+}
+
+// Quantised against full precision nodes: memory, rays/s and nodes visited per ray over a 5M triangle mesh
+
+static void bench_quantised() {
+    TriangleMesh mesh = bumpy_sphere(1250, 2000);
+    Scene scene;
+    add_mesh(scene, mesh);
+    std::vector<Line3> rays = rays_at_sphere(500000);
+    std::vector<Hit> expected;
+    for (std::size_t i = 0; i < 100; i++) { expected.push_back(scene.closest_hit(rays[i])); }
+
+    std::cout << "quantised: " << scene.bvh_prims().size() << " triangles, " << rays.size() << " rays, "
+              << sizeof(WideBVH<4>::Node) << "/" << sizeof(QuantisedBVH<4>::Node) << " byte BVH4 nodes, "
+              << sizeof(WideBVH<8>::Node) << "/" << sizeof(QuantisedBVH<8>::Node) << " byte BVH8 nodes\n";
+    time_bvh<WideBVH<4>>("BVH4          ", scene, rays, expected);
+    time_bvh<QuantisedBVH<4>>("quantised BVH4", scene, rays, expected);
+    time_bvh<WideBVH<8>>("BVH8          ", scene, rays, expected);
+    time_bvh<QuantisedBVH<8>>("quantised BVH8", scene, rays, expected);
+}
+
+// BVH build time per million primitives for each preset at 1 to 32 threads, the trace speed each preset's tree gives,
+// and refitting after the mesh moves
+
+static void bench_build() {
+    TriangleMesh mesh = bumpy_sphere(1000, 2000); // 4M triangles
+    Scene scene;
+    add_mesh(scene, mesh);
+    std::vector<BVHPrim> prims = scene.bvh_prims();
+    const double millions = prims.size() / 1e6;
+    std::cout << "build: " << prims.size() << " triangles, " << std::thread::hardware_concurrency() << " hardware threads\n";
+
+    const char* preset_names[2] = {"SAH ", "LBVH"};
+    for (BVHPreset preset : {BVHPreset::quality, BVHPreset::fast}) {
+        std::cout << "  " << preset_names[static_cast<int>(preset)] << " ms per M triangles:";
+        for (unsigned threads : {1, 2, 4, 8, 16, 32}) {
+            thread_count = threads;
+            WideBVH<4> bvh;
+            Timer timer;
+            bvh.build(prims, preset);
+            std::cout << "  " << threads << ": " << timer.seconds() * 1e3 / millions;
+        }
+        thread_count = 0;
+        std::cout << "\n";
+    }
+
+    // trace speed and correctness of each preset's tree, then of a refit one after moving the mesh
+    std::vector<Line3> rays = rays_at_sphere(200000);
+    std::vector<Hit> expected;
+    for (std::size_t i = 0; i < 100; i++) { expected.push_back(scene.closest_hit(rays[i])); }
+    auto trace = [&](const char* name, const std::vector<Hit>& expected) {
+        int mismatches = 0;
+        Timer timer;
+        for (std::size_t i = 0; i < rays.size(); i++) {
+            Hit hit = scene.closest_hit(rays[i]);
+            if (i < expected.size() && (hit.type != expected[i].type || hit.idx != expected[i].idx)) { mismatches++; }
+        }
+        std::cout << "  " << name << ": " << rays.size() / timer.seconds() / 1e6 << " M rays/s, " << mismatches << "/" << expected.size() << " differ from a linear scan\n";
+    };
+    scene.build_bvh(BVHPreset::quality);
+    trace("SAH tree          ", expected);
+    scene.build_bvh(BVHPreset::fast);
+    trace("LBVH tree         ", expected);
+
+    scene.build_bvh(BVHPreset::quality);
+    for (Vec3& vertex : mesh.vertices) { vertex = 1.1 * vertex + Vec3(0.05, 0, 0) * vertex.z; } // stretch and shear
+    WideBVH<4> saved = scene.bvh;
+    scene.bvh.clear();
+    std::vector<Hit> moved_expected;
+    for (std::size_t i = 0; i < expected.size(); i++) { moved_expected.push_back(scene.closest_hit(rays[i])); }
+    scene.bvh = saved;
+    Timer timer;
+    scene.refit_bvh();
+    std::cout << "  refit: " << timer.seconds() * 1e3 / millions << " ms per M triangles\n";
+    trace("refit SAH tree    ", moved_expected);
+    scene.build_bvh(BVHPreset::quality);
+    trace("rebuilt SAH tree  ", moved_expected);
+}
+
+// Startup with a BVH cache: building the tree cold against mapping it from the cache written by the cold run
+
+static void bench_cache() {
+    TriangleMesh mesh = bumpy_sphere(1250, 2000); // 5M triangles
+    Scene scene;
+    add_mesh(scene, mesh);
+    const std::string path = "bench.bvhcache";
+    std::remove(path.c_str());
+
+    Timer cold_timer;
+    scene.build_bvh(path);
+    double cold_seconds = cold_timer.seconds();
+    WideBVH<4> built = scene.bvh;
+
+    scene.bvh.clear();
+    Timer warm_timer;
+    bool used_cache = scene.build_bvh(path);
+    double warm_seconds = warm_timer.seconds();
+
+    Timer bounds_timer;
+    std::vector<BVHPrim> prims = scene.bvh_prims();
+    double bounds_seconds = bounds_timer.seconds();
+    Timer key_timer;
+    bvh_cache_key(prims, BVHPreset::quality, 4);
+    double key_seconds = key_timer.seconds();
+
+    bool same = used_cache && built.nodes.size() == scene.bvh.nodes.size() && built.refs.size() == scene.bvh.refs.size() &&
+                std::memcmp(built.nodes.data(), scene.bvh.nodes.data(), built.nodes.size() * sizeof(WideBVH<4>::Node)) == 0 &&
+                std::memcmp(built.refs.data(), scene.bvh.refs.data(), built.refs.size() * sizeof(PrimRef)) == 0;
+    std::cout << "cache: " << mesh.n_triangles() << " triangles, " << scene.bvh.memory() / 1e6 << " MB tree\n"
+              << "  cold build and save: " << cold_seconds * 1e3 << " ms\n"
+              << "  warm load:           " << warm_seconds * 1e3 << " ms (" << bounds_seconds * 1e3 << " ms of it finding the primitives' bounds, " << key_seconds * 1e3 << " ms hashing them), "
+              << (same ? "identical to the built tree" : "DIFFERENT from the built tree") << "\n";
+    std::remove(path.c_str());
+}
+
+// Instancing: a forest of a million trees sharing one tree object, traced through the two-level BVH. Memory is compared
+// with what the same forest would take as flattened triangles.
+
+static void bench_instances() {
+    const int n_per_side = 1000;
+    const int width = 320;
+    const int height = 180;
+
+    TriangleMesh canopy = bumpy_sphere(12, 24);
+    for (Vec3& vertex : canopy.vertices) { vertex = Vec3(1.5 * vertex.x, 1.5 * vertex.y, 2 * vertex.z + 3); }
+    Object tree;
+    add_mesh(tree, canopy);
+    tree.add(Box3(Vec3(-0.2, -0.2, 0), Vec3(0.2, 0.2, 1.5))); // trunk
+    tree.build_bvh();
+
+    Scene forest;
+    forest.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1)));
+    forest.get<Instance>().reserve(static_cast<std::size_t>(n_per_side) * n_per_side);
+    for (int i = 0; i < n_per_side; i++) {
+        for (int j = 0; j < n_per_side; j++) {
+            Vec3 position(4 * i + random_double(-1.5, 1.5), 4 * j + random_double(-1.5, 1.5), 0);
+            forest.add(Instance(tree, Transform3::translate(position) * Transform3::rotate(Vec3(0, 0, 1), random_double(0, 2 * pi)) *
+                                      Transform3::scale(random_double(0.7, 1.3))));
+        }
+    }
+    Timer build_timer;
+    forest.build_bvh();
+    double build_seconds = build_timer.seconds();
+
+    std::size_t n_instances = forest.get<Instance>().size();
+    std::size_t tree_bytes = canopy.vertices.size() * sizeof(Vec3) + canopy.indices.size() * sizeof(std::uint32_t) +
+                             tree.get<Triangle3>().size() * sizeof(Triangle3) + tree.bvh.memory();
+    std::size_t instance_bytes = n_instances * sizeof(Instance) + forest.bvh.memory();
+    std::size_t flat_triangles = n_instances * tree.get<Triangle3>().size();
+    // vertices, indices, Triangle3 and about one BVH leaf ref per triangle for every copy
+    double flat_bytes = static_cast<double>(n_instances) * (canopy.vertices.size() * sizeof(Vec3) + canopy.indices.size() * sizeof(std::uint32_t)) +
+                        static_cast<double>(flat_triangles) * (sizeof(Triangle3) + sizeof(PrimRef));
+
+    Vec3 lookfrom(-20, -20, 12);
+    Vec3 lookat(60, 60, 0);
+    Camera cam(Real(width) / Real(height), lookat, lookat - lookfrom, (lookat - lookfrom).abs(), 60, 0);
+    std::size_t n_rays = 0;
+    std::size_t n_tree_hits = 0;
+    Timer timer;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            Line3 ray = cam.generate_ray((x + 0.5) / width - 0.5, (y + 0.5) / height - 0.5);
+            for (int depth = 0; depth < 2; depth++) {
+                Hit hit = forest.closest_hit(ray);
+                n_rays++;
+                if (!hit.hit()) { break; }
+                if (hit.inner_type != -1) { n_tree_hits++; }
+                Vec3 point = ray(hit.t);
+                Vec3 normal_unit;
+                forest.visit(hit, [&](const auto& prim) { normal_unit = prim.normal(point); });
+                ray = scatter_matte(point, normal_unit);
+                ray.p = offset_ray_origin(point, normal_unit);
+            }
+        }
+    }
+    double seconds = timer.seconds();
+
+    std::cout << "instances: " << n_instances << " trees of " << tree.get<Triangle3>().size() << " triangles and a box, " << flat_triangles / 1e6 << "M triangles in all\n"
+              << "  memory: tree " << tree_bytes / 1e6 << " MB + instances and top-level BVH " << instance_bytes / 1e6 << " MB, against about "
+              << flat_bytes / 1e9 << " GB flattened\n"
+              << "  top-level BVH built in " << build_seconds * 1e3 << " ms\n"
+              << "  " << width << "x" << height << " camera rays and a diffuse bounce: " << n_rays / seconds / 1e6 << " M rays/s, "
+              << static_cast<double>(n_tree_hits) / n_rays << " of rays hit a tree\n";
+}
+
+// Occlusion queries against closest-hit queries on the same shadow rays: from points around a surface to a light,
+// limited to the light's distance
+
+static void time_occlusion(const char* name, const Scene& scene, const std::vector<Line3>& rays, const std::vector<Real>& t_maxs) {
+    std::vector<char> closest(rays.size());
+    std::vector<char> any(rays.size());
+    Timer closest_timer;
+    for (std::size_t i = 0; i < rays.size(); i++) { closest[i] = scene.closest_hit(rays[i], t_maxs[i]).hit(); }
+    double closest_seconds = closest_timer.seconds();
+    Timer any_timer;
+    for (std::size_t i = 0; i < rays.size(); i++) { any[i] = scene.occluded(rays[i], t_maxs[i]); }
+    double any_seconds = any_timer.seconds();
+
+    std::size_t n_occluded = 0;
+    std::size_t mismatches = 0;
+    for (std::size_t i = 0; i < rays.size(); i++) {
+        n_occluded += any[i];
+        mismatches += any[i] != closest[i];
+    }
+    std::cout << "  " << name << ": closest hit " << rays.size() / closest_seconds / 1e6 << " M rays/s, occluded " << rays.size() / any_seconds / 1e6
+              << " M rays/s (" << closest_seconds / any_seconds << "x), " << 100.0 * n_occluded / rays.size() << "% occluded, "
+              << mismatches << " answers differ\n";
+}
+
+static void bench_occlusion() {
+    const int n_rays = 500000;
+    // shadow rays from points scattered through a ball of the given radius to lights outside it
+    auto shadow_rays = [&](Real radius, std::vector<Line3>& rays, std::vector<Real>& t_maxs) {
+        for (int i = 0; i < n_rays; i++) {
+            Vec3 point = radius * std::cbrt(random_double()) * Vec3(normal_double(), normal_double(), normal_double()).unit();
+            Vec3 light = 3 * radius * Vec3(normal_double(), normal_double(), normal_double()).unit();
+            rays.push_back(Line3(point, (light - point).unit()));
+            t_maxs.push_back((light - point).abs());
+        }
+    };
+
+    std::cout << "occlusion: " << n_rays << " shadow rays\n";
+    Scene spheres;
+    for (int i = 0; i < 100000; i++) {
+        spheres.add(Sphere3(Vec3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50)), random_double(0.1, 0.5)));
+    }
+    spheres.build_bvh();
+    std::vector<Line3> rays;
+    std::vector<Real> t_maxs;
+    shadow_rays(50, rays, t_maxs);
+    time_occlusion("100k random spheres", spheres, rays, t_maxs);
+
+    TriangleMesh mesh = bumpy_sphere(500, 1000);
+    Scene triangles;
+    add_mesh(triangles, mesh);
+    triangles.build_bvh();
+    rays.clear();
+    t_maxs.clear();
+    shadow_rays(1.2, rays, t_maxs);
+    time_occlusion("1M triangle mesh   ", triangles, rays, t_maxs);
+}
+
+// Uniform grid against a linear scan (and the BVH, for reference) over sphere fields: spread evenly, and bunched into
+// clusters, which leaves most cells empty and a few crowded
+
+static void bench_grid_scene(const char* name, const Scene& scene, const std::vector<Line3>& rays) {
+    const std::size_t n_linear = 2000; // the linear scan only runs this many rays
+    std::vector<Hit> expected;
+    Timer linear_timer;
+    for (std::size_t i = 0; i < n_linear; i++) { expected.push_back(scene.closest_hit(rays[i])); }
+    double linear_seconds = linear_timer.seconds();
+    std::cout << "  " << name << "\n    linear scan: " << n_linear / linear_seconds / 1e6 << " M rays/s\n";
+
+    std::vector<BVHPrim> prims = scene.bvh_prims();
+    auto report = [&](const char* accel, double build_seconds, double seconds, std::size_t memory, const std::vector<Hit>& hits, const std::string& extra) {
+        int mismatches = 0;
+        for (std::size_t i = 0; i < expected.size(); i++) {
+            if (hits[i].type != expected[i].type || hits[i].idx != expected[i].idx) { mismatches++; }
+        }
+        std::cout << "    " << accel << ": " << rays.size() / seconds / 1e6 << " M rays/s, built in " << build_seconds * 1e3 << " ms, "
+                  << memory / 1e6 << " MB" << extra << ", " << mismatches << "/" << expected.size() << " differ from the linear scan\n";
+    };
+
+    for (float density : {1.0f, 2.0f, 4.0f}) {
+        GridAccel grid;
+        Timer build_timer;
+        grid.build(prims, density);
+        double build_seconds = build_timer.seconds();
+        std::vector<Hit> hits(rays.size());
+        std::size_t n_cells_visited = 0;
+        Timer timer;
+        for (std::size_t i = 0; i < rays.size(); i++) {
+            Hit& hit = hits[i];
+            grid.traverse(rays[i], hit.t, [&](const PrimRef& ref) { scene.intersect(ref, rays[i], hit); }, &n_cells_visited);
+        }
+        double seconds = timer.seconds();
+        std::string extra = ", " + std::to_string(grid.res[0]) + "x" + std::to_string(grid.res[1]) + "x" + std::to_string(grid.res[2]) + " cells, " +
+                            std::to_string(static_cast<double>(n_cells_visited) / rays.size()) + " cells/ray";
+        std::string accel = "grid (" + std::to_string(static_cast<int>(density)) + " cells/sphere)";
+        report(accel.c_str(), build_seconds, seconds, grid.memory(), hits, extra);
+    }
+
+    WideBVH<4> bvh;
+    Timer build_timer;
+    bvh.build(prims);
+    double build_seconds = build_timer.seconds();
+    std::vector<Hit> hits(rays.size());
+    Timer timer;
+    for (std::size_t i = 0; i < rays.size(); i++) {
+        Hit& hit = hits[i];
+        bvh.traverse(rays[i], hit.t, [&](const PrimRef& ref) { scene.intersect(ref, rays[i], hit); });
+    }
+    report("BVH4                ", build_seconds, timer.seconds(), bvh.memory(), hits, "");
+}
+
+static void bench_grid() {
+    const int n_spheres = 300000;
+    const int n_rays = 500000;
+    auto random_rays_in = [&](Real half_size) {
+        std::vector<Line3> rays;
+        for (int i = 0; i < n_rays; i++) {
+            Vec3 origin(random_double(-half_size, half_size), random_double(-half_size, half_size), random_double(-half_size, half_size));
+            rays.push_back(Line3(origin, Vec3(normal_double(), normal_double(), normal_double()).unit()));
+        }
+        return rays;
+    };
+    std::cout << "grid: " << n_spheres << " spheres, " << n_rays << " rays\n";
+
+    Scene uniform;
+    for (int i = 0; i < n_spheres; i++) {
+        uniform.add(Sphere3(Vec3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50)), random_double(0.2, 0.4)));
+    }
+    bench_grid_scene("uniform in a 100^3 box", uniform, random_rays_in(50));
+
+    Scene clustered;
+    std::vector<Vec3> centres;
+    for (int i = 0; i < 20; i++) { centres.push_back(Vec3(random_double(-50, 50), random_double(-50, 50), random_double(-50, 50))); }
+    for (int i = 0; i < n_spheres; i++) {
+        Vec3 offset = 3 * Vec3(normal_double(), normal_double(), normal_double());
+        clustered.add(Sphere3(centres[i % centres.size()] + offset, random_double(0.05, 0.1)));
+    }
+    bench_grid_scene("20 gaussian clusters", clustered, random_rays_in(50));
+}
+
+// Out-of-core tracing: a mesh streamed in clusters from a file through a cache much smaller than it, against the same
+// mesh held in memory
+
+static void bench_stream() {
+    const std::size_t cache_bytes = 16 << 20;
+    TriangleMesh mesh = bumpy_sphere(1000, 1000); // 2M triangles
+    const std::string path = "bench.clusters";
+    Timer write_timer;
+    if (!write_clustered_mesh(path, mesh)) { return; }
+    double write_seconds = write_timer.seconds();
+
+    StreamedMesh streamed;
+    if (!streamed.open(path, cache_bytes)) { return; }
+    std::vector<Line3> rays = rays_at_sphere(500000);
+    std::vector<StreamedHit> hits;
+    Timer trace_timer;
+    streamed.trace(rays, hits);
+    double trace_seconds = trace_timer.seconds();
+
+    Scene scene;
+    add_mesh(scene, mesh);
+    scene.build_bvh();
+    Timer memory_timer;
+    std::size_t n_mismatches = 0;
+    for (std::size_t i = 0; i < rays.size(); i++) {
+        Hit expected = scene.closest_hit(rays[i]);
+        if (expected.hit() != hits[i].hit() || (expected.hit() && expected.t != hits[i].t)) { n_mismatches++; }
+    }
+    double memory_seconds = memory_timer.seconds();
+
+    const StreamStats& stats = streamed.stats;
+    std::cout << "stream: " << mesh.n_triangles() << " triangles in " << streamed.n_clusters() << " clusters, "
+              << cache_bytes / 1e6 << " MB cache, written in " << write_seconds * 1e3 << " ms\n"
+              << "  streamed:  " << rays.size() / trace_seconds / 1e6 << " M rays/s, " << stats.cluster_visits << " cluster visits, "
+              << stats.hit_rate() * 100 << "% cache hits, " << stats.page_ins << " page-ins, " << stats.bytes_paged_in / 1e6 << " MB paged in at "
+              << stats.bandwidth() / 1e6 << " MB/s, " << static_cast<double>(stats.rays_queued) / rays.size() << " queue visits per ray\n"
+              << "  in memory: " << rays.size() / memory_seconds / 1e6 << " M rays/s, " << scene.bvh.memory() / 1e6 << " MB tree; "
+              << n_mismatches << " hits differ\n";
+    std::remove(path.c_str());
+}
+
+// Next-event estimation: a closed room lit only by two small lights, rendered for the same time with paths that must
+// hit a light by chance and with lights sampled at every matte bounce (MIS weighted against the bounces finding them).
+// Noise is the RMS difference from a long reference render.
+
+static void bench_nee() {
+    const int width = 96;
+    const int height = 72;
+    const double seconds_each = 4;
+    const int reference_spp = 8192;
+
+    MaterialTable materials;
+    MaterialId white = materials.add(Material::matte, Colour(0.75, 0.75, 0.75));
+    Scene scene;
+    scene.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1), white)); // floor
+    scene.add(Plane3(Vec3(0, 0, 2), Vec3(0, 0, -1), white)); // ceiling
+    scene.add(Plane3(Vec3(0, 1, 0), Vec3(0, -1, 0), white)); // back
+    scene.add(Plane3(Vec3(0, -1, 0), Vec3(0, 1, 0), white)); // behind the camera
+    scene.add(Plane3(Vec3(-1, 0, 0), Vec3(1, 0, 0), materials.add(Material::matte, Colour(0.7, 0.15, 0.1))));
+    scene.add(Plane3(Vec3(1, 0, 0), Vec3(-1, 0, 0), materials.add(Material::matte, Colour(0.15, 0.6, 0.15))));
+    scene.add(Box3(Vec3(-0.7, 0.1, 0), Vec3(-0.2, 0.6, 0.9), white));
+    scene.add(Sphere3(Vec3(0.4, 0.3, 0.35), 0.35, materials.add(Material::matte, Colour(0.2, 0.3, 0.7))));
+    scene.add(Sphere3(Vec3(-0.2, 0.4, 1.8), 0.04, materials.add_emissive(Colour(300, 260, 200))));
+    scene.add(Disk3(Vec3(0.5, 0.6, 1.99), Vec3(0, 0, -1), 0.08, materials.add_emissive(Colour(40, 40, 50))));
+    scene.build_bvh();
+    LightSet lights;
+    lights.build(scene, materials);
+
+    Camera cam(Real(width) / Real(height), Vec3(0, -0.2, 0.8), Vec3(0, 1, -0.3), 1, 60, 0);
+    auto render_pass = [&](std::vector<Colour>& sum, bool sample_lights) {
+        PathTracer tracer(scene, materials, lights);
+        tracer.max_depth = 6;
+        tracer.sample_lights = sample_lights;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                sum[y * width + x] += tracer.trace(ray);
+            }
+        }
+    };
+
+    std::cout << "nee: " << width << "x" << height << " room lit by a small sphere and disk, " << seconds_each << " s per render\n";
+    std::vector<Colour> reference(width * height);
+    for (int pass = 0; pass < reference_spp; pass++) { render_pass(reference, true); }
+    for (Colour& pixel : reference) { pixel /= reference_spp; }
+
+    auto run = [&](const char* name, bool sample_lights) {
+        std::vector<Colour> sum(width * height);
+        int spp = 0;
+        Timer timer;
+        while (timer.seconds() < seconds_each) {
+            render_pass(sum, sample_lights);
+            spp++;
+        }
+        double error2 = 0;
+        double mean = 0;
+        double reference_mean = 0;
+        for (std::size_t i = 0; i < sum.size(); i++) {
+            Colour difference = sum[i] / spp - reference[i];
+            error2 += difference.abs2() / 3;
+            mean += luminance(sum[i] / spp) / sum.size();
+            reference_mean += luminance(reference[i]) / sum.size();
+        }
+        double rmse = std::sqrt(error2 / sum.size());
+        std::cout << "  " << name << ": " << spp << " spp, RMSE " << rmse << " (" << 100 * rmse / reference_mean << "% of the mean), mean luminance "
+                  << mean << " against " << reference_mean << "\n";
+        return rmse;
+    };
+    double scatter_rmse = run("scatter only       ", false);
+    double nee_rmse = run("lights sampled, MIS", true);
+    std::cout << "  " << scatter_rmse / nee_rmse << "x less noise, ~" << (scatter_rmse * scatter_rmse) / (nee_rmse * nee_rmse)
+              << "x less time for equal noise\n";
+}
+
+// Many lights: a city at night lit by small emissive spheres along its streets, with lights picked uniformly, by power,
+// and through the light tree. Each renders the same number of samples; noise is the RMS difference from a long
+// render using the tree. The lights themselves aren't shown, as their edges would be equally noisy whichever is used.
+// The scenes are random, so the figures vary from run to run.
+
+static void bench_lights() {
+    const int width = 64;
+    const int height = 48;
+    const int spp = 16;
+    const int reference_spp = 8192;
+    const Real half_size = 100;
+    const int blocks = 40; // per side
+
+    Camera cam(Real(width) / Real(height), Vec3(-60, -60, 0), Vec3(1, 1, -0.6), 20, 60, 0);
+    auto render = [&](const Scene& scene, const MaterialTable& materials, const LightSet& lights, int n_spp) {
+        PathTracer tracer(scene, materials, lights);
+        tracer.max_depth = 1;
+        tracer.show_lights = false;
+        std::vector<Colour> image(width * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int i = 0; i < n_spp; i++) {
+                    Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                    image[y * width + x] += tracer.trace(ray);
+                }
+                image[y * width + x] /= n_spp;
+            }
+        }
+        return image;
+    };
+
+    std::cout << "lights: " << width << "x" << height << " city at night, " << spp << " spp of direct light, RMSE against "
+              << reference_spp << " spp with the tree\n";
+    for (int n_lights : {100, 10000, 1000000}) {
+        MaterialTable materials;
+        Scene scene;
+        scene.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1), materials.add(Material::matte, Colour(0.3, 0.3, 0.3))));
+        MaterialId concrete = materials.add(Material::matte, Colour(0.6, 0.55, 0.5));
+        const Real block = 2 * half_size / blocks;
+        for (int i = 0; i < blocks; i++) {
+            for (int j = 0; j < blocks; j++) {
+                Vec3 corner(-half_size + i * block + 0.15 * block, -half_size + j * block + 0.15 * block, 0);
+                scene.add(Box3(corner, corner + Vec3(0.7 * block, 0.7 * block, random_double(2, 12)), concrete));
+            }
+        }
+        // street lights and windows: mostly dim, a few bright, in a handful of colours
+        std::vector<MaterialId> glows;
+        for (int i = 0; i < 16; i++) {
+            Colour tint(random_double(0.6, 1), random_double(0.5, 0.9), random_double(0.3, 0.8));
+            glows.push_back(materials.add_emissive(tint * (i < 12 ? 2000.0 : 20000.0) * (100.0 / std::sqrt(n_lights))));
+        }
+        for (int i = 0; i < n_lights; i++) {
+            // on the streets between the blocks
+            Real along = random_double(-half_size, half_size);
+            Real across = -half_size + std::floor(random_double(0, blocks + 1)) * block + random_double(-0.1, 0.1) * block;
+            Vec3 centre = random_double() < 0.5 ? Vec3(along, across, random_double(0.2, 3)) : Vec3(across, along, random_double(0.2, 3));
+            scene.add(Sphere3(centre, 0.05, glows[static_cast<std::size_t>(random_double() * glows.size()) % glows.size()]));
+        }
+        Timer build_timer;
+        scene.build_bvh();
+        LightSet lights;
+        lights.build(scene, materials);
+        double build_seconds = build_timer.seconds();
+
+        std::vector<Colour> reference = render(scene, materials, lights, reference_spp);
+        double reference_mean = 0;
+        for (const Colour& pixel : reference) { reference_mean += luminance(pixel) / reference.size(); }
+        std::cout << "  " << n_lights << " lights (scene and light tree built in " << build_seconds * 1e3 << " ms, light tree "
+                  << lights.memory() / 1e6 << " MB):\n";
+        for (auto [name, picking] : {std::pair{"uniform", LightPicking::uniform}, std::pair{"power  ", LightPicking::power}, std::pair{"tree   ", LightPicking::tree}}) {
+            lights.picking = picking;
+            Timer timer;
+            std::vector<Colour> image = render(scene, materials, lights, spp);
+            double seconds = timer.seconds();
+            // relative MSE as well, as the RMSE is dominated by the few pixels nearest a light
+            double error2 = 0;
+            double relative_error2 = 0;
+            for (std::size_t i = 0; i < image.size(); i++) {
+                error2 += (image[i] - reference[i]).abs2() / 3 / image.size();
+                relative_error2 += (image[i] - reference[i]).abs2() / (reference[i].abs2() + 0.01) / image.size();
+            }
+            std::cout << "    " << name << ": " << seconds * 1e3 << " ms, RMSE " << std::sqrt(error2) << " (" << 100 * std::sqrt(error2) / reference_mean
+                      << "% of the mean), relative MSE " << relative_error2 << "\n";
+        }
+    }
+}
+
+// an equirectangular sky, blue overhead and paler towards a dark ground, with a round sun of the given angular radius
+static Framebuffer sun_sky(int width, int height, const Vec3& sun_direction, Real sun_radius_degrees, const Colour& sun) {
+    Framebuffer sky(width, height);
+    const Real sun_cos = std::cos(sun_radius_degrees * pi / 180);
+    for (int row = 0; row < height; row++) {
+        for (int column = 0; column < width; column++) {
+            Real theta = pi * (row + 0.5) / height;
+            Real phi = 2 * pi * (column + 0.5) / width;
+            Vec3 d(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
+            Colour value = d.z > 0 ? (1 - d.z) * Colour(0.9, 0.9, 1.0) + d.z * Colour(0.3, 0.5, 1.0) : Colour(0.05, 0.04, 0.03);
+            if (dot(d, sun_direction) > sun_cos) { value = sun; }
+            sky.set_pixel(column, row, value);
+        }
+    }
+    return sky;
+}
+
+// Environment map lighting: loading a 2048x1024 sky with a small sun from PFM and RLE HDR files and building its
+// sampling tables, then a diffuse scene lit by it rendered for the same time with the sun found by chance and with
+// the map sampled at every bounce
+
+static void bench_env() {
+    const int sky_width = 2048;
+    const int sky_height = 1024;
+    const int width = 96;
+    const int height = 54;
+    const double seconds_each = 4;
+    const int reference_spp = 512;
+
+    // a blue sky over a dark ground, with a sun half a degree across 30 degrees up
+    const Vec3 sun_direction = Vec3(std::cos(pi / 6) * std::cos(1.0), std::cos(pi / 6) * std::sin(1.0), std::sin(pi / 6));
+    Framebuffer sky = sun_sky(sky_width, sky_height, sun_direction, 0.25, Colour(60000, 55000, 50000));
+
+    std::cout << "env: " << sky_width << "x" << sky_height << " sky, " << n_threads() << " threads\n";
+    for (const char* path : {"bench_sky.pfm", "bench_sky.hdr"}) {
+        bool hdr = path[std::strlen(path) - 1] == 'r';
+        if (!(hdr ? save_hdr(path, sky) : save_pfm(path, sky))) { return; }
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        std::size_t file_size = file.tellg();
+        Framebuffer loaded(0, 0);
+        Timer load_timer;
+        bool ok = load_hdr_image(path, loaded);
+        double load_seconds = load_timer.seconds();
+        double worst = 0; // relative error, against the brightest channel of each pixel
+        for (std::size_t i = 0; ok && i < sky.pixels.size(); i += 3) {
+            float brightest = std::max({sky.pixels[i], sky.pixels[i + 1], sky.pixels[i + 2]});
+            for (int c = 0; c < 3; c++) { worst = std::max(worst, std::fabs(double(loaded.pixels[i + c]) - sky.pixels[i + c]) / brightest); }
+        }
+        std::cout << "  load " << path << " (" << file_size / 1e6 << " MB): " << load_seconds * 1e3 << " ms, largest error " << worst * 100 << "%\n";
+        std::remove(path);
+    }
+    EnvironmentMap environment;
+    Timer build_timer;
+    environment.build(sky);
+    std::cout << "  sampling tables: " << build_timer.seconds() * 1e3 << " ms\n";
+
+    MaterialTable materials;
+    Scene scene;
+    scene.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1), materials.add(Material::matte, Colour(0.5, 0.5, 0.5))));
+    scene.add(Sphere3(Vec3(0, 0, 0.5), 0.5, materials.add(Material::matte, Colour(0.7, 0.3, 0.3))));
+    scene.add(Sphere3(Vec3(1.1, 0.3, 0.35), 0.35, materials.add(Material::matte, Colour(0.3, 0.6, 0.3))));
+    scene.add(Box3(Vec3(-1.6, -0.2, 0), Vec3(-0.8, 0.6, 0.8), materials.add(Material::matte, Colour(0.6, 0.6, 0.7))));
+    scene.build_bvh();
+    LightSet lights;
+    lights.build(scene, materials);
+    lights.environment = &environment;
+
+    Camera cam(Real(width) / Real(height), Vec3(0, 0, 0.4), Vec3(0, 1, -0.25), 2.5, 60, 0);
+    auto render_pass = [&](std::vector<Colour>& sum, bool sample_lights) {
+        PathTracer tracer(scene, materials, lights);
+        tracer.max_depth = 3;
+        tracer.sample_lights = sample_lights;
+        tracer.show_lights = false;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                sum[y * width + x] += tracer.trace(ray);
+            }
+        }
+    };
+    std::vector<Colour> reference(width * height);
+    for (int pass = 0; pass < reference_spp; pass++) { render_pass(reference, true); }
+    for (Colour& pixel : reference) { pixel /= reference_spp; }
+
+    auto run = [&](const char* name, bool sample_lights) {
+        std::vector<Colour> sum(width * height);
+        int spp = 0;
+        Timer timer;
+        while (timer.seconds() < seconds_each) {
+            render_pass(sum, sample_lights);
+            spp++;
+        }
+        double error2 = 0;
+        double reference_mean = 0;
+        for (std::size_t i = 0; i < sum.size(); i++) {
+            error2 += (sum[i] / spp - reference[i]).abs2() / 3 / sum.size();
+            reference_mean += luminance(reference[i]) / sum.size();
+        }
+        std::cout << "  " << name << ": " << spp << " spp in " << seconds_each << " s, RMSE " << std::sqrt(error2) << " ("
+                  << 100 * std::sqrt(error2) / reference_mean << "% of the mean)\n";
+        return std::sqrt(error2);
+    };
+    double scatter_rmse = run("scatter only      ", false);
+    double sampled_rmse = run("map sampled, MIS  ", true);
+    std::cout << "  " << scatter_rmse / sampled_rmse << "x less noise, ~" << (scatter_rmse * scatter_rmse) / (sampled_rmse * sampled_rmse)
+              << "x less time for equal noise\n";
+}
+
+// Caustics from a sun through a solid and a hollow glass sphere onto the ground. Path tracing, even sampling the sun at
+// every matte bounce, only finds it through the glass by chance; the caustic map traces photons from it instead. Both
+// render for the same time, the map's including tracing its photons, and are compared with a long path traced
+// reference (which has no bias, just noise of its own), over the whole image and over the pixels the caustics light.
+
+static void bench_caustics() {
+    const int width = 64;
+    const int height = 40;
+    const double seconds_each = 4;
+    const int reference_spp = 16384;
+    const std::size_t n_photons = 1000000;
+
+    const Vec3 sun_direction = Vec3(std::cos(0.95) * std::cos(0.4), std::cos(0.95) * std::sin(0.4), std::sin(0.95));
+    EnvironmentMap environment;
+    environment.build(sun_sky(1024, 512, sun_direction, 1, Colour(4000, 3700, 3300)));
+
+    MaterialTable materials;
+    MaterialId glass = materials.add(Material::glass);
+    Scene scene;
+    scene.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1), materials.add(Material::matte, Colour(0.6, 0.6, 0.6))));
+    scene.add(Sphere3(Vec3(-0.55, 0.3, 0.8), 0.4, glass));
+    scene.add(Sphere3(Vec3(0.55, 0.3, 0.8), 0.4, glass));
+    scene.add(Sphere3(Vec3(0.55, 0.3, 0.8), 0.32, glass, true));
+    scene.add(Sphere3(Vec3(0.1, -0.5, 0.2), 0.2, materials.add(Material::matte, Colour(0.7, 0.3, 0.2))));
+    scene.build_bvh();
+    LightSet lights;
+    lights.build(scene, materials);
+    lights.environment = &environment;
+
+    Camera cam(Real(width) / Real(height), Vec3(-0.2, 0, 0.2), Vec3(0, 1, -0.9), 2.5, 70, 0);
+    // rows in parallel: the map is only read while gathering
+    auto render_pass = [&](std::vector<Colour>& sum, const CausticMap* caustics) {
+        PathTracer tracer(scene, materials, lights);
+        tracer.max_depth = 8;
+        tracer.caustics = caustics;
+        std::uint64_t seed = next_pass_seed();
+        parallel_for(0, height, [&](std::size_t y) {
+            seed_random(seed, y);
+            for (int x = 0; x < width; x++) {
+                Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                sum[y * width + x] += tracer.trace(ray);
+            }
+        });
+    };
+
+    std::cout << "caustics: " << width << "x" << height << ", sun through glass spheres, " << seconds_each << " s per render, "
+              << n_threads() << " threads\n";
+    std::vector<Colour> reference(width * height);
+    for (int pass = 0; pass < reference_spp; pass++) { render_pass(reference, nullptr); }
+    for (Colour& pixel : reference) { pixel /= reference_spp; }
+
+    // the caustics are where a render with the map is brighter than one with no light through the glass (an empty map
+    // drops it). Both are smooth, so noise in the reference doesn't pick the pixels.
+    CausticMap caustics;
+    caustics.radius = 0.015;
+    caustics.emit(scene, materials, [](const Vec3&) { return Colour(0, 0, 0); }, &environment, n_photons);
+    CausticMap no_caustics;
+    const int mask_spp = 256;
+    std::vector<Colour> with(width * height);
+    std::vector<Colour> without(width * height);
+    for (int pass = 0; pass < mask_spp; pass++) {
+        render_pass(with, &caustics);
+        render_pass(without, &no_caustics);
+    }
+    std::vector<bool> in_caustic(width * height);
+    int n_caustic = 0;
+    for (int i = 0; i < width * height; i++) {
+        in_caustic[i] = luminance(with[i] - without[i]) > 0.25 * luminance(with[i]);
+        n_caustic += in_caustic[i];
+    }
+
+    auto run = [&](const char* name, bool use_map) {
+        std::vector<Colour> sum(width * height);
+        int spp = 0;
+        Timer timer;
+        double emit_seconds = 0;
+        if (use_map) {
+            caustics.emit(scene, materials, [](const Vec3&) { return Colour(0, 0, 0); }, &environment, n_photons);
+            emit_seconds = timer.seconds();
+        }
+        while (timer.seconds() < seconds_each) {
+            render_pass(sum, use_map ? &caustics : nullptr);
+            spp++;
+        }
+        double error2 = 0;
+        double caustic_error2 = 0;
+        for (std::size_t i = 0; i < sum.size(); i++) {
+            double e = (sum[i] / spp - reference[i]).abs2() / 3;
+            error2 += e / sum.size();
+            if (in_caustic[i]) { caustic_error2 += e / n_caustic; }
+        }
+        std::cout << "  " << name << ": " << spp << " spp";
+        if (use_map) { std::cout << " after " << caustics.photons.size() << " photons in " << emit_seconds * 1e3 << " ms"; }
+        std::cout << ", RMSE " << std::sqrt(error2) << ", in the caustics " << std::sqrt(caustic_error2) << "\n";
+        return std::sqrt(caustic_error2);
+    };
+    std::cout << "  " << n_caustic << " pixels in the caustics\n";
+    double traced = run("path traced ", false);
+    double mapped = run("caustic map ", true);
+    std::cout << "  " << traced / mapped << "x less error in the caustics\n";
+}
+
+// Radiance cache: the lit room from the nee bench, all matte, where paths run through long chains of diffuse bounces.
+// Full paths of up to 32 rays (long enough that the light cut off is negligible) against paths that end in the cache
+// after 1 bounce, rendered for the same time with rows in parallel and compared with a long render of full paths. The
+// cache is filled as its render goes, from nothing.
+
+static void bench_radiance() {
+    const int width = 96;
+    const int height = 72;
+    const double seconds_each = 4;
+    const int reference_spp = 1024;
+    const int max_depth = 32;
+
+    MaterialTable materials;
+    MaterialId white = materials.add(Material::matte, Colour(0.75, 0.75, 0.75));
+    Scene scene;
+    scene.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1), white)); // floor
+    scene.add(Plane3(Vec3(0, 0, 2), Vec3(0, 0, -1), white)); // ceiling
+    scene.add(Plane3(Vec3(0, 1, 0), Vec3(0, -1, 0), white)); // back
+    scene.add(Plane3(Vec3(0, -1, 0), Vec3(0, 1, 0), white)); // behind the camera
+    scene.add(Plane3(Vec3(-1, 0, 0), Vec3(1, 0, 0), materials.add(Material::matte, Colour(0.7, 0.15, 0.1))));
+    scene.add(Plane3(Vec3(1, 0, 0), Vec3(-1, 0, 0), materials.add(Material::matte, Colour(0.15, 0.6, 0.15))));
+    scene.add(Box3(Vec3(-0.7, 0.1, 0), Vec3(-0.2, 0.6, 0.9), white));
+    scene.add(Sphere3(Vec3(0.4, 0.3, 0.35), 0.35, materials.add(Material::matte, Colour(0.2, 0.3, 0.7))));
+    scene.add(Sphere3(Vec3(-0.2, 0.4, 1.8), 0.04, materials.add_emissive(Colour(300, 260, 200))));
+    scene.add(Disk3(Vec3(0.5, 0.6, 1.99), Vec3(0, 0, -1), 0.08, materials.add_emissive(Colour(40, 40, 50))));
+    scene.build_bvh();
+    LightSet lights;
+    lights.build(scene, materials);
+
+    Camera cam(Real(width) / Real(height), Vec3(0, -0.2, 0.8), Vec3(0, 1, -0.3), 1, 60, 0);
+    auto render_pass = [&](std::vector<Colour>& sum, RadianceCache* cache) {
+        PathTracer tracer(scene, materials, lights);
+        tracer.max_depth = max_depth;
+        tracer.cache = cache;
+        std::uint64_t seed = next_pass_seed();
+        parallel_for(0, height, [&](std::size_t y) {
+            seed_random(seed, y);
+            for (int x = 0; x < width; x++) {
+                Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                sum[y * width + x] += tracer.trace(ray);
+            }
+        });
+    };
+
+    std::cout << "radiance: " << width << "x" << height << " matte room, " << seconds_each << " s per render, " << n_threads() << " threads\n";
+    std::vector<Colour> reference(width * height);
+    for (int pass = 0; pass < reference_spp; pass++) { render_pass(reference, nullptr); }
+    for (Colour& pixel : reference) { pixel /= reference_spp; }
+
+    auto run = [&](const char* name, RadianceCache* cache) {
+        std::vector<Colour> sum(width * height);
+        int spp = 0;
+        Timer timer;
+        while (timer.seconds() < seconds_each) {
+            render_pass(sum, cache);
+            spp++;
+        }
+        double error2 = 0;
+        double mean = 0;
+        double reference_mean = 0;
+        for (std::size_t i = 0; i < sum.size(); i++) {
+            error2 += (sum[i] / spp - reference[i]).abs2() / 3 / sum.size();
+            mean += luminance(sum[i] / spp) / sum.size();
+            reference_mean += luminance(reference[i]) / sum.size();
+        }
+        std::cout << "  " << name << ": " << spp << " spp, RMSE " << std::sqrt(error2) << ", mean luminance " << mean << " against "
+                  << reference_mean << "\n";
+        if (cache) {
+            std::cout << "    " << 100 * cache->hit_rate() << "% of " << cache->lookups() << " lookups hit, " << cache->cells_used()
+                      << " cells used, " << cache->memory() / 1e6 << " MB\n";
+        }
+        return std::sqrt(error2);
+    };
+    double full_rmse = run("full paths    ", nullptr);
+    RadianceCache cache;
+    cache.depth = 1;
+    double cached_rmse = run("radiance cache", &cache);
+    std::cout << "  " << full_rmse / cached_rmse << "x less error\n";
+}
+
+// Path guiding: two rooms joined by a door left ajar, with a small light in the far one and the camera looking away from
+// the gap, so all the light it sees has come through the gap and bounced at least once on this side. Cosine-weighted
+// scattering with light sampling against the same with a guide, each rendered for the same time with rows in parallel.
+// The guide is trained in passes of 1, 2, 4, ... samples per pixel while they fit in a quarter of the time, and their images
+// are thrown away. Noise is the RMS difference from a long render without guiding. The overhead is the extra
+// time per sample of guided paths over plain ones once the guide is trained; paths are a fixed length, as the rooms are
+// closed.
+
+static void bench_guiding() {
+    const int width = 64;
+    const int height = 48;
+    const double seconds_each = 20;
+    const int reference_spp = 4096;
+    const int max_depth = 8;
+
+    MaterialTable materials;
+    MaterialId white = materials.add(Material::matte, Colour(0.75, 0.75, 0.75));
+    Scene scene;
+    scene.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1), white)); // floor
+    scene.add(Plane3(Vec3(0, 0, 2), Vec3(0, 0, -1), white)); // ceiling
+    scene.add(Plane3(Vec3(0, 3, 0), Vec3(0, -1, 0), white)); // back of the far room
+    scene.add(Plane3(Vec3(0, -1, 0), Vec3(0, 1, 0), white)); // behind the camera
+    scene.add(Plane3(Vec3(-2, 0, 0), Vec3(1, 0, 0), materials.add(Material::matte, Colour(0.7, 0.15, 0.1))));
+    scene.add(Plane3(Vec3(2, 0, 0), Vec3(-1, 0, 0), materials.add(Material::matte, Colour(0.15, 0.6, 0.15))));
+    // the wall between the rooms, with a narrow gap near its right end
+    scene.add(Box3(Vec3(-2, 1, 0), Vec3(0.6, 1.1, 2), white));
+    scene.add(Box3(Vec3(0.8, 1, 0), Vec3(2, 1.1, 2), white));
+    scene.add(Box3(Vec3(0.6, 1, 1.5), Vec3(0.8, 1.1, 2), white));
+    // 40k triangles on this side, so rays cost more like they do in a real scene than in a room of a few primitives
+    TriangleMesh statue = bumpy_sphere(100, 200);
+    for (Vec3& vertex : statue.vertices) { vertex = 0.4 * vertex + Vec3(-1, 0.2, 0.4); }
+    add_mesh(scene, statue); // material 0, white
+    scene.add(Sphere3(Vec3(-1.2, 2.2, 1.2), 0.1, materials.add_emissive(Colour(1600, 1440, 1200))));
+    scene.build_bvh();
+    LightSet lights;
+    lights.build(scene, materials);
+    AABB3 room(Vec3(-2, -1, 0), Vec3(2, 3, 2));
+
+    Camera cam(Real(width) / Real(height), Vec3(1.6, -0.8, 1), Vec3(-1, 0.4, -0.3), 1, 70, 0);
+    auto render_pass = [&](std::vector<Colour>& sum, PathGuide* guide) {
+        PathTracer tracer(scene, materials, lights);
+        tracer.max_depth = max_depth;
+        tracer.guide = guide;
+        std::uint64_t seed = next_pass_seed();
+        parallel_for(0, height, [&](std::size_t y) {
+            seed_random(seed, y);
+            for (int x = 0; x < width; x++) {
+                Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                sum[y * width + x] += tracer.trace(ray);
+            }
+        });
+    };
+
+    std::cout << "guiding: " << width << "x" << height << " two rooms lit through a gap, " << seconds_each << " s per render, "
+              << n_threads() << " threads\n";
+    std::vector<Colour> reference(width * height);
+    for (int pass = 0; pass < reference_spp; pass++) { render_pass(reference, nullptr); }
+    for (Colour& pixel : reference) { pixel /= reference_spp; }
+
+    auto run = [&](const char* name, PathGuide* guide, int& spp) {
+        Timer timer;
+        if (guide) {
+            guide->reset(room);
+            // each pass takes about twice as long as the last, so stop before the next would run past a quarter of the time
+            for (int spp = 1; ; spp *= 2) {
+                Timer pass_timer;
+                std::vector<Colour> thrown_away(width * height);
+                for (int pass = 0; pass < spp; pass++) { render_pass(thrown_away, guide); }
+                guide->refine();
+                if (timer.seconds() + 2 * pass_timer.seconds() > seconds_each / 4) { break; }
+            }
+            guide->recording = false;
+            std::cout << "  trained for " << timer.seconds() << " s: " << guide->pass() << " passes, " << guide->regions() << " regions, "
+                      << guide->memory() / 1e6 << " MB\n";
+        }
+        std::vector<Colour> sum(width * height);
+        spp = 0;
+        while (timer.seconds() < seconds_each) {
+            render_pass(sum, guide);
+            spp++;
+        }
+        double error2 = 0;
+        double mean = 0;
+        double reference_mean = 0;
+        for (std::size_t i = 0; i < sum.size(); i++) {
+            error2 += (sum[i] / spp - reference[i]).abs2() / 3 / sum.size();
+            mean += luminance(sum[i] / spp) / sum.size();
+            reference_mean += luminance(reference[i]) / sum.size();
+        }
+        std::cout << "  " << name << ": " << spp << " spp, RMSE " << std::sqrt(error2) << ", mean luminance " << mean << " against "
+                  << reference_mean << "\n";
+        return std::sqrt(error2);
+    };
+    int plain_spp, guided_spp;
+    double plain_rmse = run("cosine + lights", nullptr, plain_spp);
+    PathGuide guide;
+    double guided_rmse = run("guided + lights", &guide, guided_spp);
+    std::cout << "  " << plain_rmse / guided_rmse << "x less error, ~" << (plain_rmse * plain_rmse) / (guided_rmse * guided_rmse)
+              << "x less time for equal noise, ~" << (plain_rmse * plain_rmse * plain_spp) / (guided_rmse * guided_rmse * guided_spp)
+              << "x less variance per sample\n";
+
+    // the same number of paths each way, so the difference is what sampling and looking up the guide costs
+    const int overhead_spp = 16;
+    auto time_paths = [&](PathGuide* guide) {
+        std::vector<Colour> sum(width * height);
+        Timer timer;
+        for (int pass = 0; pass < overhead_spp; pass++) { render_pass(sum, guide); }
+        return timer.seconds() * 1e9 / (double(overhead_spp) * width * height);
+    };
+    double plain_ns = time_paths(nullptr);
+    double guided_ns = time_paths(&guide);
+    std::cout << "  " << plain_ns << " ns per plain sample, " << guided_ns << " ns per guided sample (" << guided_ns - plain_ns
+              << " ns overhead, though guided paths also bounce differently)\n";
+}
+
+// Splitting: the closed room from nee, seen through a pinhole so pixels are small and most of the noise is in the
+// light arriving at the first surface, rendered for the same time with 1, 2, 4 and 8 paths from each camera ray's first
+// matte hit and with the number picked by a pilot run. Noise is the RMS difference from a long render; rays are
+// counted without shadow rays.
+
+static void bench_splitting() {
+    const int width = 96;
+    const int height = 72;
+    const double seconds_each = 4;
+    const int reference_spp = 4096;
+    const int max_depth = 6;
+
+    MaterialTable materials;
+    MaterialId white = materials.add(Material::matte, Colour(0.75, 0.75, 0.75));
+    Scene scene;
+    scene.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1), white)); // floor
+    scene.add(Plane3(Vec3(0, 0, 2), Vec3(0, 0, -1), white)); // ceiling
+    scene.add(Plane3(Vec3(0, 1, 0), Vec3(0, -1, 0), white)); // back
+    scene.add(Plane3(Vec3(0, -1, 0), Vec3(0, 1, 0), white)); // behind the camera
+    scene.add(Plane3(Vec3(-1, 0, 0), Vec3(1, 0, 0), materials.add(Material::matte, Colour(0.7, 0.15, 0.1))));
+    scene.add(Plane3(Vec3(1, 0, 0), Vec3(-1, 0, 0), materials.add(Material::matte, Colour(0.15, 0.6, 0.15))));
+    scene.add(Box3(Vec3(-0.7, 0.1, 0), Vec3(-0.2, 0.6, 0.9), white));
+    scene.add(Sphere3(Vec3(0.4, 0.3, 0.35), 0.35, materials.add(Material::matte, Colour(0.2, 0.3, 0.7))));
+    scene.add(Sphere3(Vec3(-0.2, 0.4, 1.8), 0.04, materials.add_emissive(Colour(300, 260, 200))));
+    scene.add(Disk3(Vec3(0.5, 0.6, 1.99), Vec3(0, 0, -1), 0.08, materials.add_emissive(Colour(40, 40, 50))));
+    scene.build_bvh();
+    LightSet lights;
+    lights.build(scene, materials);
+
+    Camera cam(Real(width) / Real(height), Vec3(0, -0.2, 0.8), Vec3(0, 1, -0.3), 1, 60, 0);
+    PathTracer tracer(scene, materials, lights);
+    tracer.max_depth = max_depth;
+    std::vector<std::uint64_t> row_rays(height);
+    auto sample = [&](int x, int y, int split, std::uint64_t& rays) {
+        Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+        return tracer.trace(ray, split, nullptr, &rays);
+    };
+    auto render_pass = [&](std::vector<Colour>& sum, int split) {
+        std::uint64_t seed = next_pass_seed();
+        parallel_for(0, height, [&](std::size_t y) {
+            seed_random(seed, y);
+            for (int x = 0; x < width; x++) { sum[y * width + x] += sample(x, static_cast<int>(y), split, row_rays[y]); }
+        });
+    };
+
+    std::cout << "splitting: " << width << "x" << height << " room lit by a small sphere and disk, " << seconds_each << " s per render, "
+              << n_threads() << " threads\n";
+    std::vector<Colour> reference(width * height);
+    for (int pass = 0; pass < reference_spp; pass++) { render_pass(reference, 1); }
+    for (Colour& pixel : reference) { pixel /= reference_spp; }
+
+    auto run = [&](int split, bool piloted) {
+        std::fill(row_rays.begin(), row_rays.end(), 0);
+        std::vector<Colour> sum(width * height);
+        int spp = 0;
+        Timer timer;
+        while (timer.seconds() < seconds_each) {
+            render_pass(sum, split);
+            spp++;
+        }
+        double seconds = timer.seconds();
+        std::uint64_t rays = 0;
+        for (std::uint64_t count : row_rays) { rays += count; }
+        double error2 = 0;
+        for (std::size_t i = 0; i < sum.size(); i++) { error2 += (sum[i] / spp - reference[i]).abs2() / 3 / sum.size(); }
+        std::cout << "  split " << split << (piloted ? " (pilot)" : "        ") << ": " << spp << " camera rays per pixel, " << rays / seconds / 1e6
+                  << " M rays/s, RMSE " << std::sqrt(error2) << "\n";
+        return std::sqrt(error2);
+    };
+    double unsplit_rmse = run(1, false);
+    double best_rmse = unsplit_rmse;
+    for (int split : {2, 4, 8}) { best_rmse = std::min(best_rmse, run(split, false)); }
+
+    Timer pilot_timer;
+    std::uint64_t pilot_rays = 0;
+    SplitPilot pilot = pilot_split(static_cast<std::size_t>(width) * height, 8, [&](std::size_t pixel, int split) {
+        return sample(static_cast<int>(pixel % width), static_cast<int>(pixel / width), split, pilot_rays);
+    });
+    int split = split_factor(pilot);
+    std::cout << "  pilot took " << pilot_timer.seconds() << " s: " << 1e6 * pilot.seconds[0] << " us per sample with 1 path, "
+              << 1e6 * pilot.seconds[1] << " us with 2; variance " << pilot.variance[0] << " and " << pilot.variance[1] << "\n";
+    double piloted_rmse = run(split, true);
+    std::cout << "  the pilot's split has " << unsplit_rmse / piloted_rmse << "x less error than none, the best of 2, 4 and 8 "
+              << unsplit_rmse / best_rmse << "x\n";
+}
+
+// Denoising: the closed room from nee rendered at 4 to 256 paths per pixel, as is and through the à-trous filter
+// (guided by each pixel's first-hit albedo, normal and depth and its noise), against a long render. The denoised times
+// include gathering the features and filtering. Then the filter alone on a 1920x1080 image.
+
+static void bench_denoise() {
+    const int width = 96;
+    const int height = 72;
+    const int reference_spp = 4096;
+    const int max_depth = 6;
+
+    MaterialTable materials;
+    MaterialId white = materials.add(Material::matte, Colour(0.75, 0.75, 0.75));
+    Scene scene;
+    scene.add(Plane3(Vec3(0, 0, 0), Vec3(0, 0, 1), white)); // floor
+    scene.add(Plane3(Vec3(0, 0, 2), Vec3(0, 0, -1), white)); // ceiling
+    scene.add(Plane3(Vec3(0, 1, 0), Vec3(0, -1, 0), white)); // back
+    scene.add(Plane3(Vec3(0, -1, 0), Vec3(0, 1, 0), white)); // behind the camera
+    scene.add(Plane3(Vec3(-1, 0, 0), Vec3(1, 0, 0), materials.add(Material::matte, Colour(0.7, 0.15, 0.1))));
+    scene.add(Plane3(Vec3(1, 0, 0), Vec3(-1, 0, 0), materials.add(Material::matte, Colour(0.15, 0.6, 0.15))));
+    scene.add(Box3(Vec3(-0.7, 0.1, 0), Vec3(-0.2, 0.6, 0.9), white));
+    scene.add(Sphere3(Vec3(0.4, 0.3, 0.35), 0.35, materials.add(Material::matte, Colour(0.2, 0.3, 0.7))));
+    scene.add(Sphere3(Vec3(-0.2, 0.4, 1.8), 0.04, materials.add_emissive(Colour(300, 260, 200))));
+    scene.add(Disk3(Vec3(0.5, 0.6, 1.99), Vec3(0, 0, -1), 0.08, materials.add_emissive(Colour(40, 40, 50))));
+    scene.build_bvh();
+    LightSet lights;
+    lights.build(scene, materials);
+
+    Camera cam(Real(width) / Real(height), Vec3(0, -0.2, 0.8), Vec3(0, 1, -0.3), 1, 60, 0);
+    // renders spp paths per pixel into image; with features, also what each pixel's camera rays hit first and how
+    // noisy it is, with image's rows flipped to match
+    PathTracer tracer(scene, materials, lights);
+    tracer.max_depth = max_depth;
+    auto render = [&](int spp, Framebuffer& image, FeatureBuffers* features) {
+        std::uint64_t seed = next_pass_seed();
+        parallel_for(0, height, [&](std::size_t y) {
+            seed_random(seed, y);
+            int row = height - 1 - static_cast<int>(y);
+            for (int x = 0; x < width; x++) {
+                Colour sum(0, 0, 0), albedo_sum(0, 0, 0);
+                Vec3 normal_sum(0, 0, 0);
+                Real depth_sum = 0, luminance_sum2 = 0;
+                for (int i = 0; i < spp; i++) {
+                    Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                    FirstHit first_hit;
+                    Colour sample = tracer.trace(ray, 1, features ? &first_hit : nullptr);
+                    sum += sample;
+                    luminance_sum2 += luminance(sample) * luminance(sample);
+                    albedo_sum += first_hit.albedo;
+                    normal_sum += first_hit.normal;
+                    depth_sum += first_hit.depth;
+                }
+                Colour mean = sum / Real(spp);
+                image.set_pixel(x, row, mean);
+                if (features) {
+                    Real variance = spp > 1 ? (luminance_sum2 / spp - luminance(mean) * luminance(mean)) / (spp - 1) : 0;
+                    features->set_pixel(x, row, albedo_sum / Real(spp), normal_sum / Real(spp), static_cast<float>(depth_sum / spp),
+                                        static_cast<float>(std::max(variance, Real(0))));
+                }
+            }
+        });
+    };
+
+    std::cout << "denoise: " << width << "x" << height << " room lit by a small sphere and disk, " << n_threads() << " threads\n";
+    Framebuffer reference(width, height);
+    render(reference_spp, reference, nullptr);
+    auto rmse = [&](const Framebuffer& image) {
+        double error2 = 0;
+        for (std::size_t i = 0; i < image.pixels.size(); i++) {
+            double difference = image.pixels[i] - reference.pixels[i];
+            error2 += difference * difference / image.pixels.size();
+        }
+        return std::sqrt(error2);
+    };
+
+    std::cout << "   spp    plain: ms   RMSE     denoised: ms (filter)  RMSE\n";
+    for (int spp : {4, 8, 16, 32, 64, 128, 256}) {
+        Framebuffer plain(width, height), denoised(width, height);
+        FeatureBuffers features(width, height);
+        Timer plain_timer;
+        render(spp, plain, nullptr);
+        double plain_ms = 1e3 * plain_timer.seconds();
+        Timer denoised_timer;
+        render(spp, denoised, &features);
+        Timer filter_timer;
+        denoise(denoised, features, denoised);
+        double filter_ms = 1e3 * filter_timer.seconds();
+        double denoised_ms = 1e3 * denoised_timer.seconds();
+        std::printf("  %4d  %10.1f  %8.5f  %12.1f (%6.2f)  %8.5f\n", spp, plain_ms, rmse(plain), denoised_ms, filter_ms, rmse(denoised));
+    }
+
+    // the filter's cost depends on the image size, not its content
+    const int full_width = 1920, full_height = 1080;
+    Framebuffer full(full_width, full_height);
+    FeatureBuffers full_features(full_width, full_height);
+    for (int y = 0; y < full_height; y++) {
+        for (int x = 0; x < full_width; x++) {
+            full.set_pixel(x, y, Colour(random_double(), random_double(), random_double()));
+            full_features.set_pixel(x, y, Colour(0.75, 0.75, 0.75), Vec3(0, 0, 1), static_cast<float>(1 + x / 500.0), 0.01f);
+        }
+    }
+    Timer full_timer;
+    const int repeats = 5;
+    for (int i = 0; i < repeats; i++) { denoise(full, full_features, full); }
+    std::cout << "  " << full_width << "x" << full_height << ": " << 1e3 * full_timer.seconds() / repeats << " ms per denoise\n";
+}
+
+// Nested dielectrics: glass spheres under a sky gradient on a matte floor, rendered with each glass surface taken as
+// against air, as before, and with a per-path stack of the media the path is inside. A thick glass shell is the same
+// two spheres either way and should give the same image. A glass bowl full of water needs a third sphere without the
+// stack (the bowl's inside surface, as a hollow, just outside the water's), and even then refracts from glass into a
+// sliver of air and into the water; with the stack it's two overlapping spheres, the water's taking priority.
+
+static void bench_dielectrics() {
+    const int width = 128;
+    const int height = 96;
+    const int spp = 64;
+    const int max_depth = 16;
+
+    MaterialTable materials;
+    MaterialId floor = materials.add(Material::matte, Colour(0.5, 0.5, 0.5));
+    MaterialId glass = materials.add(Material::glass, Colour(1, 1, 1), 0, 1.5, 1);
+    MaterialId water = materials.add(Material::glass, Colour(1, 1, 1), 0, 1.33, 2);
+    Camera cam(Real(width) / Real(height), Vec3(0, 0, 0), Vec3(0, 1, -0.15), 1.6, 40, 0);
+
+    // no lights but the sky, so nothing to sample at the floor
+    LightSet no_lights;
+    auto render = [&](const Scene& scene, bool use_media, std::vector<Colour>& image, std::uint64_t& rays, std::uint64_t seed) {
+        PathTracer tracer(scene, materials, no_lights);
+        tracer.max_depth = max_depth;
+        tracer.sky = [](const Vec3& direction) {
+            Real t = Real(0.5) * (direction.unit().z + 1);
+            return (1 - t) * Colour(1, 1, 1) + t * Colour(0.5, 0.7, 1.0);
+        };
+        tracer.sample_lights = false;
+        tracer.nested_media = use_media;
+        for (int y = 0; y < height; y++) {
+            seed_random(seed, y);
+            for (int x = 0; x < width; x++) {
+                Colour sum(0, 0, 0);
+                for (int i = 0; i < spp; i++) {
+                    Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                    sum += tracer.trace(ray, 1, nullptr, &rays);
+                }
+                image[y * width + x] = sum / Real(spp);
+            }
+        }
+    };
+    auto rms_difference = [&](const std::vector<Colour>& a, const std::vector<Colour>& b) {
+        double error2 = 0;
+        for (std::size_t i = 0; i < a.size(); i++) { error2 += (a[i] - b[i]).abs2() / 3 / a.size(); }
+        return std::sqrt(error2);
+    };
+    auto run = [&](const char* name, const Scene& scene, bool use_media, std::vector<Colour>& image, std::uint64_t seed = 1) {
+        std::uint64_t rays = 0;
+        Timer timer;
+        render(scene, use_media, image, rays, seed);
+        double paths = static_cast<double>(width) * height * spp;
+        std::cout << "  " << name << ": " << rays / paths << " rays per path, " << 1e9 * timer.seconds() / paths << " ns per path\n";
+    };
+
+    std::cout << "dielectrics: " << width << "x" << height << ", " << spp << " spp\n";
+    std::vector<Colour> before(width * height), after(width * height);
+
+    Scene shell;
+    shell.add(Plane3(Vec3(0, 0, -0.6), Vec3(0, 0, 1), floor));
+    shell.add(Sphere3(Vec3(0, 0, 0), 0.5, glass));
+    shell.add(Sphere3(Vec3(0, 0, 0), 0.4, glass, true));
+    shell.build_bvh();
+    run("shell, against air  ", shell, false, before);
+    run("shell, medium stack ", shell, true, after);
+    double difference = rms_difference(before, after);
+    // the same render with another seed: how much two renders differ from noise alone
+    run("shell, against air  ", shell, false, after, 2);
+    std::cout << "    RMS difference " << difference << ", against " << rms_difference(before, after) << " between two renders without the stack\n";
+
+    Scene bowl_hollow; // glass, its inside as a hollow, and water just inside that
+    bowl_hollow.add(Plane3(Vec3(0, 0, -0.6), Vec3(0, 0, 1), floor));
+    bowl_hollow.add(Sphere3(Vec3(0, 0, 0), 0.5, glass));
+    bowl_hollow.add(Sphere3(Vec3(0, 0, 0), 0.4, glass, true));
+    bowl_hollow.add(Sphere3(Vec3(0, 0, 0), 0.3999, water));
+    bowl_hollow.build_bvh();
+    Scene bowl; // glass, and water overlapping it with a higher priority
+    bowl.add(Plane3(Vec3(0, 0, -0.6), Vec3(0, 0, 1), floor));
+    bowl.add(Sphere3(Vec3(0, 0, 0), 0.5, glass));
+    bowl.add(Sphere3(Vec3(0, 0, 0), 0.4, water));
+    bowl.build_bvh();
+    run("bowl, 3 spheres     ", bowl_hollow, false, before);
+    run("bowl, 2 with a stack", bowl, true, after);
+    std::cout << "    RMS difference " << rms_difference(before, after) << " (the air gap bends light that shouldn't be)\n";
+}
+
+// Glass: two staggered 5x5 walls of glass spheres and nothing else, traced for paths of up to 16 bounces, and the
+// scattering alone on the hits those paths made. Both count glass bounces per second.
+
+static void bench_glass() {
+    const int width = 128;
+    const int height = 96;
+    const int spp = 16;
+    const int max_depth = 16;
+
+    MaterialTable materials;
+    MaterialId glass = materials.add(Material::glass);
+    Scene scene;
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 5; j++) {
+            scene.add(Sphere3(Vec3(i - 2, 5, j - 2), 0.5, glass));
+            scene.add(Sphere3(Vec3(i - 1.5, 6, j - 1.5), 0.5, glass));
+        }
+    }
+    scene.build_bvh();
+    Camera cam(Real(width) / Real(height), Vec3(0, 4, 0), Vec3(0, 1, 0), 4, 50, 0);
+
+    struct GlassHit {
+        Line3 ray;
+        Vec3 point;
+        Vec3 normal_unit;
+    };
+    std::vector<GlassHit> hits;
+    std::uint64_t bounces = 0;
+    double sum = 0; // of the rays' final directions, so nothing is optimised away
+    Timer timer;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int i = 0; i < spp; i++) {
+                Line3 ray = cam.generate_ray((x + random_double()) / width - 0.5, (y + random_double()) / height - 0.5);
+                for (int depth = 0; depth < max_depth; depth++) {
+                    Hit hit = scene.closest_hit(ray);
+                    if (!hit.hit()) { break; }
+                    Vec3 point = ray(hit.t);
+                    Vec3 normal_unit;
+                    scene.visit(hit, [&](const auto& prim) { normal_unit = prim.normal(point); });
+                    if (hits.size() < 1000000) { hits.push_back(GlassHit{ray, point, normal_unit}); }
+                    ray = scatter(materials[glass], ray, point, normal_unit);
+                    bounces++;
+                }
+                sum += ray.d.z;
+            }
+        }
+    }
+    double path_seconds = timer.seconds();
+
+    Timer scatter_timer;
+    const int repeats = 5;
+    for (int r = 0; r < repeats; r++) {
+        for (const GlassHit& hit : hits) { sum += scatter(materials[glass], hit.ray, hit.point, hit.normal_unit).d.z; }
+    }
+    double scatter_seconds = scatter_timer.seconds();
+
+    std::cout << "glass: " << width << "x" << height << ", " << spp << " spp, 50 glass spheres\n";
+    std::cout << "  paths:      " << bounces / path_seconds / 1e6 << " M glass bounces/s (" << static_cast<double>(bounces) / (width * height * spp)
+              << " per path)\n";
+    std::cout << "  scattering: " << repeats * hits.size() / scatter_seconds / 1e6 << " M glass bounces/s, " << 1e9 * scatter_seconds / (repeats * hits.size())
+              << " ns each  (checksum " << sum << ")\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::pair<std::string, std::function<void()>>> benchmarks = {
+        {"intersect", bench_intersect},
+        {"precision", bench_precision},
+        {"ground", bench_ground},
+        {"vecops", bench_vecops},
+        {"tonemap", bench_tonemap},
+        {"mesh", bench_mesh},
+        {"bvh", bench_bvh},
+        {"build", bench_build},
+        {"quantised", bench_quantised},
+        {"cache", bench_cache},
+        {"instances", bench_instances},
+        {"occlusion", bench_occlusion},
+        {"grid", bench_grid},
+        {"stream", bench_stream},
+        {"nee", bench_nee},
+        {"lights", bench_lights},
+        {"env", bench_env},
+        {"caustics", bench_caustics},
+        {"radiance", bench_radiance},
+        {"guiding", bench_guiding},
+        {"splitting", bench_splitting},
+        {"denoise", bench_denoise},
+        {"dielectrics", bench_dielectrics},
+        {"glass", bench_glass},
+    };
+
+    for (const auto& benchmark : benchmarks) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++) {
+            if (benchmark.first == argv[i]) { selected = true; }
+        }
+        if (selected) { benchmark.second(); }
+    }
+}
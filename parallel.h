@@ -0,0 +1,96 @@
+#ifndef PARALLEL
+#define PARALLEL
+
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <algorithm>
+#include <cstdint>
+
+namespace rt {
+
+    inline unsigned thread_count{0}; // number of threads parallel loops use, 0 for one per hardware thread
+
+    inline unsigned n_threads() {
+        if (thread_count > 0) { return thread_count; }
+        unsigned n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    /// @brief calls f(i) for every i in [begin, end) across n_threads() threads.
+    /// Threads take chunks of grain indices at a time, so uneven work per index still balances.
+    template <typename F>
+    void parallel_for(std::size_t begin, std::size_t end, F f, std::size_t grain = 1) {
+        if (end <= begin) { return; }
+        std::size_t n = std::min<std::size_t>(n_threads(), (end - begin + grain - 1) / grain);
+        if (n <= 1) {
+            for (std::size_t i = begin; i < end; i++) { f(i); }
+            return;
+        }
+
+        std::atomic<std::size_t> next{begin};
+        auto work = [&]() {
+            for (std::size_t start = next.fetch_add(grain); start < end; start = next.fetch_add(grain)) {
+                std::size_t stop = std::min(start + grain, end);
+                for (std::size_t i = start; i < stop; i++) { f(i); }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (std::size_t t = 1; t < n; t++) { threads.emplace_back(work); }
+        work();
+        for (std::thread& thread : threads) { thread.join(); }
+    }
+
+
+    /// @brief sorts keys ascending, applying the same permutation to values. Least significant digit radix sort on
+    /// 8 bit digits; only the low key_bits bits of each key are looked at. Each pass histograms and scatters in parallel
+    /// chunks, and passes where every key has the same digit are skipped. Stable.
+    template <typename Key, typename Value>
+    void radix_sort(std::vector<Key>& keys, std::vector<Value>& values, int key_bits = 8 * sizeof(Key)) {
+        const std::size_t n = keys.size();
+        const std::size_t n_chunks = std::max<std::size_t>(1, std::min<std::size_t>(n_threads() * 4, n / 4096));
+        std::vector<Key> keys_out(n);
+        std::vector<Value> values_out(n);
+        std::vector<std::size_t> offsets(n_chunks * 256);
+        auto chunk_begin = [&](std::size_t chunk) { return n * chunk / n_chunks; };
+
+        for (int shift = 0; shift < key_bits; shift += 8) {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            parallel_for(0, n_chunks, [&](std::size_t chunk) {
+                std::size_t* histogram = &offsets[chunk * 256];
+                for (std::size_t i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) { histogram[(keys[i] >> shift) & 0xff]++; }
+            });
+
+            // turn the counts into where each chunk's keys with each digit go: digit major, then chunk, to stay stable
+            std::size_t total = 0;
+            bool one_digit = false;
+            for (int digit = 0; digit < 256; digit++) {
+                std::size_t digit_total = 0;
+                for (std::size_t chunk = 0; chunk < n_chunks; chunk++) {
+                    std::size_t count = offsets[chunk * 256 + digit];
+                    offsets[chunk * 256 + digit] = total;
+                    total += count;
+                    digit_total += count;
+                }
+                if (digit_total == n) { one_digit = true; }
+            }
+            if (one_digit) { continue; }
+
+            parallel_for(0, n_chunks, [&](std::size_t chunk) {
+                std::size_t* offset = &offsets[chunk * 256];
+                for (std::size_t i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) {
+                    std::size_t destination = offset[(keys[i] >> shift) & 0xff]++;
+                    keys_out[destination] = keys[i];
+                    values_out[destination] = values[i];
+                }
+            });
+            keys.swap(keys_out);
+            values.swap(values_out);
+        }
+    }
+
+}
+
+#endif // PARALLEL
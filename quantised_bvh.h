@@ -0,0 +1,287 @@
+#ifndef QUANTISED_BVH
+#define QUANTISED_BVH
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "gmath.h"
+#include "geometry.h"
+#include "bvh_build.h"
+#include "bvh.h"
+
+namespace rt {
+
+    /// @brief WideBVH with its nodes compressed for large scenes: each child's box is stored as 8 bit offsets on a grid
+    /// spanning the node (its parent frame), whose spacing is a power of two per axis. Offsets are rounded outwards, so
+    /// the boxes only ever grow. Rather than one index per child, a node's inner children are stored consecutively,
+    /// as are all its leaves' primitives, leaving one byte per child to say what it is.
+    /// Nodes are 52 bytes for Width 4 and 80 for Width 8, against 128 and 256 for WideBVH.
+    /// There's no room for per-octant child orders, so hit children are visited in order of entry distance instead.
+    template <int Width>
+    class QuantisedBVH {
+        static_assert(Width == 4 || Width == 8, "QuantisedBVH supports 4 or 8 children per node");
+
+        public:
+            static constexpr std::uint8_t inner_child = 0xff; // value of meta for an inner node
+
+            struct Node {
+                float origin[3]; // low corner of the grid
+                std::int8_t exponent[3]; // grid spacing is 2^exponent
+                std::uint8_t pad;
+                std::uint32_t child_base; // index of the first inner child in nodes
+                std::uint32_t ref_base; // index of the first leaf's first primitive in refs
+                std::uint8_t meta[Width]; // 0 for an unused slot, inner_child, or the number of primitives in a leaf
+                std::uint8_t q[6][Width]; // grid coordinates of each child's min x, max x, min y, max y, min z, max z
+            };
+
+            std::vector<Node> nodes; // nodes[0] is the root
+            std::vector<PrimRef> refs;
+
+            bool empty() const { return nodes.empty(); }
+            void clear() {
+                nodes.clear();
+                refs.clear();
+            }
+            std::size_t memory() const { return nodes.size() * sizeof(Node) + refs.size() * sizeof(PrimRef); }
+
+            /// @brief builds a WideBVH, then compresses it breadth first so that siblings end up next to each other
+            void build(std::vector<BVHPrim> prims, BVHPreset preset = BVHPreset::quality) {
+                clear();
+                WideBVH<Width> wide;
+                wide.build(std::move(prims), preset);
+                if (wide.empty()) { return; }
+
+                nodes.reserve(wide.nodes.size());
+                refs.reserve(wide.refs.size());
+                nodes.emplace_back();
+                std::vector<std::pair<std::uint32_t, std::uint32_t>> queue{{0, 0}}; // wide node, its compressed node
+                for (std::size_t next = 0; next < queue.size(); next++) {
+                    const typename WideBVH<Width>::Node& source = wide.nodes[queue[next].first];
+                    const std::uint32_t index = queue[next].second;
+
+                    std::uint32_t child_base = static_cast<std::uint32_t>(nodes.size());
+                    std::uint32_t ref_base = static_cast<std::uint32_t>(refs.size());
+                    std::uint8_t meta[Width] = {};
+                    AABB3T<float> boxes[Width];
+                    AABB3T<float> frame;
+                    for (int k = 0; k < Width; k++) {
+                        std::uint32_t child = source.child[k];
+                        if (child == WideBVH<Width>::empty_child) { continue; }
+                        boxes[k] = AABB3T<float>(Vec3T<float>(source.bounds[0][k], source.bounds[2][k], source.bounds[4][k]),
+                                                 Vec3T<float>(source.bounds[1][k], source.bounds[3][k], source.bounds[5][k]));
+                        frame.extend(boxes[k]);
+                        if (child & WideBVH<Width>::leaf_flag) {
+                            std::uint32_t first = child & ((1u << WideBVH<Width>::count_shift) - 1);
+                            std::uint32_t count = ((child & ~WideBVH<Width>::leaf_flag) >> WideBVH<Width>::count_shift) + 1;
+                            refs.insert(refs.end(), wide.refs.begin() + first, wide.refs.begin() + first + count);
+                            meta[k] = static_cast<std::uint8_t>(count);
+                        } else {
+                            queue.push_back({child, static_cast<std::uint32_t>(nodes.size())});
+                            nodes.emplace_back();
+                            meta[k] = inner_child;
+                        }
+                    }
+
+                    Node& node = nodes[index];
+                    node.child_base = child_base;
+                    node.ref_base = ref_base;
+                    std::memcpy(node.meta, meta, sizeof(meta));
+                    quantise(node, frame, boxes);
+                }
+            }
+
+            /// @brief calls visit(ref) for the primitives in every leaf the ray passes through with 0 < t < t_max,
+            /// nearest leaves first. visit may lower t_max (e.g. when it finds a hit), which culls the rest of the walk.
+            template <typename F>
+            void traverse(const Line3& ray, const Real& t_max, F&& visit, std::size_t* n_nodes_visited = nullptr) const {
+                if (nodes.empty()) { return; }
+                const NodeRay node_ray(ray);
+
+                struct Entry {
+                    std::uint32_t child; // node index, or a leaf encoded as in WideBVH
+                    float t;
+                };
+                Entry stack[stack_size];
+                int top = 0;
+                stack[top++] = Entry{0, 0.0f};
+
+                while (top > 0) {
+                    const Entry entry = stack[--top];
+                    const float t_limit = static_cast<float>(t_max) * t_scale;
+                    if (entry.t > t_limit) { continue; }
+
+                    if (entry.child & leaf_flag) {
+                        std::uint32_t first = entry.child & ((1u << count_shift) - 1);
+                        std::uint32_t count = ((entry.child & ~leaf_flag) >> count_shift) + 1;
+                        for (std::uint32_t i = first; i < first + count; i++) { visit(refs[i]); }
+                        continue;
+                    }
+
+                    const Node& node = nodes[entry.child];
+                    if (n_nodes_visited) { ++*n_nodes_visited; }
+                    alignas(32) float t_near[Width];
+                    unsigned mask = intersect_children(node, node_ray, t_limit, t_near);
+
+                    // sort the hit children farthest first, so that pushing them in turn leaves the nearest on top
+                    Entry hits[Width];
+                    int n_hits = 0;
+                    std::uint32_t n_inner = 0;
+                    std::uint32_t n_prims = 0;
+                    for (int k = 0; k < Width; k++) {
+                        std::uint8_t meta = node.meta[k];
+                        if (meta == 0) { continue; }
+                        std::uint32_t child = meta == inner_child ? node.child_base + n_inner++ : leaf_flag | (meta - 1u) << count_shift | (node.ref_base + n_prims);
+                        if (meta != inner_child) { n_prims += meta; }
+                        if (!(mask & (1u << k))) { continue; }
+                        int i = n_hits++;
+                        for (; i > 0 && hits[i - 1].t < t_near[k]; i--) { hits[i] = hits[i - 1]; }
+                        hits[i] = Entry{child, t_near[k]};
+                    }
+                    for (int i = 0; i < n_hits; i++) { stack[top++] = hits[i]; }
+                }
+            }
+
+        private:
+            static constexpr std::uint32_t leaf_flag = WideBVH<Width>::leaf_flag;
+            static constexpr int count_shift = WideBVH<Width>::count_shift;
+            static constexpr int stack_size = 96 * (Width - 1) + 1;
+            // covers float rounding in the slab test, including computing the planes as q * (spacing / d) + (origin - p) / d
+            static constexpr float t_scale = 1.000002f;
+
+            // the ray in float, with the near and far box planes on each axis picked by the sign of its direction
+            struct NodeRay {
+                float origin[3];
+                float inv_dir[3];
+                int near[3]; // row of Node::q
+                int far[3];
+
+                NodeRay(const Line3& ray) {
+                    for (int a = 0; a < 3; a++) {
+                        origin[a] = static_cast<float>(axis(ray.p, a));
+                        inv_dir[a] = static_cast<float>(1 / axis(ray.d, a));
+                        bool negative = std::signbit(inv_dir[a]);
+                        near[a] = 2 * a + negative;
+                        far[a] = 2 * a + !negative;
+                    }
+                }
+            };
+
+            static float spacing(std::int8_t exponent) {
+                std::uint32_t bits = static_cast<std::uint32_t>(exponent + 127) << 23;
+                float f;
+                std::memcpy(&f, &bits, sizeof(f));
+                return f;
+            }
+
+            // fits the grid to frame and rounds each child's box outwards onto it
+            static void quantise(Node& node, const AABB3T<float>& frame, const AABB3T<float>* boxes) {
+                for (int a = 0; a < 3; a++) {
+                    const float low = axis(frame.min, a);
+                    const float high = axis(frame.max, a);
+                    // smallest power of two spacing for which 255 steps reach the top of the frame
+                    int exponent = -126;
+                    if (high > low) {
+                        std::frexp((high - low) / 255.0f, &exponent);
+                        exponent = std::max(exponent - 1, -126);
+                    }
+                    while (low + 255 * spacing(static_cast<std::int8_t>(exponent)) < high) { exponent++; }
+                    const float step = spacing(static_cast<std::int8_t>(exponent));
+                    node.origin[a] = low;
+                    node.exponent[a] = static_cast<std::int8_t>(exponent);
+
+                    for (int k = 0; k < Width; k++) {
+                        if (node.meta[k] == 0) {
+                            node.q[2 * a][k] = 0;
+                            node.q[2 * a + 1][k] = 0;
+                            continue;
+                        }
+                        const float child_low = axis(boxes[k].min, a);
+                        const float child_high = axis(boxes[k].max, a);
+                        int q_low = std::clamp(static_cast<int>(std::floor((static_cast<double>(child_low) - low) / step)), 0, 255);
+                        int q_high = std::clamp(static_cast<int>(std::ceil((static_cast<double>(child_high) - low) / step)), 0, 255);
+                        while (q_low > 0 && low + q_low * step > child_low) { q_low--; } // check the planes as float sees them
+                        while (q_high < 255 && low + q_high * step < child_high) { q_high++; }
+                        node.q[2 * a][k] = static_cast<std::uint8_t>(q_low);
+                        node.q[2 * a + 1][k] = static_cast<std::uint8_t>(q_high);
+                    }
+                }
+            }
+
+#ifdef GMATH_HAS_SSE
+            // 4 grid coordinates as floats
+            static __m128 load_q4(const std::uint8_t* q) {
+                std::int32_t packed;
+                std::memcpy(&packed, q, sizeof(packed));
+                const __m128i zero = _mm_setzero_si128();
+                return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero));
+            }
+#endif
+
+            // slab test against every child at once. Returns a bit mask of the children hit, with entry distances in t_near.
+            // Each plane is origin + q * spacing along its axis, so its distance along the ray is q * scale + offset.
+            static unsigned intersect_children(const Node& node, const NodeRay& ray, float t_limit, float* t_near) {
+                float scale[3];
+                float offset[3];
+                for (int a = 0; a < 3; a++) {
+                    scale[a] = spacing(node.exponent[a]) * ray.inv_dir[a];
+                    offset[a] = (node.origin[a] - ray.origin[a]) * ray.inv_dir[a];
+                }
+                unsigned used = 0;
+                for (int k = 0; k < Width; k++) { used |= (node.meta[k] != 0) << k; }
+
+#ifdef GMATH_HAS_SSE
+#ifdef __AVX__
+                if constexpr (Width == 8) {
+                    auto load_q8 = [](const std::uint8_t* q) { return _mm256_insertf128_ps(_mm256_castps128_ps256(load_q4(q)), load_q4(q + 4), 1); };
+                    __m256 t_in = _mm256_setzero_ps();
+                    __m256 t_out = _mm256_set1_ps(t_limit);
+                    for (int a = 0; a < 3; a++) {
+                        __m256 a_scale = _mm256_set1_ps(scale[a]);
+                        __m256 a_offset = _mm256_set1_ps(offset[a]);
+                        t_in = _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(load_q8(node.q[ray.near[a]]), a_scale), a_offset), t_in);
+                        t_out = _mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(load_q8(node.q[ray.far[a]]), a_scale), a_offset), t_out);
+                    }
+                    t_out = _mm256_mul_ps(t_out, _mm256_set1_ps(t_scale));
+                    _mm256_store_ps(t_near, t_in);
+                    return used & static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(t_in, t_out, _CMP_LE_OQ)));
+                }
+#endif
+                unsigned mask = 0;
+                for (int group = 0; group < Width; group += 4) {
+                    __m128 t_in = _mm_setzero_ps();
+                    __m128 t_out = _mm_set1_ps(t_limit);
+                    for (int a = 0; a < 3; a++) {
+                        __m128 a_scale = _mm_set1_ps(scale[a]);
+                        __m128 a_offset = _mm_set1_ps(offset[a]);
+                        t_in = _mm_max_ps(_mm_add_ps(_mm_mul_ps(load_q4(node.q[ray.near[a]] + group), a_scale), a_offset), t_in);
+                        t_out = _mm_min_ps(_mm_add_ps(_mm_mul_ps(load_q4(node.q[ray.far[a]] + group), a_scale), a_offset), t_out);
+                    }
+                    t_out = _mm_mul_ps(t_out, _mm_set1_ps(t_scale));
+                    _mm_store_ps(t_near + group, t_in);
+                    mask |= static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(t_in, t_out))) << group;
+                }
+                return used & mask;
+#else
+                unsigned mask = 0;
+                for (int k = 0; k < Width; k++) {
+                    float t_in = 0;
+                    float t_out = t_limit;
+                    for (int a = 0; a < 3; a++) {
+                        float t0 = node.q[ray.near[a]][k] * scale[a] + offset[a];
+                        float t1 = node.q[ray.far[a]][k] * scale[a] + offset[a];
+                        clip_slab(t0, t1, t_in, t_out);
+                    }
+                    t_near[k] = t_in;
+                    if (t_in <= t_out * t_scale) { mask |= 1u << k; }
+                }
+                return used & mask;
+#endif
+            }
+    };
+
+}
+
+#endif // QUANTISED_BVH
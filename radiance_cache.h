@@ -0,0 +1,75 @@
+#ifndef RADIANCE_CACHE
+#define RADIANCE_CACHE
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include "gmath.h"
+#include "geometry.h"
+
+namespace rt {
+
+    /// @brief light arriving at matte surfaces, averaged over cells of world space, so paths can stop after a few
+    /// diffuse bounces and take the rest from the cache instead of tracing long chains of them.
+    /// A cell is keyed by a point's position, quantised to cell_size, and its normal, quantised to one of 16
+    /// octahedral bins so the two sides of a thin object or a corner's walls don't share one. Cells hold the running
+    /// sum of the cosine-weighted incoming radiance (outgoing radiance before the surface's reflectance) of every path
+    /// that passed through them, and a fraction of lookups are turned down so they keep improving as the render goes
+    /// on. Only samples from paths that weren't cut short by a depth limit should be added, or the cells fill with
+    /// light that's missing its later bounces while the cache is new.
+    /// The table is open addressed and lock-free: a cell is claimed by compare-and-swap on its key and added to with
+    /// atomic adds, so any number of threads can look up and add at once. A sum and its count are read separately,
+    /// so a read racing an add can be one sample out, which only matters while the cell is new.
+    class RadianceCache {
+        public:
+            Real cell_size{0.05};
+            int depth{2}; // bounces after which paths end in the cache, where it has enough samples
+            std::uint32_t min_samples{16}; // before a cell is used rather than just added to
+            Real refresh_fraction{0.125}; // of lookups in a ready cell turned down anyway, so fresh paths keep refining it
+
+            /// @brief capacity is rounded up to a power of 2
+            explicit RadianceCache(std::size_t capacity = std::size_t(1) << 18);
+
+            /// @brief the mean incoming radiance for point, if its cell has min_samples yet (and this lookup isn't one
+            /// of the refresh_fraction turned down)
+            bool lookup(const Vec3& point, const Vec3& normal_unit, Colour& incoming) const;
+
+            /// @brief adds a sample of the incoming radiance at point. Does nothing if the table is too full to find a
+            /// free cell near the point's slot.
+            void add(const Vec3& point, const Vec3& normal_unit, const Colour& incoming);
+
+            /// @brief forgets every cell and the counts
+            void clear();
+
+            /// @brief zeroes the lookup and hit counts, keeping the cells, so a render's figures don't include
+            /// passes before it
+            void clear_counts();
+
+            std::uint64_t lookups() const { return n_lookups.load(std::memory_order_relaxed); }
+            std::uint64_t hits() const { return n_hits.load(std::memory_order_relaxed); }
+            Real hit_rate() const { return lookups() > 0 ? Real(hits()) / Real(lookups()) : 0; }
+            std::size_t cells_used() const { return n_used.load(std::memory_order_relaxed); }
+            std::size_t memory() const { return cells.size() * sizeof(Cell); }
+
+        private:
+            struct Cell {
+                std::atomic<std::uint64_t> key{0}; // 0 while free
+                std::atomic<float> sum[3] = {};
+                std::atomic<std::uint32_t> count{0};
+            };
+            static constexpr int max_probes = 16;
+
+            std::vector<Cell> cells;
+            std::uint64_t mask{0};
+            mutable std::atomic<std::uint64_t> n_lookups{0};
+            mutable std::atomic<std::uint64_t> n_hits{0};
+            std::atomic<std::size_t> n_used{0};
+
+            std::uint64_t key(const Vec3& point, const Vec3& normal_unit) const;
+            const Cell* find(std::uint64_t key) const;
+    };
+
+}
+
+#endif // RADIANCE_CACHE
@@ -0,0 +1,110 @@
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "radiance_cache.h"
+
+namespace rt {
+
+    RadianceCache::RadianceCache(std::size_t capacity) {
+        std::size_t size = 1;
+        while (size < capacity) { size *= 2; }
+        cells = std::vector<Cell>(size);
+        mask = size - 1;
+    }
+
+    // 19 bits for each coordinate (wrapping far from the origin, where cells just share keys) and 4 for the normal's
+    // octahedral bin. The top bit is set so no key is 0.
+    std::uint64_t RadianceCache::key(const Vec3& point, const Vec3& normal_unit) const {
+        auto coordinate = [&](Real x) { return static_cast<std::uint64_t>(static_cast<std::int64_t>(std::floor(x / cell_size))) & 0x7ffff; };
+        Real l1 = std::fabs(normal_unit.x) + std::fabs(normal_unit.y) + std::fabs(normal_unit.z);
+        Real u = normal_unit.x / l1;
+        Real v = normal_unit.y / l1;
+        if (normal_unit.z < 0) { // fold the lower half of the octahedron over the upper
+            Real folded_u = (1 - std::fabs(v)) * (u < 0 ? -1 : 1);
+            v = (1 - std::fabs(u)) * (v < 0 ? -1 : 1);
+            u = folded_u;
+        }
+        std::uint64_t bin_u = std::min<std::uint64_t>(3, static_cast<std::uint64_t>((u + 1) * 2));
+        std::uint64_t bin_v = std::min<std::uint64_t>(3, static_cast<std::uint64_t>((v + 1) * 2));
+        return (std::uint64_t(1) << 63) | (coordinate(point.x) << 42) | (coordinate(point.y) << 23) | (coordinate(point.z) << 4) | (bin_u << 2) | bin_v;
+    }
+
+    static std::uint64_t slot_hash(std::uint64_t key) {
+        // the finaliser of MurmurHash3, so nearby cells spread over the whole table
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    const RadianceCache::Cell* RadianceCache::find(std::uint64_t key) const {
+        std::uint64_t slot = slot_hash(key);
+        for (int probe = 0; probe < max_probes; probe++) {
+            const Cell& cell = cells[(slot + probe) & mask];
+            std::uint64_t found = cell.key.load(std::memory_order_acquire);
+            if (found == key) { return &cell; }
+            if (found == 0) { return nullptr; }
+        }
+        return nullptr;
+    }
+
+    bool RadianceCache::lookup(const Vec3& point, const Vec3& normal_unit, Colour& incoming) const {
+        n_lookups.fetch_add(1, std::memory_order_relaxed);
+        const Cell* cell = find(key(point, normal_unit));
+        if (!cell) { return false; }
+        std::uint32_t count = cell->count.load(std::memory_order_relaxed);
+        if (count < min_samples || random_double() < refresh_fraction) { return false; }
+        incoming = Colour(cell->sum[0].load(std::memory_order_relaxed), cell->sum[1].load(std::memory_order_relaxed),
+                          cell->sum[2].load(std::memory_order_relaxed)) / Real(count);
+        n_hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    static void atomic_add(std::atomic<float>& total, float value) {
+        float old = total.load(std::memory_order_relaxed);
+        while (!total.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+    }
+
+    void RadianceCache::add(const Vec3& point, const Vec3& normal_unit, const Colour& incoming) {
+        if (!(std::isfinite(incoming.x) && std::isfinite(incoming.y) && std::isfinite(incoming.z))) { return; }
+        std::uint64_t cell_key = key(point, normal_unit);
+        std::uint64_t slot = slot_hash(cell_key);
+        for (int probe = 0; probe < max_probes; probe++) {
+            Cell& cell = cells[(slot + probe) & mask];
+            std::uint64_t found = cell.key.load(std::memory_order_acquire);
+            if (found == 0) {
+                // claim it; if another thread got there first, it may have claimed it for this same key
+                if (cell.key.compare_exchange_strong(found, cell_key, std::memory_order_acq_rel)) {
+                    n_used.fetch_add(1, std::memory_order_relaxed);
+                    found = cell_key;
+                }
+            }
+            if (found != cell_key) { continue; }
+            atomic_add(cell.sum[0], static_cast<float>(incoming.x));
+            atomic_add(cell.sum[1], static_cast<float>(incoming.y));
+            atomic_add(cell.sum[2], static_cast<float>(incoming.z));
+            cell.count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    void RadianceCache::clear() {
+        for (Cell& cell : cells) {
+            cell.key.store(0, std::memory_order_relaxed);
+            for (std::atomic<float>& channel : cell.sum) { channel.store(0, std::memory_order_relaxed); }
+            cell.count.store(0, std::memory_order_relaxed);
+        }
+        clear_counts();
+        n_used.store(0, std::memory_order_relaxed);
+    }
+
+    void RadianceCache::clear_counts() {
+        n_lookups.store(0, std::memory_order_relaxed);
+        n_hits.store(0, std::memory_order_relaxed);
+    }
+
+}
@@ -0,0 +1,306 @@
+#ifndef SCENE
+#define SCENE
+
+#include <vector>
+#include <tuple>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <type_traits>
+#include "geometry.h"
+#include "mesh.h"
+#include "instance.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+
+namespace rt {
+
+    /// @brief result of a closest-hit query: which primitive was hit and where along the ray
+    struct Hit {
+        Real t{std::numeric_limits<Real>::infinity()};
+        int type{-1}; // index into the primitive type list, PrimitiveSet::custom_type for user-defined Hittables, -1 for a miss
+        std::size_t idx{0}; // index into that type's array
+        int inner_type{-1}; // for a hit on an instance, the type and index of the primitive hit within its object
+        std::size_t inner_idx{0};
+
+        bool hit() const { return type != -1; }
+    };
+
+    /// @brief whether P has a bounds() method, and so can go in a BVH. Unbounded primitives (e.g. Plane3) are tested one by one.
+    template <typename P, typename = void>
+    struct is_bounded : std::false_type {};
+    template <typename P>
+    struct is_bounded<P, std::void_t<decltype(std::declval<const P&>().bounds())>> : std::true_type {};
+    template <typename P>
+    inline constexpr bool is_bounded_v = is_bounded<P>::value;
+
+    /// @brief whether P places other geometry, with a closest_hit() of its own (e.g. InstanceT)
+    template <typename P, typename = void>
+    struct is_instance : std::false_type {};
+    template <typename P>
+    struct is_instance<P, std::void_t<decltype(std::declval<const P&>().closest_hit(std::declval<const Line3&>(), Real()))>> : std::true_type {};
+    template <typename P>
+    inline constexpr bool is_instance_v = is_instance<P>::value;
+
+    /// @brief closed set of primitive types, each stored by value in its own contiguous array.
+    /// Intersection loops are instantiated per type so the primitive tests are monomorphic and can be inlined.
+    /// User-defined primitives can still be added as Hittable pointers, and are tested through virtual dispatch.
+    /// Once build_bvh() has been called, closest_hit() finds the built-in primitives that have a bounds() method through
+    /// a BVH; unbounded ones and custom Hittables are always tested one by one.
+    template <typename... Prims>
+    class PrimitiveSet {
+        public:
+            std::tuple<std::vector<Prims>...> primitives;
+            std::vector<Hittable*> custom;
+            WideBVH<4> bvh; // empty until build_bvh()
+
+            static constexpr int custom_type = sizeof...(Prims);
+
+            template <typename P, typename = std::enable_if_t<!std::is_pointer_v<P>>>
+            void add(const P& prim) {
+                std::get<std::vector<P>>(primitives).push_back(prim);
+                if constexpr (is_bounded_v<P>) { bvh.clear(); }
+            }
+            void add(Hittable* hittable) { custom.push_back(hittable); }
+
+            template <typename P>
+            std::vector<P>& get() { return std::get<std::vector<P>>(primitives); }
+            template <typename P>
+            const std::vector<P>& get() const { return std::get<std::vector<P>>(primitives); }
+
+            /// @brief (re)builds the BVH over the built-in primitives. Call again after adding or removing them through get().
+            void build_bvh(BVHPreset preset = BVHPreset::quality) { bvh.build(bvh_prims(), preset); }
+
+            /// @brief like build_bvh(), but loads the tree from the cache file at cache_path if it was saved for this scene,
+            /// and otherwise builds it and saves it there. Returns true if the cache was used.
+            /// A warm start still costs O(n) in the primitives: the file is matched to the scene by bounding and hashing
+            /// every one, and the tree is copied out of it. That skips the build (10x faster for 5M triangles) but not
+            /// a pass over the scene, which takes most of what's left.
+            bool build_bvh(const std::string& cache_path, BVHPreset preset = BVHPreset::quality) {
+                std::vector<BVHPrim> prims = bvh_prims();
+                std::uint64_t key = bvh_cache_key(prims, preset, 4);
+                if (load_bvh_cache(cache_path, key, bvh)) { return true; }
+                bvh.build(std::move(prims), preset);
+                save_bvh_cache(cache_path, key, bvh);
+                return false;
+            }
+
+            /// @brief updates the BVH for primitives that have moved or changed size, without rebuilding it
+            void refit_bvh() {
+                bvh.refit([&](const PrimRef& ref) { return bounds(ref); });
+            }
+
+            /// @brief bounds of every bounded built-in primitive, for building a BVH over them
+            std::vector<BVHPrim> bvh_prims() const {
+                std::vector<BVHPrim> prims(bounded_size());
+                bvh_prims_types(prims, std::index_sequence_for<Prims...>{});
+                return prims;
+            }
+
+            /// @brief bounds of every bounded built-in primitive together
+            AABB3 bounds() const {
+                AABB3T<float> box;
+                if (bvh.empty()) {
+                    for (const BVHPrim& prim : bvh_prims()) { box.extend(prim.box); }
+                } else {
+                    box = bvh.bounds();
+                }
+                return AABB3(Vec3(box.min.x, box.min.y, box.min.z), Vec3(box.max.x, box.max.y, box.max.z));
+            }
+
+            /// @brief bounds of the primitive ref refers to, in float
+            AABB3T<float> bounds(const PrimRef& ref) const {
+                return bounds_type<0>(ref);
+            }
+
+            /// @brief tests the primitive ref refers to, updating hit if it's nearer
+            void intersect(const PrimRef& ref, const Line3& ray, Hit& hit) const {
+                intersect_type<0>(ref, ray, hit);
+            }
+
+            std::size_t size() const {
+                return std::apply([](const auto&... arrays) { return (arrays.size() + ... + 0); }, primitives) + custom.size();
+            }
+
+            /// @brief number of built-in primitives that go in the BVH
+            std::size_t bounded_size() const {
+                return std::apply([](const auto&... arrays) {
+                    return ((is_bounded_v<typename std::decay_t<decltype(arrays)>::value_type> ? arrays.size() : 0) + ... + 0);
+                }, primitives);
+            }
+
+            /// @brief finds the closest primitive hit by the ray with 0 < t < t_max
+            Hit closest_hit(const Line3& ray, Real t_max = std::numeric_limits<Real>::infinity()) const {
+                Hit hit;
+                hit.t = t_max;
+                if (bvh.empty()) {
+                    closest_hit_types(ray, hit, std::index_sequence_for<Prims...>{});
+                } else {
+                    bvh.traverse(ray, hit.t, [&](const PrimRef& ref) { intersect(ref, ray, hit); });
+                    closest_hit_unbounded_types(ray, hit, std::index_sequence_for<Prims...>{});
+                }
+                for (std::size_t i = 0; i < custom.size(); i++) { intersect_prim(*custom[i], custom_type, i, ray, hit); }
+                return hit;
+            }
+
+            /// @brief whether anything is hit with 0 < t < t_max: for shadow rays and the like, where it doesn't matter what.
+            /// Stops at the first hit found, trying the cheap unbounded primitives before the BVH.
+            bool occluded(const Line3& ray, Real t_max = std::numeric_limits<Real>::infinity()) const {
+                bool found = false;
+                if (bvh.empty()) {
+                    found = occluded_types<false>(ray, t_max, std::index_sequence_for<Prims...>{});
+                } else {
+                    found = occluded_types<true>(ray, t_max, std::index_sequence_for<Prims...>{}) ||
+                            bvh.traverse_any(ray, t_max, [&](const PrimRef& ref) { return occluded_type<0>(ref, ray, t_max); });
+                }
+                for (std::size_t i = 0; i < custom.size() && !found; i++) { found = occluded_prim(*custom[i], ray, t_max); }
+                return found;
+            }
+
+            /// @brief calls f with the primitive referred to by hit (concrete type for built-ins, Hittable for custom,
+            /// Instanced<concrete type> for a primitive within an instance)
+            template <typename F>
+            decltype(auto) visit(const Hit& hit, F&& f) const {
+                return visit_type<0>(hit, f);
+            }
+
+        private:
+            template <typename P>
+            static void intersect_prim(const P& prim, int type, std::size_t idx, const Line3& ray, Hit& hit) {
+                if constexpr (is_instance_v<P>) {
+                    auto inner = prim.closest_hit(ray, hit.t);
+                    if (inner.hit()) {
+                        hit.t = inner.t;
+                        hit.type = type;
+                        hit.idx = idx;
+                        hit.inner_type = inner.type;
+                        hit.inner_idx = inner.idx;
+                    }
+                } else {
+                    Real intersect_t = prim.intersects(ray);
+                    if (intersect_t < hit.t && intersect_t > 0) {
+                        hit.t = intersect_t;
+                        hit.type = type;
+                        hit.idx = idx;
+                        hit.inner_type = -1;
+                    }
+                }
+            }
+
+            template <typename P>
+            static bool occluded_prim(const P& prim, const Line3& ray, Real t_max) {
+                if constexpr (is_instance_v<P>) {
+                    return prim.occluded(ray, t_max);
+                } else {
+                    Real intersect_t = prim.intersects(ray);
+                    return intersect_t < t_max && intersect_t > 0;
+                }
+            }
+
+            template <typename P>
+            static void closest_hit_array(const std::vector<P>& array, int type, const Line3& ray, Hit& hit) {
+                for (std::size_t i = 0; i < array.size(); i++) { intersect_prim(array[i], type, i, ray, hit); }
+            }
+
+            template <std::size_t... I>
+            void closest_hit_types(const Line3& ray, Hit& hit, std::index_sequence<I...>) const {
+                (closest_hit_array(std::get<I>(primitives), static_cast<int>(I), ray, hit), ...);
+            }
+
+            template <std::size_t... I>
+            void closest_hit_unbounded_types(const Line3& ray, Hit& hit, std::index_sequence<I...>) const {
+                auto test_array = [&](const auto& array, int type) {
+                    if constexpr (!is_bounded_v<typename std::decay_t<decltype(array)>::value_type>) { closest_hit_array(array, type, ray, hit); }
+                };
+                (test_array(std::get<I>(primitives), static_cast<int>(I)), ...);
+            }
+
+            // with unbounded_only, just the types kept out of the BVH
+            template <bool unbounded_only, std::size_t... I>
+            bool occluded_types(const Line3& ray, Real t_max, std::index_sequence<I...>) const {
+                auto test_array = [&](const auto& array) {
+                    if constexpr (!unbounded_only || !is_bounded_v<typename std::decay_t<decltype(array)>::value_type>) {
+                        for (const auto& prim : array) {
+                            if (occluded_prim(prim, ray, t_max)) { return true; }
+                        }
+                    }
+                    return false;
+                };
+                return (test_array(std::get<I>(primitives)) || ...);
+            }
+
+            template <std::size_t I>
+            bool occluded_type(const PrimRef& ref, const Line3& ray, Real t_max) const {
+                if constexpr (I < sizeof...(Prims)) {
+                    if (ref.type != I) { return occluded_type<I + 1>(ref, ray, t_max); }
+                    return occluded_prim(std::get<I>(primitives)[ref.idx], ray, t_max);
+                } else {
+                    return false;
+                }
+            }
+
+            template <std::size_t... I>
+            void bvh_prims_types(std::vector<BVHPrim>& prims, std::index_sequence<I...>) const {
+                std::size_t offset = 0;
+                auto add_array = [&](const auto& array, std::uint32_t type) {
+                    if constexpr (is_bounded_v<typename std::decay_t<decltype(array)>::value_type>) {
+                        parallel_for(0, array.size(), [&, offset](std::size_t i) {
+                            prims[offset + i] = BVHPrim{to_float_bounds(array[i].bounds()), PrimRef{type, static_cast<std::uint32_t>(i)}};
+                        }, 4096);
+                        offset += array.size();
+                    }
+                };
+                (add_array(std::get<I>(primitives), static_cast<std::uint32_t>(I)), ...);
+            }
+
+            template <std::size_t I>
+            AABB3T<float> bounds_type(const PrimRef& ref) const {
+                if constexpr (I < sizeof...(Prims)) {
+                    if (ref.type != I) { return bounds_type<I + 1>(ref); }
+                    if constexpr (is_bounded_v<std::tuple_element_t<I, std::tuple<Prims...>>>) {
+                        return to_float_bounds(std::get<I>(primitives)[ref.idx].bounds());
+                    } else {
+                        return AABB3T<float>();
+                    }
+                } else {
+                    return AABB3T<float>();
+                }
+            }
+
+            template <std::size_t I>
+            void intersect_type(const PrimRef& ref, const Line3& ray, Hit& hit) const {
+                if constexpr (I < sizeof...(Prims)) {
+                    if (ref.type != I) { return intersect_type<I + 1>(ref, ray, hit); }
+                    intersect_prim(std::get<I>(primitives)[ref.idx], static_cast<int>(I), ref.idx, ray, hit);
+                }
+            }
+
+            template <std::size_t I, typename F>
+            decltype(auto) visit_type(const Hit& hit, F& f) const {
+                if constexpr (I < sizeof...(Prims)) {
+                    if (hit.type == static_cast<int>(I)) {
+                        if constexpr (is_instance_v<std::tuple_element_t<I, std::tuple<Prims...>>>) {
+                            return std::get<I>(primitives)[hit.idx].visit(Hit{hit.t, hit.inner_type, hit.inner_idx}, f);
+                        } else {
+                            return f(std::get<I>(primitives)[hit.idx]);
+                        }
+                    }
+                    return visit_type<I + 1>(hit, f);
+                } else {
+                    return f(static_cast<const Hittable&>(*custom[hit.idx]));
+                }
+            }
+    };
+
+    // Geometry that can be instanced: bounded primitives only, and no instances of its own, so scenes are two levels deep
+    using Object = PrimitiveSet<Sphere3, Triangle3, Disk3, Box3>;
+    using Instance = InstanceT<Object>;
+
+    // The renderer's primitive registry. New built-in primitive types get added to this list.
+    using Scene = PrimitiveSet<Sphere3, Triangle3, Plane3, Disk3, Box3, Instance>;
+
+}
+
+#endif // SCENE
@@ -0,0 +1,71 @@
+#ifndef SPLITTING
+#define SPLITTING
+
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include "gmath.h"
+
+namespace rt {
+
+    using namespace gmath;
+
+    /// @brief what a pilot run measured of samples that take 1 and 2 continuations from their first diffuse hit
+    struct SplitPilot {
+        double seconds[2] = {0, 0}; // per sample
+        double variance[2] = {0, 0}; // of one sample about its pixel's mean, averaged over the pixels and colour channels
+    };
+
+    /// @brief the number of continuations from each first diffuse hit that gives the least noise for the time, where
+    /// a sample costs t_p + N t_s and has variance V_p + V_s / N: N = sqrt(t_p V_s / (t_s V_p)). The primary part
+    /// (camera ray, anything before the hit, and the pixel and lens position) and the secondary part (one continuation)
+    /// are separated by comparing the pilot's runs with 1 and 2 continuations.
+    inline int split_factor(const SplitPilot& pilot, int max_split = 16) {
+        double secondary_seconds = pilot.seconds[1] - pilot.seconds[0];
+        double primary_seconds = pilot.seconds[0] - secondary_seconds;
+        double secondary_variance = 2 * (pilot.variance[0] - pilot.variance[1]);
+        double primary_variance = pilot.variance[0] - secondary_variance;
+        // timing noise or the pixels' own noise can push either part below 0, in which case it's negligible
+        if (!(secondary_seconds > 0) || !(secondary_variance > 0)) { return 1; }
+        if (!(primary_seconds > 0)) { return 1; }
+        if (!(primary_variance > 0)) { return max_split; }
+        double split = std::sqrt(primary_seconds * secondary_variance / (secondary_seconds * primary_variance));
+        return std::clamp(static_cast<int>(std::lround(split)), 1, max_split);
+    }
+
+    /// @brief runs the pilot: samples_per_pixel samples of each of n_pixels pixels with 1 continuation from the first
+    /// diffuse hit, and as many with 2. sample(pixel, split) traces one sample of the pixel with split continuations.
+    /// The two alternate, so anything else slowing the machine down slows both alike.
+    template <typename Sample>
+    SplitPilot pilot_split(std::size_t n_pixels, int samples_per_pixel, Sample sample) {
+        SplitPilot pilot;
+        std::vector<Colour> sum[2] = {std::vector<Colour>(n_pixels), std::vector<Colour>(n_pixels)};
+        std::vector<Colour> sum2[2] = {std::vector<Colour>(n_pixels), std::vector<Colour>(n_pixels)};
+        double seconds[2] = {0, 0};
+        for (std::size_t pixel = 0; pixel < n_pixels; pixel++) {
+            for (int i = 0; i < samples_per_pixel; i++) {
+                for (int split = 1; split <= 2; split++) {
+                    auto start = std::chrono::steady_clock::now();
+                    Colour colour = sample(pixel, split);
+                    seconds[split - 1] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    sum[split - 1][pixel] += colour;
+                    sum2[split - 1][pixel] += colour * colour;
+                }
+            }
+        }
+        for (int split = 1; split <= 2; split++) {
+            pilot.seconds[split - 1] = seconds[split - 1] / (static_cast<double>(n_pixels) * samples_per_pixel);
+            double variance = 0;
+            for (std::size_t pixel = 0; pixel < n_pixels; pixel++) {
+                Colour mean = sum[split - 1][pixel] / Real(samples_per_pixel);
+                Colour spread = (sum2[split - 1][pixel] - Real(samples_per_pixel) * mean * mean) / Real(samples_per_pixel - 1);
+                variance += (spread.x + spread.y + spread.z) / 3;
+            }
+            pilot.variance[split - 1] = variance / n_pixels;
+        }
+        return pilot;
+    }
+}
+
+#endif // SPLITTING
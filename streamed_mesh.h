@@ -0,0 +1,102 @@
+#ifndef STREAMED_MESH
+#define STREAMED_MESH
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <string>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+#include "gmath.h"
+#include "geometry.h"
+#include "mesh.h"
+#include "scene.h"
+#include "bvh.h"
+#include "mapped_file.h"
+
+namespace rt {
+
+    /// @brief writes mesh to path split into spatially coherent clusters of up to triangles_per_cluster triangles,
+    /// each with its own BVH, for StreamedMesh. Returns false (and prints why) if the file can't be written.
+    bool write_clustered_mesh(const std::string& path, const TriangleMesh& mesh, std::uint32_t triangles_per_cluster = 16384);
+
+    /// @brief closest hit of a ray on a StreamedMesh. The normal is found while the triangle is paged in, as it may not
+    /// be by the time the hit is shaded.
+    struct StreamedHit {
+        static constexpr std::uint32_t no_triangle = std::numeric_limits<std::uint32_t>::max();
+
+        Real t{std::numeric_limits<Real>::infinity()};
+        std::uint32_t triangle{no_triangle}; // index in the mesh that was written
+        Vec3 normal;
+
+        bool hit() const { return triangle != no_triangle; }
+    };
+
+    /// @brief counters for a StreamedMesh's run report
+    struct StreamStats {
+        std::size_t cluster_visits{0}; // batches of queued rays tested against a cluster
+        std::size_t cache_hits{0}; // of those, how many found the cluster already resident
+        std::size_t page_ins{0};
+        std::size_t bytes_paged_in{0};
+        double page_in_seconds{0};
+        std::size_t rays_queued{0};
+
+        double hit_rate() const { return cluster_visits > 0 ? static_cast<double>(cache_hits) / cluster_visits : 0; }
+        double bandwidth() const { return page_in_seconds > 0 ? bytes_paged_in / page_in_seconds : 0; } // bytes per second
+    };
+
+    /// @brief a mesh written by write_clustered_mesh(), traced without holding it all in memory. The file is memory
+    /// mapped; clusters are copied out of it when needed, up to cache_bytes of them at a time, evicting the least
+    /// recently used. Only the clusters' boxes and a BVH over them are always resident.
+    /// Rays are traced in batches: each waits in the queue of the nearest cluster it might hit, and the cluster with the
+    /// longest queue (or any already resident) is processed next, so every page-in is shared by as many rays as possible
+    /// (Pharr et al., "Rendering Complex Scenes with Memory-Coherent Ray Tracing", 1997).
+    /// This is a batch tracer alongside Scene, not a primitive in one: PathTracer traces one ray at a time and shades
+    /// hits long after the cluster they're in may have been evicted. So only batches see it: main.cpp traces each row's
+    /// camera rays through it and hands the hits to PathTracer as ExternalHits, and the paths' later rays only see the
+    /// scene. Whoever calls trace() reports stats (main's run report does, as does other/benchmarks.cpp's "stream").
+    class StreamedMesh {
+        public:
+            MaterialId material_id{0};
+            StreamStats stats;
+
+            bool open(const std::string& path, std::size_t cache_bytes); // returns false (and prints why) if it can't
+            std::size_t n_clusters() const { return clusters.size(); }
+            std::size_t resident_bytes() const { return resident_total; }
+
+            /// @brief finds the closest hit for every ray
+            void trace(const std::vector<Line3>& rays, std::vector<StreamedHit>& hits);
+
+        private:
+            struct Cluster {
+                AABB3T<float> box;
+                std::uint64_t offset; // of its data in the file
+                std::uint64_t size;
+                std::uint32_t n_triangles;
+                std::uint32_t n_nodes;
+            };
+
+            struct Resident {
+                TriangleMesh mesh;
+                Object object;
+                std::vector<std::uint32_t> triangle_ids;
+                std::size_t bytes{0};
+                std::list<std::uint32_t>::iterator lru_position;
+            };
+
+            MappedFile file;
+            bool has_normals{false};
+            std::vector<Cluster> clusters;
+            WideBVH<4> top; // over the clusters' boxes
+            std::size_t cache_bytes{0};
+            std::size_t resident_total{0};
+            std::vector<std::unique_ptr<Resident>> resident; // by cluster, null when not resident
+            std::list<std::uint32_t> lru; // resident clusters, most recently used first
+
+            Resident& fetch(std::uint32_t cluster);
+    };
+
+}
+
+#endif // STREAMED_MESH
@@ -0,0 +1,360 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include "streamed_mesh.h"
+#include "bvh_build.h"
+#include "parallel.h"
+
+namespace rt {
+
+    namespace {
+
+        // start of a clustered mesh file. The cluster table is at table_offset; each cluster's data is at its own
+        // page aligned offset: vertices (x, y, z as Real, three per triangle), vertex normals likewise if the mesh
+        // has them, original triangle indices, then the cluster's BVH nodes and refs at a 256 byte aligned offset.
+        struct ClusterFileHeader {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t real_size; // sizeof(Real) of the build that wrote it
+            std::uint32_t n_clusters;
+            std::uint32_t has_normals;
+            std::uint32_t node_size;
+            std::uint16_t material_id;
+            std::uint16_t pad;
+            std::uint64_t table_offset;
+        };
+
+        struct ClusterRecord {
+            float box_min[3];
+            float box_max[3];
+            std::uint32_t n_triangles;
+            std::uint32_t n_nodes;
+            std::uint64_t offset;
+            std::uint64_t size;
+        };
+
+        constexpr char cluster_magic[8] = "RTCLUST";
+        constexpr std::uint32_t cluster_version = 1;
+        constexpr std::uint64_t page_size = 4096;
+
+        std::uint64_t align(std::uint64_t offset, std::uint64_t alignment) { return (offset + alignment - 1) / alignment * alignment; }
+
+        // offsets within a cluster's data
+        struct ClusterLayout {
+            std::uint64_t normals;
+            std::uint64_t ids;
+            std::uint64_t nodes;
+            std::uint64_t refs;
+            std::uint64_t size;
+
+            ClusterLayout(std::uint32_t n_triangles, std::uint32_t n_nodes, bool has_normals) {
+                const std::uint64_t vertex_bytes = 9ull * n_triangles * sizeof(Real);
+                normals = vertex_bytes;
+                ids = normals + (has_normals ? vertex_bytes : 0);
+                nodes = align(ids + n_triangles * sizeof(std::uint32_t), 256);
+                refs = nodes + n_nodes * sizeof(WideBVH<4>::Node);
+                size = refs + n_triangles * sizeof(PrimRef);
+            }
+        };
+
+        void put_vec3(char* out, const Vec3& v) {
+            Real components[3] = {v.x, v.y, v.z};
+            std::memcpy(out, components, sizeof(components));
+        }
+
+        Vec3 get_vec3(const char* in) {
+            Real components[3];
+            std::memcpy(components, in, sizeof(components));
+            return Vec3(components[0], components[1], components[2]);
+        }
+
+    }
+
+    bool write_clustered_mesh(const std::string& path, const TriangleMesh& mesh, std::uint32_t triangles_per_cluster) {
+        // a quick (Morton code) BVH over the whole mesh; its subtrees of at most triangles_per_cluster are the clusters
+        Object all;
+        add_mesh(all, mesh);
+        std::vector<BVHPrim> prims = all.bvh_prims();
+        std::vector<BVHBuildNode> tree = BVHBuilder(prims).build(BVHPreset::fast);
+
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> ranges; // first and count of each cluster's prims
+        if (!tree.empty()) {
+            // leaves are contiguous and in order, so a subtree's primitives run from its leftmost leaf to its rightmost
+            std::function<std::pair<std::uint32_t, std::uint32_t>(std::uint32_t)> range = [&](std::uint32_t node) {
+                if (tree[node].count > 0) { return std::make_pair(tree[node].first, tree[node].count); }
+                auto left = range(tree[node].left);
+                auto right = range(tree[node].right);
+                return std::make_pair(left.first, left.second + right.second);
+            };
+            std::function<void(std::uint32_t)> cut = [&](std::uint32_t node) {
+                auto node_range = range(node);
+                if (node_range.second <= triangles_per_cluster || tree[node].count > 0) {
+                    ranges.push_back(node_range);
+                } else {
+                    cut(tree[node].left);
+                    cut(tree[node].right);
+                }
+            };
+            cut(0);
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Error in write_clustered_mesh(): could not open " << path << "\n";
+            return false;
+        }
+        const bool has_normals = !mesh.normals.empty();
+        std::vector<ClusterRecord> records(ranges.size());
+        std::uint64_t offset = page_size; // the header gets the first page to itself
+
+        // clusters are built in parallel a batch at a time and written in order, so only a batch is held at once
+        const std::size_t batch_size = std::max<std::size_t>(4 * n_threads(), 1);
+        for (std::size_t batch = 0; batch < ranges.size(); batch += batch_size) {
+            const std::size_t batch_end = std::min(ranges.size(), batch + batch_size);
+            std::vector<std::vector<char>> blobs(batch_end - batch);
+            parallel_for(batch, batch_end, [&](std::size_t c) {
+                const std::uint32_t first = ranges[c].first;
+                const std::uint32_t count = ranges[c].second;
+                TriangleMesh part;
+                std::vector<std::uint32_t> ids(count);
+                for (std::uint32_t i = 0; i < count; i++) {
+                    ids[i] = prims[first + i].ref.idx;
+                    for (int corner = 0; corner < 3; corner++) {
+                        std::uint32_t vertex = mesh.indices[3 * ids[i] + corner];
+                        part.vertices.push_back(mesh.vertices[vertex]);
+                        if (has_normals) { part.normals.push_back(mesh.normals[vertex]); }
+                        part.indices.push_back(3 * i + corner);
+                    }
+                }
+                Object object;
+                add_mesh(object, part);
+                object.build_bvh();
+
+                ClusterLayout layout(count, static_cast<std::uint32_t>(object.bvh.nodes.size()), has_normals);
+                std::vector<char>& blob = blobs[c - batch];
+                blob.assign(layout.size, 0);
+                for (std::size_t v = 0; v < part.vertices.size(); v++) {
+                    put_vec3(blob.data() + v * 3 * sizeof(Real), part.vertices[v]);
+                    if (has_normals) { put_vec3(blob.data() + layout.normals + v * 3 * sizeof(Real), part.normals[v]); }
+                }
+                std::memcpy(blob.data() + layout.ids, ids.data(), count * sizeof(std::uint32_t));
+                std::memcpy(blob.data() + layout.nodes, object.bvh.nodes.data(), object.bvh.nodes.size() * sizeof(WideBVH<4>::Node));
+                std::memcpy(blob.data() + layout.refs, object.bvh.refs.data(), object.bvh.refs.size() * sizeof(PrimRef));
+
+                AABB3T<float> box = object.bvh.bounds();
+                ClusterRecord& record = records[c];
+                record = ClusterRecord{{box.min.x, box.min.y, box.min.z}, {box.max.x, box.max.y, box.max.z}, count,
+                                       static_cast<std::uint32_t>(object.bvh.nodes.size()), 0, layout.size};
+            });
+
+            for (std::size_t c = batch; c < batch_end; c++) {
+                records[c].offset = offset;
+                out.seekp(static_cast<std::streamoff>(offset));
+                out.write(blobs[c - batch].data(), static_cast<std::streamsize>(blobs[c - batch].size()));
+                offset = align(offset + records[c].size, page_size);
+            }
+        }
+
+        ClusterFileHeader header{};
+        std::memcpy(header.magic, cluster_magic, sizeof(header.magic));
+        header.version = cluster_version;
+        header.real_size = sizeof(Real);
+        header.n_clusters = static_cast<std::uint32_t>(records.size());
+        header.has_normals = has_normals;
+        header.node_size = sizeof(WideBVH<4>::Node);
+        header.material_id = mesh.material_id;
+        header.table_offset = offset;
+        out.seekp(static_cast<std::streamoff>(offset));
+        out.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(ClusterRecord)));
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!out) {
+            std::cerr << "Error in write_clustered_mesh(): could not write " << path << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool StreamedMesh::open(const std::string& path, std::size_t cache_bytes) {
+        clusters.clear();
+        resident.clear();
+        lru.clear();
+        resident_total = 0;
+        stats = StreamStats();
+        this->cache_bytes = cache_bytes;
+        if (!file.open(path, MappedFile::Access::random)) { return false; }
+
+        ClusterFileHeader header;
+        if (file.size < sizeof(header)) {
+            std::cerr << "Error in StreamedMesh::open(): " << path << " is too small to be a clustered mesh\n";
+            return false;
+        }
+        std::memcpy(&header, file.data, sizeof(header));
+        if (std::memcmp(header.magic, cluster_magic, sizeof(header.magic)) != 0 || header.version != cluster_version) {
+            std::cerr << "Error in StreamedMesh::open(): " << path << " is not a clustered mesh of this version\n";
+            return false;
+        }
+        if (header.real_size != sizeof(Real) || header.node_size != sizeof(WideBVH<4>::Node)) {
+            std::cerr << "Error in StreamedMesh::open(): " << path << " was written by a build with a different Real or BVH layout\n";
+            return false;
+        }
+        if (header.table_offset + header.n_clusters * sizeof(ClusterRecord) > file.size) {
+            std::cerr << "Error in StreamedMesh::open(): " << path << " is truncated\n";
+            return false;
+        }
+        has_normals = header.has_normals != 0;
+        material_id = header.material_id;
+
+        std::vector<BVHPrim> boxes;
+        for (std::uint32_t c = 0; c < header.n_clusters; c++) {
+            ClusterRecord record;
+            std::memcpy(&record, file.data + header.table_offset + c * sizeof(ClusterRecord), sizeof(record));
+            if (record.offset + record.size > file.size) {
+                std::cerr << "Error in StreamedMesh::open(): " << path << " is truncated\n";
+                clusters.clear();
+                return false;
+            }
+            AABB3T<float> box(Vec3T<float>(record.box_min[0], record.box_min[1], record.box_min[2]),
+                              Vec3T<float>(record.box_max[0], record.box_max[1], record.box_max[2]));
+            clusters.push_back(Cluster{box, record.offset, record.size, record.n_triangles, record.n_nodes});
+            boxes.push_back(BVHPrim{box, PrimRef{0, c}});
+        }
+        file.release(header.table_offset, header.n_clusters * sizeof(ClusterRecord));
+        top.build(std::move(boxes));
+        resident.resize(clusters.size());
+        return true;
+    }
+
+    StreamedMesh::Resident& StreamedMesh::fetch(std::uint32_t cluster) {
+        stats.cluster_visits++;
+        if (resident[cluster]) {
+            stats.cache_hits++;
+            Resident& hit = *resident[cluster];
+            lru.splice(lru.begin(), lru, hit.lru_position);
+            return hit;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        const Cluster& info = clusters[cluster];
+        const char* data = file.data + info.offset;
+        ClusterLayout layout(info.n_triangles, info.n_nodes, has_normals);
+        auto loaded = std::make_unique<Resident>();
+        TriangleMesh& mesh = loaded->mesh;
+        const std::uint32_t n_vertices = 3 * info.n_triangles;
+        mesh.vertices.resize(n_vertices);
+        if (has_normals) { mesh.normals.resize(n_vertices); }
+        mesh.indices.resize(n_vertices);
+        for (std::uint32_t v = 0; v < n_vertices; v++) {
+            mesh.vertices[v] = get_vec3(data + v * 3 * sizeof(Real));
+            if (has_normals) { mesh.normals[v] = get_vec3(data + layout.normals + v * 3 * sizeof(Real)); }
+            mesh.indices[v] = v;
+        }
+        loaded->triangle_ids.resize(info.n_triangles);
+        std::memcpy(loaded->triangle_ids.data(), data + layout.ids, info.n_triangles * sizeof(std::uint32_t));
+        add_mesh(loaded->object, mesh);
+        WideBVH<4>& bvh = loaded->object.bvh;
+        bvh.nodes.resize(info.n_nodes);
+        bvh.refs.resize(info.n_triangles);
+        std::memcpy(bvh.nodes.data(), data + layout.nodes, info.n_nodes * sizeof(WideBVH<4>::Node));
+        std::memcpy(bvh.refs.data(), data + layout.refs, info.n_triangles * sizeof(PrimRef));
+        file.release(info.offset, info.size);
+
+        loaded->bytes = mesh.vertices.size() * sizeof(Vec3) + mesh.normals.size() * sizeof(Vec3) + mesh.indices.size() * sizeof(std::uint32_t) +
+                        info.n_triangles * (sizeof(Triangle3) + sizeof(std::uint32_t)) + bvh.memory();
+        stats.page_ins++;
+        stats.bytes_paged_in += info.size;
+        stats.page_in_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // make room, keeping at least the cluster being paged in
+        resident_total += loaded->bytes;
+        while (resident_total > cache_bytes && !lru.empty()) {
+            std::uint32_t victim = lru.back();
+            lru.pop_back();
+            resident_total -= resident[victim]->bytes;
+            resident[victim].reset();
+        }
+        lru.push_front(cluster);
+        loaded->lru_position = lru.begin();
+        resident[cluster] = std::move(loaded);
+        return *resident[cluster];
+    }
+
+    void StreamedMesh::trace(const std::vector<Line3>& rays, std::vector<StreamedHit>& hits) {
+        hits.assign(rays.size(), StreamedHit());
+
+        // every cluster each ray's line passes through, nearest entry first
+        struct Candidate {
+            Real t;
+            std::uint32_t cluster;
+        };
+        std::vector<std::vector<Candidate>> candidates(rays.size());
+        parallel_for(0, rays.size(), [&](std::size_t r) {
+            const Line3& ray = rays[r];
+            const Real no_limit = std::numeric_limits<Real>::infinity();
+            top.traverse(ray, no_limit, [&](const PrimRef& ref) {
+                const AABB3T<float>& box = clusters[ref.idx].box;
+                Real t_enter = 0;
+                Real t_exit = no_limit;
+                for (int a = 0; a < 3; a++) {
+                    Real inv_d = 1 / axis(ray.d, a);
+                    Real t0 = (axis(box.min, a) - axis(ray.p, a)) * inv_d;
+                    Real t1 = (axis(box.max, a) - axis(ray.p, a)) * inv_d;
+                    if (inv_d < 0) { std::swap(t0, t1); }
+                    clip_slab(t0, t1, t_enter, t_exit);
+                }
+                if (t_enter <= t_exit) { candidates[r].push_back(Candidate{t_enter, ref.idx}); }
+            });
+            std::sort(candidates[r].begin(), candidates[r].end(), [](const Candidate& a, const Candidate& b) { return a.t < b.t; });
+        }, 256);
+
+        // queues each ray at its next candidate that could still hold a nearer hit than it has
+        std::vector<std::vector<std::uint32_t>> queues(clusters.size());
+        std::vector<std::uint32_t> next(rays.size(), 0);
+        std::size_t n_queued = 0;
+        auto advance = [&](std::uint32_t r) {
+            if (next[r] < candidates[r].size() && candidates[r][next[r]].t < hits[r].t) {
+                queues[candidates[r][next[r]++].cluster].push_back(r);
+                stats.rays_queued++;
+                n_queued++;
+            }
+        };
+        for (std::uint32_t r = 0; r < rays.size(); r++) { advance(r); }
+
+        while (n_queued > 0) {
+            // a resident cluster with rays waiting if there is one, else the cluster with the most
+            std::uint32_t cluster = 0;
+            bool found = false;
+            for (std::uint32_t c : lru) {
+                if (!queues[c].empty()) {
+                    cluster = c;
+                    found = true;
+                    break;
+                }
+            }
+            for (std::uint32_t c = 0; c < clusters.size() && !found; c++) {
+                if (queues[c].size() > queues[cluster].size()) { cluster = c; }
+            }
+
+            std::vector<std::uint32_t> batch;
+            batch.swap(queues[cluster]);
+            n_queued -= batch.size();
+            const Resident& part = fetch(cluster);
+            parallel_for(0, batch.size(), [&](std::size_t i) {
+                const std::uint32_t r = batch[i];
+                Hit hit = part.object.closest_hit(rays[r], hits[r].t);
+                if (hit.hit()) {
+                    hits[r].t = hit.t;
+                    hits[r].triangle = part.triangle_ids[hit.idx];
+                    hits[r].normal = part.object.get<Triangle3>()[hit.idx].normal(rays[r](hit.t));
+                }
+            }, 64);
+            for (std::uint32_t r : batch) { advance(r); }
+        }
+    }
+
+}
@@ -0,0 +1,139 @@
+#ifndef TONEMAP
+#define TONEMAP
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "gmath.h"
+#include "gpng.h"
+#include "parallel.h"
+
+namespace rt {
+
+    using namespace gmath;
+
+    /// @brief linear radiance for every pixel, rows top to bottom, interleaved rgb
+    class Framebuffer {
+        public:
+            int width;
+            int height;
+            std::vector<float> pixels;
+
+            Framebuffer(int width, int height) : width(width), height(height), pixels(static_cast<std::size_t>(width) * height * 3, 0.0f) {}
+
+            float* operator()(int column, int row) { return &pixels[(static_cast<std::size_t>(row) * width + column) * 3]; }
+            const float* operator()(int column, int row) const { return &pixels[(static_cast<std::size_t>(row) * width + column) * 3]; }
+
+            void set_pixel(int column, int row, const Colour& u) {
+                float* pixel = (*this)(column, row);
+                pixel[0] = static_cast<float>(u.x);
+                pixel[1] = static_cast<float>(u.y);
+                pixel[2] = static_cast<float>(u.z);
+            }
+    };
+
+    enum class Transfer {
+        srgb,
+        gamma2 // colour to the power of 1/2, as the renderer originally used
+    };
+
+    struct TonemapSettings {
+        Transfer transfer{Transfer::srgb};
+        bool dither{true}; // 8x8 ordered dither, hides banding in smooth gradients like the sky
+    };
+
+    /// @brief table of the transfer function over [0,1]. 8192 intervals (32 KB) keep the interpolation error around
+    /// 0.001 of an 8 bit step and 0.3 of a 16 bit step.
+    class TransferTable : public LinearTable<8192> {
+        public:
+            TransferTable(Transfer transfer) : LinearTable([transfer](double linear) { return encode(transfer, linear); }) {}
+
+            static double encode(Transfer transfer, double linear) {
+                switch (transfer) {
+                    case Transfer::gamma2:
+                        return std::sqrt(linear);
+                    case Transfer::srgb:
+                    default:
+                        return linear <= 0.0031308 ? 12.92 * linear : 1.055 * std::pow(linear, 1.0 / 2.4) - 0.055;
+                }
+            }
+    };
+
+    // 8x8 Bayer matrix, thresholds 0..63
+    inline constexpr std::uint8_t bayer8[8][8] = {
+        { 0, 32,  8, 40,  2, 34, 10, 42},
+        {48, 16, 56, 24, 50, 18, 58, 26},
+        {12, 44,  4, 36, 14, 46,  6, 38},
+        {60, 28, 52, 20, 62, 30, 54, 22},
+        { 3, 35, 11, 43,  1, 33,  9, 41},
+        {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47,  7, 39, 13, 45,  5, 37},
+        {63, 31, 55, 23, 61, 29, 53, 21}
+    };
+
+    // converts one row of samples. Out is written through its own type, not uint8_t, so the compiler knows the stores
+    // can't change the table or the input row. offsets holds the rounding offset for each of the 24 samples in
+    // 8 pixels, repeating along the row.
+    template <typename Out>
+    void tonemap_row(const float* in, Out* out, int n_samples, const float* table, float max_code, const float* offsets) {
+        int i = 0;
+#ifdef GMATH_HAS_SSE
+        // 4 samples at a time: clamp, index and interpolate in SSE, with only the table reads done one by one
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 scale = _mm_set1_ps(static_cast<float>(TransferTable::n_intervals));
+        const __m128 max_codes = _mm_set1_ps(max_code);
+        alignas(16) std::int32_t idx[4];
+        alignas(16) std::int32_t codes[4];
+        for (; i + 4 <= n_samples; i += 4) {
+            __m128 linear = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), zero), one); // maxps returns its second operand for NaN, so NaN maps to 0
+            __m128 position = _mm_mul_ps(linear, scale);
+            __m128i index = _mm_cvttps_epi32(position);
+            __m128 frac = _mm_sub_ps(position, _mm_cvtepi32_ps(index));
+            _mm_store_si128(reinterpret_cast<__m128i*>(idx), index);
+            __m128 low = _mm_setr_ps(table[idx[0]], table[idx[1]], table[idx[2]], table[idx[3]]);
+            __m128 high = _mm_setr_ps(table[idx[0] + 1], table[idx[1] + 1], table[idx[2] + 1], table[idx[3] + 1]);
+            __m128 encoded = _mm_add_ps(low, _mm_mul_ps(_mm_sub_ps(high, low), frac));
+            __m128 code = _mm_min_ps(_mm_add_ps(_mm_mul_ps(encoded, max_codes), _mm_loadu_ps(offsets + i % 24)), max_codes);
+            _mm_store_si128(reinterpret_cast<__m128i*>(codes), _mm_cvttps_epi32(code));
+            for (int k = 0; k < 4; k++) { out[i + k] = static_cast<Out>(codes[k]); }
+        }
+#endif
+        for (; i < n_samples; i++) {
+            float linear = std::max(0.0f, std::min(in[i], 1.0f)); // in this order NaN maps to 0
+            float code = TransferTable::lookup(table, linear) * max_code + offsets[i % 24];
+            out[i] = static_cast<Out>(std::min(code, max_code));
+        }
+    }
+
+    /// @brief converts linear radiance to the image's bit depth: clamps to [0,1], applies the transfer function,
+    /// then quantises, optionally with ordered dither. Rows are processed in parallel.
+    /// image must be the same size as framebuffer; framebuffer row 0 is written to image row 0.
+    inline void tonemap(const Framebuffer& framebuffer, gpng::Image& image, const TonemapSettings& settings = TonemapSettings()) {
+        const TransferTable table(settings.transfer);
+        const int width = framebuffer.width;
+
+        parallel_for(0, framebuffer.height, [&](std::size_t row) {
+            // dither offsets the rounding point by up to half a step either way
+            float offsets[24];
+            for (int k = 0; k < 24; k++) { offsets[k] = settings.dither ? (bayer8[row % 8][k / 3] + 0.5f) / 64.0f : 0.5f; }
+
+            const float* in = framebuffer(0, static_cast<int>(row));
+            std::uint8_t* out = image.image + row * width * image.bytes_per_pixel();
+            if (image.bit_depth == 16) {
+                std::vector<std::uint16_t> samples(static_cast<std::size_t>(width) * 3);
+                tonemap_row(in, samples.data(), width * 3, table.table.data(), 65535.0f, offsets);
+                for (std::size_t i = 0; i < samples.size(); i++) { // png stores 16 bit samples big-endian
+                    out[i * 2] = samples[i] >> 8;
+                    out[i * 2 + 1] = samples[i] & 0xff;
+                }
+            } else {
+                tonemap_row(in, out, width * 3, table.table.data(), 255.0f, offsets);
+            }
+        }, 8);
+    }
+
+}
+
+#endif // TONEMAP
@@ -0,0 +1,120 @@
+#ifndef TRANSFORM
+#define TRANSFORM
+
+#include <cmath>
+#include <algorithm>
+#include "gmath.h"
+#include "geometry.h"
+
+namespace rt {
+
+    /// @brief affine transform as a 3x4 matrix: the linear part in the first three columns, the translation in the last.
+    /// Compose with *, where (a * b) applies b first.
+    template <typename T>
+    class Transform3T {
+        public:
+            T m[3][4];
+
+            Transform3T() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+            static Transform3T translate(const Vec3T<T>& v) {
+                Transform3T transform;
+                transform.m[0][3] = v.x;
+                transform.m[1][3] = v.y;
+                transform.m[2][3] = v.z;
+                return transform;
+            }
+            static Transform3T scale(const Vec3T<T>& s) {
+                Transform3T transform;
+                transform.m[0][0] = s.x;
+                transform.m[1][1] = s.y;
+                transform.m[2][2] = s.z;
+                return transform;
+            }
+            static Transform3T scale(T s) { return scale(Vec3T<T>(s, s, s)); }
+            // anticlockwise by angle (in radians) looking down axis towards the origin (Rodrigues' formula)
+            static Transform3T rotate(const Vec3T<T>& axis, T angle) {
+                Vec3T<T> u = axis.unit();
+                T c = std::cos(angle);
+                T s = std::sin(angle);
+                T k = 1 - c;
+                Transform3T transform;
+                transform.m[0][0] = c + u.x*u.x*k;     transform.m[0][1] = u.x*u.y*k - u.z*s; transform.m[0][2] = u.x*u.z*k + u.y*s;
+                transform.m[1][0] = u.y*u.x*k + u.z*s; transform.m[1][1] = c + u.y*u.y*k;     transform.m[1][2] = u.y*u.z*k - u.x*s;
+                transform.m[2][0] = u.z*u.x*k - u.y*s; transform.m[2][1] = u.z*u.y*k + u.x*s; transform.m[2][2] = c + u.z*u.z*k;
+                return transform;
+            }
+
+            Transform3T operator*(const Transform3T& b) const {
+                Transform3T product;
+                for (int i = 0; i < 3; i++) {
+                    for (int j = 0; j < 4; j++) {
+                        product.m[i][j] = m[i][0]*b.m[0][j] + m[i][1]*b.m[1][j] + m[i][2]*b.m[2][j] + (j == 3 ? m[i][3] : 0);
+                    }
+                }
+                return product;
+            }
+
+            // inverse of the linear part by cofactors, then the translation undone through it. The transform must not be singular.
+            Transform3T inverse() const {
+                T det = m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                      - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                      + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+                T inv_det = 1 / det;
+                Transform3T inv;
+                inv.m[0][0] = (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+                inv.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * inv_det;
+                inv.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+                inv.m[1][0] = (m[1][2]*m[2][0] - m[1][0]*m[2][2]) * inv_det;
+                inv.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+                inv.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * inv_det;
+                inv.m[2][0] = (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+                inv.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * inv_det;
+                inv.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+                Vec3T<T> translation = inv.vector(Vec3T<T>(m[0][3], m[1][3], m[2][3]));
+                inv.m[0][3] = -translation.x;
+                inv.m[1][3] = -translation.y;
+                inv.m[2][3] = -translation.z;
+                return inv;
+            }
+
+            Vec3T<T> point(const Vec3T<T>& p) const { return vector(p) + Vec3T<T>(m[0][3], m[1][3], m[2][3]); }
+            Vec3T<T> vector(const Vec3T<T>& v) const {
+                return Vec3T<T>(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+                                m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+                                m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+            }
+            // v through the transpose of the linear part. Normals go to world space through the transpose of the
+            // world-to-object transform.
+            Vec3T<T> transpose_vector(const Vec3T<T>& v) const {
+                return Vec3T<T>(m[0][0]*v.x + m[1][0]*v.y + m[2][0]*v.z,
+                                m[0][1]*v.x + m[1][1]*v.y + m[2][1]*v.z,
+                                m[0][2]*v.x + m[1][2]*v.y + m[2][2]*v.z);
+            }
+
+            // the direction isn't normalised, so distances t along the ray are the same on both sides of the transform
+            Line3T<T> operator()(const Line3T<T>& ray) const { return Line3T<T>(point(ray.p), vector(ray.d)); }
+
+            // bounds of the transformed box, a row at a time (Arvo, "Transforming Axis-Aligned Bounding Boxes", Graphics Gems, 1990)
+            template <typename U>
+            AABB3T<U> operator()(const AABB3T<U>& box) const {
+                U low[3];
+                U high[3];
+                for (int i = 0; i < 3; i++) {
+                    low[i] = high[i] = static_cast<U>(m[i][3]);
+                    for (int j = 0; j < 3; j++) {
+                        U a = static_cast<U>(m[i][j]) * axis(box.min, j);
+                        U b = static_cast<U>(m[i][j]) * axis(box.max, j);
+                        low[i] += std::min(a, b);
+                        high[i] += std::max(a, b);
+                    }
+                }
+                return AABB3T<U>(Vec3T<U>(low[0], low[1], low[2]), Vec3T<U>(high[0], high[1], high[2]));
+            }
+    };
+
+    using Transform3 = Transform3T<Real>;
+
+}
+
+#endif // TRANSFORM